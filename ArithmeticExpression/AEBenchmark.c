@@ -0,0 +1,439 @@
+//
+//  AEBenchmark.c
+//  Blackthorn
+//
+//  Times AEProgram against a tree walker, over a table of rows.
+//
+//  usage: AEBenchmark [rows]
+//         AEBenchmark -c
+//
+//  The tree walker is evaluateSubTree:withVariables: done in C: the same
+//  tree, an operator that's a string checked with a chain of compares, a
+//  variable looked up by name in a hash table, and every intermediate
+//  value a freshly allocated box, freed once it's been used.  It doesn't
+//  pay for message sends or autorelease pools, so the real one is slower
+//  still.
+//
+//  Every row's answer from the compiled program, one row at a time and a
+//  column at a time, is checked against the tree walker's.  With -c,
+//  that's all it does, over a few thousand rows and some awkward
+//  expressions; the exit status says whether they all agreed.
+//
+
+#define _POSIX_C_SOURCE 199309L     // for clock_gettime
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "AEProgram.h"
+
+#define VARIABLES 4
+
+static const char *variableNames[VARIABLES] =
+    { "price", "quantity", "tax rate", "discount" };
+
+static const char *benchmarks[] =
+{
+    "price * quantity",
+    "price * quantity * (1 + \"tax rate\") - discount",
+    "int(price * 100 + 0.5) / 100 + 2 * 3 - 6",
+    "(price + discount) * (quantity - 1) / (\"tax rate\" + 2)"
+        " - price / quantity",
+    NULL
+};
+
+static const char *checks[] =
+{
+    "2",
+    "2 + 3 * 4",
+    "int(2.5) * 3",
+    "int(7.9)",
+    "price",
+    "\"  tax rate\"",
+    "tax    rate * 2",
+    "price - quantity - discount - 1",
+    "1 / price / quantity / 2",
+    "-1 - -2 * price",
+    "2 - (price - (quantity - (discount - (1 - price))))",
+    "((price + 1) * (quantity + 2)) / ((discount + 3) - (price - 4))",
+    "int(price * quantity) / int(discount + 1)",
+    "int(price - 1000)",
+    "int(price, quantity)",
+    "min(price, nosuchthing) + price",
+    "avg() * price",
+    "price / 0 + discount",
+    "1e3 * price + .5 - 5.",
+    NULL
+};
+
+// the tree walker
+
+typedef struct Box
+{
+    float value;
+    int integer;
+} Box;
+
+typedef struct Tree
+{
+    const char *op;         // NULL for a number
+    Box number;
+    char *name;             // for a lookup
+    struct Tree **args;
+    int nargs;
+} Tree;
+
+typedef struct Entry
+{
+    const char *key;
+    Box *value;
+    struct Entry *next;
+} Entry;
+
+#define BUCKETS 16
+
+typedef struct Dictionary
+{
+    Entry *buckets[BUCKETS];
+} Dictionary;
+
+static unsigned int hash (const char *s)
+{
+    unsigned int h = 5381;
+
+    while (*s)
+        h = h * 33 + (unsigned char) *s++;
+    return h;
+}
+
+static void dictionarySet (Dictionary *d, const char *key, Box *value)
+{
+    Entry *e = malloc (sizeof *e);
+    unsigned int b = hash (key) % BUCKETS;
+
+    e->key = key;
+    e->value = value;
+    e->next = d->buckets[b];
+    d->buckets[b] = e;
+}
+
+static Box *dictionaryGet (Dictionary *d, const char *key)
+{
+    Entry *e;
+
+    for (e = d->buckets[hash (key) % BUCKETS]; e != NULL; e = e->next)
+        if (strcmp (e->key, key) == 0)
+            return e->value;
+    return NULL;
+}
+
+static Box *box (float value, int integer)
+{
+    Box *b = malloc (sizeof *b);
+
+    b->value = value;
+    b->integer = integer;
+    return b;
+}
+
+static void release (Tree *tree, Box *b)
+{
+    // the boxes a subtree hands back are new, except a number's own and a
+    // variable's value
+    if (b != NULL && tree->op != NULL && strcmp (tree->op, "lookup") != 0)
+        free (b);
+}
+
+static Box *evaluateSubTree (Tree *tree, Dictionary *vars)
+{
+    const char *op = tree->op;
+
+    if (op == NULL)
+        return &tree->number;
+
+    if (strcmp (op, "+") == 0
+        || strcmp (op, "-") == 0
+        || strcmp (op, "*") == 0
+        || strcmp (op, "/") == 0)
+    {
+        Box *left = evaluateSubTree (tree->args[0], vars);
+        Box *right = evaluateSubTree (tree->args[1], vars);
+        Box *result = NULL;
+
+        if (left != NULL && right != NULL)
+        {
+            if (strcmp (op, "+") == 0)
+                result = box (left->value + right->value, 0);
+            else if (strcmp (op, "-") == 0)
+                result = box (left->value - right->value, 0);
+            else if (strcmp (op, "*") == 0)
+                result = box (left->value * right->value, 0);
+            else if (strcmp (op, "/") == 0)
+                result = box (left->value / right->value, 0);
+        }
+        release (tree->args[0], left);
+        release (tree->args[1], right);
+        return result;
+    }
+    else if (strcmp (op, "lookup") == 0)
+        return dictionaryGet (vars, tree->name);
+    else if (strcmp (op, "int") == 0)
+    {
+        Box *input = evaluateSubTree (tree->args[0], vars);
+        Box *result = NULL;
+
+        // [input intValue], where that's defined
+        if (input != NULL)
+            result = box (input->value < -2147483648.0f
+                          || input->value >= 2147483648.0f
+                          || input->value != input->value
+                          ? input->value : (int) input->value, 1);
+        release (tree->args[0], input);
+        return result;
+    }
+    else
+        return box (0, 1);
+}
+
+// building trees with the parser AEProgram uses
+
+typedef struct TreeBuilder
+{
+    Tree *stack[64];
+    int depth;
+} TreeBuilder;
+
+static Tree *newTree (const char *op)
+{
+    Tree *t = calloc (1, sizeof *t);
+
+    t->op = op == NULL ? NULL : strcpy (malloc (strlen (op) + 1), op);
+    return t;
+}
+
+static int buildNumber (void *context, float value)
+{
+    TreeBuilder *b = context;
+    Tree *t = newTree (NULL);
+
+    t->number.value = value;
+    b->stack[b->depth++] = t;
+    return b->depth < 64;
+}
+
+static int buildVariable (void *context, const char *name)
+{
+    TreeBuilder *b = context;
+    Tree *t = newTree ("lookup");
+
+    t->name = strcpy (malloc (strlen (name) + 1), name);
+    b->stack[b->depth++] = t;
+    return b->depth < 64;
+}
+
+static int buildApply (void *context, const char *op, int nargs)
+{
+    TreeBuilder *b = context;
+    Tree *t = newTree (op);
+    int i;
+
+    t->nargs = nargs;
+    t->args = malloc ((nargs + 1) * sizeof *t->args);
+    b->depth -= nargs;
+    for (i = 0; i < nargs; i++)
+        t->args[i] = b->stack[b->depth + i];
+    b->stack[b->depth++] = t;
+    return 1;
+}
+
+static Tree *parseTree (const char *text)
+{
+    static const AEParseCallbacks build =
+        { buildNumber, buildVariable, buildApply };
+    TreeBuilder b;
+    const char *error;
+
+    b.depth = 0;
+    if (!AEParseString (text, &build, &b, &error) || b.depth != 1)
+    {
+        fprintf (stderr, "can't parse %s: %s\n", text, error);
+        exit (2);
+    }
+    return b.stack[0];
+}
+
+// the table
+
+static float random01 (unsigned long *state)
+{
+    *state = *state * 6364136223846793005UL + 1442695040888963407UL;
+    return (*state >> 40) / 16777216.0f;
+}
+
+static float **makeColumns (size_t rows)
+{
+    float **columns = malloc (VARIABLES * sizeof *columns);
+    unsigned long state = 1;
+    size_t i;
+    int v;
+
+    for (v = 0; v < VARIABLES; v++)
+        columns[v] = malloc (rows * sizeof **columns);
+    for (i = 0; i < rows; i++)
+    {
+        columns[0][i] = 0.01f + 1000 * random01 (&state);
+        columns[1][i] = 1 + (int) (10 * random01 (&state));
+        columns[2][i] = 0.2f * random01 (&state);
+        columns[3][i] = 5 * random01 (&state);
+    }
+    return columns;
+}
+
+static double now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int same (float a, float b)
+{
+    return a == b || (a != a && b != b);
+}
+
+static int run (const char *text, float **columns, size_t rows, int report)
+{
+    // returns: the number of rows on which the answers differ
+
+    const char *error;
+    AEProgram *program = AEProgramCreateWithString (text, &error);
+    Tree *tree = parseTree (text);
+    Box values[VARIABLES];
+    Dictionary vars;
+    const float *slotColumns[VARIABLES];
+    float *walked = malloc (rows * sizeof *walked);
+    float *compiled = malloc (rows * sizeof *compiled);
+    float *batched = malloc (rows * sizeof *batched);
+    float slots[VARIABLES];
+    double start, walkTime, compiledTime, batchTime;
+    size_t i, wrong = 0;
+    int s, v;
+
+    if (program == NULL)
+    {
+        fprintf (stderr, "can't compile %s: %s\n", text, error);
+        exit (2);
+    }
+
+    // the tree walker, with a dictionary of the row's values
+
+    memset (&vars, 0, sizeof vars);
+    for (v = 0; v < VARIABLES; v++)
+    {
+        values[v].integer = 0;
+        dictionarySet (&vars, variableNames[v], values + v);
+    }
+    start = now ();
+    for (i = 0; i < rows; i++)
+    {
+        Box *result;
+
+        for (v = 0; v < VARIABLES; v++)
+            values[v].value = columns[v][i];
+        result = evaluateSubTree (tree, &vars);
+        walked[i] = result == NULL ? -1 : result->value;
+        release (tree, result);
+    }
+    walkTime = now () - start;
+
+    // the program, a row at a time, then a column at a time
+
+    for (s = 0; s < AEProgramSlotCount (program); s++)
+        for (v = 0; v < VARIABLES; v++)
+            if (strcmp (AEProgramSlotName (program, s), variableNames[v]) == 0)
+                slotColumns[s] = columns[v];
+    start = now ();
+    for (i = 0; i < rows; i++)
+    {
+        for (s = 0; s < AEProgramSlotCount (program); s++)
+            slots[s] = slotColumns[s][i];
+        compiled[i] = AEProgramEvaluate (program, slots);
+    }
+    compiledTime = now () - start;
+
+    start = now ();
+    AEProgramEvaluateColumns (program, slotColumns, rows, batched);
+    batchTime = now () - start;
+
+    for (i = 0; i < rows; i++)
+        if (!same (walked[i], compiled[i]) || !same (walked[i], batched[i]))
+        {
+            if (wrong++ == 0)
+                fprintf (stderr, "%s: row %lu: walker %.9g, program %.9g, "
+                         "columns %.9g\n", text, (unsigned long) i,
+                         walked[i], compiled[i], batched[i]);
+        }
+
+    if (report)
+    {
+        printf ("%s\n  %d instructions, stack %d, %d slots\n", text,
+                AEProgramLength (program), AEProgramDepth (program),
+                AEProgramSlotCount (program));
+        printf ("  tree walker %7.1f ns/row\n", walkTime * 1e9 / rows);
+        printf ("  program     %7.1f ns/row  %6.1fx\n",
+                compiledTime * 1e9 / rows, walkTime / compiledTime);
+        printf ("  columns     %7.2f ns/row  %6.1fx\n",
+                batchTime * 1e9 / rows, walkTime / batchTime);
+    }
+
+    AEProgramRelease (program);
+    free (walked);
+    free (compiled);
+    free (batched);
+    return wrong != 0;
+}
+
+int main (int argc, char **argv)
+{
+    int check = argc > 1 && strcmp (argv[1], "-c") == 0;
+    size_t rows = check ? 5000 : argc > 1 ? strtoul (argv[1], NULL, 10)
+        : 1000000;
+    float **columns;
+    const char *error;
+    int i, failed = 0;
+
+    if (rows == 0)
+    {
+        fprintf (stderr, "usage: AEBenchmark [rows]\n"
+                 "       AEBenchmark -c\n");
+        return 2;
+    }
+    columns = makeColumns (rows);
+
+    if (check)
+    {
+        static const char *bad[] =
+            { "", "2 +", "(price", "price )", "foo_bar", "\"\"", "2 3",
+              "lookup(price)", "int()", NULL };
+
+        for (i = 0; checks[i] != NULL; i++)
+            failed += run (checks[i], columns, rows, 0);
+        for (i = 0; benchmarks[i] != NULL; i++)
+            failed += run (benchmarks[i], columns, rows, 0);
+        for (i = 0; bad[i] != NULL; i++)
+            if (AEProgramCreateWithString (bad[i], &error) != NULL)
+            {
+                fprintf (stderr, "compiled \"%s\", which is wrong\n", bad[i]);
+                failed++;
+            }
+        printf ("%s\n", failed ? "FAILED" : "ok");
+        return failed != 0;
+    }
+
+    for (i = 0; benchmarks[i] != NULL; i++)
+        failed += run (benchmarks[i], columns, rows, 1);
+    return failed != 0;
+}
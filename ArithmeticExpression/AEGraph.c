@@ -0,0 +1,748 @@
+//
+//  AEGraph.c
+//  Blackthorn
+//
+//  See AEGraph.h.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "AEGraph.h"
+
+#define AEHasValue 1
+#define AEQueued 2      // waiting in its level's queue
+#define AECyclic 4      // in a cycle, or depends on one
+#define AEChanged 8     // its value changed when it was last recomputed
+
+typedef struct AEQueue
+{
+    int *cells;
+    int count, capacity;
+} AEQueue;
+
+typedef struct AEWorkers
+{
+    AEGraph *graph;
+    pthread_t *threads;
+    int count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start, finish;
+    unsigned long generation;   // one more for each level shared out
+    int busy;                   // threads still on this generation
+    int quit;
+
+    // the level being shared out, and how far the threads have got
+
+    const int *cells;
+    int total, next;
+} AEWorkers;
+
+struct AEGraph
+{
+    // by cell
+
+    int count, capacity;
+    char **names;
+    AEProgram **programs;       // NULL for an input
+    int **uses;                 // the cell in each of a program's slots
+    double *values;
+    unsigned char *flags;
+    int *levels;
+
+    // name to cell, open addressing
+
+    int *table;
+    unsigned int tableSize;
+
+    // rebuilt with the order: the formulas that use cell c are
+    // usedBy[usedByStart[c]] up to usedBy[usedByStart[c + 1]]
+
+    int *usedByStart, *usedBy;
+    AEQueue *queues;            // by level
+    int levelCount;
+    int stale;                  // cells or formulas changed since
+    int cycle;                  // a cell in a cycle, or -1
+
+    AEQueue seeds;              // cells set since the last recalculation
+    float *scratch;             // slot values, for the calling thread
+    int maxSlots;
+    AEWorkers *workers;
+};
+
+static void *AEGrow (void *array, int *capacity, int count, size_t size)
+{
+    // returns: array, moved if need be to make room for one more, or
+    //   NULL if there's no memory for that (and array is untouched)
+
+    int newCapacity;
+
+    if (count < *capacity)
+        return array;
+    newCapacity = *capacity ? 2 * *capacity : 16;
+    array = realloc (array, newCapacity * size);
+    if (array != NULL)
+        *capacity = newCapacity;
+    return array;
+}
+
+static int AEQueuePush (AEQueue *queue, int cell)
+{
+    int *cells = AEGrow (queue->cells, &queue->capacity, queue->count,
+                         sizeof (int));
+
+    if (cells == NULL)
+        return 0;
+    queue->cells = cells;
+    cells[queue->count++] = cell;
+    return 1;
+}
+
+static int AESame (double a, double b)
+{
+    return a == b || (a != a && b != b);
+}
+
+static unsigned int AEHash (const char *name)
+{
+    unsigned int h = 2166136261u;
+
+    while (*name)
+        h = (h ^ (unsigned char) *name++) * 16777619u;
+    return h;
+}
+
+// threads
+
+static void AEGraphEvaluate (AEGraph *graph, int cell, float *scratch)
+{
+    // recompute one formula.  the cells it uses are all at lower levels,
+    // so nothing else is writing them, and it writes only its own
+
+    AEProgram *program = graph->programs[cell];
+    const int *uses = graph->uses[cell];
+    int i, n = AEProgramSlotCount (program), has = 1;
+    unsigned char flags = graph->flags[cell];
+    double value = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        if (!(graph->flags[uses[i]] & AEHasValue))
+        {
+            has = 0;
+            break;
+        }
+        scratch[i] = (float) graph->values[uses[i]];
+    }
+    if (has)
+        value = AEProgramEvaluate (program, scratch);
+
+    if (has != ((flags & AEHasValue) != 0)
+        || (has && !AESame (value, graph->values[cell])))
+        flags |= AEChanged;
+    flags = has ? flags | AEHasValue : flags & ~AEHasValue;
+    graph->values[cell] = value;
+    graph->flags[cell] = flags;
+}
+
+static void AEWork (AEWorkers *workers, float *scratch)
+{
+    int first, last, i;
+
+    for (;;)
+    {
+        pthread_mutex_lock (&workers->lock);
+        first = workers->next;
+        workers->next += AE_CHUNK;
+        pthread_mutex_unlock (&workers->lock);
+
+        if (first >= workers->total)
+            return;
+        last = workers->total - first < AE_CHUNK
+            ? workers->total : first + AE_CHUNK;
+        for (i = first; i < last; i++)
+            AEGraphEvaluate (workers->graph, workers->cells[i], scratch);
+    }
+}
+
+static void *AEWorker (void *argument)
+{
+    AEWorkers *workers = argument;
+    unsigned long seen = 0;
+    float *scratch = NULL;
+    int room = 0;
+
+    pthread_mutex_lock (&workers->lock);
+    for (;;)
+    {
+        while (workers->generation == seen && !workers->quit)
+            pthread_cond_wait (&workers->start, &workers->lock);
+        if (workers->quit)
+            break;
+        seen = workers->generation;
+
+        // a thread without room for a formula's slots leaves the level
+        // to the others; the calling thread always has room
+
+        if (room < workers->graph->maxSlots)
+        {
+            float *more = realloc (scratch, workers->graph->maxSlots
+                                   * sizeof (float));
+
+            if (more != NULL)
+            {
+                scratch = more;
+                room = workers->graph->maxSlots;
+            }
+        }
+        pthread_mutex_unlock (&workers->lock);
+
+        if (room >= workers->graph->maxSlots)
+            AEWork (workers, scratch);
+
+        pthread_mutex_lock (&workers->lock);
+        if (--workers->busy == 0)
+            pthread_cond_signal (&workers->finish);
+    }
+    pthread_mutex_unlock (&workers->lock);
+
+    free (scratch);
+    return NULL;
+}
+
+static void AEGraphEvaluateAll (AEGraph *graph, const int *cells, int count)
+{
+    AEWorkers *workers = graph->workers;
+    int i;
+
+    if (workers == NULL || count < AE_PARALLEL_MIN)
+    {
+        for (i = 0; i < count; i++)
+            AEGraphEvaluate (graph, cells[i], graph->scratch);
+        return;
+    }
+
+    pthread_mutex_lock (&workers->lock);
+    workers->cells = cells;
+    workers->total = count;
+    workers->next = 0;
+    workers->busy = workers->count;
+    workers->generation++;
+    pthread_cond_broadcast (&workers->start);
+    pthread_mutex_unlock (&workers->lock);
+
+    AEWork (workers, graph->scratch);
+
+    pthread_mutex_lock (&workers->lock);
+    while (workers->busy > 0)
+        pthread_cond_wait (&workers->finish, &workers->lock);
+    pthread_mutex_unlock (&workers->lock);
+}
+
+static void AEStopWorkers (AEGraph *graph)
+{
+    AEWorkers *workers = graph->workers;
+    int i;
+
+    if (workers == NULL)
+        return;
+    pthread_mutex_lock (&workers->lock);
+    workers->quit = 1;
+    pthread_cond_broadcast (&workers->start);
+    pthread_mutex_unlock (&workers->lock);
+    for (i = 0; i < workers->count; i++)
+        pthread_join (workers->threads[i], NULL);
+
+    pthread_mutex_destroy (&workers->lock);
+    pthread_cond_destroy (&workers->start);
+    pthread_cond_destroy (&workers->finish);
+    free (workers->threads);
+    free (workers);
+    graph->workers = NULL;
+}
+
+int AEGraphSetThreads (AEGraph *graph, int threads)
+{
+    // threads, counting the one that calls AEGraphRecalculate.
+    // returns: 1, or 0 if no more than the calling thread could be had
+
+    AEWorkers *workers;
+
+    AEStopWorkers (graph);
+    if (threads <= 1)
+        return 1;
+
+    workers = calloc (1, sizeof (AEWorkers));
+    if (workers == NULL)
+        return 0;
+    workers->threads = malloc ((threads - 1) * sizeof (pthread_t));
+    if (workers->threads == NULL)
+    {
+        free (workers);
+        return 0;
+    }
+    workers->graph = graph;
+    pthread_mutex_init (&workers->lock, NULL);
+    pthread_cond_init (&workers->start, NULL);
+    pthread_cond_init (&workers->finish, NULL);
+    graph->workers = workers;
+
+    while (workers->count < threads - 1
+           && pthread_create (workers->threads + workers->count, NULL,
+                              AEWorker, workers) == 0)
+        workers->count++;
+    if (workers->count == 0)
+    {
+        AEStopWorkers (graph);
+        return 0;
+    }
+    return 1;
+}
+
+// cells
+
+AEGraph *AEGraphCreate (void)
+{
+    AEGraph *graph = calloc (1, sizeof (AEGraph));
+
+    if (graph != NULL)
+        graph->cycle = -1;
+    return graph;
+}
+
+static void AEForgetProgram (AEGraph *graph, int cell)
+{
+    AEProgramRelease (graph->programs[cell]);
+    graph->programs[cell] = NULL;
+    free (graph->uses[cell]);
+    graph->uses[cell] = NULL;
+}
+
+void AEGraphRelease (AEGraph *graph)
+{
+    int i;
+
+    if (graph == NULL)
+        return;
+    AEStopWorkers (graph);
+    for (i = 0; i < graph->count; i++)
+    {
+        free (graph->names[i]);
+        AEForgetProgram (graph, i);
+    }
+    for (i = 0; i < graph->levelCount; i++)
+        free (graph->queues[i].cells);
+    free (graph->names);
+    free (graph->programs);
+    free (graph->uses);
+    free (graph->values);
+    free (graph->flags);
+    free (graph->levels);
+    free (graph->table);
+    free (graph->usedByStart);
+    free (graph->usedBy);
+    free (graph->queues);
+    free (graph->seeds.cells);
+    free (graph->scratch);
+    free (graph);
+}
+
+static int *AESlot (AEGraph *graph, const char *name)
+{
+    // returns: where name's cell is in the table, or the empty place
+    //   it would go
+
+    unsigned int mask = graph->tableSize - 1;
+    unsigned int i = AEHash (name) & mask;
+
+    while (graph->table[i] >= 0
+           && strcmp (graph->names[graph->table[i]], name) != 0)
+        i = (i + 1) & mask;
+    return graph->table + i;
+}
+
+int AEGraphFind (AEGraph *graph, const char *name)
+{
+    // returns: name's cell, or -1 if there isn't one
+
+    if (graph->tableSize == 0)
+        return -1;
+    return *AESlot (graph, name);
+}
+
+static int AEGrowTable (AEGraph *graph)
+{
+    unsigned int size = graph->tableSize ? 2 * graph->tableSize : 64;
+    int *table = malloc (size * sizeof (int));
+    unsigned int i;
+    int cell;
+
+    if (table == NULL)
+        return 0;
+    for (i = 0; i < size; i++)
+        table[i] = -1;
+    free (graph->table);
+    graph->table = table;
+    graph->tableSize = size;
+    for (cell = 0; cell < graph->count; cell++)
+        *AESlot (graph, graph->names[cell]) = cell;
+    return 1;
+}
+
+static int AEGrowCells (AEGraph *graph)
+{
+    int capacity = graph->capacity ? 2 * graph->capacity : 64;
+    void *p;
+
+#define AE_GROW(array)                                                  \
+    if ((p = realloc (graph->array, capacity * sizeof *graph->array))   \
+        == NULL)                                                        \
+        return 0;                                                       \
+    graph->array = p;
+
+    AE_GROW (names)
+    AE_GROW (programs)
+    AE_GROW (uses)
+    AE_GROW (values)
+    AE_GROW (flags)
+    AE_GROW (levels)
+#undef AE_GROW
+
+    graph->capacity = capacity;
+    return 1;
+}
+
+int AEGraphCell (AEGraph *graph, const char *name)
+{
+    // returns: name's cell, made if need be, or -1 if out of memory
+
+    int cell = AEGraphFind (graph, name);
+    char *copy;
+
+    if (cell >= 0)
+        return cell;
+    if ((2 * (graph->count + 1) > (int) graph->tableSize
+         && !AEGrowTable (graph))
+        || (graph->count == graph->capacity && !AEGrowCells (graph))
+        || (copy = malloc (strlen (name) + 1)) == NULL)
+        return -1;
+
+    cell = graph->count++;
+    graph->names[cell] = strcpy (copy, name);
+    graph->programs[cell] = NULL;
+    graph->uses[cell] = NULL;
+    graph->values[cell] = 0;
+    graph->flags[cell] = 0;
+    graph->levels[cell] = 0;
+    *AESlot (graph, name) = cell;
+    graph->stale = 1;
+    return cell;
+}
+
+int AEGraphCount (AEGraph *graph)
+{
+    return graph->count;
+}
+
+const char *AEGraphName (AEGraph *graph, int cell)
+{
+    return cell >= 0 && cell < graph->count ? graph->names[cell] : NULL;
+}
+
+int AEGraphSetProgram (AEGraph *graph, int cell, AEProgram *program)
+{
+    // make cell a formula.  the graph owns program from now on, whether
+    // or not this works.  returns: 1, or 0 if out of memory
+
+    int i, n, *uses;
+
+    if (program == NULL || cell < 0 || cell >= graph->count)
+    {
+        AEProgramRelease (program);
+        return 0;
+    }
+
+    n = AEProgramSlotCount (program);
+    uses = malloc ((n + 1) * sizeof (int));
+    if (n >= graph->maxSlots)
+    {
+        float *scratch = realloc (graph->scratch, (n + 1) * sizeof (float));
+
+        if (scratch != NULL)
+        {
+            graph->scratch = scratch;
+            graph->maxSlots = n + 1;
+        }
+    }
+    for (i = 0; uses != NULL && i < n; i++)
+        if ((uses[i] = AEGraphCell (graph,
+                                    AEProgramSlotName (program, i))) < 0)
+            break;
+    if (uses == NULL || i < n || n >= graph->maxSlots
+        || !AEQueuePush (&graph->seeds, cell))
+    {
+        free (uses);
+        AEProgramRelease (program);
+        return 0;
+    }
+
+    AEForgetProgram (graph, cell);
+    graph->programs[cell] = program;
+    graph->uses[cell] = uses;
+    graph->stale = 1;
+    return 1;
+}
+
+int AEGraphSetFormula (AEGraph *graph, int cell, const char *text,
+                       const char **error)
+{
+    AEProgram *program = AEProgramCreateWithString (text, error);
+
+    return program != NULL && AEGraphSetProgram (graph, cell, program);
+}
+
+int AEGraphSetValue (AEGraph *graph, int cell, double value)
+{
+    // make cell an input with this value.  returns: 1, or 0 if out of
+    // memory
+
+    if (cell < 0 || cell >= graph->count)
+        return 0;
+    if (graph->programs[cell] != NULL)
+    {
+        AEForgetProgram (graph, cell);
+        graph->flags[cell] &= ~AEHasValue;
+        graph->stale = 1;
+    }
+    if ((graph->flags[cell] & AEHasValue)
+        && AESame (graph->values[cell], value))
+        return 1;
+    if (!AEQueuePush (&graph->seeds, cell))
+        return 0;
+    graph->values[cell] = value;
+    graph->flags[cell] |= AEHasValue;
+    return 1;
+}
+
+void AEGraphInvalidate (AEGraph *graph)
+{
+    // recompute every formula next time, changed or not
+
+    int cell;
+
+    for (cell = 0; cell < graph->count; cell++)
+        if (graph->programs[cell] != NULL)
+            AEQueuePush (&graph->seeds, cell);
+}
+
+// ordering
+
+static int AEGraphRebuild (AEGraph *graph)
+{
+    // work out who uses each cell, and order the formulas by level, from
+    // scratch: cheap enough next to parsing the formulas that changed.
+    // formulas the order never reaches are in a cycle or depend on one
+
+    int n = graph->count, cell, i, head = 0, tail = 0, levels = 1;
+    int *pending = malloc ((n + 1) * sizeof (int));
+    int *order = malloc ((n + 1) * sizeof (int));
+    int *start = calloc (n + 2, sizeof (int));
+    int *usedBy = NULL;
+    AEQueue *queues;
+
+    if (pending == NULL || order == NULL || start == NULL)
+        goto failed;
+
+    for (cell = 0; cell < n; cell++)
+        if (graph->programs[cell] != NULL)
+            for (i = 0; i < AEProgramSlotCount (graph->programs[cell]); i++)
+                start[graph->uses[cell][i] + 2]++;
+    for (cell = 0; cell < n; cell++)
+        start[cell + 2] += start[cell + 1];
+    usedBy = malloc ((start[n + 1] + 1) * sizeof (int));
+    if (usedBy == NULL)
+        goto failed;
+    for (cell = 0; cell < n; cell++)
+        if (graph->programs[cell] != NULL)
+            for (i = 0; i < AEProgramSlotCount (graph->programs[cell]); i++)
+                usedBy[start[graph->uses[cell][i] + 1]++] = cell;
+
+    for (cell = 0; cell < n; cell++)
+    {
+        pending[cell] = graph->programs[cell] == NULL ? 0
+            : AEProgramSlotCount (graph->programs[cell]);
+        graph->levels[cell] = graph->programs[cell] == NULL ? 0 : 1;
+        if (pending[cell] == 0)
+            order[tail++] = cell;
+    }
+    while (head < tail)
+    {
+        int used = order[head++];
+
+        for (i = start[used]; i < start[used + 1]; i++)
+        {
+            cell = usedBy[i];
+            if (graph->levels[cell] <= graph->levels[used])
+                graph->levels[cell] = graph->levels[used] + 1;
+            if (--pending[cell] == 0)
+                order[tail++] = cell;
+        }
+        if (graph->levels[used] >= levels)
+            levels = graph->levels[used] + 1;
+    }
+
+    queues = realloc (graph->queues, levels * sizeof (AEQueue));
+    if (queues == NULL)
+        goto failed;
+    for (i = graph->levelCount; i < levels; i++)
+        memset (queues + i, 0, sizeof (AEQueue));
+    for (i = levels; i < graph->levelCount; i++)
+        free (queues[i].cells);
+    graph->queues = queues;
+    graph->levelCount = levels;
+
+    // a formula that was in a cycle and isn't now is worked out afresh
+
+    graph->cycle = -1;
+    for (cell = 0; cell < n; cell++)
+        if (pending[cell] > 0)
+        {
+            graph->flags[cell] |= AECyclic;
+            graph->flags[cell] &= ~AEHasValue;
+            graph->levels[cell] = -1;
+            graph->cycle = cell;
+        }
+        else if (graph->flags[cell] & AECyclic)
+        {
+            graph->flags[cell] &= ~AECyclic;
+            if (!AEQueuePush (&graph->seeds, cell))
+                goto failed;
+        }
+
+    // to name a formula that's in a cycle, and not just after one, follow
+    // unordered cells back until the walk must have gone round
+
+    if (graph->cycle >= 0)
+        for (head = 0; head < n; head++)
+        {
+            const int *uses = graph->uses[graph->cycle];
+
+            for (i = 0; pending[uses[i]] == 0; i++)
+                ;
+            graph->cycle = uses[i];
+        }
+
+    free (graph->usedByStart);
+    free (graph->usedBy);
+    graph->usedByStart = start;
+    graph->usedBy = usedBy;
+    graph->stale = 0;
+    free (pending);
+    free (order);
+    return 1;
+
+failed:
+    free (pending);
+    free (order);
+    free (start);
+    free (usedBy);
+    return 0;
+}
+
+static int AEEnqueue (AEGraph *graph, int cell)
+{
+    if (graph->flags[cell] & (AEQueued | AECyclic))
+        return 1;
+    if (!AEQueuePush (graph->queues + graph->levels[cell], cell))
+        return 0;
+    graph->flags[cell] |= AEQueued;
+    return 1;
+}
+
+static int AEEnqueueUsers (AEGraph *graph, int cell)
+{
+    int i;
+
+    for (i = graph->usedByStart[cell]; i < graph->usedByStart[cell + 1]; i++)
+        if (!AEEnqueue (graph, graph->usedBy[i]))
+            return 0;
+    return 1;
+}
+
+int AEGraphRecalculate (AEGraph *graph)
+{
+    // returns: how many formulas were recomputed, or -1 if out of memory
+
+    int i, level, done = 0;
+
+    if (graph->stale && !AEGraphRebuild (graph))
+        return -1;
+
+    for (i = 0; i < graph->seeds.count; i++)
+    {
+        int cell = graph->seeds.cells[i];
+
+        if (!(graph->programs[cell] != NULL
+              ? AEEnqueue (graph, cell) : AEEnqueueUsers (graph, cell)))
+            return -1;
+    }
+    graph->seeds.count = 0;
+
+    for (level = 1; level < graph->levelCount; level++)
+    {
+        AEQueue *queue = graph->queues + level;
+
+        if (queue->count == 0)
+            continue;
+        AEGraphEvaluateAll (graph, queue->cells, queue->count);
+
+        // a formula whose value didn't change stops the change there
+
+        for (i = 0; i < queue->count; i++)
+        {
+            int cell = queue->cells[i];
+
+            graph->flags[cell] &= ~AEQueued;
+            if (graph->flags[cell] & AEChanged)
+            {
+                graph->flags[cell] &= ~AEChanged;
+                if (!AEEnqueueUsers (graph, cell))
+                    return -1;
+            }
+        }
+        done += queue->count;
+        queue->count = 0;
+    }
+    return done;
+}
+
+// answers
+
+int AEGraphValue (AEGraph *graph, int cell, double *value)
+{
+    // returns: 1 with cell's value, as of the last recalculation, or 0
+    //   if it doesn't have one
+
+    if (cell < 0 || cell >= graph->count
+        || !(graph->flags[cell] & AEHasValue))
+        return 0;
+    *value = graph->values[cell];
+    return 1;
+}
+
+AEProgram *AEGraphProgram (AEGraph *graph, int cell)
+{
+    return cell >= 0 && cell < graph->count ? graph->programs[cell] : NULL;
+}
+
+int AEGraphLevel (AEGraph *graph, int cell)
+{
+    return cell >= 0 && cell < graph->count ? graph->levels[cell] : -1;
+}
+
+const char *AEGraphCycle (AEGraph *graph)
+{
+    return graph->cycle >= 0 ? graph->names[graph->cycle] : NULL;
+}
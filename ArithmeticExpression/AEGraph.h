@@ -0,0 +1,61 @@
+//
+//  AEGraph.h
+//  Blackthorn
+//
+//  Named formulas that depend on one another, recalculated incrementally.
+//
+
+#ifndef AEGRAPH_H
+#define AEGRAPH_H
+
+#include "AEProgram.h"
+
+// A graph holds named cells.  A cell is a formula, an AEProgram whose
+// variables are the names of other cells, or an input, a value set from
+// outside.  A name a formula uses before anything has been set for it is
+// an input without a value, and like a variable missing from the
+// dictionary, it leaves every formula that depends on it without one.
+//
+// Setting a value or a formula only notes what changed.  Recalculating
+// puts the formulas in order, by level (a formula's level is one more
+// than the highest level among the cells it uses; inputs are level 0),
+// and then works through the levels, recomputing only the formulas that
+// use something that changed.  A formula whose value comes out the same
+// as before stops the change there.  Formulas in a level don't depend on
+// each other, so with more than one thread, a level with plenty to do is
+// shared out among them.
+//
+// Formulas in a cycle, or that depend on one, have no value;
+// AEGraphCycle names one of the cycle's formulas.  Only the variables a
+// program actually reads are dependencies: the arguments of a function
+// ArithmeticExpression doesn't implement aren't.
+
+#define AE_PARALLEL_MIN 1024    // formulas in a level worth sharing out
+#define AE_CHUNK 128            // formulas a thread takes at a time
+
+typedef struct AEGraph AEGraph;
+
+AEGraph *AEGraphCreate (void);
+void AEGraphRelease (AEGraph *graph);
+int AEGraphSetThreads (AEGraph *graph, int threads);
+
+// cells are numbered from 0 in the order their names first turn up
+
+int AEGraphCell (AEGraph *graph, const char *name);
+int AEGraphFind (AEGraph *graph, const char *name);
+int AEGraphCount (AEGraph *graph);
+const char *AEGraphName (AEGraph *graph, int cell);
+
+int AEGraphSetProgram (AEGraph *graph, int cell, AEProgram *program);
+int AEGraphSetFormula (AEGraph *graph, int cell, const char *text,
+                       const char **error);
+int AEGraphSetValue (AEGraph *graph, int cell, double value);
+void AEGraphInvalidate (AEGraph *graph);
+
+int AEGraphRecalculate (AEGraph *graph);
+int AEGraphValue (AEGraph *graph, int cell, double *value);
+AEProgram *AEGraphProgram (AEGraph *graph, int cell);
+int AEGraphLevel (AEGraph *graph, int cell);
+const char *AEGraphCycle (AEGraph *graph);
+
+#endif
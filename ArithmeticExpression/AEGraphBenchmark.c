@@ -0,0 +1,337 @@
+//
+//  AEGraphBenchmark.c
+//  Blackthorn
+//
+//  Times incremental recalculation of a graph of formulas against
+//  recomputing all of them.
+//
+//  usage: AEGraphBenchmark [-t threads] [formulas] [ticks]
+//         AEGraphBenchmark -c
+//
+//  The graph is laid out like a big spreadsheet: a tenth as many inputs
+//  as formulas, and four layers of formulas, each using a few cells of
+//  the layer below (50%, 30%, 15% and 5% of the formulas).  Each tick
+//  changes 1% of the inputs and recalculates.  At the end, the values
+//  are checked against recomputing everything.
+//
+//  With -c, it checks ordering, missing inputs, cycles, cut-offs and
+//  redefinitions on small graphs, and a big graph with several threads;
+//  the exit status says whether everything came out right.
+//
+
+#define _POSIX_C_SOURCE 199309L     // for clock_gettime
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "AEGraph.h"
+
+static double now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long state = 1;
+
+static unsigned int randomBelow (unsigned int n)
+{
+    state = state * 6364136223846793005UL + 1442695040888963407UL;
+    return (state >> 33) % n;
+}
+
+static int cell (AEGraph *graph, const char *format, int n)
+{
+    char name[32];
+
+    sprintf (name, format, n);
+    return AEGraphCell (graph, name);
+}
+
+static void define (AEGraph *graph, const char *name, const char *text)
+{
+    const char *error = "out of memory";
+
+    if (!AEGraphSetFormula (graph, AEGraphCell (graph, name), text, &error))
+    {
+        fprintf (stderr, "%s = %s: %s\n", name, text, error);
+        exit (2);
+    }
+}
+
+static AEGraph *spreadsheet (int formulas, int threads, int **inputCells,
+                             int *inputCount)
+{
+    static const char *layers[] = { "a%d", "b%d", "c%d", "d%d" };
+    static const char *below[] = { "in%d", "a%d", "b%d", "c%d" };
+    static const int percent[] = { 50, 30, 15, 5 };
+    AEGraph *graph = AEGraphCreate ();
+    int inputs = formulas / 10 > 0 ? formulas / 10 : 1;
+    int sizes[5], layer, i;
+    char name[32], text[128], x[32], y[32], z[32];
+
+    sizes[0] = inputs;
+    for (layer = 0; layer < 4; layer++)
+    {
+        sizes[layer + 1] = formulas * percent[layer] / 100;
+        if (sizes[layer + 1] == 0)
+            sizes[layer + 1] = 1;
+    }
+
+    *inputCells = malloc (inputs * sizeof (int));
+    *inputCount = inputs;
+    for (i = 0; i < inputs; i++)
+    {
+        (*inputCells)[i] = cell (graph, "in%d", i);
+        AEGraphSetValue (graph, (*inputCells)[i], randomBelow (1000));
+    }
+
+    for (layer = 0; layer < 4; layer++)
+        for (i = 0; i < sizes[layer + 1]; i++)
+        {
+            sprintf (name, layers[layer], i);
+            sprintf (x, below[layer], randomBelow (sizes[layer]));
+            sprintf (y, below[layer], randomBelow (sizes[layer]));
+            sprintf (z, below[layer], randomBelow (sizes[layer]));
+            switch (layer)
+            {
+                case 0:
+                    sprintf (text, "%s + %s * 0.5 - %s / 4", x, y, z);
+                    break;
+                case 1:
+                    sprintf (text, "%s * 0.25 + int(%s)", x, y);
+                    break;
+                case 2:
+                    sprintf (text, "(%s + %s) / 2", x, y);
+                    break;
+                default:
+                    sprintf (text, "%s - %s + %s / 3", x, y, z);
+            }
+            define (graph, name, text);
+        }
+
+    if (threads > 1 && !AEGraphSetThreads (graph, threads))
+        fprintf (stderr, "can't start threads; going on with one\n");
+    return graph;
+}
+
+static int tick (AEGraph *graph, int *inputs, int count)
+{
+    int i;
+
+    for (i = 0; i < count / 100 || i < 1; i++)
+        AEGraphSetValue (graph, inputs[randomBelow (count)],
+                         randomBelow (1000));
+    return AEGraphRecalculate (graph);
+}
+
+static int compareWithFull (AEGraph *graph)
+{
+    // returns: the number of cells whose incremental values differ from
+    // recomputing everything
+
+    int i, n = AEGraphCount (graph), wrong = 0;
+    double *values = malloc (n * sizeof (double));
+    char *has = malloc (n);
+
+    for (i = 0; i < n; i++)
+        has[i] = AEGraphValue (graph, i, values + i);
+    AEGraphInvalidate (graph);
+    AEGraphRecalculate (graph);
+    for (i = 0; i < n; i++)
+    {
+        double value;
+        int hasNow = AEGraphValue (graph, i, &value);
+
+        if (hasNow != has[i] || (hasNow && value != values[i]))
+        {
+            if (wrong++ == 0)
+                fprintf (stderr, "%s: %g incrementally, %g in full\n",
+                         AEGraphName (graph, i), values[i], value);
+        }
+    }
+    free (values);
+    free (has);
+    return wrong;
+}
+
+static int expect (AEGraph *graph, const char *name, int has, double value)
+{
+    double actual;
+    int hasNow = AEGraphValue (graph, AEGraphFind (graph, name), &actual);
+
+    if (hasNow == has && (!has || actual == value))
+        return 0;
+    if (hasNow)
+        fprintf (stderr, "%s is %g, not ", name, actual);
+    else
+        fprintf (stderr, "%s has no value, not ", name);
+    if (has)
+        fprintf (stderr, "%g\n", value);
+    else
+        fprintf (stderr, "none\n");
+    return 1;
+}
+
+static int check (void)
+{
+    AEGraph *graph = AEGraphCreate ();
+    int failed = 0, done, *inputs, count;
+
+    // in order, whatever order they're defined in
+
+    define (graph, "total", "subtotal * (1 + \"tax rate\")");
+    define (graph, "subtotal", "price * quantity");
+    AEGraphSetValue (graph, AEGraphCell (graph, "price"), 2.5);
+    AEGraphSetValue (graph, AEGraphCell (graph, "quantity"), 4);
+    AEGraphSetValue (graph, AEGraphCell (graph, "tax rate"), 0.5);
+    AEGraphRecalculate (graph);
+    failed += expect (graph, "total", 1, 15);
+    failed += AEGraphLevel (graph, AEGraphFind (graph, "total")) != 2;
+
+    // missing inputs, and functions that don't look at their arguments
+
+    define (graph, "scaled", "missing * 2");
+    define (graph, "zero", "min(missing, 1) + 1");
+    AEGraphRecalculate (graph);
+    failed += expect (graph, "scaled", 0, 0);
+    failed += expect (graph, "zero", 1, 1);
+    AEGraphSetValue (graph, AEGraphFind (graph, "missing"), 4);
+    AEGraphRecalculate (graph);
+    failed += expect (graph, "scaled", 1, 8);
+
+    // a value that comes out the same goes no further
+
+    define (graph, "tens", "int(units / 10)");
+    define (graph, "doubled", "tens * 2");
+    AEGraphSetValue (graph, AEGraphCell (graph, "units"), 11);
+    AEGraphRecalculate (graph);
+    AEGraphSetValue (graph, AEGraphFind (graph, "units"), 12);
+    done = AEGraphRecalculate (graph);
+    failed += expect (graph, "doubled", 1, 2);
+    if (done != 1)
+    {
+        fprintf (stderr, "recomputed %d formulas, not 1\n", done);
+        failed++;
+    }
+
+    // cycles, and breaking them
+
+    define (graph, "x", "y + 1");
+    define (graph, "y", "x + 1");
+    define (graph, "after", "x * 10");
+    define (graph, "self", "self + 1");
+    AEGraphRecalculate (graph);
+    if (AEGraphCycle (graph) == NULL
+        || strcmp (AEGraphCycle (graph), "after") == 0)
+    {
+        fprintf (stderr, "cycle: %s\n", AEGraphCycle (graph));
+        failed++;
+    }
+    failed += expect (graph, "x", 0, 0);
+    failed += expect (graph, "after", 0, 0);
+    failed += expect (graph, "total", 1, 15);
+    AEGraphSetValue (graph, AEGraphFind (graph, "y"), 5);
+    define (graph, "self", "3");
+    AEGraphRecalculate (graph);
+    failed += AEGraphCycle (graph) != NULL;
+    failed += expect (graph, "x", 1, 6);
+    failed += expect (graph, "after", 1, 60);
+    failed += expect (graph, "self", 1, 3);
+
+    // redefining a formula changes what it depends on
+
+    define (graph, "subtotal", "price * 10");
+    AEGraphRecalculate (graph);
+    failed += expect (graph, "total", 1, 37.5);
+    AEGraphSetValue (graph, AEGraphFind (graph, "quantity"), 100);
+    failed += AEGraphRecalculate (graph) != 0;
+    AEGraphRelease (graph);
+
+    // a big one, with threads
+
+    graph = spreadsheet (20000, 3, &inputs, &count);
+    AEGraphRecalculate (graph);
+    for (done = 0; done < 20; done++)
+        tick (graph, inputs, count);
+    failed += compareWithFull (graph);
+    AEGraphRelease (graph);
+    free (inputs);
+
+    printf ("%s\n", failed ? "FAILED" : "ok");
+    return failed != 0;
+}
+
+int main (int argc, char **argv)
+{
+    int formulas = 100000, ticks = 100, threads = 1;
+    int *inputs, count, i, recomputed = 0, levels = 0;
+    double start, built, first, incremental, full;
+    AEGraph *graph;
+
+    if (argc > 1 && strcmp (argv[1], "-c") == 0)
+        return check ();
+    if (argc > 2 && strcmp (argv[1], "-t") == 0)
+    {
+        threads = atoi (argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc > 1)
+        formulas = atoi (argv[1]);
+    if (argc > 2)
+        ticks = atoi (argv[2]);
+    if (formulas <= 0 || ticks <= 0 || threads <= 0)
+    {
+        fprintf (stderr, "usage: AEGraphBenchmark [-t threads] [formulas] "
+                 "[ticks]\n       AEGraphBenchmark -c\n");
+        return 2;
+    }
+
+    start = now ();
+    graph = spreadsheet (formulas, threads, &inputs, &count);
+    built = now () - start;
+    start = now ();
+    AEGraphRecalculate (graph);
+    first = now () - start;
+    for (i = 0; i < AEGraphCount (graph); i++)
+        if (AEGraphLevel (graph, i) > levels)
+            levels = AEGraphLevel (graph, i);
+
+    start = now ();
+    for (i = 0; i < ticks; i++)
+        recomputed += tick (graph, inputs, count);
+    incremental = now () - start;
+
+    start = now ();
+    for (i = 0; i < ticks; i++)
+    {
+        AEGraphInvalidate (graph);
+        AEGraphRecalculate (graph);
+    }
+    full = now () - start;
+
+    printf ("%d formulas, %d inputs, %d levels, %d thread%s\n",
+            AEGraphCount (graph) - count, count, levels, threads,
+            threads == 1 ? "" : "s");
+    printf ("  parsing and compiling %8.1f ms\n", built * 1e3);
+    printf ("  first calculation     %8.1f ms\n", first * 1e3);
+    printf ("  %d inputs changed a tick, %.0f formulas recomputed\n",
+            count / 100 > 0 ? count / 100 : 1, (double) recomputed / ticks);
+    printf ("  incremental           %8.3f ms/tick\n",
+            incremental * 1e3 / ticks);
+    printf ("  everything            %8.3f ms/tick  %.1fx\n",
+            full * 1e3 / ticks, full / incremental);
+
+    AEGraphRecalculate (graph);
+    for (i = 0; i < ticks; i++)
+        tick (graph, inputs, count);
+    i = compareWithFull (graph);
+    AEGraphRelease (graph);
+    free (inputs);
+    return i != 0;
+}
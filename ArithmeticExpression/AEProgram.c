@@ -0,0 +1,947 @@
+//
+//  AEProgram.c
+//  Blackthorn
+//
+//  See AEProgram.h.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+
+#include "AEProgram.h"
+
+// tree nodes, as the program is built; constant subtrees are folded as
+// soon as they're complete, so a node with operands has at least one
+// that isn't a number
+
+enum
+{
+    AENodeNumber,
+    AENodeVariable,
+    AENodeAdd,
+    AENodeSubtract,
+    AENodeMultiply,
+    AENodeDivide,
+    AENodeInt
+};
+
+typedef struct AENode
+{
+    int kind;
+    int integer;            // an int() or an unimplemented function
+    float value;            // AENodeNumber
+    int name;               // AENodeVariable: index into names
+    int left, right;        // operands; AENodeInt has only left
+    int depth;              // stack entries needed to evaluate it
+} AENode;
+
+// the bytecode.  the accumulator holds the value so far; K, V and S say
+// whether the other operand is a constant, a slot or the top of the stack,
+// and whether it goes on the left (KSUB: constant - accumulator) or the
+// right (SUBK: accumulator - constant) of the operator
+
+enum
+{
+    AE_LOADK, AE_LOADV, AE_PUSH,
+    AE_ADDK, AE_ADDV, AE_ADDS,
+    AE_SUBK, AE_SUBV, AE_SUBS,
+    AE_KSUB, AE_VSUB, AE_SSUB,
+    AE_MULK, AE_MULV, AE_MULS,
+    AE_DIVK, AE_DIVV, AE_DIVS,
+    AE_KDIV, AE_VDIV, AE_SDIV,
+    AE_TRUNC
+};
+
+typedef struct AEInstruction
+{
+    int op;
+    union
+    {
+        float constant;
+        int slot;
+    } arg;
+} AEInstruction;
+
+struct AEProgram
+{
+    // while building
+
+    AENode *nodes;
+    int nodeCount, nodeCapacity;
+    int *operands;
+    int operandCount, operandCapacity;
+    char **names;
+    int *slotOfName;
+    int nameCount, nameCapacity;
+
+    // once finished
+
+    AEInstruction *code;
+    int length, codeCapacity;
+    int *nameOfSlot;
+    int slotCount;
+    int depth;
+    int integer;
+    int finished;
+
+    const char *error;
+};
+
+static void *AEGrow (void *array, int *capacity, int count, size_t size)
+{
+    // returns: array, moved if need be to make room for one more, or
+    //   NULL if there's no memory for that (and array is untouched)
+
+    int newCapacity;
+
+    if (count < *capacity)
+        return array;
+    newCapacity = *capacity ? 2 * *capacity : 16;
+    array = realloc (array, newCapacity * size);
+    if (array != NULL)
+        *capacity = newCapacity;
+    return array;
+}
+
+static int AEFail (AEProgram *program, const char *why)
+{
+    if (program->error == NULL)
+        program->error = why;
+    return 0;
+}
+
+static float AETruncate (float value)
+{
+    // what [[NSNumber numberWithInt: [input intValue]] floatValue] does.
+    // a float of 2^23 or more is a whole number already, and may be too
+    // big for an int.  written without branches, so that it vectorizes
+
+    int small = fabsf (value) < 8388608.0f;
+    float whole = (float) (int) (small ? value : 0);
+
+    return small ? whole : value;
+}
+
+static double AEIntegerValue (float value)
+{
+    // an int() at the top gives an int, not a float, so keeps every digit
+    if (value != value)
+        return 0;
+    if (value >= (float) INT_MAX)
+        return INT_MAX;
+    if (value <= (float) INT_MIN)
+        return INT_MIN;
+    return (int) value;
+}
+
+// building
+
+AEProgram *AEProgramCreate (void)
+{
+    return calloc (1, sizeof (AEProgram));
+}
+
+void AEProgramRelease (AEProgram *program)
+{
+    int i;
+
+    if (program == NULL)
+        return;
+    for (i = 0; i < program->nameCount; i++)
+        free (program->names[i]);
+    free (program->names);
+    free (program->slotOfName);
+    free (program->nodes);
+    free (program->operands);
+    free (program->code);
+    free (program->nameOfSlot);
+    free (program);
+}
+
+static int AEPushNode (AEProgram *program, AENode *node)
+{
+    AENode *nodes;
+    int *operands;
+
+    if (program->error != NULL)
+        return 0;
+    if (program->finished)
+        return AEFail (program, "the program is already finished");
+    if ((nodes = AEGrow (program->nodes, &program->nodeCapacity,
+                         program->nodeCount, sizeof (AENode))) != NULL)
+        program->nodes = nodes;
+    if ((operands = AEGrow (program->operands, &program->operandCapacity,
+                            program->operandCount, sizeof (int))) != NULL)
+        program->operands = operands;
+    if (nodes == NULL || operands == NULL)
+        return AEFail (program, "out of memory");
+
+    program->nodes[program->nodeCount] = *node;
+    program->operands[program->operandCount++] = program->nodeCount++;
+    return 1;
+}
+
+static int AEIsLeaf (AENode *node)
+{
+    return node->kind == AENodeNumber || node->kind == AENodeVariable;
+}
+
+int AEProgramPushNumber (AEProgram *program, float value)
+{
+    AENode node;
+
+    memset (&node, 0, sizeof node);
+    node.kind = AENodeNumber;
+    node.value = value;
+    return AEPushNode (program, &node);
+}
+
+int AEProgramPushVariable (AEProgram *program, const char *name)
+{
+    AENode node;
+    int i;
+
+    if (program->error != NULL)
+        return 0;
+
+    for (i = 0; i < program->nameCount; i++)
+        if (strcmp (program->names[i], name) == 0)
+            break;
+    if (i == program->nameCount)
+    {
+        char **names = AEGrow (program->names, &program->nameCapacity,
+                               program->nameCount, sizeof (char *));
+
+        if (names == NULL)
+            return AEFail (program, "out of memory");
+        program->names = names;
+        if ((names[i] = malloc (strlen (name) + 1)) == NULL)
+            return AEFail (program, "out of memory");
+        strcpy (program->names[i], name);
+        program->nameCount++;
+    }
+
+    memset (&node, 0, sizeof node);
+    node.kind = AENodeVariable;
+    node.name = i;
+    return AEPushNode (program, &node);
+}
+
+static float AEFold (int kind, float left, float right)
+{
+    switch (kind)
+    {
+        case AENodeAdd:
+            return left + right;
+        case AENodeSubtract:
+            return left - right;
+        case AENodeMultiply:
+            return left * right;
+        case AENodeDivide:
+            return left / right;
+        default:
+            return AETruncate (left);
+    }
+}
+
+static int AEDepth (AEProgram *program, AENode *node)
+{
+    // the accumulator holds a leaf's value, so it needs no stack.  an
+    // operand that's a leaf goes straight into the instruction; otherwise
+    // the side that needs more stack goes first, and its value waits on
+    // the stack while the other side is worked out
+
+    AENode *left = program->nodes + node->left;
+    AENode *right = program->nodes + node->right;
+
+    if (AEIsLeaf (node))
+        return 0;
+    if (node->kind == AENodeInt)
+        return left->depth;
+    if (AEIsLeaf (right))
+        return left->depth;
+    if (AEIsLeaf (left))
+        return right->depth;
+    if (left->depth == right->depth)
+        return left->depth + 1;
+    return left->depth > right->depth ? left->depth : right->depth;
+}
+
+int AEProgramApply (AEProgram *program, const char *op, int nargs)
+{
+    AENode node, *left, *right;
+    int *args;
+
+    if (program->error != NULL)
+        return 0;
+    if (nargs < 0 || nargs > program->operandCount)
+        return AEFail (program, "not enough operands");
+    program->operandCount -= nargs;
+    args = program->operands + program->operandCount;
+
+    memset (&node, 0, sizeof node);
+    if (strcmp (op, "+") == 0)
+        node.kind = AENodeAdd;
+    else if (strcmp (op, "-") == 0)
+        node.kind = AENodeSubtract;
+    else if (strcmp (op, "*") == 0)
+        node.kind = AENodeMultiply;
+    else if (strcmp (op, "/") == 0)
+        node.kind = AENodeDivide;
+    else if (strcmp (op, "int") == 0)
+    {
+        // the tree walker looks at the first argument and no further
+        if (nargs < 1)
+            return AEFail (program, "int() needs an argument");
+        node.kind = AENodeInt;
+        node.integer = 1;
+    }
+    else if (strcmp (op, "lookup") == 0)
+        return AEFail (program, "lookup isn't a function");
+    else
+    {
+        // not implemented in the tree walker, which says 0 without
+        // evaluating the arguments; so their variables aren't needed
+        node.kind = AENodeNumber;
+        node.integer = 1;
+        return AEPushNode (program, &node);
+    }
+
+    if (node.kind != AENodeInt && nargs != 2)
+        return AEFail (program, "an operator needs two operands");
+
+    node.left = args[0];
+    node.right = node.kind == AENodeInt ? args[0] : args[1];
+    left = program->nodes + node.left;
+    right = program->nodes + node.right;
+
+    if (left->kind == AENodeNumber && right->kind == AENodeNumber)
+    {
+        int integer = node.integer;
+
+        if (!AEProgramPushNumber (program,
+                                  AEFold (node.kind, left->value,
+                                          right->value)))
+            return 0;
+        program->nodes[program->nodeCount - 1].integer = integer;
+        return 1;
+    }
+
+    node.depth = AEDepth (program, &node);
+    return AEPushNode (program, &node);
+}
+
+static int AEEmit (AEProgram *program, int op, AENode *operand)
+{
+    AEInstruction *instruction = AEGrow (program->code,
+                                         &program->codeCapacity,
+                                         program->length,
+                                         sizeof (AEInstruction));
+
+    if (instruction == NULL)
+        return AEFail (program, "out of memory");
+    program->code = instruction;
+    instruction += program->length++;
+    instruction->op = op;
+    instruction->arg.slot = 0;
+
+    if (operand == NULL)
+        return 1;
+    if (operand->kind == AENodeNumber)
+    {
+        instruction->arg.constant = operand->value;
+        return 1;
+    }
+
+    // variables get slots in the order the program first reads them
+
+    if (program->slotOfName[operand->name] < 0)
+    {
+        program->slotOfName[operand->name] = program->slotCount;
+        program->nameOfSlot[program->slotCount++] = operand->name;
+    }
+    instruction->arg.slot = program->slotOfName[operand->name];
+    return 1;
+}
+
+static int AEOpcode (int kind, AENode *operand, int operandOnLeft)
+{
+    // the opcode for kind with operand, a leaf (or NULL for the top of
+    // the stack) on the given side; opcodes come in threes, K V S
+
+    int base, form = operand == NULL ? 2
+        : operand->kind == AENodeNumber ? 0 : 1;
+
+    switch (kind)
+    {
+        case AENodeAdd:
+            return AE_ADDK + form;
+        case AENodeMultiply:
+            return AE_MULK + form;
+        case AENodeSubtract:
+            base = operandOnLeft ? AE_KSUB : AE_SUBK;
+            return base + form;
+        default:
+            base = operandOnLeft ? AE_KDIV : AE_DIVK;
+            return base + form;
+    }
+}
+
+static int AEGenerate (AEProgram *program, int index)
+{
+    AENode *node = program->nodes + index;
+    AENode *left = program->nodes + node->left;
+    AENode *right = program->nodes + node->right;
+
+    switch (node->kind)
+    {
+        case AENodeNumber:
+            return AEEmit (program, AE_LOADK, node);
+        case AENodeVariable:
+            return AEEmit (program, AE_LOADV, node);
+        case AENodeInt:
+            return AEGenerate (program, node->left)
+                && AEEmit (program, AE_TRUNC, NULL);
+    }
+
+    if (AEIsLeaf (right))
+        return AEGenerate (program, node->left)
+            && AEEmit (program, AEOpcode (node->kind, right, 0), right);
+    if (AEIsLeaf (left))
+        return AEGenerate (program, node->right)
+            && AEEmit (program, AEOpcode (node->kind, left, 1), left);
+
+    // SUBS and DIVS take the stack on the right, SSUB and SDIV on the left
+
+    if (right->depth > left->depth)
+        return AEGenerate (program, node->right)
+            && AEEmit (program, AE_PUSH, NULL)
+            && AEGenerate (program, node->left)
+            && AEEmit (program, AEOpcode (node->kind, NULL, 0), NULL);
+    return AEGenerate (program, node->left)
+        && AEEmit (program, AE_PUSH, NULL)
+        && AEGenerate (program, node->right)
+        && AEEmit (program, AEOpcode (node->kind, NULL, 1), NULL);
+}
+
+int AEProgramFinish (AEProgram *program)
+{
+    AENode *root;
+    int i;
+
+    if (program->error != NULL)
+        return 0;
+    if (program->finished)
+        return 1;
+    if (program->operandCount != 1)
+        return AEFail (program, program->operandCount
+                       ? "operands left over" : "nothing to evaluate");
+
+    root = program->nodes + program->operands[0];
+    program->integer = root->integer;
+    program->depth = root->depth;
+    if (program->depth > AE_MAX_DEPTH)
+        return AEFail (program, "the expression is nested too deeply");
+
+    program->slotOfName = malloc ((program->nameCount + 1) * sizeof (int));
+    program->nameOfSlot = malloc ((program->nameCount + 1) * sizeof (int));
+    if (program->slotOfName == NULL || program->nameOfSlot == NULL)
+        return AEFail (program, "out of memory");
+    for (i = 0; i < program->nameCount; i++)
+        program->slotOfName[i] = -1;
+
+    // an int() at the top is done on the way out, as an int
+
+    if (root->kind == AENodeInt)
+        root = program->nodes + root->left;
+    if (!AEGenerate (program, root - program->nodes))
+        return 0;
+
+    free (program->nodes);
+    program->nodes = NULL;
+    program->nodeCount = program->nodeCapacity = 0;
+    program->finished = 1;
+    return 1;
+}
+
+const char *AEProgramError (AEProgram *program)
+{
+    return program->error;
+}
+
+// parsing
+
+// the grammar ArithmeticExpression.m parses, with NSScanner's habits:
+// white space is skipped before every token, keywords are letters and
+// digits, and a variable's keywords are joined with single spaces
+
+typedef struct AEParser
+{
+    const char *at;
+    char *name;             // room for any name in the text
+    const AEParseCallbacks *callbacks;
+    void *context;
+    const char *error;
+} AEParser;
+
+static int AEParseExpression (AEParser *parser);
+
+static int AEParseFailed (AEParser *parser, const char *why)
+{
+    if (parser->error == NULL)
+        parser->error = why;
+    return 0;
+}
+
+static void AESkipSpace (AEParser *parser)
+{
+    while (isspace ((unsigned char) *parser->at))
+        parser->at++;
+}
+
+static const char *AEScanNumber (const char *at)
+{
+    // NUMBER : /[+-]?\d*\.?\d+/, and an exponent, as NSScanner takes;
+    // returns: the end of the number, or at if there isn't one
+
+    const char *start = at, *digits;
+
+    if (*at == '+' || *at == '-')
+        at++;
+    digits = at;
+    while (isdigit ((unsigned char) *at))
+        at++;
+    if (*at == '.')
+        at++;
+    while (isdigit ((unsigned char) *at))
+        at++;
+    if (at - digits == 0 || (at - digits == 1 && *digits == '.'))
+        return start;
+    if ((*at == 'e' || *at == 'E')
+        && (isdigit ((unsigned char) at[1])
+            || ((at[1] == '+' || at[1] == '-')
+                && isdigit ((unsigned char) at[2]))))
+    {
+        at += 2;
+        while (isdigit ((unsigned char) *at))
+            at++;
+    }
+    return at;
+}
+
+static size_t AEScanKeyword (AEParser *parser)
+{
+    const char *at = parser->at;
+
+    while (isalnum ((unsigned char) *at))
+        at++;
+    return at - parser->at;
+}
+
+static int AEParseFactor (AEParser *parser)
+{
+    const AEParseCallbacks *callbacks = parser->callbacks;
+    const char *end;
+    size_t length;
+
+    AESkipSpace (parser);
+    end = AEScanNumber (parser->at);
+    if (end != parser->at)
+    {
+        char buffer[64];
+        size_t n = end - parser->at;
+
+        if (n >= sizeof buffer)
+            return AEParseFailed (parser, "number too long");
+        memcpy (buffer, parser->at, n);
+        buffer[n] = '\0';
+        parser->at = end;
+        return callbacks->number (parser->context, strtof (buffer, NULL))
+            || AEParseFailed (parser, "can't use a number");
+    }
+
+    if ((length = AEScanKeyword (parser)) > 0)
+    {
+        memcpy (parser->name, parser->at, length);
+        parser->name[length] = '\0';
+        parser->at += length;
+        AESkipSpace (parser);
+
+        if (*parser->at == '(')
+        {
+            // function : KEYWORD "(" arglist ")", and the arglist may be
+            // empty.  the name is copied, since arguments reuse the room
+
+            char *function = malloc (length + 1);
+            int nargs = 0, ok = 1;
+
+            if (function == NULL)
+                return AEParseFailed (parser, "out of memory");
+            strcpy (function, parser->name);
+            parser->at++;
+            AESkipSpace (parser);
+            while (ok && *parser->at != ')')
+            {
+                if (nargs > 0 && *parser->at++ != ',')
+                    break;
+                ok = AEParseExpression (parser);
+                nargs++;
+                AESkipSpace (parser);
+            }
+            if (ok && *parser->at != ')')
+                ok = AEParseFailed (parser, "expected ) after arguments");
+            if (ok)
+            {
+                parser->at++;
+                ok = callbacks->apply (parser->context, function, nargs)
+                    || AEParseFailed (parser, "can't apply a function");
+            }
+            free (function);
+            return ok;
+        }
+
+        // variable : spacedkeywords
+
+        while ((length = AEScanKeyword (parser)) > 0)
+        {
+            strcat (parser->name, " ");
+            strncat (parser->name, parser->at, length);
+            parser->at += length;
+            AESkipSpace (parser);
+        }
+        return callbacks->variable (parser->context, parser->name)
+            || AEParseFailed (parser, "can't use a variable");
+    }
+
+    if (*parser->at == '"')
+    {
+        // variable : "\"" QUOTESTRING "\""
+
+        parser->at++;
+        AESkipSpace (parser);
+        end = strchr (parser->at, '"');
+        if (end == NULL || end == parser->at)
+            return AEParseFailed (parser, "expected a name in quotes");
+        memcpy (parser->name, parser->at, end - parser->at);
+        parser->name[end - parser->at] = '\0';
+        parser->at = end + 1;
+        return callbacks->variable (parser->context, parser->name)
+            || AEParseFailed (parser, "can't use a variable");
+    }
+
+    if (*parser->at == '(')
+    {
+        parser->at++;
+        if (!AEParseExpression (parser))
+            return 0;
+        AESkipSpace (parser);
+        if (*parser->at != ')')
+            return AEParseFailed (parser, "expected )");
+        parser->at++;
+        return 1;
+    }
+
+    return AEParseFailed (parser, "expected a number, function or variable");
+}
+
+static int AEParseTerm (AEParser *parser)
+{
+    // term : factor MULOP term, so it groups to the right
+
+    char op[2] = "*";
+
+    if (!AEParseFactor (parser))
+        return 0;
+    AESkipSpace (parser);
+    if (*parser->at != '*' && *parser->at != '/')
+        return 1;
+    op[0] = *parser->at++;
+    return AEParseTerm (parser)
+        && (parser->callbacks->apply (parser->context, op, 2)
+            || AEParseFailed (parser, "can't apply an operator"));
+}
+
+static int AEParseExpression (AEParser *parser)
+{
+    // expression : term ADDOP expression
+
+    char op[2] = "+";
+
+    if (!AEParseTerm (parser))
+        return 0;
+    AESkipSpace (parser);
+    if (*parser->at != '+' && *parser->at != '-')
+        return 1;
+    op[0] = *parser->at++;
+    return AEParseExpression (parser)
+        && (parser->callbacks->apply (parser->context, op, 2)
+            || AEParseFailed (parser, "can't apply an operator"));
+}
+
+int AEParseString (const char *text, const AEParseCallbacks *callbacks,
+                   void *context, const char **error)
+{
+    AEParser parser;
+    int ok;
+
+    parser.at = text;
+    parser.callbacks = callbacks;
+    parser.context = context;
+    parser.error = NULL;
+    parser.name = malloc (strlen (text) + 1);
+    if (parser.name == NULL)
+        ok = AEParseFailed (&parser, "out of memory");
+    else
+    {
+        ok = AEParseExpression (&parser);
+        AESkipSpace (&parser);
+        if (ok && *parser.at != '\0')
+            ok = AEParseFailed (&parser, "unexpected text after the end");
+    }
+    free (parser.name);
+    if (!ok && error != NULL)
+        *error = parser.error;
+    return ok;
+}
+
+static int AEBuildNumber (void *context, float value)
+{
+    return AEProgramPushNumber (context, value);
+}
+
+static int AEBuildVariable (void *context, const char *name)
+{
+    return AEProgramPushVariable (context, name);
+}
+
+static int AEBuildApply (void *context, const char *op, int nargs)
+{
+    return AEProgramApply (context, op, nargs);
+}
+
+AEProgram *AEProgramCreateWithString (const char *text, const char **error)
+{
+    static const AEParseCallbacks build =
+        { AEBuildNumber, AEBuildVariable, AEBuildApply };
+    AEProgram *program = AEProgramCreate ();
+    const char *why = NULL;
+
+    if (program == NULL)
+        why = "out of memory";
+    else if (!AEParseString (text, &build, program, &why)
+             || !AEProgramFinish (program))
+    {
+        if (AEProgramError (program) != NULL)
+            why = AEProgramError (program);
+        AEProgramRelease (program);
+        program = NULL;
+    }
+    if (program == NULL && error != NULL)
+        *error = why;
+    return program;
+}
+
+// finished programs
+
+int AEProgramSlotCount (AEProgram *program)
+{
+    return program->slotCount;
+}
+
+const char *AEProgramSlotName (AEProgram *program, int slot)
+{
+    if (slot < 0 || slot >= program->slotCount)
+        return NULL;
+    return program->names[program->nameOfSlot[slot]];
+}
+
+int AEProgramSlotForVariable (AEProgram *program, const char *name)
+{
+    int i;
+
+    for (i = 0; i < program->slotCount; i++)
+        if (strcmp (program->names[program->nameOfSlot[i]], name) == 0)
+            return i;
+    return -1;
+}
+
+int AEProgramResultIsInteger (AEProgram *program)
+{
+    return program->integer;
+}
+
+int AEProgramDepth (AEProgram *program)
+{
+    return program->depth;
+}
+
+int AEProgramLength (AEProgram *program)
+{
+    return program->length;
+}
+
+double AEProgramEvaluate (AEProgram *program, const float *slots)
+{
+    float stack[AE_MAX_DEPTH];
+    float acc = 0;
+    int sp = 0;
+    const AEInstruction *i = program->code;
+    const AEInstruction *end = i + program->length;
+
+    for (; i < end; i++)
+        switch (i->op)
+        {
+            case AE_LOADK: acc = i->arg.constant; break;
+            case AE_LOADV: acc = slots[i->arg.slot]; break;
+            case AE_PUSH: stack[sp++] = acc; break;
+
+            case AE_ADDK: acc = acc + i->arg.constant; break;
+            case AE_ADDV: acc = acc + slots[i->arg.slot]; break;
+            case AE_ADDS: acc = stack[--sp] + acc; break;
+
+            case AE_SUBK: acc = acc - i->arg.constant; break;
+            case AE_SUBV: acc = acc - slots[i->arg.slot]; break;
+            case AE_SUBS: acc = acc - stack[--sp]; break;
+            case AE_KSUB: acc = i->arg.constant - acc; break;
+            case AE_VSUB: acc = slots[i->arg.slot] - acc; break;
+            case AE_SSUB: acc = stack[--sp] - acc; break;
+
+            case AE_MULK: acc = acc * i->arg.constant; break;
+            case AE_MULV: acc = acc * slots[i->arg.slot]; break;
+            case AE_MULS: acc = stack[--sp] * acc; break;
+
+            case AE_DIVK: acc = acc / i->arg.constant; break;
+            case AE_DIVV: acc = acc / slots[i->arg.slot]; break;
+            case AE_DIVS: acc = acc / stack[--sp]; break;
+            case AE_KDIV: acc = i->arg.constant / acc; break;
+            case AE_VDIV: acc = slots[i->arg.slot] / acc; break;
+            case AE_SDIV: acc = stack[--sp] / acc; break;
+
+            case AE_TRUNC: acc = AETruncate (acc); break;
+        }
+
+    return program->integer ? AEIntegerValue (acc) : acc;
+}
+
+// columns
+
+// one instruction at a time over a block of rows, rather than one row at
+// a time through the program: each of these is a plain loop over arrays
+// that don't overlap, which the compiler turns into vector instructions
+
+static void AEFill (float *restrict acc, float k, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        acc[i] = k;
+}
+
+#define AE_LOOP(name, expression)                                       \
+    static void name (float *restrict acc, const float *restrict v,     \
+                      size_t n)                                         \
+    {                                                                   \
+        size_t i;                                                       \
+                                                                        \
+        for (i = 0; i < n; i++)                                         \
+            acc[i] = expression (acc[i], v[i]);                         \
+    }                                                                   \
+    static void name##K (float *restrict acc, float k, size_t n)        \
+    {                                                                   \
+        size_t i;                                                       \
+                                                                        \
+        for (i = 0; i < n; i++)                                         \
+            acc[i] = expression (acc[i], k);                            \
+    }
+
+#define AE_ADD(a, b) ((a) + (b))
+#define AE_SUB(a, b) ((a) - (b))
+#define AE_RSUB(a, b) ((b) - (a))
+#define AE_MUL(a, b) ((a) * (b))
+#define AE_DIV(a, b) ((a) / (b))
+#define AE_RDIV(a, b) ((b) / (a))
+
+AE_LOOP (AEAdd, AE_ADD)
+AE_LOOP (AESubtract, AE_SUB)
+AE_LOOP (AESubtractFrom, AE_RSUB)
+AE_LOOP (AEMultiply, AE_MUL)
+AE_LOOP (AEDivide, AE_DIV)
+AE_LOOP (AEDivideInto, AE_RDIV)
+
+static void AETruncateAll (float *restrict acc, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        acc[i] = AETruncate (acc[i]);
+}
+
+void AEProgramEvaluateColumns (AEProgram *program,
+                               const float *const *columns, size_t count,
+                               float *results)
+{
+    float stack[AE_MAX_DEPTH][AE_BLOCK];
+    float acc[AE_BLOCK];
+    const AEInstruction *end = program->code + program->length;
+    size_t base, n, i;
+
+    for (base = 0; base < count; base += n)
+    {
+        const AEInstruction *in;
+        int sp = 0;
+
+        n = count - base < AE_BLOCK ? count - base : AE_BLOCK;
+
+        for (in = program->code; in < end; in++)
+        {
+            // v is good only for the V forms, k for the K forms
+
+            const float *v = in->op == AE_LOADV
+                || (in->op >= AE_ADDK && in->op < AE_TRUNC
+                    && (in->op - AE_ADDK) % 3 == 1)
+                ? columns[in->arg.slot] + base : NULL;
+            float k = in->arg.constant;
+
+            switch (in->op)
+            {
+                case AE_LOADK: AEFill (acc, k, n); break;
+                case AE_LOADV: memcpy (acc, v, n * sizeof *acc); break;
+                case AE_PUSH: memcpy (stack[sp++], acc, n * sizeof *acc);
+                    break;
+
+                case AE_ADDK: AEAddK (acc, k, n); break;
+                case AE_ADDV: AEAdd (acc, v, n); break;
+                case AE_ADDS: AEAdd (acc, stack[--sp], n); break;
+
+                case AE_SUBK: AESubtractK (acc, k, n); break;
+                case AE_SUBV: AESubtract (acc, v, n); break;
+                case AE_SUBS: AESubtract (acc, stack[--sp], n); break;
+                case AE_KSUB: AESubtractFromK (acc, k, n); break;
+                case AE_VSUB: AESubtractFrom (acc, v, n); break;
+                case AE_SSUB: AESubtractFrom (acc, stack[--sp], n); break;
+
+                case AE_MULK: AEMultiplyK (acc, k, n); break;
+                case AE_MULV: AEMultiply (acc, v, n); break;
+                case AE_MULS: AEMultiply (acc, stack[--sp], n); break;
+
+                case AE_DIVK: AEDivideK (acc, k, n); break;
+                case AE_DIVV: AEDivide (acc, v, n); break;
+                case AE_DIVS: AEDivide (acc, stack[--sp], n); break;
+                case AE_KDIV: AEDivideIntoK (acc, k, n); break;
+                case AE_VDIV: AEDivideInto (acc, v, n); break;
+                case AE_SDIV: AEDivideInto (acc, stack[--sp], n); break;
+
+                case AE_TRUNC: AETruncateAll (acc, n); break;
+            }
+        }
+
+        if (program->integer)
+            for (i = 0; i < n; i++)
+                results[base + i] = AEIntegerValue (acc[i]);
+        else
+            memcpy (results + base, acc, n * sizeof *acc);
+    }
+}
@@ -0,0 +1,82 @@
+//
+//  AEProgram.h
+//  Blackthorn
+//
+//  A compiled form of an ArithmeticExpression parse tree, in plain C so
+//  it builds and runs anywhere, not just under Cocoa.
+//
+
+#ifndef AEPROGRAM_H
+#define AEPROGRAM_H
+
+#include <stddef.h>
+
+// A program is built by handing it the parse tree in postfix order: the
+// operands of each node, then the node itself.  ArithmeticExpression does
+// that from its NSArray tree; AEParseString does it from text, with the
+// same grammar and the same tree shape (so a - b - c is a - (b - c), as
+// it is in ArithmeticExpression).
+//
+// Building folds everything that doesn't depend on a variable into a
+// constant, gives each variable the program actually reads a slot
+// number, and turns what's left into bytecode for an accumulator
+// machine in which every instruction says what its operand is: a
+// constant, a slot or the stack.  Evaluating is then a short run of
+// float arithmetic, with no string compares, lookups by name, recursion
+// or allocation.
+//
+// The answers are the tree walker's: arithmetic is in float, as it is
+// when every intermediate value is [NSNumber numberWithFloat:], int()
+// truncates and makes the result an integer, and any other function
+// (min, max, sum, avg and table aren't implemented yet) is 0, without
+// looking at its arguments.  A variable's value is a float too, so
+// int() of a variable holding an integer too big for a float can differ
+// from [input intValue].
+
+#define AE_MAX_DEPTH 16     // stack entries an expression may need
+#define AE_BLOCK 256        // rows the column evaluator works on at once
+
+typedef struct AEProgram AEProgram;
+
+typedef struct AEParseCallbacks
+{
+    // each returns nonzero on success; a zero stops the parse
+    int (*number) (void *context, float value);
+    int (*variable) (void *context, const char *name);
+    int (*apply) (void *context, const char *op, int nargs);
+} AEParseCallbacks;
+
+// building
+
+AEProgram *AEProgramCreate (void);
+void AEProgramRelease (AEProgram *program);
+
+int AEProgramPushNumber (AEProgram *program, float value);
+int AEProgramPushVariable (AEProgram *program, const char *name);
+int AEProgramApply (AEProgram *program, const char *op, int nargs);
+int AEProgramFinish (AEProgram *program);
+
+const char *AEProgramError (AEProgram *program);
+
+AEProgram *AEProgramCreateWithString (const char *text, const char **error);
+int AEParseString (const char *text, const AEParseCallbacks *callbacks,
+                   void *context, const char **error);
+
+// what a finished program needs and gives
+
+int AEProgramSlotCount (AEProgram *program);
+const char *AEProgramSlotName (AEProgram *program, int slot);
+int AEProgramSlotForVariable (AEProgram *program, const char *name);
+int AEProgramResultIsInteger (AEProgram *program);
+int AEProgramDepth (AEProgram *program);
+int AEProgramLength (AEProgram *program);
+
+// evaluating: slots[i] (or columns[i], count rows long) holds the value of
+// the variable in slot i.  results may be one of the columns.
+
+double AEProgramEvaluate (AEProgram *program, const float *slots);
+void AEProgramEvaluateColumns (AEProgram *program,
+                               const float *const *columns, size_t count,
+                               float *results);
+
+#endif
@@ -7,6 +7,7 @@
 //
 
 #import <Cocoa/Cocoa.h>
+#import "AEProgram.h"
 
 @interface ArithmeticExpression : NSObject <NSCoding, NSCopying>
 {
@@ -15,6 +16,9 @@
     NSArray *variables;
     
     NSScanner *scanner; 
+    
+    AEProgram *program;     // the parse tree compiled, or NULL
+    NSArray *slots;         // the variable in each of its slots
 }
 
 // convenience method
@@ -28,6 +32,8 @@
 - (NSArray *) parseTree;
 
 - (id) evaluateWithVariables: (NSDictionary *) vars;
+- (BOOL) evaluateColumns: (const float **) columns count: (unsigned int) count results: (float *) results;
+- (AEProgram *) createProgram;
 - (NSNumber *) solveForVariable: (NSString *) theVariable withOtherVariables: (NSDictionary *) vars equalTo: (NSNumber *) theNumber;
 
 // private methods declared - clients should NOT USE THESE.
@@ -51,6 +57,8 @@
 
 - (NSSet *) findVariablesIn: (NSArray *) theTree;
 - (id) evaluateSubTree: (id) tree withVariables: (NSDictionary *) vars;
+- (BOOL) compileSubTree: (id) tree into: (AEProgram *) theProgram;
+- (void) compileParseTree;
 - (NSNumber *) solveSubTree: (id) tree forVariable: (NSString *) theVariable withOtherVariables: (NSDictionary *) vars equalTo: (NSNumber *) theNumber;
 
 @end
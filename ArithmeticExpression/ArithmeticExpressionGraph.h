@@ -0,0 +1,31 @@
+//
+//  ArithmeticExpressionGraph.h
+//  Blackthorn
+//
+//  Named ArithmeticExpressions that use one another's values, like the
+//  cells of a spreadsheet, recalculated only where something changed.
+//  See AEGraph.h for how.
+//
+
+#import <Cocoa/Cocoa.h>
+#import "ArithmeticExpression.h"
+#import "AEGraph.h"
+
+@interface ArithmeticExpressionGraph : NSObject
+{
+    AEGraph *graph;
+    NSMutableDictionary *formulas;
+}
+
++ (ArithmeticExpressionGraph *) graph;
+
+- (BOOL) setFormula: (ArithmeticExpression *) theFormula forName: (NSString *) theName;
+- (ArithmeticExpression *) formulaForName: (NSString *) theName;
+- (void) setValue: (NSNumber *) theValue forName: (NSString *) theName;
+- (NSNumber *) valueForName: (NSString *) theName;
+
+- (int) recalculate;
+- (NSString *) cycle;
+- (BOOL) setThreads: (int) theThreads;
+
+@end
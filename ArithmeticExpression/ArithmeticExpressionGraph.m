@@ -0,0 +1,113 @@
+//
+//  ArithmeticExpressionGraph.m
+//  Blackthorn
+//
+
+#import "ArithmeticExpressionGraph.h"
+
+@implementation ArithmeticExpressionGraph
+
++ (ArithmeticExpressionGraph *) graph
+{
+    return [[[ArithmeticExpressionGraph alloc] init] autorelease];
+}
+
+- (id) init
+{
+    self = [super init];
+    graph = AEGraphCreate ();
+    formulas = [[NSMutableDictionary alloc] init];
+    if (graph == NULL)
+    {
+        [self release];
+        return nil;
+    }
+    return self;
+}
+
+- (void) dealloc
+{
+    AEGraphRelease (graph);
+    [formulas release];
+    [super dealloc];
+}
+
+- (BOOL) setFormula: (ArithmeticExpression *) theFormula forName: (NSString *) theName
+{
+    // the formula's variables are the names of other formulas or values.
+    // nothing is worked out until -recalculate
+
+    int cell = AEGraphCell (graph, [theName UTF8String]);
+    AEProgram *theProgram = [theFormula createProgram];
+
+    if (cell < 0 || theProgram == NULL || !AEGraphSetProgram (graph, cell, theProgram))
+    {
+        // AEGraphSetProgram has the program even when it fails
+        if (cell < 0)
+            AEProgramRelease (theProgram);
+        return NO;
+    }
+    [formulas setObject: [[theFormula copy] autorelease] forKey: theName];
+    return YES;
+}
+
+- (ArithmeticExpression *) formulaForName: (NSString *) theName
+{
+    return [formulas objectForKey: theName];
+}
+
+- (void) setValue: (NSNumber *) theValue forName: (NSString *) theName
+{
+    int cell = AEGraphCell (graph, [theName UTF8String]);
+
+    if (cell >= 0)
+    {
+        AEGraphSetValue (graph, cell, [theValue floatValue]);
+        [formulas removeObjectForKey: theName];
+    }
+}
+
+- (NSNumber *) valueForName: (NSString *) theName
+{
+    // as of the last -recalculate; nil if it has no value, because
+    // something it depends on doesn't or it's in a cycle
+
+    int cell = AEGraphFind (graph, [theName UTF8String]);
+    double value;
+
+    if (!AEGraphValue (graph, cell, &value))
+        return nil;
+
+    AEProgram *theProgram = AEGraphProgram (graph, cell);
+    if (theProgram != NULL && AEProgramResultIsInteger (theProgram))
+        return [NSNumber numberWithInt: (int) value];
+    else
+        return [NSNumber numberWithFloat: value];
+}
+
+- (int) recalculate
+{
+    // returns the number of formulas worked out again, or -1 if we ran
+    // out of memory
+
+    return AEGraphRecalculate (graph);
+}
+
+- (NSString *) cycle
+{
+    // a formula that depends on itself, if the last -recalculate found one
+
+    const char *name = AEGraphCycle (graph);
+
+    if (name == NULL)
+        return nil;
+    else
+        return [NSString stringWithUTF8String: name];
+}
+
+- (BOOL) setThreads: (int) theThreads
+{
+    return AEGraphSetThreads (graph, theThreads);
+}
+
+@end
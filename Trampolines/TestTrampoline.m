@@ -26,8 +26,30 @@
     return ([self length] == length);
 }
 
+static unsigned countedCalls = 0;
+
+- (BOOL) countedHasLength: (unsigned) length
+{
+    @synchronized ([NSString class])
+    {
+        countedCalls++;
+    }
+    return ([self length] == length);
+}
+
 @end
 
+static NSArray *numberStrings (unsigned count)
+{
+    NSMutableArray *output = [NSMutableArray arrayWithCapacity: count];
+    unsigned i;
+    
+    for (i = 0; i < count; i++)
+        [output addObject: [NSString stringWithFormat: @"%u", i]];
+    
+    return output;
+}
+
 @implementation TestTrampoline
 
 - (void) testCreation
@@ -166,6 +188,134 @@
     STAssertEqualObjects (rejectTwo, rejectExpect, @"-rejectAll/-each");
 }
 
+// the parallel trampolines only go parallel for big collections, so these 
+// use a few thousand elements, and ask for threads even on one processor
+
+- (void) testParallelDo
+{
+    NSMutableArray *input = [NSMutableArray arrayWithCapacity: 5000];
+    NSArray *expected = [[numberStrings (5000) collect] stringByAppendingString: @" fish"];
+    unsigned i;
+    
+    for (i = 0; i < 5000; i++)
+        [input addObject: [NSMutableString stringWithFormat: @"%u", i]];
+    
+    [Trampoline setParallelThreads: 4];
+    [[input parallelDo] appendString: @" fish"];
+    [Trampoline setParallelThreads: 0];
+    
+    STAssertEqualObjects (input, expected, @"-parallelDo");
+}
+
+- (void) testParallelDoFailing
+{
+    NSMutableArray *input = [NSMutableArray arrayWithCapacity: 5000];
+    unsigned i;
+    
+    for (i = 0; i < 5000; i++)
+        [input addObject: [NSMutableString stringWithFormat: @"%u", i]];
+    [input replaceObjectAtIndex: 4000 withObject: [NSNumber numberWithInt: 4000]];
+
+    [Trampoline setParallelThreads: 4];
+    STAssertThrows ([[input parallelDo] appendString: @"fish"], @"-parallelDo doesn't fail on another thread when not all of the collection's contents respond to the chosen selector");
+    [Trampoline setParallelThreads: 0];
+}
+
+- (void) testParallelCollect
+{
+    NSArray *input = numberStrings (5000);
+    NSArray *expected = [[input collect] stringByAppendingString: @" fish"];
+    
+    [Trampoline setParallelThreads: 4];
+    NSArray *output = (NSArray *) [[input parallelCollect] stringByAppendingString: @" fish"];
+    
+    STAssertEqualObjects (output, expected, @"-parallelCollect keeps arrays in order");
+    
+    NSArray *iter = [NSArray arrayWithObjects: @"-", @"fish", nil];
+    
+    expected = [[input collect] stringByAppendingString: [iter each]];
+    output = [[input parallelCollect] stringByAppendingString: [iter each]];
+    STAssertEqualObjects (output, expected, @"-parallelCollect/-each");
+    
+    NSDictionary *dict = [NSDictionary dictionaryWithObjects: input forKeys: input];
+    NSDictionary *dictExpected = [[dict collect] stringByAppendingString: @" fish"];
+    NSDictionary *dictOutput = [[dict parallelCollect] stringByAppendingString: @" fish"];
+    
+    STAssertEqualObjects (dictOutput, dictExpected, @"-parallelCollect with dictionaries");
+    STAssertThrows ([[dict parallelCollect] stringByAppendingString: [iter each]], @"-parallelCollect doesn't fail when the target is a dictionary and there's an -each present");
+    [Trampoline setParallelThreads: 0];
+}
+
+- (void) testParallelSelectRejectDetect
+{
+    NSArray *input = numberStrings (5000);
+    
+    [Trampoline setParallelThreads: 4];
+    
+    NSArray *matches = (id) (long) [[input parallelSelect] hasLength: 3];
+    NSArray *matchExpect = (id) (long) [[input select] hasLength: 3];
+    STAssertEqualObjects (matches, matchExpect, @"-parallelSelect keeps arrays in order");
+    
+    NSArray *nomatches = (id) (long) [[input parallelReject] hasLength: 4];
+    NSArray *nomatchesExpect = (id) (long) [[input reject] hasLength: 4];
+    STAssertEqualObjects (nomatches, nomatchesExpect, @"-parallelReject keeps arrays in order");
+    
+    NSSet *set = [NSSet setWithArray: input];
+    NSSet *setMatches = (id) (long) [[set parallelSelect] hasLength: 2];
+    STAssertEqualObjects (setMatches, [NSSet setWithArray: (id) (long) [[input select] hasLength: 2]], @"-parallelSelect with sets");
+
+    NSArray *toReject = [NSArray arrayWithObjects: @"10", @"4999", nil];
+    NSArray *rejectTwo = (id) (long) [[input parallelRejectAll] isEqualToString: [toReject each]];
+    NSArray *rejectExpect = (id) (long) [[input rejectAll] isEqualToString: [toReject each]];
+    STAssertEqualObjects (rejectTwo, rejectExpect, @"-parallelRejectAll/-each");
+
+    // the earliest match wins, and the rest of the array isn't looked at
+    
+    countedCalls = 0;
+    NSString *detect = (id) (long) [[input parallelDetect] countedHasLength: 3];
+    STAssertEqualObjects (detect, @"100", @"-parallelDetect finds the first match");
+    STAssertTrue (countedCalls < 2500, @"-parallelDetect doesn't stop early");
+    
+    NSArray *none = (id) (long) [[input parallelDetect] hasLength: 5];
+    STAssertEqualObjects (none, [NSArray array], @"-parallelDetect with no match");
+
+    [Trampoline setParallelThreads: 0];
+}
+
+// calling methods directly has to give what the NSInvocations give, for
+// one class or several, and to leave the errors to the slow way
+
+- (void) testFastPath
+{
+    NSMutableArray *input = [NSMutableArray arrayWithArray: numberStrings (200)];
+    unsigned i;
+    
+    for (i = 0; i < 200; i += 3)
+        [input replaceObjectAtIndex: i withObject: [NSMutableString stringWithString: [input objectAtIndex: i]]];
+    
+    [Trampoline setUsesFastPath: NO];
+    NSArray *slowCollect = [[input collect] stringByAppendingString: @" fish"];
+    NSArray *slowSelect = (id) (long) [[input select] hasLength: 2];
+    NSArray *slowReject = (id) (long) [[input reject] isEqualToString: @"150"];
+    NSString *slowDetect = (id) (long) [[input detect] hasPrefix: @"15"];
+    
+    [Trampoline setUsesFastPath: YES];
+    STAssertEqualObjects ([[input collect] stringByAppendingString: @" fish"], slowCollect, @"-collect, called directly");
+    STAssertEqualObjects ((id) (long) [[input select] hasLength: 2], slowSelect, @"-select, called directly");
+    STAssertEqualObjects ((id) (long) [[input reject] isEqualToString: @"150"], slowReject, @"-reject, called directly");
+    STAssertEqualObjects ((id) (long) [[input detect] hasPrefix: @"15"], slowDetect, @"-detect, called directly");
+    
+    NSArray *mutables = [NSArray arrayWithObjects: [input objectAtIndex: 0], [input objectAtIndex: 3], nil];
+    [[mutables do] appendString: @"!"];
+    STAssertEqualObjects ([input objectAtIndex: 3], @"3!", @"-do, called directly");
+    
+    // -length, because the trampoline would answer anything NSObject has
+    STAssertThrows ([[input collect] length], @"-collect, called directly, doesn't fail on a method that returns something other than an object");
+    
+    [input addObject: [NSNumber numberWithInt: 1]];
+    STAssertThrows ([[input collect] stringByAppendingString: @" fish"], @"-collect, called directly, doesn't fail when not all of the collection's contents respond to the chosen selector");
+}
+
 
 
 @end
@@ -6,7 +6,7 @@
 //  Copyright 2005 Charlton Wilbur. All rights reserved.
 //
 
-#import <Cocoa/Cocoa.h>
+#import <Foundation/Foundation.h>
 
 @class Trampoline;
 
@@ -23,6 +23,19 @@
 - (id) detectAll;
 - (id) target;
 
+// the same, spread over several threads.  arrays come back in order, and
+// -parallelDetect gives the same element -detect would for an array; the
+// messages must be safe to send to different elements at the same time
+
+- (id) parallelDo;
+- (id) parallelCollect;
+- (id) parallelSelect;
+- (id) parallelSelectAll;
+- (id) parallelReject;
+- (id) parallelRejectAll;
+- (id) parallelDetect;
+- (id) parallelDetectAll;
+
 @end
 
 typedef enum
@@ -37,11 +50,14 @@ typedef enum
     kTarget,
 } TrampolineType;
 
+struct TrFastCall;
+
 @interface Trampoline : NSObject 
 {
     TrampolineType type;
     id target;
     BOOL shouldMatchAll;
+    BOOL isParallel;
 }
 
 - (TrampolineType) type;
@@ -50,6 +66,23 @@ typedef enum
 - (void) setTarget: (id) newTarget;
 - (BOOL) shouldMatchAll;
 - (void) setShouldMatchAll: (BOOL) flag;
+- (BOOL) isParallel;
+- (void) setParallel: (BOOL) flag;
+
+// how many threads the parallel trampolines use; 0, the default, means one
+// for each processor
+
++ (unsigned) parallelThreads;
++ (void) setParallelThreads: (unsigned) count;
+
+// whether to call methods directly when the elements allow it, rather than
+// through an NSInvocation; YES by default.  what's known about each class
+// and selector is cached; flush the cache, while no trampolines are in use,
+// after adding or replacing methods at run time
+
++ (BOOL) usesFastPath;
++ (void) setUsesFastPath: (BOOL) flag;
++ (void) flushDispatchCache;
 
 - (Trampoline *) initWithType: (TrampolineType) newType andTarget: (id) newTarget;
 + (Trampoline *) trampolineWithType: (TrampolineType) newType andTarget: (id) newTarget;
@@ -62,6 +95,10 @@ typedef enum
 - (void) invokeDo: (NSArray *) invocArray;
 - (id) invokeCollect: (NSArray *) invocArray;
 - invokeSelectRejectDetect: (NSArray *) invocArray;
+- (id) invokeParallel: (NSArray *) invocArray;
+- (void) doElement: (id) obj withInvocations: (NSArray *) invocArray fastCall: (struct TrFastCall *) fast;
+- (id) collectElement: (id) elem withInvocation: (NSInvocation *) invoc fastCall: (struct TrFastCall *) fast;
+- (BOOL) matchElement: (id) elem withInvocations: (NSArray *) invocArray fastCall: (struct TrFastCall *) fast;
 
 @end
 
@@ -7,6 +7,37 @@
 //
 
 #import "Trampoline.h"
+#import <objc/runtime.h>
+#import <pthread.h>
+
+// the GNUmakefile says whether to use libdispatch, since it's the one
+// that has to link it
+
+#ifdef TR_USE_DISPATCH
+#import <dispatch/dispatch.h>
+#define TrUseDispatch 1
+#endif
+
+#if !defined (__APPLE__) && !defined (__FreeBSD__) && !defined (__OpenBSD__)
+
+// glibc doesn't have strlcat, at least not before 2.38
+
+static size_t TrStrlcat (char *dst, const char *src, size_t size)
+{
+    size_t dstLen = strlen (dst);
+    size_t srcLen = strlen (src);
+    
+    if (dstLen + 1 < size)
+    {
+        size_t n = (srcLen < size - dstLen - 1) ? srcLen : size - dstLen - 1;
+        memcpy (dst + dstLen, src, n);
+        dst[dstLen + n] = 0;
+    }
+    return dstLen + srcLen;
+}
+
+#define strlcat TrStrlcat
+#endif
 
 #pragma mark undocumented stuff!
 
@@ -78,6 +109,62 @@
     return [Trampoline trampolineWithType: kTarget andTarget: self];
 }
 
+- (id) parallelDo
+{
+    id tr = [self do];
+    [tr setParallel: YES];
+    return tr;
+}
+
+- (id) parallelCollect
+{
+    id tr = [self collect];
+    [tr setParallel: YES];
+    return tr;
+}
+
+- (id) parallelSelect
+{
+    id tr = [self select];
+    [tr setParallel: YES];
+    return tr;
+}
+
+- (id) parallelSelectAll
+{
+    id tr = [self selectAll];
+    [tr setParallel: YES];
+    return tr;
+}
+
+- (id) parallelReject
+{
+    id tr = [self reject];
+    [tr setParallel: YES];
+    return tr;
+}
+
+- (id) parallelRejectAll
+{
+    id tr = [self rejectAll];
+    [tr setParallel: YES];
+    return tr;
+}
+
+- (id) parallelDetect
+{
+    id tr = [self detect];
+    [tr setParallel: YES];
+    return tr;
+}
+
+- (id) parallelDetectAll
+{
+    id tr = [self detectAll];
+    [tr setParallel: YES];
+    return tr;
+}
+
 @end
 
 #pragma mark NSInvocation category
@@ -112,6 +199,294 @@
 
 @end
 
+#pragma mark the dispatch cache
+
+// asking every element -respondsToSelector: and -methodSignatureForSelector:
+// and then bouncing an NSInvocation off it costs far more than most of the
+// messages themselves.  so what the runtime tells us about a class and a 
+// selector is kept here, once per pair, and when a message has at most one
+// simple argument and the element is an ordinary object that implements 
+// the method itself, we call the method's IMP directly.  anything else -
+// forwarding, proxies, classes that answer -respondsToSelector: their own
+// way, odd argument or return types - takes the NSInvocation path, with
+// the same checks and exceptions as ever.
+
+// the kinds of argument and return value the fast path handles
+#define TrKindNone 0
+#define TrKindVoid 'v'
+#define TrKindObject '@'
+#define TrKindBool 'B'
+#define TrKindInt 'i'
+#define TrKindLong 'l'
+#define TrKindOther '?'
+
+typedef struct
+{
+    Class cls;
+    SEL selector;
+    IMP imp;                        // NULL: do it the slow way
+    NSMethodSignature *signature;   // retained, when imp is set
+    char returnKind;
+    char argKind;
+} TrCacheEntry;
+
+static TrCacheEntry *TrCache = NULL;
+static unsigned TrCacheSize = 0;   // a power of two
+static unsigned TrCacheUsed = 0;
+static pthread_mutex_t TrCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static BOOL TrUsesFastPath = YES;
+
+static char TrKind (const char *type)
+{
+    const char *boolType = @encode (BOOL);
+    
+    // skip qualifiers like const and inout
+    while (*type != 0 && strchr ("rnNoORV", *type) != NULL)
+        type++;
+    
+    if (*type == *boolType)
+        return TrKindBool;
+    
+    switch (*type)
+    {
+        case 'v':
+            return TrKindVoid;
+        case '@':
+            return TrKindObject;
+        case 'i':
+        case 'I':
+            return TrKindInt;
+        case 'l':
+        case 'L':
+            return TrKindLong;
+        case 'q':
+        case 'Q':
+            return sizeof (long long) == sizeof (long) ? TrKindLong : TrKindOther;
+        default:
+            return TrKindOther;
+    }
+}
+
+static void TrDescribe (Class cls, SEL selector, TrCacheEntry *entry)
+{
+    static IMP plainRespondsToSelector = NULL;
+    
+    if (plainRespondsToSelector == NULL)
+        plainRespondsToSelector = class_getMethodImplementation ([NSObject class], @selector (respondsToSelector:));
+    
+    entry->cls = cls;
+    entry->selector = selector;
+    entry->imp = NULL;
+    entry->signature = nil;
+    entry->returnKind = TrKindOther;
+    entry->argKind = TrKindOther;
+    
+    if (!class_respondsToSelector (cls, selector)
+        || class_getMethodImplementation (cls, @selector (respondsToSelector:)) != plainRespondsToSelector)
+        return;
+    
+    NSMethodSignature *sig = [cls instanceMethodSignatureForSelector: selector];
+    
+    if (sig == nil || [sig numberOfArguments] > 3)
+        return;
+    
+    entry->returnKind = TrKind ([sig methodReturnType]);
+    entry->argKind = ([sig numberOfArguments] == 3) ? TrKind ([sig getArgumentTypeAtIndex: 2]) : TrKindNone;
+    
+    if ((entry->returnKind == TrKindVoid || entry->returnKind == TrKindObject || entry->returnKind == TrKindBool)
+        && (entry->argKind == TrKindNone || entry->argKind == TrKindObject || entry->argKind == TrKindInt || entry->argKind == TrKindLong))
+    {
+        entry->signature = [sig retain];
+        entry->imp = class_getMethodImplementation (cls, selector);
+    }
+}
+
+static unsigned TrHash (Class cls, SEL selector)
+{
+    const char *name = sel_getName (selector);
+    unsigned long hash = (unsigned long) cls >> 4;
+    
+    while (*name != 0)
+        hash = hash * 31 + (unsigned char) *name++;
+    
+    return (unsigned) hash;
+}
+
+static BOOL TrLookup (Class cls, SEL selector, TrCacheEntry *found)
+{
+    // finds or works out the entry for cls and selector, and copies it into
+    // *found, since the table can move.  returns NO when out of memory.
+    
+    unsigned i;
+    
+    pthread_mutex_lock (&TrCacheLock);
+    
+    if (TrCacheUsed * 2 >= TrCacheSize)
+    {
+        unsigned newSize = TrCacheSize ? TrCacheSize * 2 : 64;
+        TrCacheEntry *newCache = calloc (newSize, sizeof (TrCacheEntry));
+        
+        if (newCache == NULL)
+        {
+            pthread_mutex_unlock (&TrCacheLock);
+            return NO;
+        }
+        
+        for (i = 0; i < TrCacheSize; i++)
+            if (TrCache[i].cls != Nil)
+            {
+                unsigned j = TrHash (TrCache[i].cls, TrCache[i].selector) & (newSize - 1);
+                
+                while (newCache[j].cls != Nil)
+                    j = (j + 1) & (newSize - 1);
+                newCache[j] = TrCache[i];
+            }
+        
+        free (TrCache);
+        TrCache = newCache;
+        TrCacheSize = newSize;
+    }
+    
+    i = TrHash (cls, selector) & (TrCacheSize - 1);
+    while (TrCache[i].cls != Nil 
+           && !(TrCache[i].cls == cls && sel_isEqual (TrCache[i].selector, selector)))
+        i = (i + 1) & (TrCacheSize - 1);
+    
+    if (TrCache[i].cls == Nil)
+    {
+        TrDescribe (cls, selector, &TrCache[i]);
+        TrCacheUsed++;
+    }
+    
+    *found = TrCache[i];
+    pthread_mutex_unlock (&TrCacheLock);
+    return YES;
+}
+
+// one message about to be sent to a lot of elements, and the entries for
+// the classes it last went to: one for the elements, one for the copies
+// -collect makes of them.  each thread has its own.
+
+typedef struct TrFastCall
+{
+    SEL selector;
+    char argKind;
+    id objectArg;
+    int intArg;
+    long longArg;
+    Class lastClass[2];
+    TrCacheEntry last[2];
+} TrFastCall;
+
+static TrFastCall *TrPrepareFastCall (TrFastCall *fast, NSArray *invocArray)
+{
+    // returns fast, ready to use, or NULL if the message has to go the 
+    // slow way
+    
+    if (!TrUsesFastPath || [invocArray count] != 1)
+        return NULL;
+    
+    NSInvocation *invoc = [invocArray objectAtIndex: 0];
+    NSMethodSignature *sig = [invoc methodSignature];
+    
+    fast->selector = [invoc selector];
+    fast->lastClass[0] = fast->lastClass[1] = Nil;
+    
+    if ([sig numberOfArguments] == 2)
+        fast->argKind = TrKindNone;
+    else if ([sig numberOfArguments] == 3)
+        fast->argKind = TrKind ([sig getArgumentTypeAtIndex: 2]);
+    else
+        return NULL;
+    
+    switch (fast->argKind)
+    {
+        case TrKindNone:
+            break;
+        case TrKindObject:
+            [invoc getArgument: &fast->objectArg atIndex: 2];
+            break;
+        case TrKindInt:
+            [invoc getArgument: &fast->intArg atIndex: 2];
+            break;
+        case TrKindLong:
+            [invoc getArgument: &fast->longArg atIndex: 2];
+            break;
+        default:
+            return NULL;
+    }
+    
+    return fast;
+}
+
+static TrCacheEntry *TrFastEntry (TrFastCall *fast, id receiver, int which)
+{
+    // the entry to call receiver's method through, or NULL for the slow way
+    
+    Class cls = object_getClass (receiver);
+    
+    if (cls != fast->lastClass[which])
+    {
+        if (!TrLookup (cls, fast->selector, &fast->last[which]))
+            return NULL;
+        fast->lastClass[which] = cls;
+    }
+    
+    if (fast->last[which].imp == NULL || fast->last[which].argKind != fast->argKind)
+        return NULL;
+    else
+        return &fast->last[which];
+}
+
+static void TrCallVoid (TrFastCall *fast, IMP imp, id receiver)
+{
+    switch (fast->argKind)
+    {
+        case TrKindNone:
+            ((void (*) (id, SEL)) imp) (receiver, fast->selector);
+            break;
+        case TrKindObject:
+            ((void (*) (id, SEL, id)) imp) (receiver, fast->selector, fast->objectArg);
+            break;
+        case TrKindInt:
+            ((void (*) (id, SEL, int)) imp) (receiver, fast->selector, fast->intArg);
+            break;
+        default:
+            ((void (*) (id, SEL, long)) imp) (receiver, fast->selector, fast->longArg);
+            break;
+    }
+}
+
+static id TrCallObject (TrFastCall *fast, IMP imp, id receiver)
+{
+    switch (fast->argKind)
+    {
+        case TrKindNone:
+            return ((id (*) (id, SEL)) imp) (receiver, fast->selector);
+        case TrKindObject:
+            return ((id (*) (id, SEL, id)) imp) (receiver, fast->selector, fast->objectArg);
+        case TrKindInt:
+            return ((id (*) (id, SEL, int)) imp) (receiver, fast->selector, fast->intArg);
+        default:
+            return ((id (*) (id, SEL, long)) imp) (receiver, fast->selector, fast->longArg);
+    }
+}
+
+static BOOL TrCallBool (TrFastCall *fast, IMP imp, id receiver)
+{
+    switch (fast->argKind)
+    {
+        case TrKindNone:
+            return ((BOOL (*) (id, SEL)) imp) (receiver, fast->selector);
+        case TrKindObject:
+            return ((BOOL (*) (id, SEL, id)) imp) (receiver, fast->selector, fast->objectArg);
+        case TrKindInt:
+            return ((BOOL (*) (id, SEL, int)) imp) (receiver, fast->selector, fast->intArg);
+        default:
+            return ((BOOL (*) (id, SEL, long)) imp) (receiver, fast->selector, fast->longArg);
+    }
+}
+
 #pragma mark Trampoline
 
 @implementation Trampoline
@@ -138,6 +513,7 @@
         [self setTarget: newTarget];
         [self setType: newType];
         [self setShouldMatchAll: NO];
+        [self setParallel: NO];
     }
     
     return self;
@@ -181,6 +557,16 @@
     shouldMatchAll = flag;
 }
 
+- (BOOL) isParallel
+{    
+    return isParallel;
+}
+
+- (void) setParallel: (BOOL) flag
+{    
+    isParallel = flag;
+}
+
 #pragma mark an important message from the programmer
 
 // this relies on the good intentions and competence of the programmer.
@@ -215,6 +601,10 @@
 //   trampolines can't be used as arguments to those messages.
 //
 // * messages bounced by -select, -reject, and -detect must return BOOLs.
+//
+// * messages bounced by the parallel trampolines are sent from several
+//   threads at once, to different elements.  if two elements share 
+//   something, it had better be thread-safe.
 
 #pragma mark playing nice with the runtime
 
@@ -249,13 +639,21 @@
             break;
     }
     
-    if (![[self representativeElement] respondsToSelector: aSelector])
+    id element = [self representativeElement];
+    NSMethodSignature *proxySig = nil;
+    TrCacheEntry entry;
+    
+    if (element != nil && TrUsesFastPath && TrLookup (object_getClass (element), aSelector, &entry))
+        proxySig = entry.signature;
+    
+    if (proxySig == nil && ![element respondsToSelector: aSelector])
         [[NSException exceptionWithName: TrampolineTargetDoesntRespondToSelector 
                                  reason: TrampolineTargetDoesntRespondToSelectorExplanation
                                userInfo: [NSDictionary dictionaryWithObjectsAndKeys: [self target], @"target", [NSNumber numberWithInt: [self type]], @"type", NSStringFromSelector(aSelector), @"selector", nil]] 
             raise];
     
-    NSMethodSignature *proxySig = [[self representativeElement] methodSignatureForSelector: aSelector];
+    if (proxySig == nil)
+        proxySig = [element methodSignatureForSelector: aSelector];
     
     int argCount = [proxySig numberOfArguments];
     int i;
@@ -420,6 +818,14 @@
     NSArray *invocArray = [self expandInvocation: newInvoc];
     id result;
     
+    if ([self isParallel] && type != kTarget && type != kNone)
+    {
+        result = [self invokeParallel: invocArray];
+        if (type != kDo && type != kEach)
+            [anInvocation setReturnValue: &result];
+        return;
+    }
+    
     switch (type) 
     {
         case kDo:
@@ -495,22 +901,40 @@
     else
         e = [[NSArray arrayWithObject: target] objectEnumerator];
     
+    TrFastCall fastCall;
+    TrFastCall *fast = TrPrepareFastCall (&fastCall, invocArray);
     id obj;
     
     while (obj = [e nextObject])
-    {
-        NSEnumerator *invocE = [invocArray objectEnumerator];
-        NSInvocation *invoc;
+        [self doElement: obj withInvocations: invocArray fastCall: fast];
+}
 
-        while (invoc = [invocE nextObject])
-            if ([obj respondsToSelector: [invoc selector]])
-                [invoc invokeWithTarget: obj];
-            else
-                [[NSException exceptionWithName: TrampolineTargetDoesntRespondToSelector 
-                                         reason: TrampolineTargetDoesntRespondToSelectorExplanation
-                                       userInfo: [NSDictionary dictionaryWithObjectsAndKeys: [self target], @"target", [NSNumber numberWithInt: [self type]], @"type", NSStringFromSelector([invoc selector]), @"selector", nil]] 
-                    raise];
+- (void) doElement: (id) obj withInvocations: (NSArray *) invocArray fastCall: (TrFastCall *) fast
+{
+    TrCacheEntry *entry = fast ? TrFastEntry (fast, obj, 0) : NULL;
+    
+    if (entry != NULL)
+    {
+        if (entry->returnKind == TrKindObject)
+            TrCallObject (fast, entry->imp, obj);
+        else if (entry->returnKind == TrKindBool)
+            TrCallBool (fast, entry->imp, obj);
+        else
+            TrCallVoid (fast, entry->imp, obj);
+        return;
     }
+    
+    NSEnumerator *invocE = [invocArray objectEnumerator];
+    NSInvocation *invoc;
+
+    while (invoc = [invocE nextObject])
+        if ([obj respondsToSelector: [invoc selector]])
+            [invoc invokeWithTarget: obj];
+        else
+            [[NSException exceptionWithName: TrampolineTargetDoesntRespondToSelector 
+                                     reason: TrampolineTargetDoesntRespondToSelectorExplanation
+                                   userInfo: [NSDictionary dictionaryWithObjectsAndKeys: [self target], @"target", [NSNumber numberWithInt: [self type]], @"type", NSStringFromSelector([invoc selector]), @"selector", nil]] 
+                raise];
 }
 
 - (id) invokeCollect: (NSArray *) invocArray
@@ -562,6 +986,8 @@
                                userInfo: [NSDictionary dictionaryWithObjectsAndKeys: [self target], @"target", [NSNumber numberWithInt: [self type]], @"type", nil]] 
             raise];
     
+    TrFastCall fastCall;
+    TrFastCall *fast = TrPrepareFastCall (&fastCall, invocArray);
     id elem;
     id key;
     
@@ -577,53 +1003,86 @@
     
         while (invoc = [invocE nextObject])
         {
-            if (![elem respondsToSelector: [invoc selector]])
-                [[NSException exceptionWithName: TrampolineTargetDoesntRespondToSelector 
-                                         reason: TrampolineTargetDoesntRespondToSelectorExplanation
-                                       userInfo: [NSDictionary dictionaryWithObjectsAndKeys: [self target], @"target", [NSNumber numberWithInt: [self type]], @"type", NSStringFromSelector([invoc selector]), @"selector", nil]] 
-                    raise];
-
-            else if (strcmp ([[elem methodSignatureForSelector: [invoc selector]] methodReturnType], @encode (id)) != 0)
-                [[NSException exceptionWithName: TrampolineCantCollectNonObjects 
-                                         reason: TrampolineCantCollectNonObjectsExplanation
-                                       userInfo: [NSDictionary dictionaryWithObjectsAndKeys: [self target], @"target", [NSNumber numberWithInt: [self type]], @"type", NSStringFromSelector([invoc selector]), @"selector", [NSString stringWithCString: [[elem methodSignatureForSelector: [invoc selector]] methodReturnType]], @"actualReturnValue", nil]] 
-                    raise];
+            id result = [self collectElement: elem withInvocation: invoc fastCall: fast];
             
+            if (isDictionary)
+                [output setObject: result forKey: key];
             else
-            {
-                id eCopy;
-                
-                @try 
-                {
-                    eCopy = [[elem copy] autorelease];  
-                    // -copy will raise an exception if the target doesn't
-                    // conform to the NSCopying protocol.  
-                }
-                
-                @catch (NSException *e)
-                {
-                    [[NSException exceptionWithName: TrampolineCollectNeedsCopy 
-                                             reason: TrampolineCollectNeedsCopyExplanation
-                                           userInfo: [NSDictionary dictionaryWithObjectsAndKeys: [self target], @"target", [NSNumber numberWithInt: [self type]], @"type", NSStringFromSelector([invoc selector]), @"selector", [NSString stringWithCString: [[elem methodSignatureForSelector: [invoc selector]] methodReturnType]], @"actualReturnValue", nil]] 
-                        raise];
-                }
-                    
-                id result;
-                
-                [invoc invokeWithTarget: eCopy];
-                [invoc getReturnValue: &result];
-                
-                if (isDictionary)
-                    [output setObject: result forKey: key];
-                else
-                    [output addObject: result];
-            }
+                [output addObject: result];
         }
     }
     
     return output;
 }
 
+- (id) collectElement: (id) elem withInvocation: (NSInvocation *) invoc fastCall: (TrFastCall *) fast
+{
+    id result = nil;
+    TrCacheEntry *entry = fast ? TrFastEntry (fast, elem, 0) : NULL;
+    
+    if (entry != NULL && entry->returnKind == TrKindObject)
+    {
+        // the copy may well be of another class, so it's looked up too.  if
+        // the element can't be copied, the slow way says so properly
+        
+        id eCopy = nil;
+        
+        @try
+        {
+            eCopy = [[elem copy] autorelease];
+        }
+        
+        @catch (NSException *e)
+        {
+            eCopy = nil;
+        }
+        
+        if (eCopy != nil)
+        {
+            entry = TrFastEntry (fast, eCopy, 1);
+            if (entry != NULL && entry->returnKind == TrKindObject)
+                return TrCallObject (fast, entry->imp, eCopy);
+        }
+    }
+    
+    if (![elem respondsToSelector: [invoc selector]])
+        [[NSException exceptionWithName: TrampolineTargetDoesntRespondToSelector 
+                                 reason: TrampolineTargetDoesntRespondToSelectorExplanation
+                               userInfo: [NSDictionary dictionaryWithObjectsAndKeys: [self target], @"target", [NSNumber numberWithInt: [self type]], @"type", NSStringFromSelector([invoc selector]), @"selector", nil]] 
+            raise];
+
+    else if (strcmp ([[elem methodSignatureForSelector: [invoc selector]] methodReturnType], @encode (id)) != 0)
+        [[NSException exceptionWithName: TrampolineCantCollectNonObjects 
+                                 reason: TrampolineCantCollectNonObjectsExplanation
+                               userInfo: [NSDictionary dictionaryWithObjectsAndKeys: [self target], @"target", [NSNumber numberWithInt: [self type]], @"type", NSStringFromSelector([invoc selector]), @"selector", [NSString stringWithCString: [[elem methodSignatureForSelector: [invoc selector]] methodReturnType]], @"actualReturnValue", nil]] 
+            raise];
+    
+    else
+    {
+        id eCopy;
+        
+        @try 
+        {
+            eCopy = [[elem copy] autorelease];  
+            // -copy will raise an exception if the target doesn't
+            // conform to the NSCopying protocol.  
+        }
+        
+        @catch (NSException *e)
+        {
+            [[NSException exceptionWithName: TrampolineCollectNeedsCopy 
+                                     reason: TrampolineCollectNeedsCopyExplanation
+                                   userInfo: [NSDictionary dictionaryWithObjectsAndKeys: [self target], @"target", [NSNumber numberWithInt: [self type]], @"type", NSStringFromSelector([invoc selector]), @"selector", [NSString stringWithCString: [[elem methodSignatureForSelector: [invoc selector]] methodReturnType]], @"actualReturnValue", nil]] 
+                raise];
+        }
+            
+        [invoc invokeWithTarget: eCopy];
+        [invoc getReturnValue: &result];
+    }
+    
+    return result;
+}
+
 - invokeSelectRejectDetect: (NSArray *) invocArray
 {
     id output;
@@ -659,6 +1118,8 @@
     // trampoline situation only if *all* of the trampolines return YES 
     // (-select) or NO (-reject).
     
+    TrFastCall fastCall;
+    TrFastCall *fast = TrPrepareFastCall (&fastCall, invocArray);
     id elem;
     id key;
     
@@ -669,58 +1130,446 @@
         else
             elem = key;
         
-        NSEnumerator *invocE = [invocArray objectEnumerator];
-        NSInvocation *invoc;
+        BOOL shouldAdd = [self matchElement: elem withInvocations: invocArray fastCall: fast];
         
-        BOOL shouldAdd = [self shouldMatchAll]; 
+        if (shouldAdd && ([self type] == kDetect))
+            return elem;
         
-        while (invoc = [invocE nextObject])
+        if (shouldAdd)
+        {
+            if (isDictionary)
+                [output setObject: elem forKey: key];
+            else
+                [output addObject: elem];
+        }
+    }
+        
+    return output;
+}
+
+- (BOOL) matchElement: (id) elem withInvocations: (NSArray *) invocArray fastCall: (TrFastCall *) fast
+{
+    TrCacheEntry *entry = fast ? TrFastEntry (fast, elem, 0) : NULL;
+    
+    // with only one message, matching any and matching all come to the same
+    if (entry != NULL && entry->returnKind == TrKindBool)
+    {
+        BOOL result = TrCallBool (fast, entry->imp, elem);
+        
+        return ([self type] == kReject) ? !result : result;
+    }
+    
+    NSEnumerator *invocE = [invocArray objectEnumerator];
+    NSInvocation *invoc;
+    
+    BOOL shouldAdd = [self shouldMatchAll]; 
+    
+    while (invoc = [invocE nextObject])
+    {
+        if (![elem respondsToSelector: [invoc selector]])
+            [[NSException exceptionWithName: TrampolineTargetDoesntRespondToSelector 
+                                     reason: TrampolineTargetDoesntRespondToSelectorExplanation
+                                   userInfo: [NSDictionary dictionaryWithObjectsAndKeys: [self target], @"target", [NSNumber numberWithInt: [self type]], @"type", NSStringFromSelector([invoc selector]), @"selector", nil]] 
+                raise];
+        
+        else if (strcmp ([[elem methodSignatureForSelector: [invoc selector]] methodReturnType], @encode (BOOL)) != 0)
+            [[NSException exceptionWithName: TrampolineCantSelectOrRejectNonBools
+                                     reason: TrampolineCantSelectOrRejectNonBoolsExplanation
+                                   userInfo: [NSDictionary dictionaryWithObjectsAndKeys: [self target], @"target", [NSNumber numberWithInt: [self type]], @"type", NSStringFromSelector([invoc selector]), @"selector", [NSString stringWithCString: [[elem methodSignatureForSelector: [invoc selector]] methodReturnType]], @"actualReturnValue", nil]] 
+                raise];
+        
+        else
         {
-            if (![elem respondsToSelector: [invoc selector]])
-                [[NSException exceptionWithName: TrampolineTargetDoesntRespondToSelector 
-                                         reason: TrampolineTargetDoesntRespondToSelectorExplanation
-                                       userInfo: [NSDictionary dictionaryWithObjectsAndKeys: [self target], @"target", [NSNumber numberWithInt: [self type]], @"type", NSStringFromSelector([invoc selector]), @"selector", nil]] 
-                    raise];
+            BOOL result;
+            [invoc invokeWithTarget: elem];
+            [invoc getReturnValue: &result];
             
-            else if (strcmp ([[elem methodSignatureForSelector: [invoc selector]] methodReturnType], @encode (BOOL)) != 0)
-                [[NSException exceptionWithName: TrampolineCantSelectOrRejectNonBools
-                                         reason: TrampolineCantSelectOrRejectNonBoolsExplanation
-                                       userInfo: [NSDictionary dictionaryWithObjectsAndKeys: [self target], @"target", [NSNumber numberWithInt: [self type]], @"type", NSStringFromSelector([invoc selector]), @"selector", [NSString stringWithCString: [[elem methodSignatureForSelector: [invoc selector]] methodReturnType]], @"actualReturnValue", nil]] 
-                    raise];
+            if ([self type] == kReject)
+                result = !result;
             
+            if ([self shouldMatchAll])
+                shouldAdd = shouldAdd && result;
             else
+                shouldAdd = shouldAdd || result;
+        }        
+
+        if ([self shouldMatchAll] && !shouldAdd)
+            break;
+        if (![self shouldMatchAll] && shouldAdd)
+            break;
+    }
+    
+    return shouldAdd;
+}
+
+#pragma mark going parallel
+
+// the parallel trampolines turn the target into an array of elements, cut
+// it into chunks, and let a few workers take chunks in order until they
+// run out; a worker that draws cheap elements just takes more chunks.  
+// each element's results go in its own slot, so putting them together in
+// order afterwards is easy.  -detect stops handing out chunks past the 
+// earliest match found so far, since nothing after it can win.
+
+// below this many elements, it isn't worth starting the threads
+#define TrParallelMinimum 64
+
+// chunks per worker: more balances the load better, fewer locks less
+#define TrChunksPerWorker 8
+
+static unsigned TrParallelThreads = 0;
+
+typedef struct
+{
+    Trampoline *trampoline;
+    NSArray *elements;          // the values, for a dictionary
+    NSArray *invocations;
+    unsigned count;
+    unsigned chunkSize;
+    unsigned chunkCount;
+    unsigned nextChunk;
+    unsigned firstMatch;        // -detect: earliest match so far, or count
+    id *results;                // -collect: retained, [invocations count] 
+                                // for each element
+    BOOL *matches;              // -select, -reject
+    NSException *exception;     // the first one raised, retained
+    pthread_mutex_t lock;
+} TrParallelJob;
+
+static void TrRunChunks (void *context, size_t worker)
+{
+    TrParallelJob *job = context;
+    
+#ifdef GNUSTEP
+    // libdispatch's threads and ours aren't NSThreads
+    BOOL registered = GSRegisterCurrentThread ();
+#endif
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    Trampoline *tr = job->trampoline;
+    TrampolineType type = [tr type];
+    unsigned invocCount = [job->invocations count];
+    
+    // an NSInvocation holds its return value, so each worker needs its own
+    NSMutableArray *invocArray = [NSMutableArray arrayWithCapacity: invocCount];
+    unsigned k;
+    
+    for (k = 0; k < invocCount; k++)
+        [invocArray addObject: [[[job->invocations objectAtIndex: k] copy] autorelease]];
+    
+    TrFastCall fastCall;
+    TrFastCall *fast = TrPrepareFastCall (&fastCall, invocArray);
+    
+    for (;;)
+    {
+        pthread_mutex_lock (&job->lock);
+        unsigned chunk = job->nextChunk++;
+        BOOL stop = chunk >= job->chunkCount 
+            || job->exception != nil 
+            || chunk * job->chunkSize > job->firstMatch;
+        pthread_mutex_unlock (&job->lock);
+        
+        if (stop)
+            break;
+        
+        NSAutoreleasePool *chunkPool = [[NSAutoreleasePool alloc] init];
+        unsigned i = chunk * job->chunkSize;
+        unsigned end = i + job->chunkSize;
+        
+        if (end > job->count)
+            end = job->count;
+        
+        @try
+        {
+            for (; i < end; i++)
             {
-                BOOL result;
-                [invoc invokeWithTarget: elem];
-                [invoc getReturnValue: &result];
-                
-                if ([self type] == kReject)
-                    result = !result;
+                id elem = [job->elements objectAtIndex: i];
                 
-                if ([self shouldMatchAll])
-                    shouldAdd = shouldAdd && result;
-                else
-                    shouldAdd = shouldAdd || result;
-            }        
-
-            if ([self shouldMatchAll] && !shouldAdd)
-                break;
-            if (![self shouldMatchAll] && shouldAdd)
-                break;
+                switch (type)
+                {
+                    case kDo:
+                    case kEach:
+                        [tr doElement: elem withInvocations: invocArray fastCall: fast];
+                        break;
+                        
+                    case kCollect:
+                        for (k = 0; k < invocCount; k++)
+                            job->results[i * invocCount + k] = [[tr collectElement: elem withInvocation: [invocArray objectAtIndex: k] fastCall: fast] retain];
+                        break;
+                        
+                    case kSelect:
+                    case kReject:
+                        job->matches[i] = [tr matchElement: elem withInvocations: invocArray fastCall: fast];
+                        break;
+                        
+                    default:    // kDetect
+                        pthread_mutex_lock (&job->lock);
+                        if (i > job->firstMatch)
+                            end = i;
+                        pthread_mutex_unlock (&job->lock);
+                        
+                        if (i < end && [tr matchElement: elem withInvocations: invocArray fastCall: fast])
+                        {
+                            pthread_mutex_lock (&job->lock);
+                            if (i < job->firstMatch)
+                                job->firstMatch = i;
+                            pthread_mutex_unlock (&job->lock);
+                            end = i;
+                        }
+                        break;
+                }
+            }
         }
         
-        if (shouldAdd && ([self type] == kDetect))
-            return elem;
+        @catch (NSException *e)
+        {
+            pthread_mutex_lock (&job->lock);
+            if (job->exception == nil)
+                job->exception = [e retain];
+            pthread_mutex_unlock (&job->lock);
+        }
         
-        if (shouldAdd)
+        [chunkPool release];
+    }
+    
+    [pool release];
+#ifdef GNUSTEP
+    if (registered)
+        GSUnregisterCurrentThread ();
+#endif
+}
+
+#ifndef TrUseDispatch
+
+typedef struct
+{
+    TrParallelJob *job;
+    size_t worker;
+} TrWorker;
+
+static void *TrWorkerThread (void *context)
+{
+    TrWorker *w = context;
+    
+    TrRunChunks (w->job, w->worker);
+    return NULL;
+}
+
+#endif
+
+static void TrRunWorkers (TrParallelJob *job, unsigned workers)
+{
+#ifdef TrUseDispatch
+    dispatch_apply_f (workers, dispatch_get_global_queue (DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), job, TrRunChunks);
+#else
+    // the calling thread is worker 0; if a thread won't start, the others
+    // take its share of the chunks
+    pthread_t *threads = calloc (workers, sizeof (pthread_t));
+    TrWorker *w = calloc (workers, sizeof (TrWorker));
+    BOOL *started = calloc (workers, sizeof (BOOL));
+    unsigned i;
+    
+    for (i = 1; threads && w && started && i < workers; i++)
+    {
+        w[i].job = job;
+        w[i].worker = i;
+        started[i] = pthread_create (&threads[i], NULL, TrWorkerThread, &w[i]) == 0;
+    }
+    TrRunChunks (job, 0);
+    for (i = 1; threads && w && started && i < workers; i++)
+        if (started[i])
+            pthread_join (threads[i], NULL);
+    free (threads);
+    free (w);
+    free (started);
+#endif
+}
+
++ (BOOL) usesFastPath
+{
+    return TrUsesFastPath;
+}
+
++ (void) setUsesFastPath: (BOOL) flag
+{
+    TrUsesFastPath = flag;
+}
+
++ (void) flushDispatchCache
+{
+    unsigned i;
+    
+    pthread_mutex_lock (&TrCacheLock);
+    for (i = 0; i < TrCacheSize; i++)
+        [TrCache[i].signature release];
+    free (TrCache);
+    TrCache = NULL;
+    TrCacheSize = 0;
+    TrCacheUsed = 0;
+    pthread_mutex_unlock (&TrCacheLock);
+}
+
++ (unsigned) parallelThreads
+{
+    return TrParallelThreads;
+}
+
++ (void) setParallelThreads: (unsigned) count
+{
+    TrParallelThreads = count;
+}
+
+- (id) invokeParallel: (NSArray *) invocArray
+{
+    NSArray *keys = nil;
+    NSArray *elements;
+    id output;
+    
+    if ([target isKindOfClass: [NSArray class]])
+    {
+        elements = target;
+        output = [NSMutableArray array];
+    }
+    else if ([target isKindOfClass: [NSSet class]])
+    {
+        elements = [target allObjects];
+        output = [NSMutableSet set];
+    }
+    else if ([target isKindOfClass: [NSDictionary class]])
+    {
+        keys = [target allKeys];
+        elements = [target objectsForKeys: keys notFoundMarker: [NSNull null]];
+        output = [NSMutableDictionary dictionary];
+    }
+    else
+    {
+        elements = nil;
+        output = nil;
+    }
+    
+    unsigned workers = TrParallelThreads;
+    
+    if (workers == 0)
+        workers = [[NSProcessInfo processInfo] activeProcessorCount];
+    
+    // not worth it, or not a collection, or an error the serial version
+    // reports: do it the ordinary way
+    
+    if (elements == nil || [elements count] < TrParallelMinimum || workers < 2
+        || (keys != nil && type == kCollect && [invocArray count] > 1))
+    {
+        switch (type)
         {
-            if (isDictionary)
-                [output setObject: elem forKey: key];
-            else
-                [output addObject: elem];
+            case kDo:
+            case kEach:
+                [self invokeDo: invocArray];
+                return nil;
+                
+            case kCollect:
+                return [self invokeCollect: invocArray];
+                
+            default:
+                return [self invokeSelectRejectDetect: invocArray];
         }
     }
+    
+    TrParallelJob job;
+    unsigned invocCount = [invocArray count];
+    unsigned i, k;
+    
+    job.trampoline = self;
+    job.elements = elements;
+    job.invocations = invocArray;
+    job.count = [elements count];
+    job.chunkSize = job.count / (workers * TrChunksPerWorker);
+    if (job.chunkSize == 0)
+        job.chunkSize = 1;
+    job.chunkCount = (job.count + job.chunkSize - 1) / job.chunkSize;
+    job.nextChunk = 0;
+    job.firstMatch = job.count;
+    job.results = NULL;
+    job.matches = NULL;
+    job.exception = nil;
+    
+    if (type == kCollect)
+        job.results = calloc (job.count * invocCount, sizeof (id));
+    else if (type == kSelect || type == kReject)
+        job.matches = calloc (job.count, sizeof (BOOL));
+    
+    if ((type == kCollect && job.results == NULL && invocCount > 0)
+        || ((type == kSelect || type == kReject) && job.matches == NULL)
+        || pthread_mutex_init (&job.lock, NULL) != 0)
+    {
+        free (job.results);
+        free (job.matches);
+        [NSException raise: NSMallocException format: @"can't set up a parallel trampoline"];
+    }
+    
+    TrRunWorkers (&job, workers);
+    pthread_mutex_destroy (&job.lock);
+    
+    // results we collected but won't return would leak; a nil one can't go
+    // in the output any more than it could for -collect
+    
+    BOOL hasNil = NO;
+    
+    if (job.results != NULL)
+        for (i = 0; i < job.count * invocCount; i++)
+            hasNil = hasNil || job.results[i] == nil;
+    
+    if (job.exception != nil || hasNil)
+    {
+        if (job.results != NULL)
+            for (i = 0; i < job.count * invocCount; i++)
+                [job.results[i] release];
+        free (job.results);
+        free (job.matches);
         
+        if (job.exception != nil)
+            [[job.exception autorelease] raise];
+        [NSException raise: NSInvalidArgumentException format: @"a message bounced by -parallelCollect returned nil"];
+    }
+    
+    switch (type)
+    {
+        case kDo:
+        case kEach:
+            output = nil;
+            break;
+            
+        case kCollect:
+            for (i = 0; i < job.count; i++)
+                for (k = 0; k < invocCount; k++)
+                {
+                    id result = job.results[i * invocCount + k];
+                    
+                    if (keys != nil)
+                        [output setObject: result forKey: [keys objectAtIndex: i]];
+                    else
+                        [output addObject: result];
+                    [result release];
+                }
+            break;
+            
+        case kSelect:
+        case kReject:
+            for (i = 0; i < job.count; i++)
+                if (job.matches[i])
+                {
+                    if (keys != nil)
+                        [output setObject: [elements objectAtIndex: i] forKey: [keys objectAtIndex: i]];
+                    else
+                        [output addObject: [elements objectAtIndex: i]];
+                }
+            break;
+            
+        default:    // kDetect
+            if (job.firstMatch < job.count)
+                output = [elements objectAtIndex: job.firstMatch];
+            break;
+    }
+    
+    free (job.results);
+    free (job.matches);
     return output;
 }
 
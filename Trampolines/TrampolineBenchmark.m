@@ -0,0 +1,344 @@
+//
+//  TrampolineBenchmark.m
+//  Trampolines
+//
+//  Times the parallel trampolines against the serial ones, by collection
+//  size and number of threads.
+//
+//  usage: TrampolineBenchmark [-w work] [largest size] [most threads]
+//         TrampolineBenchmark -d [size]
+//
+//  The collections are arrays of strings; each message does `work' rounds
+//  of hashing the string (default 200), so the cost of a message can be
+//  set from next to nothing, where the trampoline itself is what's being
+//  timed, to enough that the threads pay off.  Sizes go up by tens from
+//  100, threads by twos from 1; by default, up to 100000 and one for each
+//  processor.  Every parallel result is checked against the serial one.
+//
+//  With -d, it times the messages themselves instead: trivial methods
+//  bounced to every element of an array (100000 by default), through
+//  NSInvocations and then called directly, for an array of one class and
+//  an array of two, mixed.
+//
+
+#import <Foundation/Foundation.h>
+#import <stdlib.h>
+#import <string.h>
+#import <sys/time.h>
+#import "Trampoline.h"
+
+static unsigned work = 200;
+
+@interface NSString (Benchmark)
+
+- (NSString *) digest;
+- (BOOL) hasOddDigest;
+- (BOOL) hasDigest: (NSString *) other;
+
+@end
+
+@implementation NSString (Benchmark)
+
+- (NSString *) digest
+{
+    unsigned long hash = 5381;
+    unsigned length = [self length];
+    unsigned round, i;
+
+    for (round = 0; round < work; round++)
+        for (i = 0; i < length; i++)
+            hash = hash * 33 + [self characterAtIndex: i] + round;
+
+    return [NSString stringWithFormat: @"%08lx", hash & 0xffffffffUL];
+}
+
+- (BOOL) hasOddDigest
+{
+    return ([[self digest] characterAtIndex: 7] & 1) != 0;
+}
+
+- (BOOL) hasDigest: (NSString *) other
+{
+    return [[self digest] isEqualToString: other];
+}
+
+@end
+
+static unsigned long touched = 0;
+
+// the elements' own methods.  they can't go in a category on NSObject:
+// Trampoline is an NSObject too, so it would answer them itself rather
+// than bounce them
+
+@interface NSString (DispatchBenchmark)
+
+- (void) touch;
+- (id) itself;
+- (BOOL) hasHashBit: (NSNumber *) bit;
+- (BOOL) isIdenticalTo: (id) other;
+
+@end
+
+@interface NSNumber (DispatchBenchmark)
+
+- (void) touch;
+- (id) itself;
+- (BOOL) hasHashBit: (NSNumber *) bit;
+- (BOOL) isIdenticalTo: (id) other;
+
+@end
+
+@implementation NSString (DispatchBenchmark)
+
+- (void) touch
+{
+    touched++;
+}
+
+- (id) itself
+{
+    return self;
+}
+
+- (BOOL) hasHashBit: (NSNumber *) bit
+{
+    return (([self hash] >> [bit intValue]) & 1) != 0;
+}
+
+- (BOOL) isIdenticalTo: (id) other
+{
+    return self == other;
+}
+
+@end
+
+@implementation NSNumber (DispatchBenchmark)
+
+- (void) touch
+{
+    touched++;
+}
+
+- (id) itself
+{
+    return self;
+}
+
+- (BOOL) hasHashBit: (NSNumber *) bit
+{
+    return (([self hash] >> [bit intValue]) & 1) != 0;
+}
+
+- (BOOL) isIdenticalTo: (id) other
+{
+    return self == other;
+}
+
+@end
+
+// what -select and -detect trampolines give back for BOOL messages is an
+// object; sent to one of these, the compiler reads it as one
+
+@protocol SelectingTrampoline
+
+- (id) hasOddDigest;
+- (id) hasDigest: (NSString *) other;
+- (id) hasHashBit: (NSNumber *) bit;
+- (id) isIdenticalTo: (id) other;
+
+@end
+
+static double now (void)
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static unsigned failures = 0;
+
+static void compare (id serial, id parallel, NSString *what, unsigned size, unsigned threads)
+{
+    if (![serial isEqual: parallel])
+    {
+        fprintf (stderr, "%s of %u with %u threads came out wrong\n", [what UTF8String], size, threads);
+        failures++;
+    }
+}
+
+static double dispatchTimes (NSArray *input, BOOL fast, double *times)
+{
+    // fills in times[0..3] with ns per element for -do, -collect, -select
+    // and -detect, and returns how many elements they selected, as a check
+    
+    unsigned size = [input count];
+    id last = [input lastObject];
+    unsigned long wasTouched = touched;
+    double start;
+    
+    [Trampoline setUsesFastPath: fast];
+
+    start = now ();
+    [[input do] touch];
+    times[0] = (now () - start) * 1e9 / size;
+
+    start = now ();
+    NSArray *collected = [[input collect] itself];
+    times[1] = (now () - start) * 1e9 / size;
+
+    start = now ();
+    NSArray *selected = [(id <SelectingTrampoline>) [input select] hasHashBit: [NSNumber numberWithInt: 3]];
+    times[2] = (now () - start) * 1e9 / size;
+
+    start = now ();
+    id found = [(id <SelectingTrampoline>) [input detect] isIdenticalTo: last];
+    times[3] = (now () - start) * 1e9 / size;
+
+    if (touched - wasTouched != size || ![collected isEqual: input] || found != last)
+        failures++;
+    
+    return [selected count];
+}
+
+static int dispatchBenchmark (unsigned size)
+{
+    NSMutableArray *same = [NSMutableArray arrayWithCapacity: size];
+    NSMutableArray *mixed = [NSMutableArray arrayWithCapacity: size];
+    unsigned i, k;
+
+    for (i = 0; i < size; i++)
+    {
+        [same addObject: [NSString stringWithFormat: @"element %u", i]];
+        if (i % 2 == 0)
+            [mixed addObject: [NSString stringWithFormat: @"element %u", i]];
+        else
+            [mixed addObject: [NSNumber numberWithUnsignedInt: i]];
+    }
+
+    printf ("%u elements; ns per element\n\n", size);
+    printf ("%-8s %-13s %9s %9s %9s %9s\n", "array", "", "do", "collect", "select", "detect");
+
+    for (k = 0; k < 2; k++)
+    {
+        NSArray *input = k ? mixed : same;
+        double slow[4], fast[4];
+        NSAutoreleasePool *slowPool = [[NSAutoreleasePool alloc] init];
+        unsigned slowSelected = dispatchTimes (input, NO, slow);
+
+        [slowPool release];
+
+        NSAutoreleasePool *fastPool = [[NSAutoreleasePool alloc] init];
+        unsigned fastSelected = dispatchTimes (input, YES, fast);
+
+        [fastPool release];
+
+        if (slowSelected != fastSelected)
+            failures++;
+
+        printf ("%-8s %-13s %9.1f %9.1f %9.1f %9.1f\n", k ? "mixed" : "one class", "NSInvocation", slow[0], slow[1], slow[2], slow[3]);
+        printf ("%-8s %-13s %9.1f %9.1f %9.1f %9.1f\n", "", "direct", fast[0], fast[1], fast[2], fast[3]);
+        printf ("%-8s %-13s %8.1fx %8.1fx %8.1fx %8.1fx\n", "", "", slow[0] / fast[0], slow[1] / fast[1], slow[2] / fast[2], slow[3] / fast[3]);
+    }
+
+    if (failures != 0)
+        fprintf (stderr, "calling directly gave different results\n");
+    return failures != 0;
+}
+
+int main (int argc, const char *argv[])
+{
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    unsigned largest = 100000;
+    unsigned most = [[NSProcessInfo processInfo] activeProcessorCount];
+    unsigned size, threads, i;
+
+    if (argc > 1 && strcmp (argv[1], "-d") == 0)
+    {
+        int status = dispatchBenchmark (argc > 2 ? atoi (argv[2]) : 100000);
+
+        [pool release];
+        return status;
+    }
+    if (argc > 2 && strcmp (argv[1], "-w") == 0)
+    {
+        work = atoi (argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc > 1)
+        largest = atoi (argv[1]);
+    if (argc > 2)
+        most = atoi (argv[2]);
+    if (largest == 0 || most == 0)
+    {
+        fprintf (stderr, "usage: TrampolineBenchmark [-w work] [largest size] [most threads]\n"
+                 "       TrampolineBenchmark -d [size]\n");
+        return 2;
+    }
+
+    printf ("%u rounds of hashing a message; times in ms, speedup over serial\n\n", work);
+    printf ("%8s %7s %18s %18s %18s\n", "size", "threads", "collect", "select", "detect");
+
+    for (size = 100; size <= largest; size *= 10)
+    {
+        NSAutoreleasePool *sizePool = [[NSAutoreleasePool alloc] init];
+        NSMutableArray *input = [NSMutableArray arrayWithCapacity: size];
+
+        for (i = 0; i < size; i++)
+            [input addObject: [NSString stringWithFormat: @"element %u", i]];
+
+        // -detect looks for the element two thirds of the way along
+        NSString *wanted = [[input objectAtIndex: size * 2 / 3] digest];
+
+        double start = now ();
+        NSArray *serialCollect = [[input collect] digest];
+        double collectTime = now () - start;
+
+        start = now ();
+        NSArray *serialSelect = [(id <SelectingTrampoline>) [input select] hasOddDigest];
+        double selectTime = now () - start;
+
+        start = now ();
+        NSString *serialDetect = [(id <SelectingTrampoline>) [input detect] hasDigest: wanted];
+        double detectTime = now () - start;
+
+        printf ("%8u %7s %9.2f %8s %9.2f %8s %9.2f %8s\n", size, "serial", collectTime * 1e3, "", selectTime * 1e3, "", detectTime * 1e3, "");
+
+        for (threads = 1; threads <= most; threads = (threads < 2) ? 2 : threads * 2)
+        {
+            NSAutoreleasePool *threadsPool = [[NSAutoreleasePool alloc] init];
+
+            [Trampoline setParallelThreads: threads];
+
+            start = now ();
+            NSArray *collect = [[input parallelCollect] digest];
+            double collectParallel = now () - start;
+
+            start = now ();
+            NSArray *select = [(id <SelectingTrampoline>) [input parallelSelect] hasOddDigest];
+            double selectParallel = now () - start;
+
+            start = now ();
+            NSString *detect = [(id <SelectingTrampoline>) [input parallelDetect] hasDigest: wanted];
+            double detectParallel = now () - start;
+
+            compare (serialCollect, collect, @"-parallelCollect", size, threads);
+            compare (serialSelect, select, @"-parallelSelect", size, threads);
+            compare (serialDetect, detect, @"-parallelDetect", size, threads);
+
+            printf ("%8u %7u %9.2f %7.1fx %9.2f %7.1fx %9.2f %7.1fx\n", size, threads,
+                    collectParallel * 1e3, collectTime / collectParallel,
+                    selectParallel * 1e3, selectTime / selectParallel,
+                    detectParallel * 1e3, detectTime / detectParallel);
+
+            [threadsPool release];
+        }
+
+        [sizePool release];
+    }
+
+    [Trampoline setParallelThreads: 0];
+    [pool release];
+    return failures != 0;
+}
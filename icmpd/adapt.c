@@ -0,0 +1,316 @@
+/* adapt.c */
+/* adaptive probe rates: the per-target detectors, and sharing out
+   the budget */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "targets.h"
+#include "adapt.h"
+
+void adapt_init (struct adapt *a, double budget, unsigned int timeout)
+     /* budget: probes a second for all watches together, or 0 to
+	probe every watch at its own interval
+      * timeout: how long the scheduler waits for a reply, msec
+      */
+{
+  memset (a, 0, sizeof *a);
+  a->budget = budget;
+  a->timeout = timeout;
+}
+
+void adapt_free (struct adapt *a)
+{
+  free (a->state);
+  memset (a, 0, sizeof *a);
+}
+
+static int reserve (struct adapt *a, unsigned int targets)
+     /* make room for the state of targets targets
+      * returns: 1 on success, 0 if we're out of memory
+      */
+{
+  unsigned int cap = a->cap ? a->cap : 1024;
+  struct adapt_state *state;
+
+  if (targets <= a->cap)
+    return 1;
+  while (cap < targets)
+    cap *= 2;
+  state = realloc (a->state, cap * sizeof *state);
+  if (state == NULL)
+    return 0;
+  memset (state + a->cap, 0, (cap - a->cap) * sizeof *state);
+  a->state = state;
+  a->cap = cap;
+  return 1;
+}
+
+static double wanted (struct adapt *a, unsigned int interval, int level)
+     /* returns: the interval, msec, a watch at this level asks for */
+{
+  double want = interval, slowest = 2.0 * interval + a->timeout / 2;
+
+  for (; level > 0; level--)
+    want *= 2;
+  for (; level < 0; level++)
+    want /= 2;
+
+  /* probing a watch every interval catches it going quiet two
+     intervals and a timeout after the last reply, at worst.  a quiet
+     target is probed no less often than that less two of its own
+     timeouts, so it's caught no later; its timeouts are short
+     enough for that if they're under a quarter of the scheduler's */
+
+  return want < slowest ? want : slowest;
+}
+
+static void count (struct adapt *a, unsigned int interval, int level,
+		   int sign)
+     /* add a watch's probe rate to its group's, or take it away */
+{
+  double rate = 1000 / wanted (a, interval, level);
+
+  if (level <= 0)
+    a->hot += sign * rate;
+  else
+    a->cold += sign * rate;
+
+  /* rounding shouldn't leave a group wanting less than nothing */
+
+  if (a->hot < 1e-9)
+    a->hot = 0;
+  if (a->cold < 1e-9)
+    a->cold = 0;
+}
+
+static int set_level (struct adapt *a, struct target_table *t,
+		      unsigned int id, int level)
+     /* returns: ADAPT_FASTER if that shortened the interval */
+{
+  struct adapt_state *s = &a->state[id];
+  unsigned int interval = t->info[id].interval;
+  int old = s->level;
+
+  if (level < ADAPT_MIN_LEVEL)
+    level = ADAPT_MIN_LEVEL;
+  if (level > ADAPT_MAX_LEVEL)
+    level = ADAPT_MAX_LEVEL;
+  if (level == old)
+    return 0;
+  if (interval)
+    {
+      count (a, interval, old, -1);
+      count (a, interval, level, 1);
+    }
+  s->level = level;
+  s->calm = 0;
+  return level < old ? ADAPT_FASTER : 0;
+}
+
+int adapt_watch (struct adapt *a, struct target_table *t, unsigned int id,
+		 unsigned int interval)
+     /* note a target's watch interval changing; call it before
+	setting t->info[id].interval.  a new watch starts at level 0
+      * interval: the new interval, msec, or 0 if it's not watched now
+      * returns: 1 on success, 0 if we're out of memory
+      */
+{
+  struct adapt_state *s;
+
+  if (!reserve (a, id + 1))
+    return 0;
+  s = &a->state[id];
+  if (t->info[id].interval)
+    count (a, t->info[id].interval, s->level, -1);
+  else
+    memset (s, 0, sizeof *s);
+  if (interval)
+    count (a, interval, s->level, 1);
+  return 1;
+}
+
+static double steady (struct adapt *a)
+     /* returns: the probes a second the bucket fills at: the budget
+	less what the bucket holds, so that a full bucket and a
+	second's filling come to the budget and no more */
+{
+  return a->budget * (1000 - ADAPT_BURST_MSEC) / 1000;
+}
+
+long adapt_interval (struct adapt *a, struct target_table *t,
+		     unsigned int id)
+     /* returns: how long to wait before the watch's next probe, msec */
+{
+  struct adapt_state *s;
+  double want, cold_room, hot_room, rate = steady (a);
+
+  if (a->budget <= 0 || id >= a->cap || t->info[id].interval == 0)
+    return t->info[id].interval;
+
+  s = &a->state[id];
+  want = wanted (a, t->info[id].interval, s->level);
+
+  /* hot targets first, but the cold ones always keep a share.  it's
+     the rate the bucket fills at that's shared out; planning on the
+     bursts as well would only have probes wait for tokens */
+
+  cold_room = rate - a->hot;
+  if (cold_room < rate / ADAPT_COLD_SHARE)
+    cold_room = rate / ADAPT_COLD_SHARE;
+  hot_room = rate - (a->cold < cold_room ? a->cold : cold_room);
+
+  if (s->level <= 0 && a->hot > hot_room)
+    want *= a->hot / hot_room;
+  else if (s->level > 0 && a->cold > cold_room)
+    want *= a->cold / cold_room;
+
+  if (want < WHEEL_TICK_MSEC)
+    want = WHEEL_TICK_MSEC;
+  return want + 0.5;
+}
+
+unsigned int adapt_timeout (struct adapt *a, unsigned int id)
+     /* returns: how long to wait for a watch probe's reply before
+	counting it lost, msec.  a target with a baseline gets well
+	over its usual RTT, and never more than the scheduler's
+	timeout; one without, or a daemon not adapting, gets that */
+{
+  struct adapt_state *s;
+  float wait;
+
+  if (a->budget <= 0 || id >= a->cap || a->state[id].mean == 0)
+    return a->timeout;
+  s = &a->state[id];
+  wait = s->mean + ADAPT_OVERDUE * s->dev;
+  if (wait < 2 * s->mean)
+    wait = 2 * s->mean;
+  wait = wait / 1000 + ADAPT_OVERDUE_MSEC;
+  return wait < a->timeout ? (unsigned int) wait : a->timeout;
+}
+
+int adapt_admit (struct adapt *a, long now)
+     /* take a watch probe's token from the bucket
+      * now: the current time in msec
+      * returns: 1 if the probe may go now, 0 if it has to wait
+      */
+{
+  double most = a->budget * ADAPT_BURST_MSEC / 1000;
+
+  if (a->budget <= 0)
+    return 1;
+  if (now > a->filled)
+    {
+      a->tokens += (now - a->filled) * steady (a) / 1000;
+      a->filled = now;
+    }
+  if (a->tokens > most)
+    a->tokens = most;
+  if (a->tokens < 1)
+    return 0;
+  a->tokens--;
+  return 1;
+}
+
+int adapt_reply (struct adapt *a, struct target_table *t, unsigned int id,
+		 float rtt)
+     /* fold a reply from a watched target into its detector; call it
+	after target_reply
+      * rtt: usec
+      * returns: ADAPT_FASTER and ADAPT_CHANGED, or'ed, or 0
+      */
+{
+  struct adapt_state *s;
+  float dev, z, off;
+  int calm_needed;
+
+  if (!reserve (a, id + 1))
+    return 0;
+  s = &a->state[id];
+  s->lost = 0;
+
+  /* a first reply, or the first since the target changed, is the
+     baseline; its deviation starts wide and narrows as replies come */
+
+  if (s->mean == 0)
+    {
+      s->mean = rtt;
+      s->dev = rtt / 8;
+      s->up = s->down = 0;
+      return 0;
+    }
+
+  dev = s->dev;
+  if (dev < s->mean * ADAPT_DEV_FLOOR)
+    dev = s->mean * ADAPT_DEV_FLOOR;
+  if (dev < ADAPT_DEV_MIN)
+    dev = ADAPT_DEV_MIN;
+  z = (rtt - s->mean) / dev;
+
+  s->up += z - ADAPT_SLACK;
+  if (s->up < 0)
+    s->up = 0;
+  s->down += -z - ADAPT_SLACK;
+  if (s->down < 0)
+    s->down = 0;
+
+  if (s->up > ADAPT_THRESHOLD || s->down > ADAPT_THRESHOLD)
+    {
+      s->mean = rtt;
+      s->up = s->down = 0;
+      return set_level (a, t, id, ADAPT_MIN_LEVEL) | ADAPT_CHANGED;
+    }
+
+  /* a shift too small to make any one reply suspect still shows up
+     in the sums; halfway to a change is worth a closer look */
+
+  off = z < 0 ? -z : z;
+  if (off > ADAPT_SUSPECT || s->up > ADAPT_THRESHOLD / 2
+      || s->down > ADAPT_THRESHOLD / 2)
+    return set_level (a, t, id, ADAPT_MIN_LEVEL);
+
+  /* only replies that aren't suspect move the baseline, so a shift
+     is left for the CUSUM to find rather than soaked up */
+
+  s->mean += (rtt - s->mean) / ADAPT_GAIN;
+  s->dev += (off * dev - s->dev) / ADAPT_GAIN;
+
+  if (off > ADAPT_SUSPECT / 2)
+    {
+      s->calm = 0;
+      return 0;
+    }
+
+  /* coming back from a scare is quicker than slowing down further */
+
+  calm_needed = s->level < 0 ? ADAPT_CALM / 4 : ADAPT_CALM;
+  if (++s->calm >= calm_needed
+      && (s->level < 0 || (t->loss[id] <= ADAPT_LOSS
+			   && s->dev <= s->mean * ADAPT_JITTER)))
+    set_level (a, t, id, s->level + 1);
+  return 0;
+}
+
+int adapt_lost (struct adapt *a, struct target_table *t, unsigned int id)
+     /* count a watched target's probe as lost; call it after
+	target_lost
+      * returns: ADAPT_FASTER and ADAPT_CHANGED, or'ed, or 0
+      */
+{
+  struct adapt_state *s;
+  int changed = 0;
+
+  if (!reserve (a, id + 1))
+    return 0;
+  s = &a->state[id];
+  if (s->lost < 255)
+    s->lost++;
+  if (s->lost == 2)
+    {
+      /* it's gone away; when it's back, its RTT may be different */
+
+      s->mean = 0;
+      changed = ADAPT_CHANGED;
+    }
+  return set_level (a, t, id, ADAPT_MIN_LEVEL) | changed;
+}
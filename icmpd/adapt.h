@@ -0,0 +1,118 @@
+/* adapt.h */
+/* adaptive probe rates for watched targets.  with a budget set
+   (ping-server -a pps), a watch's interval is where its target
+   starts, not what it keeps: a target whose RTT and loss stay put is
+   probed less and less often, and one that starts misbehaving is
+   probed more often than it asked for, until it settles down again.
+
+   each target has a level: its interval is the watch interval times
+   2 to the level, from ADAPT_MIN_LEVEL (faster) to ADAPT_MAX_LEVEL
+   (slower).  it steps up a level after ADAPT_CALM replies in a row
+   near its baseline, and is knocked down by
+
+   - variance: a reply more than ADAPT_SUSPECT deviations from the
+     baseline puts the target at ADAPT_MIN_LEVEL, so the next few
+     probes say quickly whether it was a blip or the start of
+     something.  so does a CUSUM sum (below) past half of
+     ADAPT_THRESHOLD.  when the level drops, the daemon sends the
+     next probe straight away rather than when the old interval is
+     up.
+
+   - loss: a lost probe does the same, and a target whose loss ratio
+     is over ADAPT_LOSS never slows down.  nor does one whose mean
+     deviation is over ADAPT_JITTER of its RTT: it's too noisy for a
+     shift to show up in a reply or two.
+
+   - a change point: a two-sided CUSUM over replies' distance from the
+     baseline, in deviations, less ADAPT_SLACK each.  when either sum
+     passes ADAPT_THRESHOLD, or two probes in a row are lost, the
+     target has changed: it goes to ADAPT_MIN_LEVEL and its baseline
+     starts again from the reply that tipped it over.
+
+   the baseline is a running mean and mean deviation of RTT, with
+   gain 1/ADAPT_GAIN; the deviation is never taken as less than
+   ADAPT_DEV_FLOOR of the mean or ADAPT_DEV_MIN usec, so that a target
+   with next to no jitter isn't alarmed by a few usec.
+
+   the budget is a ceiling on the probes in any one second, bursts
+   and all.  every watch probe has to get past a token bucket that
+   holds ADAPT_BURST_MSEC of the budget and fills at the rest of it,
+   so a full bucket and a second's filling come to the budget.  one
+   that finds the bucket empty waits for the next tick.
+
+   the rate the bucket fills at is shared out when each probe's next
+   one is scheduled.  targets at level 0 or below (hot) are served
+   first; the rest (cold) share whatever is left, and never less than
+   1/ADAPT_COLD_SHARE of it.  if either group wants more than it has,
+   all of its intervals are stretched by the same factor.  that works
+   out what the intervals should be now; the bucket is for the probes
+   scheduled before a lot of targets changed level, which can still
+   bunch up.
+
+   however calm a target is, its interval never goes past twice the
+   watch interval plus half the scheduler's timeout, so a target that
+   goes quiet is noticed no later than it would be at a fixed rate.
+   to make up for that, a watch probe is given up on once it's
+   ADAPT_OVERDUE deviations (and at least twice the mean) past the
+   target's RTT, plus ADAPT_OVERDUE_MSEC, rather than after the
+   scheduler's SCHED_TIMEOUT_MSEC; adapt_timeout says how long.  a
+   reply that turns up after that has already been counted as a loss.
+
+   none of this is in the hand-over snapshot; a replacement daemon
+   starts every target at level 0 and learns the baselines again.
+
+   adapt.h needs targets.h. */
+
+#define ADAPT_MIN_LEVEL -2
+#define ADAPT_MAX_LEVEL 2
+#define ADAPT_CALM 8
+#define ADAPT_SUSPECT 4.0f
+#define ADAPT_SLACK 1.0f
+#define ADAPT_THRESHOLD 8.0f
+#define ADAPT_LOSS 0.05f
+#define ADAPT_JITTER 0.05f
+#define ADAPT_GAIN 16
+#define ADAPT_DEV_FLOOR 0.02f
+#define ADAPT_DEV_MIN 50.0f
+#define ADAPT_COLD_SHARE 8
+#define ADAPT_BURST_MSEC 50
+#define ADAPT_OVERDUE 8.0f
+#define ADAPT_OVERDUE_MSEC 50
+
+/* what a reply or a loss did, from adapt_reply and adapt_lost */
+
+#define ADAPT_FASTER 0x01    /* the target's interval got shorter */
+#define ADAPT_CHANGED 0x02   /* the change point detector fired */
+
+struct adapt_state
+{
+  float mean;                /* baseline RTT, usec; 0 before the first */
+  float dev;                 /* baseline mean deviation, usec */
+  float up, down;            /* the CUSUM sums, in deviations */
+  signed char level;
+  unsigned char calm;        /* replies in a row near the baseline */
+  unsigned char lost;        /* probes lost in a row */
+};
+
+struct adapt
+{
+  double budget;             /* probes a second; 0 if not adapting */
+  unsigned int timeout;      /* the scheduler's, msec */
+  double hot, cold;          /* probes a second wanted by each group */
+  double tokens;             /* probes the bucket will let through */
+  long filled;               /* when it was last topped up, msec */
+  struct adapt_state *state; /* by target id */
+  unsigned int cap;
+};
+
+void adapt_init (struct adapt *a, double budget, unsigned int timeout);
+void adapt_free (struct adapt *a);
+int adapt_watch (struct adapt *a, struct target_table *t, unsigned int id,
+		 unsigned int interval);
+long adapt_interval (struct adapt *a, struct target_table *t,
+		     unsigned int id);
+unsigned int adapt_timeout (struct adapt *a, unsigned int id);
+int adapt_admit (struct adapt *a, long now);
+int adapt_reply (struct adapt *a, struct target_table *t, unsigned int id,
+		 float rtt);
+int adapt_lost (struct adapt *a, struct target_table *t, unsigned int id);
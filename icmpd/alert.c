@@ -0,0 +1,166 @@
+/* alert.c */
+/* testing alerts against targets, and noticing when they change */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ipc-msgs.h"
+#include "targets.h"
+#include "expr.h"
+#include "alert.h"
+
+/* in ALERT_* slot order */
+
+static char *names[ALERT_VARS] =
+{
+  "rtt", "p99", "loss", "last rtt", "sent", "received"
+};
+
+void alerts_init (struct alerts *al)
+{
+  int i;
+
+  memset (al, 0, sizeof *al);
+  for (i = 0; i < ALERT_MAX; i++)
+    al->a[i].owner = -1;
+}
+
+int alerts_reserve (struct alerts *al, unsigned int targets)
+     /* make room for the state of targets targets
+      * returns: 1 on success, 0 if we're out of memory
+      */
+{
+  unsigned int cap = al->cap ? al->cap : 1024;
+  unsigned int *raised;
+
+  if (targets <= al->cap)
+    return 1;
+  while (cap < targets)
+    cap *= 2;
+  raised = realloc (al->raised, cap * sizeof *raised);
+  if (raised == NULL)
+    return 0;
+  memset (raised + al->cap, 0, (cap - al->cap) * sizeof *raised);
+  al->raised = raised;
+  al->cap = cap;
+  return 1;
+}
+
+int alert_restore (struct alerts *al, unsigned int id, int owner,
+		   char *text)
+     /* set up alert id, as alert_add does
+      * returns: 1 on success, 0 if the text doesn't compile
+      */
+{
+  struct alert *a = &al->a[id];
+
+  if (!expr_compile (&a->expr, text, names, ALERT_VARS))
+    return 0;
+  a->owner = owner;
+  strlcpy (a->text, text, MAX_MSGLEN);
+  al->active |= 1u << id;
+  return 1;
+}
+
+int alert_add (struct alerts *al, int owner, char *text,
+	       char **error, int *error_at)
+     /* compile an alert for a client
+      * returns: the alert's id, or -1 with error and error_at set to
+      *   what's wrong and where in the text
+      */
+{
+  struct expr e;
+  unsigned int id;
+
+  for (id = 0; id < ALERT_MAX; id++)
+    if (!(al->active & 1u << id))
+      break;
+  if (id == ALERT_MAX)
+    {
+      *error = "too many alerts";
+      *error_at = 0;
+      return -1;
+    }
+
+  if (!expr_compile (&e, text, names, ALERT_VARS))
+    {
+      *error = e.error;
+      *error_at = e.error_at;
+      return -1;
+    }
+  alert_restore (al, id, owner, text);
+  return id;
+}
+
+int alert_remove (struct alerts *al, int owner, unsigned int id)
+     /* returns: 1 if owner had alert id and it's gone, else 0 */
+{
+  unsigned int i, bit;
+
+  if (id >= ALERT_MAX)
+    return 0;
+  bit = 1u << id;
+  if (!(al->active & bit) || al->a[id].owner != owner)
+    return 0;
+  al->active &= ~bit;
+  al->a[id].owner = -1;
+  for (i = 0; i < al->cap; i++)
+    al->raised[i] &= ~bit;
+  return 1;
+}
+
+void alerts_forget (struct alerts *al, int owner)
+     /* drop a departed client's alerts */
+{
+  unsigned int id;
+
+  for (id = 0; id < ALERT_MAX; id++)
+    if (al->a[id].owner == owner)
+      alert_remove (al, owner, id);
+}
+
+int alerts_check (struct alerts *al, struct target_table *t,
+		  unsigned int target, float last,
+		  struct alert_crossing *out)
+     /* test every alert against a target whose statistics have just
+	changed
+	last: the RTT of the reply that changed them, in usec
+	out: the alerts that changed for it; there's room for
+	  ALERT_MAX
+	returns: how many there were
+     */
+{
+  double vars[ALERT_VARS];
+  unsigned int active = al->active;
+  unsigned int *raised;
+  double value;
+  int id, now, n = 0;
+
+  if (active == 0 || !alerts_reserve (al, target + 1))
+    return 0;
+
+  vars[ALERT_RTT] = t->srtt[target] / 1000;
+  vars[ALERT_P99] = t->p99[target] / 1000;
+  vars[ALERT_LOSS] = t->loss[target];
+  vars[ALERT_LAST] = last / 1000;
+  vars[ALERT_SENT] = t->sent[target];
+  vars[ALERT_RECD] = t->recd[target];
+
+  raised = &al->raised[target];
+  for (id = 0; active; id++, active >>= 1)
+    {
+      if (!(active & 1))
+	continue;
+      now = expr_test (&al->a[id].expr, vars, &value);
+      if (now == !(*raised & 1u << id))
+	{
+	  *raised ^= 1u << id;
+	  out[n].alert = id;
+	  out[n].target = target;
+	  out[n].raised = now;
+	  out[n].value = value;
+	  n++;
+	}
+    }
+  return n;
+}
@@ -0,0 +1,70 @@
+/* alert.h */
+/* alerts: expressions over a target's statistics that clients set
+   with ALERT_SET, such as
+
+     loss * 100 + p99 / 2 > 50
+
+   each is compiled once (see expr.h) and tested against a target
+   every time a reply comes back from it or a probe to it times out.
+   a client hears about a target only when an alert's test changes
+   for it, with ALERT_CROSSED, not on every reply.
+
+   the variables are
+
+     rtt        smoothed RTT, msec
+     p99        running 99th percentile RTT, msec
+     loss       recent loss ratio, 0 to 1
+     last rtt   this reply's RTT, msec, or SCHED_TIMEOUT_MSEC for a
+                probe that timed out
+     sent       probes sent to the target
+     received   replies from it
+
+   which alerts hold for which targets is kept as a bit per alert in
+   a word per target.
+
+   alert.h needs ipc-msgs.h, targets.h and expr.h. */
+
+#define ALERT_MAX 32         /* alerts at once, for all clients */
+
+#define ALERT_RTT 0
+#define ALERT_P99 1
+#define ALERT_LOSS 2
+#define ALERT_LAST 3
+#define ALERT_SENT 4
+#define ALERT_RECD 5
+#define ALERT_VARS 6
+
+struct alert
+{
+  struct expr expr;
+  int owner;                 /* client slot, or -1 if unused */
+  char text[MAX_MSGLEN];     /* for handing over */
+};
+
+struct alert_crossing
+{
+  unsigned int alert;
+  unsigned int target;
+  int raised;                /* 1 if the test holds now, 0 if not */
+  double value;
+};
+
+struct alerts
+{
+  struct alert a[ALERT_MAX];
+  unsigned int active;       /* bit per alert in use */
+  unsigned int *raised;      /* by target id, bit per alert */
+  unsigned int cap;
+};
+
+void alerts_init (struct alerts *al);
+int alerts_reserve (struct alerts *al, unsigned int targets);
+int alert_add (struct alerts *al, int owner, char *text,
+	       char **error, int *error_at);
+int alert_restore (struct alerts *al, unsigned int id, int owner,
+		   char *text);
+int alert_remove (struct alerts *al, int owner, unsigned int id);
+void alerts_forget (struct alerts *al, int owner);
+int alerts_check (struct alerts *al, struct target_table *t,
+		  unsigned int target, float last,
+		  struct alert_crossing *out);
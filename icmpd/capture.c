@@ -0,0 +1,359 @@
+/* capture.c */
+/* walking pcap and pcapng files */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "capture.h"
+
+#define PCAP_HEADER 24
+#define PCAP_RECORD 16
+
+#define PCAPNG_IDB 1
+#define PCAPNG_PB 2         /* obsolete */
+#define PCAPNG_SPB 3
+#define PCAPNG_EPB 6
+#define PCAPNG_TSRESOL 9    /* the interface's timestamp resolution */
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88a8
+#define FAMILY_INET 2       /* AF_INET, the same on every system */
+
+static unsigned int get16 (struct capture *c, unsigned char *p)
+{
+  if (c->big_endian)
+    return p[0] << 8 | p[1];
+  return p[1] << 8 | p[0];
+}
+
+static unsigned long get32 (struct capture *c, unsigned char *p)
+{
+  if (c->big_endian)
+    return (unsigned long) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+  return (unsigned long) p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+static int add_interface (struct capture *c, int linktype,
+			  unsigned long units)
+     /* returns: 1 on success, 0 if we're out of memory */
+{
+  if (c->n_ifs == c->ifs_cap)
+    {
+      unsigned int cap = c->ifs_cap ? 2 * c->ifs_cap : 4;
+      struct capture_if *ifs = realloc (c->ifs, cap * sizeof *ifs);
+
+      if (ifs == NULL)
+	return 0;
+      c->ifs = ifs;
+      c->ifs_cap = cap;
+    }
+  c->ifs[c->n_ifs].linktype = linktype;
+  c->ifs[c->n_ifs].units = units;
+  c->n_ifs++;
+  return 1;
+}
+
+static unsigned long tsresol (unsigned char v)
+     /* an if_tsresol option: a power of ten, or of two if the top bit
+	is set.  returns: units per second, or 0 for a resolution too
+	fine to turn into usec without overflowing */
+{
+  unsigned long units = 1;
+  int i;
+
+  if (v & 0x80)
+    return (v & 0x7f) <= 39 ? units << (v & 0x7f) : 0;
+  if (v > 12)
+    return 0;
+  for (i = 0; i < v; i++)
+    units *= 10;
+  return units;
+}
+
+static int parse_idb (struct capture *c, unsigned char *body,
+		      unsigned long len)
+     /* an interface description block: the link type, and in among
+	the options, perhaps a timestamp resolution other than usec */
+{
+  unsigned long units = 1000000, at;
+
+  if (len < 8)
+    return 1;
+
+  for (at = 8; at + 4 <= len; )
+    {
+      unsigned int code = get16 (c, body + at);
+      unsigned int olen = get16 (c, body + at + 2);
+
+      if (code == 0 || at + 4 + olen > len)
+	break;
+      if (code == PCAPNG_TSRESOL && olen >= 1 && tsresol (body[at + 4]))
+	units = tsresol (body[at + 4]);
+      at += 4 + ((olen + 3) & ~3);
+    }
+  return add_interface (c, get16 (c, body), units);
+}
+
+static int link_strip (struct capture *c, int linktype,
+		       unsigned char *p, unsigned long len, struct frame *f)
+     /* find the IPv4 datagram in a link-layer frame
+      * returns: 1 if there is one, else 0
+      */
+{
+  unsigned long hdr;
+  unsigned int proto;
+
+  switch (linktype)
+    {
+    case LINKTYPE_NULL:
+      if (len < 4 || get32 (c, p) != FAMILY_INET)
+	return 0;
+      hdr = 4;
+      break;
+
+    case LINKTYPE_LOOP:
+      if (len < 4 || p[0] || p[1] || p[2] || p[3] != FAMILY_INET)
+	return 0;
+      hdr = 4;
+      break;
+
+    case LINKTYPE_ETHERNET:
+      if (len < 14)
+	return 0;
+      hdr = 12;
+      proto = p[12] << 8 | p[13];
+      while ((proto == ETHERTYPE_VLAN || proto == ETHERTYPE_QINQ)
+	     && hdr + 6 <= len)
+	{
+	  hdr += 4;
+	  proto = p[hdr] << 8 | p[hdr + 1];
+	}
+      if (proto != ETHERTYPE_IPV4)
+	return 0;
+      hdr += 2;
+      break;
+
+    case LINKTYPE_RAW:
+    case LINKTYPE_IPV4:
+      hdr = 0;
+      break;
+
+    case LINKTYPE_LINUX_SLL:
+      if (len < 16 || (p[14] << 8 | p[15]) != ETHERTYPE_IPV4)
+	return 0;
+      hdr = 16;
+      break;
+
+    case LINKTYPE_LINUX_SLL2:
+      if (len < 20 || (p[0] << 8 | p[1]) != ETHERTYPE_IPV4)
+	return 0;
+      hdr = 20;
+      break;
+
+    default:
+      return 0;
+    }
+
+  if (len < hdr + 20 || p[hdr] >> 4 != 4)
+    return 0;
+  f->ip = p + hdr;
+  f->len = len - hdr;
+  return 1;
+}
+
+static long to_usec (unsigned long ts, unsigned long units)
+{
+  return ts / units * 1000000 + ts % units * 1000000 / units;
+}
+
+int capture_open (struct capture *c, char *file)
+     /* map a capture and read its file header
+      * returns: 1 on success, 0 on failure, having said why
+      */
+{
+  struct stat st;
+  unsigned long magic;
+  int fd;
+
+  memset (c, 0, sizeof *c);
+
+  fd = open (file, O_RDONLY);
+  if (fd < 0)
+    {
+      perror (file);
+      return 0;
+    }
+  if (fstat (fd, &st) < 0)
+    {
+      perror (file);
+      close (fd);
+      return 0;
+    }
+  c->size = st.st_size;
+  if (c->size < PCAP_HEADER)
+    {
+      fprintf (stderr, "%s: too short to be a capture\n", file);
+      close (fd);
+      return 0;
+    }
+  c->map = mmap (NULL, c->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (c->map == MAP_FAILED)
+    {
+      perror (file);
+      c->map = NULL;
+      return 0;
+    }
+  madvise (c->map, c->size, MADV_SEQUENTIAL);
+
+  /* pcapng starts with a section header, whose block type reads the
+     same either way round; capture_next works out the byte order */
+
+  if (get32 (c, c->map) == PCAPNG_SHB)
+    {
+      c->ng = 1;
+      return 1;
+    }
+
+  magic = get32 (c, c->map);
+  if (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NSEC)
+    {
+      c->big_endian = 1;
+      magic = get32 (c, c->map);
+    }
+  if ((magic != PCAP_MAGIC && magic != PCAP_MAGIC_NSEC)
+      || !add_interface (c, get32 (c, c->map + 20) & 0xffff,
+			 magic == PCAP_MAGIC ? 1000000 : 1000000000))
+    {
+      fprintf (stderr, "%s: not a pcap or pcapng capture\n", file);
+      capture_close (c);
+      return 0;
+    }
+  c->pos = PCAP_HEADER;
+  return 1;
+}
+
+static int next_pcap (struct capture *c, struct frame *f)
+{
+  unsigned char *r;
+  unsigned long caplen;
+
+  while (c->pos + PCAP_RECORD <= c->size)
+    {
+      r = c->map + c->pos;
+      caplen = get32 (c, r + 8);
+      if (c->pos + PCAP_RECORD + caplen > c->size)
+	break;
+      c->pos += PCAP_RECORD + caplen;
+      c->records++;
+
+      if (link_strip (c, c->ifs[0].linktype, r + PCAP_RECORD, caplen, f))
+	{
+	  f->usec = get32 (c, r) * 1000000
+	    + get32 (c, r + 4) * 1000000 / c->ifs[0].units;
+	  return 1;
+	}
+      c->skipped++;
+    }
+  c->truncated = c->pos != c->size;
+  return 0;
+}
+
+static int next_pcapng (struct capture *c, struct frame *f)
+{
+  unsigned char *b, *body;
+  unsigned long type, len, caplen, id, ts;
+
+  while (c->pos + 12 <= c->size)
+    {
+      b = c->map + c->pos;
+      type = get32 (c, b);
+
+      /* a section header says what byte order the section is in, and
+	 starts a new list of interfaces */
+
+      if (type == PCAPNG_SHB)
+	{
+	  c->big_endian = b[8] == 0x1a;
+	  if (get32 (c, b + 8) != PCAPNG_BYTE_ORDER)
+	    break;
+	  c->n_ifs = 0;
+	}
+
+      len = get32 (c, b + 4);
+      if (len < 12 || len % 4 || c->pos + len > c->size)
+	break;
+      c->pos += len;
+      body = b + 8;
+      len -= 12;
+
+      switch (type)
+	{
+	case PCAPNG_IDB:
+	  if (!parse_idb (c, body, len))
+	    {
+	      fprintf (stderr, "out of memory for interfaces\n");
+	      return 0;
+	    }
+	  break;
+
+	  /* the obsolete packet block is laid out like an enhanced one,
+	     but for a 16-bit interface id followed by a drop count */
+
+	case PCAPNG_PB:
+	case PCAPNG_EPB:
+	  c->records++;
+	  if (len < 20)
+	    {
+	      c->skipped++;
+	      break;
+	    }
+	  id = type == PCAPNG_PB ? get16 (c, body) : get32 (c, body);
+	  caplen = get32 (c, body + 12);
+	  if (id < c->n_ifs && caplen <= len - 20
+	      && link_strip (c, c->ifs[id].linktype, body + 20, caplen, f))
+	    {
+	      ts = get32 (c, body + 4) << 16 << 16 | get32 (c, body + 8);
+	      f->usec = to_usec (ts, c->ifs[id].units);
+	      return 1;
+	    }
+	  c->skipped++;
+	  break;
+
+	  /* no timestamp, so nothing to match */
+
+	case PCAPNG_SPB:
+	  c->records++;
+	  c->skipped++;
+	  break;
+	}
+    }
+  c->truncated = c->pos != c->size;
+  return 0;
+}
+
+int capture_next (struct capture *c, struct frame *f)
+     /* returns: 1 with the next IPv4 frame in f, or 0 at the end of
+      *   the capture, or where it stops making sense (truncated says
+      *   which)
+      */
+{
+  if (c->ng)
+    return next_pcapng (c, f);
+  return next_pcap (c, f);
+}
+
+void capture_close (struct capture *c)
+{
+  if (c->map != NULL)
+    munmap (c->map, c->size);
+  free (c->ifs);
+  memset (c, 0, sizeof *c);
+}
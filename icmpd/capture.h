@@ -0,0 +1,65 @@
+/* capture.h */
+/* reading packet captures, for ping-replay.  both classic pcap (micro
+   or nanosecond timestamps, either byte order) and pcapng are
+   understood.  a file is mapped whole and walked record by record;
+   each record comes back as the IPv4 datagram it carries, with the
+   link-layer header stripped, so what's left is what the raw socket
+   would have handed parse_ping.  records that aren't IPv4, or that
+   have no timestamp, are skipped and counted.
+
+   frames point into the mapping, so they're good until the capture
+   is closed.  the IP header isn't necessarily aligned.
+
+   timestamps are usec since the epoch, in a long, which like the
+   msec clocks elsewhere in icmpd wants a 64-bit long. */
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_BYTE_ORDER 0x1a2b3c4d
+
+/* the link types we can take the IPv4 out of */
+
+#define LINKTYPE_NULL 0      /* BSD loopback, family in host order */
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LOOP 108    /* OpenBSD loopback, family in net order */
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_LINUX_SLL2 276
+
+struct frame
+{
+  unsigned char *ip;         /* the IP header */
+  unsigned int len;          /* how much of the datagram was captured */
+  long usec;                 /* when */
+};
+
+struct capture_if
+{
+  int linktype;
+  unsigned long units;       /* timestamp units per second */
+};
+
+struct capture
+{
+  unsigned char *map;
+  unsigned long size, pos;
+  int big_endian;            /* the file's byte order */
+  int ng;                    /* pcapng */
+
+  /* classic pcap has one link type and timestamp unit for the file;
+     pcapng gives each interface its own, and starts the list afresh
+     with each section */
+
+  struct capture_if *ifs;
+  unsigned int n_ifs, ifs_cap;
+
+  unsigned long records;     /* all of them */
+  unsigned long skipped;     /* not IPv4 over a link we know */
+  int truncated;             /* the file ended in mid record */
+};
+
+int capture_open (struct capture *c, char *file);
+int capture_next (struct capture *c, struct frame *f);
+void capture_close (struct capture *c);
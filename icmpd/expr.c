@@ -0,0 +1,607 @@
+/* expr.c */
+/* compiling and evaluating expressions; see expr.h for the grammar */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr.h"
+
+/* the bytecode.  CONST and VAR take a byte of operand, a constant's
+   index or a variable's slot; the n-ary functions take the number of
+   arguments.  the arithmetic operators also come in forms whose right
+   operand is a constant or variable named by such a byte, so the
+   common "x * 100" is one instruction rather than two */
+
+#define OP_END 0
+#define OP_CONST 1
+#define OP_VAR 2
+#define OP_ADD 3
+#define OP_SUB 4
+#define OP_MUL 5
+#define OP_DIV 6
+#define OP_INT 7
+#define OP_ABS 8
+#define OP_MIN 9
+#define OP_MAX 10
+#define OP_SUM 11
+#define OP_AVG 12
+#define OP_ADDC 13      /* OP_ADD + CONSTANT_OPERAND, and so on */
+#define OP_SUBC 14
+#define OP_MULC 15
+#define OP_DIVC 16
+#define OP_ADDV 17      /* OP_ADD + VARIABLE_OPERAND, and so on */
+#define OP_SUBV 18
+#define OP_MULV 19
+#define OP_DIVV 20
+
+#define CONSTANT_OPERAND (OP_ADDC - OP_ADD)
+#define VARIABLE_OPERAND (OP_ADDV - OP_ADD)
+
+/* what the code for a value on the stack is */
+
+#define COMPUTED 0
+#define CONSTANT 1      /* a lone OP_CONST */
+#define VARIABLE 2      /* a lone OP_VAR */
+
+#define MAX_NAME 64
+
+static struct
+{
+  char *name;
+  int op;
+  int arity;       /* 0 for any number, at least one */
+} functions[] =
+{
+  { "int", OP_INT, 1 },
+  { "abs", OP_ABS, 1 },
+  { "min", OP_MIN, 0 },
+  { "max", OP_MAX, 0 },
+  { "sum", OP_SUM, 0 },
+  { "avg", OP_AVG, 0 },
+  { NULL, 0, 0 }
+};
+
+struct compiler
+{
+  struct expr *e;
+  char *text, *p;
+  char **names;
+  int n_names;
+  unsigned int len;      /* bytes of code so far */
+  unsigned int n_consts;
+
+  /* what the machine's stack will hold at this point in the code:
+     for each value, where the code that computes it starts, and
+     whether it's a constant that can be folded or an operand that can
+     be fused into an operator */
+
+  struct
+  {
+    unsigned int start;
+    int kind;
+  } stack[EXPR_STACK];
+  int depth;
+};
+
+static double apply (int op, double *args, int n)
+     /* the operators and functions, for folding constants at compile
+	time and for the machine's n-ary functions */
+{
+  double x = args[0];
+  int i;
+
+  switch (op)
+    {
+    case OP_ADD:
+      return args[0] + args[1];
+    case OP_SUB:
+      return args[0] - args[1];
+    case OP_MUL:
+      return args[0] * args[1];
+    case OP_DIV:
+      return args[0] / args[1];
+
+      /* truncated toward zero, like -intValue */
+
+    case OP_INT:
+      return x > -1e18 && x < 1e18 ? (double) (long) x : x;
+    case OP_ABS:
+      return x < 0 ? -x : x;
+
+    case OP_MIN:
+      for (i = 1; i < n; i++)
+	if (args[i] < x)
+	  x = args[i];
+      return x;
+    case OP_MAX:
+      for (i = 1; i < n; i++)
+	if (args[i] > x)
+	  x = args[i];
+      return x;
+    case OP_SUM:
+    case OP_AVG:
+      for (i = 1; i < n; i++)
+	x += args[i];
+      return op == OP_AVG ? x / n : x;
+    }
+  return 0;
+}
+
+static int fail (struct compiler *c, char *why)
+{
+  if (c->e->error == NULL)
+    {
+      c->e->error = why;
+      c->e->error_at = c->p - c->text;
+    }
+  return 0;
+}
+
+static int emit (struct compiler *c, int op, int arg)
+     /* append an instruction, with its operand if arg isn't -1 */
+{
+  if (c->len + 2 > EXPR_CODE)
+    return fail (c, "expression too long");
+  c->e->code[c->len++] = op;
+  if (arg >= 0)
+    c->e->code[c->len++] = arg;
+  return 1;
+}
+
+static int push (struct compiler *c, int kind)
+     /* note that the code from here on pushes a value */
+{
+  if (c->depth == EXPR_STACK)
+    return fail (c, "expression too deeply nested");
+  c->stack[c->depth].start = c->len;
+  c->stack[c->depth].kind = kind;
+  c->depth++;
+  return 1;
+}
+
+static int emit_const (struct compiler *c, double value)
+{
+  unsigned int i;
+
+  for (i = 0; i < c->n_consts; i++)
+    if (c->e->consts[i] == value)
+      break;
+  if (i == c->n_consts)
+    {
+      if (i == EXPR_CONSTS)
+	return fail (c, "too many constants");
+      c->e->consts[c->n_consts++] = value;
+    }
+  return push (c, CONSTANT) && emit (c, OP_CONST, i);
+}
+
+static int emit_op (struct compiler *c, int op, int n)
+     /* an operator or function of the top n values.  if they're all
+	constants, work it out now and replace their code with the
+	answer */
+{
+  double args[EXPR_STACK];
+  int first = c->depth - n;
+  int i, operand;
+
+  for (i = first; i < c->depth; i++)
+    {
+      if (c->stack[i].kind != CONSTANT)
+	break;
+      args[i - first] = c->e->consts[c->e->code[c->stack[i].start + 1]];
+    }
+
+  if (i == c->depth)
+    {
+      c->len = c->stack[first].start;
+      c->depth = first;
+      return emit_const (c, apply (op, args, n));
+    }
+
+  /* an arithmetic operator whose right operand is a lone constant or
+     variable takes it as its own operand instead */
+
+  if (op <= OP_DIV && c->stack[first + 1].kind != COMPUTED)
+    {
+      c->len = c->stack[first + 1].start;
+      operand = c->e->code[c->len + 1];
+      op += c->stack[first + 1].kind == CONSTANT
+	? CONSTANT_OPERAND : VARIABLE_OPERAND;
+      c->depth = first;
+      return push (c, COMPUTED) && emit (c, op, operand);
+    }
+
+  c->depth = first;
+  return push (c, COMPUTED) && emit (c, op, op >= OP_MIN ? n : -1);
+}
+
+static void skip_space (struct compiler *c)
+{
+  while (isspace ((unsigned char) *c->p))
+    c->p++;
+}
+
+static int literal (struct compiler *c, char *s)
+     /* returns: 1 if s comes next, having skipped it, else 0 */
+{
+  size_t n = strlen (s);
+
+  skip_space (c);
+  if (strncmp (c->p, s, n) != 0)
+    return 0;
+  c->p += n;
+  return 1;
+}
+
+static int keyword (struct compiler *c, char *name, char *end)
+     /* scan /\w+/ onto the end of name, which has room up to end
+      * returns: the keyword's length, or 0 if there isn't one
+      */
+{
+  char *start;
+
+  skip_space (c);
+  for (start = c->p; isalnum ((unsigned char) *c->p); c->p++)
+    if (name < end)
+      *name++ = *c->p;
+  *name = '\0';
+  return c->p - start;
+}
+
+static int number (struct compiler *c, double *value)
+     /* scan /[+-]?\d*\.?\d+/
+      * returns: 1 if there was one, else 0
+      */
+{
+  char buf[MAX_NAME];
+  char *p;
+  int digits = 0;
+
+  skip_space (c);
+  p = c->p;
+  if (*p == '+' || *p == '-')
+    p++;
+  for (; isdigit ((unsigned char) *p); p++)
+    digits++;
+  if (*p == '.' && isdigit ((unsigned char) p[1]))
+    for (p++; isdigit ((unsigned char) *p); p++)
+      digits++;
+  if (digits == 0 || p - c->p >= MAX_NAME)
+    return 0;
+
+  /* strtod alone would take exponents, hex and "inf" too */
+
+  memcpy (buf, c->p, p - c->p);
+  buf[p - c->p] = '\0';
+  *value = strtod (buf, NULL);
+  c->p = p;
+  return 1;
+}
+
+static int variable (struct compiler *c, char *name, char *start)
+     /* start: where its name was, for complaining */
+{
+  int i;
+
+  for (i = 0; i < c->n_names; i++)
+    if (strcmp (c->names[i], name) == 0)
+      {
+	c->e->uses |= 1u << i;
+	return push (c, VARIABLE) && emit (c, OP_VAR, i);
+      }
+  c->p = start;
+  skip_space (c);
+  return fail (c, "unknown variable");
+}
+
+static int expression (struct compiler *c);
+
+static int function (struct compiler *c, char *name, char *start)
+     /* the arguments and the call; the name and "(" are behind us
+	start: where the name was, for complaining */
+{
+  int n = 0;
+  int i;
+
+  for (i = 0; functions[i].name; i++)
+    if (strcmp (functions[i].name, name) == 0)
+      break;
+  if (functions[i].name == NULL)
+    {
+      c->p = start;
+      skip_space (c);
+      return fail (c, "unknown function");
+    }
+
+  do
+    {
+      if (!expression (c))
+	return 0;
+      n++;
+    }
+  while (literal (c, ","));
+
+  if (!literal (c, ")"))
+    return fail (c, "expected , or )");
+  if (functions[i].arity && n != functions[i].arity)
+    return fail (c, "wrong number of arguments");
+  return emit_op (c, functions[i].op, n);
+}
+
+static int factor (struct compiler *c)
+{
+  char name[MAX_NAME + 1];
+  char *word = name;
+  double value;
+  char *start;
+  int len;
+
+  if (number (c, &value))
+    return emit_const (c, value);
+
+  /* a keyword is a function if "(" follows it, and otherwise the
+     start of a variable name made of keywords and single spaces */
+
+  start = c->p;
+  if (keyword (c, name, name + MAX_NAME))
+    {
+      if (literal (c, "("))
+	return function (c, name, start);
+
+      c->p = start;
+      while ((len = keyword (c, word, name + MAX_NAME)) > 0)
+	{
+	  word += strlen (word);
+	  if (word < name + MAX_NAME)
+	    *word++ = ' ';
+	}
+      word[-1] = '\0';
+      return variable (c, name, start);
+    }
+
+  if (literal (c, "\""))
+    {
+      for (start = c->p; *c->p && *c->p != '"'; c->p++)
+	;
+      if (*c->p != '"')
+	return fail (c, "unterminated quote");
+      len = c->p - start < MAX_NAME ? c->p - start : MAX_NAME;
+      memcpy (name, start, len);
+      name[len] = '\0';
+      c->p++;
+      return variable (c, name, start);
+    }
+
+  if (literal (c, "("))
+    {
+      if (!expression (c))
+	return 0;
+      if (!literal (c, ")"))
+	return fail (c, "expected )");
+      return 1;
+    }
+
+  skip_space (c);
+  return fail (c, "expected a number, variable, function or (");
+}
+
+static int term (struct compiler *c)
+{
+  if (!factor (c))
+    return 0;
+  for (;;)
+    {
+      if (literal (c, "*"))
+	{
+	  if (!factor (c) || !emit_op (c, OP_MUL, 2))
+	    return 0;
+	}
+      else if (literal (c, "/"))
+	{
+	  if (!factor (c) || !emit_op (c, OP_DIV, 2))
+	    return 0;
+	}
+      else
+	return 1;
+    }
+}
+
+static int expression (struct compiler *c)
+{
+  if (!term (c))
+    return 0;
+  for (;;)
+    {
+      if (literal (c, "+"))
+	{
+	  if (!term (c) || !emit_op (c, OP_ADD, 2))
+	    return 0;
+	}
+      else if (literal (c, "-"))
+	{
+	  if (!term (c) || !emit_op (c, OP_SUB, 2))
+	    return 0;
+	}
+      else
+	return 1;
+    }
+}
+
+static int relop (struct compiler *c)
+     /* returns: the comparison that comes next, or EXPR_TRUTH */
+{
+  if (literal (c, "<="))
+    return EXPR_LE;
+  if (literal (c, ">="))
+    return EXPR_GE;
+  if (literal (c, "=="))
+    return EXPR_EQ;
+  if (literal (c, "!="))
+    return EXPR_NE;
+  if (literal (c, "<"))
+    return EXPR_LT;
+  if (literal (c, ">"))
+    return EXPR_GT;
+  return EXPR_TRUTH;
+}
+
+int expr_compile (struct expr *e, char *text, char **names, int n_names)
+     /* compile text
+	names: the variables, in slot order
+	n_names: how many; no more than EXPR_VARS
+	returns: 1 on success, 0 with e->error and e->error_at set
+     */
+{
+  struct compiler c;
+
+  memset (e, 0, sizeof *e);
+  memset (&c, 0, sizeof c);
+  c.e = e;
+  c.text = c.p = text;
+  c.names = names;
+  c.n_names = n_names;
+
+  if (!expression (&c) || !emit (&c, OP_END, -1))
+    return 0;
+
+  e->bound = c.len;
+  e->relop = relop (&c);
+  if (e->relop != EXPR_TRUTH)
+    {
+      c.depth = 0;
+      if (!expression (&c) || !emit (&c, OP_END, -1))
+	return 0;
+      if (c.stack[0].kind == CONSTANT)
+	{
+	  e->constant_bound = 1;
+	  e->limit = e->consts[e->code[e->bound + 1]];
+	}
+    }
+
+  skip_space (&c);
+  if (*c.p)
+    return fail (&c, "unexpected text");
+  return 1;
+}
+
+static double run (struct expr *e, unsigned char *pc, double *vars)
+     /* the machine.  the top of the stack is kept in top, and the
+	rest in stack, below sp.  the first push puts the empty top in
+	stack[0], so sp runs one ahead of the compiler's depth, and a
+	function of the whole stack stores top at sp: EXPR_STACK values
+	take EXPR_STACK + 1 slots */
+{
+  double stack[EXPR_STACK + 1];
+  double *sp = stack;
+  double *consts = e->consts;
+  double top = 0;
+  int n;
+
+  for (;;)
+    switch (*pc++)
+      {
+      case OP_CONST:
+	*sp++ = top;
+	top = consts[*pc++];
+	break;
+      case OP_VAR:
+	*sp++ = top;
+	top = vars[*pc++];
+	break;
+
+      case OP_ADD:
+	top = *--sp + top;
+	break;
+      case OP_SUB:
+	top = *--sp - top;
+	break;
+      case OP_MUL:
+	top = *--sp * top;
+	break;
+      case OP_DIV:
+	top = *--sp / top;
+	break;
+
+      case OP_ADDC:
+	top += consts[*pc++];
+	break;
+      case OP_SUBC:
+	top -= consts[*pc++];
+	break;
+      case OP_MULC:
+	top *= consts[*pc++];
+	break;
+      case OP_DIVC:
+	top /= consts[*pc++];
+	break;
+
+      case OP_ADDV:
+	top += vars[*pc++];
+	break;
+      case OP_SUBV:
+	top -= vars[*pc++];
+	break;
+      case OP_MULV:
+	top *= vars[*pc++];
+	break;
+      case OP_DIVV:
+	top /= vars[*pc++];
+	break;
+
+      case OP_INT:
+      case OP_ABS:
+	top = apply (pc[-1], &top, 1);
+	break;
+      case OP_MIN:
+      case OP_MAX:
+      case OP_SUM:
+      case OP_AVG:
+	n = *pc++;
+	*sp = top;
+	sp -= n - 1;
+	top = apply (pc[-2], sp, n);
+	break;
+
+      default:
+	return top;
+      }
+}
+
+double expr_value (struct expr *e, double *vars)
+     /* returns: the expression's value, or if it's a test, the value
+      *   of the left-hand side
+      */
+{
+  return run (e, e->code, vars);
+}
+
+int expr_test (struct expr *e, double *vars, double *value)
+     /* returns: whether the test holds, or for a plain expression,
+      *   whether it's nonzero.  value gets what expr_value would
+      *   return
+      */
+{
+  double bound;
+
+  *value = run (e, e->code, vars);
+  if (e->relop == EXPR_TRUTH)
+    return *value != 0;
+  bound = e->constant_bound ? e->limit : run (e, e->code + e->bound, vars);
+
+  switch (e->relop)
+    {
+    case EXPR_LT:
+      return *value < bound;
+    case EXPR_LE:
+      return *value <= bound;
+    case EXPR_GT:
+      return *value > bound;
+    case EXPR_GE:
+      return *value >= bound;
+    case EXPR_EQ:
+      return *value == bound;
+    default:
+      return *value != bound;
+    }
+}
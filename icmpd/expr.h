@@ -0,0 +1,65 @@
+/* expr.h */
+/* compiled arithmetic expressions, for alerts on target statistics.
+
+   the language is the one ArithmeticExpression.m parses:
+
+     expression : term { ADDOP term }
+     term       : factor { MULOP factor }
+     factor     : NUMBER | function | variable | "(" expression ")"
+     function   : KEYWORD "(" expression { "," expression } ")"
+     variable   : KEYWORD { KEYWORD } | "\"" anything but quotes "\""
+
+   with one comparison allowed on top, so an expression can be a test:
+
+     test       : expression [ RELOP expression ]
+     RELOP      : "<" | "<=" | ">" | ">=" | "==" | "!="
+
+   a variable is one or more keywords separated by white space, which
+   count as a single space, or anything at all in double quotes.
+   functions are int, abs, min, max, sum and avg.  unlike the tree
+   ArithmeticExpression.m builds, operators of equal precedence group
+   to the left, so a - b - c is (a - b) - c.
+
+   an expression is compiled once into bytecode for a little stack
+   machine.  variables are resolved to slots in an array of doubles
+   the caller fills in, and anything that doesn't depend on a
+   variable is folded into a constant, so evaluating one is a short
+   run of array loads and arithmetic: no parsing, string comparison,
+   allocation or recursion. */
+
+#define EXPR_CODE 128      /* bytes of bytecode */
+#define EXPR_CONSTS 32
+#define EXPR_STACK 16
+#define EXPR_VARS 32       /* the most slots a caller can define */
+
+#define EXPR_TRUTH 0       /* no comparison: true if nonzero */
+#define EXPR_LT 1
+#define EXPR_LE 2
+#define EXPR_GT 3
+#define EXPR_GE 4
+#define EXPR_EQ 5
+#define EXPR_NE 6
+
+struct expr
+{
+  unsigned char code[EXPR_CODE];  /* the value, then the bound */
+  double consts[EXPR_CONSTS];
+  unsigned int bound;             /* where the bound's code starts */
+  unsigned int uses;              /* bit per variable slot */
+  int relop;
+
+  /* the bound is nearly always a constant, and then it's here too,
+     so testing doesn't have to run a second program */
+
+  int constant_bound;
+  double limit;
+
+  /* when compiling fails */
+
+  char *error;
+  int error_at;                   /* offset into the text */
+};
+
+int expr_compile (struct expr *e, char *text, char **names, int n_names);
+double expr_value (struct expr *e, double *vars);
+int expr_test (struct expr *e, double *vars, double *value);
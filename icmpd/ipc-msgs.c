@@ -2,6 +2,7 @@
 /* implementation of important client-server message stuff */
 
 #include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include "ipc-msgs.h"
@@ -17,26 +18,30 @@ void parse_msg (char *raw, int *msg, char *msg_text)
     *msg = *msg * 10 + *p_raw - '0';
   while (isspace(*p_raw))
     p_raw++;
-  strlcpy (msg_text, raw, MAX_MSGLEN);
+  strlcpy (msg_text, p_raw, MAX_MSGLEN);
 }
 
 void make_msg (char *raw, int msg, char *msg_text)
 {
+  memset (raw, 0, MAX_MSGLEN);
   snprintf (raw, MAX_MSGLEN, "%d %s", msg, msg_text);
 }
 
-/* the order for a ping_rec is hostname/IP, id, sequence number, and size */
+/* the order for a ping_rec is hostname/IP, id, sequence number, size,
+   and priority */
 
 void parse_ping_req (char *raw, struct ping_req *req)
 {
   char *p_raw;
   char *p_host;
 
+  p_raw = raw;
   while (isspace(*p_raw)) p_raw++;
   
   /* hostname or IP */
 
-  for (p_host = req->host; !isspace (*p_raw); p_raw++, p_host++)
+  for (p_host = req->host; *p_raw && !isspace (*p_raw)
+	 && p_host < req->host + MAX_HOST - 1; p_raw++, p_host++)
     *p_host = *p_raw;
   *p_host = '\0';
   while (isspace(*p_raw)) p_raw++;
@@ -57,12 +62,18 @@ void parse_ping_req (char *raw, struct ping_req *req)
 
   for (req->size = 0; *p_raw && !isspace(*p_raw); p_raw++)
     req->size = req->size * 10 + *p_raw - '0';
+  while (isspace(*p_raw)) p_raw++;
+
+  /* priority, if there is one */
+
+  for (req->priority = 0; *p_raw && !isspace(*p_raw); p_raw++)
+    req->priority = req->priority * 10 + *p_raw - '0';
 }
 
 void make_ping_req (char *raw, struct ping_req *req)
 {
-  snprintf (raw, MAX_MSGLEN, "%s %d %d %d", 
-	    req->host, req->id, req->seq_no, req->size);
+  snprintf (raw, MAX_MSGLEN, "%s %d %d %d %d", 
+	    req->host, req->id, req->seq_no, req->size, req->priority);
 }
 
 /* the order for a ping_ack is host, id, sequence number, size, 
@@ -73,11 +84,13 @@ void parse_ping_ack (char *raw, struct ping_ack *ack)
   char *p_raw;
   char *p_host;
 
+  p_raw = raw;
   while (isspace(*p_raw)) p_raw++;
   
   /* hostname or IP */
 
-  for (p_host = ack->host; !isspace (*p_raw); p_raw++, p_host++)
+  for (p_host = ack->host; *p_raw && !isspace (*p_raw)
+	 && p_host < ack->host + MAX_HOST - 1; p_raw++, p_host++)
     *p_host = *p_raw;
   *p_host = '\0';
   while (isspace(*p_raw)) p_raw++;
@@ -119,8 +132,274 @@ void make_ping_ack (char *raw, struct ping_ack *ack)
 	    ack->d_sec, ack->d_usec); 
 }
 
+/* numbers written by hand, for the reply path, where snprintf was
+   most of the cost of a PING_RECD */
+
+static char *put_uint (char *p, unsigned int n)
+{
+  char digits[10];
+  int k = 0;
+
+  do
+    {
+      digits[k++] = '0' + n % 10;
+      n /= 10;
+    }
+  while (n);
+  while (k > 0)
+    *p++ = digits[--k];
+  return p;
+}
+
+static char *put_int (char *p, int n)
+{
+  if (n < 0)
+    {
+      *p++ = '-';
+      return put_uint (p, -(unsigned int) n);
+    }
+  return put_uint (p, n);
+}
+
+int make_addr (char *raw, unsigned int addr)
+{
+  unsigned char *b = (unsigned char *) &addr;
+  char *p = raw;
+  int k;
+
+  for (k = 0; k < 4; k++)
+    {
+      if (k > 0)
+	*p++ = '.';
+      p = put_uint (p, b[k]);
+    }
+  *p = '\0';
+  return p - raw;
+}
+
+int make_ping_recd (char *raw, struct ping_ack *ack)
+{
+  char *p = raw;
+
+  p = put_uint (p, PING_RECD);
+  *p++ = ' ';
+  p += make_addr (p, ack->addr);
+  *p++ = ' ';
+  p = put_int (p, ack->id);
+  *p++ = ' ';
+  p = put_int (p, ack->seq_no);
+  *p++ = ' ';
+  p = put_int (p, ack->size);
+  *p++ = ' ';
+  p = put_uint (p, ack->d_sec);
+  *p++ = ' ';
+  p = put_uint (p, ack->d_usec);
+  memset (p, 0, raw + MAX_MSGLEN - p);
+  return p - raw;
+}
+
+/* ack records may sit anywhere in a buffer of records, so they're
+   copied rather than cast */
+
+void parse_ack_record (char *raw, struct ping_ack *ack)
+{
+  struct ack_record r;
+
+  memcpy (&r, raw, sizeof r);
+  ack->id = r.id;
+  ack->seq_no = r.seq_no;
+  ack->size = r.size;
+  ack->d_sec = r.d_sec;
+  ack->d_usec = r.d_usec;
+  ack->addr = r.addr;
+  ack->host[0] = '\0';
+}
+
+void make_ack_record (char *raw, struct ping_ack *ack)
+{
+  struct ack_record r;
+
+  memset (raw, 0, MAX_MSGLEN);
+  memcpy (r.tag, ACK_RECORD_TAG, sizeof r.tag);
+  r.id = ack->id;
+  r.seq_no = ack->seq_no;
+  r.size = ack->size;
+  r.d_sec = ack->d_sec;
+  r.d_usec = ack->d_usec;
+  r.addr = ack->addr;
+  memcpy (raw, &r, sizeof r);
+}
+
+/* the order for a watch_req is host, interval, size */
+
+void parse_watch_req (char *raw, struct watch_req *req)
+{
+  char *p_raw;
+  char *p_host;
+
+  p_raw = raw;
+  while (isspace(*p_raw)) p_raw++;
+  
+  /* hostname or IP */
+
+  for (p_host = req->host; *p_raw && !isspace (*p_raw)
+	 && p_host < req->host + MAX_HOST - 1; p_raw++, p_host++)
+    *p_host = *p_raw;
+  *p_host = '\0';
+  while (isspace(*p_raw)) p_raw++;
+
+  /* interval */
+
+  for (req->interval = 0; *p_raw && !isspace(*p_raw); p_raw++)
+    req->interval = req->interval * 10 + *p_raw - '0';
+  while (isspace(*p_raw)) p_raw++;
+
+  /* size */
+
+  for (req->size = 0; *p_raw && !isspace(*p_raw); p_raw++)
+    req->size = req->size * 10 + *p_raw - '0';
+}
+
+void make_watch_req (char *raw, struct watch_req *req)
+{
+  snprintf (raw, MAX_MSGLEN, "%s %u %u", 
+	    req->host, req->interval, req->size);
+}
+
+/* the order for a top_query is metric, count */
+
+void parse_top_query (char *raw, struct top_query *query)
+{
+  char *p_raw;
+
+  p_raw = raw;
+  while (isspace(*p_raw)) p_raw++;
+
+  /* metric */
+
+  for (query->metric = 0; *p_raw && !isspace(*p_raw); p_raw++)
+    query->metric = query->metric * 10 + *p_raw - '0';
+  while (isspace(*p_raw)) p_raw++;
+
+  /* count */
+
+  for (query->count = 0; *p_raw && !isspace(*p_raw); p_raw++)
+    query->count = query->count * 10 + *p_raw - '0';
+}
+
+void make_top_query (char *raw, struct top_query *query)
+{
+  snprintf (raw, MAX_MSGLEN, "%u %u", query->metric, query->count);
+}
+
+/* the order for a top_entry is host, metric, rank, value */
 
+void parse_top_entry (char *raw, struct top_entry *entry)
+{
+  char *p_raw;
+  char *p_host;
+
+  p_raw = raw;
+  while (isspace(*p_raw)) p_raw++;
+  
+  /* hostname or IP */
+
+  for (p_host = entry->host; *p_raw && !isspace (*p_raw)
+	 && p_host < entry->host + MAX_HOST - 1; p_raw++, p_host++)
+    *p_host = *p_raw;
+  *p_host = '\0';
+  while (isspace(*p_raw)) p_raw++;
+
+  /* metric */
+
+  for (entry->metric = 0; *p_raw && !isspace(*p_raw); p_raw++)
+    entry->metric = entry->metric * 10 + *p_raw - '0';
+  while (isspace(*p_raw)) p_raw++;
+
+  /* rank */
+
+  for (entry->rank = 0; *p_raw && !isspace(*p_raw); p_raw++)
+    entry->rank = entry->rank * 10 + *p_raw - '0';
+  while (isspace(*p_raw)) p_raw++;
+
+  /* value */
 
+  for (entry->value = 0; *p_raw && !isspace(*p_raw); p_raw++)
+    entry->value = entry->value * 10 + *p_raw - '0';
+}
 
+void make_top_entry (char *raw, struct top_entry *entry)
+{
+  snprintf (raw, MAX_MSGLEN, "%s %u %u %u", 
+	    entry->host, entry->metric, entry->rank, entry->value);
+}
 
+/* the order for a pmtu_msg is host, mtu */
+
+void parse_pmtu_msg (char *raw, struct pmtu_msg *pm)
+{
+  char *p_raw;
+  char *p_host;
 
+  p_raw = raw;
+  while (isspace(*p_raw)) p_raw++;
+  
+  /* hostname or IP */
+
+  for (p_host = pm->host; *p_raw && !isspace (*p_raw)
+	 && p_host < pm->host + MAX_HOST - 1; p_raw++, p_host++)
+    *p_host = *p_raw;
+  *p_host = '\0';
+  while (isspace(*p_raw)) p_raw++;
+
+  /* mtu */
+
+  for (pm->mtu = 0; *p_raw && !isspace(*p_raw); p_raw++)
+    pm->mtu = pm->mtu * 10 + *p_raw - '0';
+}
+
+void make_pmtu_msg (char *raw, struct pmtu_msg *pm)
+{
+  snprintf (raw, MAX_MSGLEN, "%s %u", pm->host, pm->mtu);
+}
+
+/* the order for an alert_msg is host, id, raised, value */
+
+void parse_alert_msg (char *raw, struct alert_msg *am)
+{
+  char *p_raw;
+  char *p_host;
+
+  p_raw = raw;
+  while (isspace(*p_raw)) p_raw++;
+  
+  /* hostname or IP */
+
+  for (p_host = am->host; *p_raw && !isspace (*p_raw)
+	 && p_host < am->host + MAX_HOST - 1; p_raw++, p_host++)
+    *p_host = *p_raw;
+  *p_host = '\0';
+  while (isspace(*p_raw)) p_raw++;
+
+  /* id */
+
+  for (am->id = 0; *p_raw && !isspace(*p_raw); p_raw++)
+    am->id = am->id * 10 + *p_raw - '0';
+  while (isspace(*p_raw)) p_raw++;
+
+  /* raised */
+
+  for (am->raised = 0; *p_raw && !isspace(*p_raw); p_raw++)
+    am->raised = am->raised * 10 + *p_raw - '0';
+  while (isspace(*p_raw)) p_raw++;
+
+  /* value */
+
+  am->value = strtod (p_raw, NULL);
+}
+
+void make_alert_msg (char *raw, struct alert_msg *am)
+{
+  snprintf (raw, MAX_MSGLEN, "%s %u %u %g", am->host, am->id, am->raised,
+	    am->value);
+}
@@ -6,6 +6,10 @@
 
 #define SOCKET_FILE "/tmp/icmpd_sock"
 
+/* how many clients can the daemon serve at once? */
+
+#define MAX_CLIENTS 16
+
 /* the structure of actual messages can vary. until we get the IPC
    roughed out, and probably longer, we're using a combination of an
    integer and a string, with the actual structure of the string
@@ -20,9 +24,63 @@
 #define SEND_PING 10
 #define PING_SENT 11
 #define PING_RECD 12
+#define PING_REJECTED 13
+
+/* a client that would only parse PING_RECD's text straight back can
+   send BINARY_ACKS.  from the daemon's BINARY_OK on, its replies come
+   as PING_RECD_BINARY records instead (see struct ack_record); a
+   daemon that doesn't know about them answers UNSUPPORTED_MESSAGE
+   and carries on with text */
+
+#define PING_RECD_BINARY 14
+#define BINARY_ACKS 15
+#define BINARY_OK 16
+
+#define WATCH_TARGET 20
+#define WATCH_OK 21
+
+#define TOP_QUERY 30
+#define TOP_ENTRY 31
+#define TOP_END 32
+
+/* a replacement daemon connects and sends HANDOVER instead of
+   registering.  the running one answers with HANDOVER_STATE, whose
+   text lists the client slots of the sockets that come with it, and
+   follows it with a state snapshot (see snapshot.h).  a HANDOVER
+   from a process running as another user is refused with
+   UNSUPPORTED_MESSAGE */
+
+#define HANDOVER 40
+#define HANDOVER_STATE 41
+
+#define PMTU_QUERY 50
+#define PMTU_RESULT 51
+
+/* ALERT_SET's text is an expression (see alert.h).  the daemon
+   answers ALERT_OK with the alert's id, or ALERT_BAD with the offset
+   into the text where compiling it failed and why.  ALERT_DELETE's
+   text is an id; it's answered with ALERT_OK */
+
+#define ALERT_SET 60
+#define ALERT_OK 61
+#define ALERT_BAD 62
+#define ALERT_CROSSED 63
+#define ALERT_DELETE 64
+
+/* TRACE_DUMP has the daemon write the flight recorder's rings to
+   TRACE_FILE (see trace.h); its text is ignored.  the daemon answers
+   TRACE_OK with the number of events written and the file */
+
+#define TRACE_DUMP 70
+#define TRACE_OK 71
 
 #define UNSUPPORTED_MESSAGE 999
 
+/* every message is MAX_MSGLEN bytes on the wire, whatever its
+   length.  make_msg, make_ping_recd and make_ack_record fill the
+   whole record, zeros after what the message says, so none of what
+   was in the buffer before goes out with it */
+
 #define MAX_MSGLEN 80
 #define MAX_HOST 60
 
@@ -30,13 +88,21 @@ void parse_msg (char *raw, int *msg, char *msg_text);
 void make_msg (char *raw, int msg, char *msg_text);
 
 /* to issue a ping, we need to know the address, the id, the sequence
-   number,  and the size to ping. */
+   number,  and the size to ping.  the priority is optional and picks
+   the daemon's scheduling class; leaving it off means interactive.
+   a request the daemon can't queue is answered with PING_REJECTED
+   rather than PING_SENT. */
+
+#define PRIORITY_INTERACTIVE 0
+#define PRIORITY_REALTIME 1
+#define PRIORITY_BULK 2
 
 struct ping_req
 { 
   unsigned int id;
   unsigned int seq_no;
   unsigned int size;
+  unsigned int priority;
   char host[MAX_HOST];
 };
 
@@ -53,12 +119,119 @@ struct ping_ack
   unsigned int size;
   unsigned int d_sec;
   unsigned int d_usec;
-  char host[MAX_HOST];
+  unsigned int addr; /* binary, network order; sent only in binary acks */
+  char host[MAX_HOST]; /* empty from parse_ping; the daemon uses addr */
 };
 
 void parse_ping_ack (char *raw, struct ping_ack *ack);
 void make_ping_ack (char *raw, struct ping_ack *ack);
 
+/* the same PING_RECD record make_ping_ack and make_msg give, with
+   the host as the dotted quad of addr, but put together by hand
+   rather than with snprintf; and the dotted quad on its own.  both
+   return the length of the text */
+
+int make_ping_recd (char *raw, struct ping_ack *ack);
+int make_addr (char *raw, unsigned int addr);
+
+/* a PING_RECD_BINARY record.  the tag is the message number as
+   text, so parse_msg makes sense of it like any other record; the
+   rest is a ping_ack's numbers in the daemon's byte order, the
+   address still in network order.  it fits well inside MAX_MSGLEN */
+
+#define ACK_RECORD_TAG "14 " /* PING_RECD_BINARY, and a NUL */
+
+struct ack_record
+{
+  char tag[4];
+  unsigned int id;
+  unsigned int seq_no;
+  unsigned int size;
+  unsigned int d_sec;
+  unsigned int d_usec;
+  unsigned int addr;
+};
+
+void parse_ack_record (char *raw, struct ping_ack *ack);
+void make_ack_record (char *raw, struct ping_ack *ack);
+
+/* to have the daemon ping a host on a schedule, we need the address,
+   the interval in milliseconds, and the size.  replies come back as
+   PING_RECD with sequence numbers the daemon picks.  an interval of 0
+   stops the schedule. */
+
+struct watch_req
+{
+  unsigned int interval;
+  unsigned int size;
+  char host[MAX_HOST];
+};
+
+void parse_watch_req (char *raw, struct watch_req *req);
+void make_watch_req (char *raw, struct watch_req *req);
+
+/* to ask which targets are worst right now, we need the metric and
+   how many.  the daemon answers with one TOP_ENTRY per target, worst
+   first, and then TOP_END with the same query and the number of
+   entries it sent.  RTTs are in usec and loss in parts per million. */
+
+#define TOP_RTT 0   /* smoothed RTT */
+#define TOP_P99 1   /* running 99th percentile RTT */
+#define TOP_LOSS 2  /* recent loss ratio */
+#define TOP_METRICS 3
+
+#define TOP_MAX 64  /* the most entries a query can ask for */
+
+struct top_query
+{
+  unsigned int metric;
+  unsigned int count;
+};
+
+struct top_entry
+{
+  unsigned int metric;
+  unsigned int rank;
+  unsigned int value;
+  char host[MAX_HOST];
+};
+
+void parse_top_query (char *raw, struct top_query *query);
+void make_top_query (char *raw, struct top_query *query);
+void parse_top_entry (char *raw, struct top_entry *entry);
+void make_top_entry (char *raw, struct top_entry *entry);
+
+/* to find the path MTU to a host, we need the address, and
+   optionally an upper bound to search up to; 0 means PMTU_MAX.  the
+   answer comes back as PMTU_RESULT with the path MTU in bytes of IP
+   packet, or 0 if it couldn't be measured.  it may be from a cache
+   and come straight away, or take a few round trips. */
+
+struct pmtu_msg
+{
+  unsigned int mtu;
+  char host[MAX_HOST];
+};
+
+void parse_pmtu_msg (char *raw, struct pmtu_msg *pm);
+void make_pmtu_msg (char *raw, struct pmtu_msg *pm);
+
+/* when an alert's test starts or stops holding for a target, its
+   owner gets ALERT_CROSSED with the alert's id, whether it holds now,
+   the value of the expression (the left-hand side, for a comparison),
+   and the host. */
+
+struct alert_msg
+{
+  unsigned int id;
+  unsigned int raised;
+  double value;
+  char host[MAX_HOST];
+};
+
+void parse_alert_msg (char *raw, struct alert_msg *am);
+void make_alert_msg (char *raw, struct alert_msg *am);
+
 
 
 
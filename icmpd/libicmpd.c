@@ -0,0 +1,487 @@
+/* libicmpd.c */
+/* asynchronous, pipelined client side of the icmpd protocol */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ipc-msgs.h"
+#include "libicmpd.h"
+
+/* the daemon going away must not kill the caller */
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define INITIAL_SLOTS 64
+#define READ_RECORDS 64
+
+struct icmpd_conn
+{
+  char sockfile[104];
+  int sock;
+  int changed;
+  long retry_at;
+
+  icmpd_ack_fn on_ack;
+  void *arg;
+
+  /* requests the daemon hasn't answered with PING_SENT or
+     PING_REJECTED yet, oldest first.  the daemon answers each
+     priority class in order, so the answer is nearly always at the
+     head of this ring */
+
+  struct ping_req *pending;
+  unsigned int pend_head, pend_count, pend_cap;
+  unsigned int rejected;
+
+  /* formatted records waiting for the socket to take them */
+
+  char *out;
+  unsigned int out_off, out_len, out_cap;
+
+  /* records from the daemon, the last possibly partial */
+
+  char in[READ_RECORDS * MAX_MSGLEN];
+  unsigned int in_len;
+
+  /* results waiting for icmpd_read_acks, when there's no callback */
+
+  struct ping_ack *acks;
+  unsigned int ack_head, ack_count, ack_cap;
+};
+
+static long now_msec (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec * 1000L + tv.tv_usec / 1000;
+}
+
+static int queue_msg (struct icmpd_conn *conn, int msg, char *text)
+     /* append one fixed-size record to the output buffer
+      * returns: ICMPD_OK, or ICMPD_ERROR if we're out of memory
+      */
+{
+  if (conn->out_off > 0 && conn->out_off == conn->out_len)
+    conn->out_off = conn->out_len = 0;
+
+  if (conn->out_len + MAX_MSGLEN > conn->out_cap)
+    {
+      unsigned int cap = conn->out_cap ? conn->out_cap * 2
+	: INITIAL_SLOTS * MAX_MSGLEN;
+      char *out;
+
+      /* reclaim what's already been sent before growing */
+
+      if (conn->out_off > 0)
+	{
+	  memmove (conn->out, conn->out + conn->out_off,
+		   conn->out_len - conn->out_off);
+	  conn->out_len -= conn->out_off;
+	  conn->out_off = 0;
+	}
+      if (conn->out_len + MAX_MSGLEN > conn->out_cap)
+	{
+	  out = realloc (conn->out, cap);
+	  if (out == NULL)
+	    return ICMPD_ERROR;
+	  conn->out = out;
+	  conn->out_cap = cap;
+	}
+    }
+
+  memset (conn->out + conn->out_len, 0, MAX_MSGLEN);
+  make_msg (conn->out + conn->out_len, msg, text);
+  conn->out_len += MAX_MSGLEN;
+  return ICMPD_OK;
+}
+
+static int queue_req (struct icmpd_conn *conn, struct ping_req *req)
+{
+  char info[MAX_MSGLEN];
+
+  make_ping_req (info, req);
+  return queue_msg (conn, SEND_PING, info);
+}
+
+static void drop_conn (struct icmpd_conn *conn)
+     /* forget the current socket and schedule a reconnect; anything
+	still in the output buffer will be regenerated from the
+	pending ring */
+{
+  if (conn->sock != -1)
+    close (conn->sock);
+  conn->sock = -1;
+  conn->changed = 1;
+  conn->out_off = conn->out_len = 0;
+  conn->in_len = 0;
+  conn->retry_at = now_msec () + ICMPD_RETRY_MSEC;
+}
+
+static int try_connect (struct icmpd_conn *conn)
+     /* open a new connection and queue the registration and every
+	unanswered request behind it
+      * returns: ICMPD_OK, or ICMPD_ERROR if the daemon isn't there
+      */
+{
+  struct sockaddr_un comm_remote;
+  int len, sock;
+  unsigned int i;
+
+  sock = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (sock == -1)
+    return ICMPD_ERROR;
+
+  comm_remote.sun_family = AF_UNIX;
+  strlcpy (comm_remote.sun_path, conn->sockfile, 104);
+  len = strlen (comm_remote.sun_path) + sizeof(comm_remote.sun_family) + 1;
+  if (connect (sock, (struct sockaddr *) &comm_remote, len) == -1)
+    {
+      close (sock);
+      conn->retry_at = now_msec () + ICMPD_RETRY_MSEC;
+      return ICMPD_ERROR;
+    }
+  fcntl (sock, F_SETFL, fcntl (sock, F_GETFL) | O_NONBLOCK);
+
+  conn->sock = sock;
+  conn->changed = 1;
+  conn->out_off = conn->out_len = 0;
+  conn->in_len = 0;
+
+  /* we only want the numbers, so we ask for them without the text;
+     an older daemon says no and sends text, which we read as well */
+
+  if (queue_msg (conn, CLIENT_REGISTER, "Client registering") != ICMPD_OK
+      || queue_msg (conn, BINARY_ACKS, "Binary acks, please") != ICMPD_OK)
+    return ICMPD_ERROR;
+  for (i = 0; i < conn->pend_count; i++)
+    if (queue_req (conn, &conn->pending[(conn->pend_head + i)
+					% conn->pend_cap]) != ICMPD_OK)
+      return ICMPD_ERROR;
+
+  return ICMPD_OK;
+}
+
+static int flush_out (struct icmpd_conn *conn)
+     /* push as much of the output buffer as the socket will take
+      * returns: ICMPD_OK, or ICMPD_ERROR if the connection died
+      */
+{
+  while (conn->sock != -1 && conn->out_off < conn->out_len)
+    {
+      int result = send (conn->sock, conn->out + conn->out_off,
+			 conn->out_len - conn->out_off, MSG_NOSIGNAL);
+      if (result < 0)
+	{
+	  if (errno == EAGAIN || errno == EINTR)
+	    return ICMPD_OK;
+	  drop_conn (conn);
+	  return ICMPD_ERROR;
+	}
+      conn->out_off += result;
+    }
+  return ICMPD_OK;
+}
+
+static int push_ack (struct icmpd_conn *conn, struct ping_ack *ack)
+{
+  if (conn->ack_count == conn->ack_cap)
+    {
+      unsigned int cap = conn->ack_cap ? conn->ack_cap * 2 : INITIAL_SLOTS;
+      struct ping_ack *acks = malloc (cap * sizeof *acks);
+      unsigned int i;
+
+      if (acks == NULL)
+	return ICMPD_ERROR;
+      for (i = 0; i < conn->ack_count; i++)
+	acks[i] = conn->acks[(conn->ack_head + i) % conn->ack_cap];
+      free (conn->acks);
+      conn->acks = acks;
+      conn->ack_head = 0;
+      conn->ack_cap = cap;
+    }
+  conn->acks[(conn->ack_head + conn->ack_count) % conn->ack_cap] = *ack;
+  conn->ack_count++;
+  return ICMPD_OK;
+}
+
+static void pending_done (struct icmpd_conn *conn, char *info)
+     /* forget the pending request the daemon has just answered.
+	requests to different hosts can share a sequence number, so
+	it takes both to say which one it was */
+{
+  struct ping_req req;
+  struct ping_req *p;
+  unsigned int i, j;
+
+  parse_ping_req (info, &req);
+  for (i = 0; i < conn->pend_count; i++)
+    {
+      p = &conn->pending[(conn->pend_head + i) % conn->pend_cap];
+      if (p->seq_no == req.seq_no && strcmp (p->host, req.host) == 0)
+	break;
+    }
+  if (i == conn->pend_count)
+    return;
+
+  /* close the gap, moving the older requests up */
+
+  for (j = i; j > 0; j--)
+    conn->pending[(conn->pend_head + j) % conn->pend_cap]
+      = conn->pending[(conn->pend_head + j - 1) % conn->pend_cap];
+  conn->pend_head = (conn->pend_head + 1) % conn->pend_cap;
+  conn->pend_count--;
+}
+
+static int handle_record (struct icmpd_conn *conn, char *raw)
+     /* act on one complete record from the daemon
+      * returns: ICMPD_OK, ICMPD_REFUSED or ICMPD_ERROR
+      */
+{
+  char info[MAX_MSGLEN];
+  struct ping_ack ack;
+  int msg;
+
+  raw[MAX_MSGLEN - 1] = '\0';
+  parse_msg (raw, &msg, info);
+  switch (msg)
+    {
+    case PING_SENT:
+      pending_done (conn, info);
+      break;
+
+    case PING_REJECTED:
+      pending_done (conn, info);
+      conn->rejected++;
+      break;
+
+    case PING_RECD:
+    case PING_RECD_BINARY:
+      if (msg == PING_RECD)
+	parse_ping_ack (info, &ack);
+      else
+	{
+	  /* callers still get the host as text; here's where it's
+	     made, rather than in the daemon */
+
+	  parse_ack_record (raw, &ack);
+	  make_addr (ack.host, ack.addr);
+	}
+      if (conn->on_ack)
+	conn->on_ack (conn, &ack, conn->arg);
+      else if (push_ack (conn, &ack) != ICMPD_OK)
+	return ICMPD_ERROR;
+      break;
+
+    case TOO_MANY_CLIENTS:
+      drop_conn (conn);
+      return ICMPD_REFUSED;
+
+    default:
+      /* REGISTER_OK, BINARY_OK, and anything we don't know about,
+	 including an older daemon's UNSUPPORTED_MESSAGE for
+	 BINARY_ACKS */
+      break;
+    }
+  return ICMPD_OK;
+}
+
+struct icmpd_conn *icmpd_open (char *sockfile, icmpd_ack_fn on_ack,
+			       void *arg)
+     /* set up a connection to the daemon
+      * sockfile: path to the unix domain socket file
+      * on_ack: called for every ping result, or NULL to batch them
+      * arg: passed through to on_ack
+      * returns: the connection, or NULL if we're out of memory.  a
+      *   daemon that isn't running yet is not an error; we keep trying
+      */
+{
+  struct icmpd_conn *conn;
+
+  conn = calloc (1, sizeof *conn);
+  if (conn == NULL)
+    return NULL;
+
+  strlcpy (conn->sockfile, sockfile, sizeof conn->sockfile);
+  conn->sock = -1;
+  conn->on_ack = on_ack;
+  conn->arg = arg;
+
+  try_connect (conn);
+  conn->changed = 0;
+  return conn;
+}
+
+void icmpd_close (struct icmpd_conn *conn)
+{
+  if (conn->sock != -1)
+    {
+      char buf[MAX_MSGLEN];
+
+      memset (buf, 0, MAX_MSGLEN);
+      make_msg (buf, CLIENT_SIGNOFF, "Goodnight, Mrs Calabash");
+      send (conn->sock, buf, MAX_MSGLEN, MSG_NOSIGNAL);
+      close (conn->sock);
+    }
+  free (conn->pending);
+  free (conn->out);
+  free (conn->acks);
+  free (conn);
+}
+
+int icmpd_fd (struct icmpd_conn *conn)
+{
+  return conn->sock;
+}
+
+int icmpd_want_write (struct icmpd_conn *conn)
+{
+  return conn->sock != -1 && conn->out_off < conn->out_len;
+}
+
+int icmpd_timeout (struct icmpd_conn *conn)
+     /* returns: milliseconds until icmpd_process() should be called
+      *   even if the fd isn't ready, or -1 for no deadline
+      */
+{
+  long wait;
+
+  if (conn->sock != -1)
+    return -1;
+  wait = conn->retry_at - now_msec ();
+  return wait > 0 ? (int) wait : 0;
+}
+
+unsigned int icmpd_unsent (struct icmpd_conn *conn)
+{
+  return conn->pend_count;
+}
+
+unsigned int icmpd_rejected (struct icmpd_conn *conn)
+     /* returns: how many requests the daemon has turned away, because
+      *   the host didn't resolve or the request's queue was full
+      */
+{
+  return conn->rejected;
+}
+
+int icmpd_ping (struct icmpd_conn *conn, char *host,
+		unsigned int seq_no, unsigned int size,
+		unsigned int priority)
+     /* queue a ping request; it goes out without waiting for the
+	daemon to acknowledge earlier ones
+      * priority: PRIORITY_REALTIME, PRIORITY_INTERACTIVE or
+      *   PRIORITY_BULK
+      * returns: ICMPD_OK, or ICMPD_ERROR if we're out of memory
+      */
+{
+  struct ping_req *req;
+
+  if (conn->pend_count == conn->pend_cap)
+    {
+      unsigned int cap = conn->pend_cap ? conn->pend_cap * 2 : INITIAL_SLOTS;
+      struct ping_req *pending = malloc (cap * sizeof *pending);
+      unsigned int i;
+
+      if (pending == NULL)
+	return ICMPD_ERROR;
+      for (i = 0; i < conn->pend_count; i++)
+	pending[i] = conn->pending[(conn->pend_head + i) % conn->pend_cap];
+      free (conn->pending);
+      conn->pending = pending;
+      conn->pend_head = 0;
+      conn->pend_cap = cap;
+    }
+
+  req = &conn->pending[(conn->pend_head + conn->pend_count) % conn->pend_cap];
+  strlcpy (req->host, host, MAX_HOST);
+  req->id = 0; /* assigned by server */
+  req->seq_no = seq_no;
+  req->size = size;
+  req->priority = priority;
+  conn->pend_count++;
+
+  if (conn->sock == -1)
+    return ICMPD_OK; /* goes out when we reconnect */
+
+  if (queue_req (conn, req) != ICMPD_OK)
+    return ICMPD_ERROR;
+  flush_out (conn);
+  return ICMPD_OK;
+}
+
+int icmpd_process (struct icmpd_conn *conn)
+     /* do whatever I/O the connection is ready for, delivering any
+	results that have arrived
+      * returns: ICMPD_OK, ICMPD_FD_CHANGED if the caller must swap
+      *   icmpd_fd() into its poll set, ICMPD_REFUSED if the daemon
+      *   has no room for us (we'll retry), or ICMPD_ERROR
+      */
+{
+  int result = ICMPD_OK;
+
+  if (conn->sock == -1)
+    {
+      if (now_msec () < conn->retry_at || try_connect (conn) != ICMPD_OK)
+	goto done;
+    }
+
+  flush_out (conn);
+
+  while (conn->sock != -1)
+    {
+      unsigned int off;
+      int cc = recv (conn->sock, conn->in + conn->in_len,
+		     sizeof conn->in - conn->in_len, 0);
+      if (cc < 0 && (errno == EAGAIN || errno == EINTR))
+	break;
+      if (cc <= 0)
+	{
+	  drop_conn (conn);
+	  break;
+	}
+      conn->in_len += cc;
+
+      for (off = 0; off + MAX_MSGLEN <= conn->in_len; off += MAX_MSGLEN)
+	{
+	  result = handle_record (conn, conn->in + off);
+	  if (result != ICMPD_OK)
+	    goto done;
+	}
+      memmove (conn->in, conn->in + off, conn->in_len - off);
+      conn->in_len -= off;
+    }
+
+ done:
+  if (result == ICMPD_OK && conn->changed)
+    result = ICMPD_FD_CHANGED;
+  conn->changed = 0;
+  return result;
+}
+
+int icmpd_read_acks (struct icmpd_conn *conn, struct ping_ack *acks,
+		     int max)
+     /* take queued results, oldest first
+      * returns: the number copied into acks
+      */
+{
+  int n = 0;
+
+  while (n < max && conn->ack_count > 0)
+    {
+      acks[n++] = conn->acks[conn->ack_head];
+      conn->ack_head = (conn->ack_head + 1) % conn->ack_cap;
+      conn->ack_count--;
+    }
+  return n;
+}
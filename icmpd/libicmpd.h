@@ -0,0 +1,51 @@
+/* libicmpd.h */
+/* asynchronous client library for icmpd */
+
+/* the library owns one non-blocking connection to the daemon.  the
+   caller adds icmpd_fd() to its own poll/select/epoll set, waiting
+   for readability always and for writability whenever
+   icmpd_want_write() is true, and calls icmpd_process() when the fd
+   is ready.  ping requests are queued and pipelined; nothing waits
+   for PING_SENT before the next request goes out.  each request
+   carries a priority, which the daemon's scheduler uses to order
+   probes across all its clients; a request the daemon can't take is
+   answered with PING_REJECTED and counted by icmpd_rejected().
+
+   results are delivered to the callback given to icmpd_open(), or,
+   if that is NULL, queued for icmpd_read_acks().
+
+   if the daemon goes away, the library reconnects, re-registers, and
+   resends any requests the daemon hadn't acknowledged.  the socket
+   changes when that happens: icmpd_process() returns ICMPD_FD_CHANGED
+   and the caller must swap the new icmpd_fd() into its poll set.
+   while disconnected, icmpd_fd() is -1 and icmpd_timeout() says how
+   long to wait before calling icmpd_process() again. */
+
+#define ICMPD_OK 0
+#define ICMPD_FD_CHANGED 1
+#define ICMPD_ERROR -1
+#define ICMPD_REFUSED -2
+
+#define ICMPD_RETRY_MSEC 500
+
+struct icmpd_conn;
+
+typedef void (*icmpd_ack_fn) (struct icmpd_conn *conn,
+			      struct ping_ack *ack, void *arg);
+
+struct icmpd_conn *icmpd_open (char *sockfile, icmpd_ack_fn on_ack,
+			       void *arg);
+void icmpd_close (struct icmpd_conn *conn);
+
+int icmpd_fd (struct icmpd_conn *conn);
+int icmpd_want_write (struct icmpd_conn *conn);
+int icmpd_timeout (struct icmpd_conn *conn);
+int icmpd_process (struct icmpd_conn *conn);
+
+int icmpd_ping (struct icmpd_conn *conn, char *host,
+		unsigned int seq_no, unsigned int size,
+		unsigned int priority);
+int icmpd_read_acks (struct icmpd_conn *conn, struct ping_ack *acks,
+		     int max);
+unsigned int icmpd_unsent (struct icmpd_conn *conn);
+unsigned int icmpd_rejected (struct icmpd_conn *conn);
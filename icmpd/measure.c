@@ -0,0 +1,207 @@
+/* measure.c */
+/* the busy-polling measurement thread */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for pthread_setaffinity_np */
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "ipc-msgs.h"
+#include "ping-code.h"
+#include "measure.h"
+#include "trace.h"
+
+/* everything the thread touches is allocated here, up front, and
+   locked into memory before it starts */
+
+static struct ping_ack ring[MEASURE_RING];
+static volatile unsigned long ring_head; /* written by the thread */
+static volatile unsigned long ring_tail; /* written by the main loop */
+static unsigned long dropped;
+
+static char packet[MAX_PACKET];
+static unsigned int measure_sock;
+static int wake_pipe[2];
+static pthread_t thread;
+static volatile int stopping;
+static struct trace_ring *tr;
+
+static void *measure_loop (void *arg)
+{
+  struct sockaddr_in from;
+  socklen_t fromlen;
+  struct ping_ack *ack;
+  unsigned long head, tail;
+  int cc;
+
+  while (!stopping)
+    {
+      fromlen = sizeof from;
+      cc = recvfrom (measure_sock, packet, MAX_PACKET, MSG_DONTWAIT,
+		     (struct sockaddr *)&from, &fromlen);
+      if (cc < 0)
+	continue; /* nothing yet: spin */
+
+      /* the PARSE span starts as the reply comes off the socket, and
+	 ends when the main loop can have it */
+
+      trace_begin (tr, TRACE_PARSE, 0);
+
+      head = ring_head;
+      tail = ring_tail;
+      if (head - tail == MEASURE_RING)
+	{
+	  dropped++;
+	  trace_end (tr, TRACE_PARSE, MAX_CLIENTS);
+	  continue;
+	}
+
+      ack = &ring[head & (MEASURE_RING - 1)];
+      if (!parse_ping (&from, packet, cc, ack))
+	{
+	  trace_end (tr, TRACE_PARSE, MAX_CLIENTS);
+	  continue;
+	}
+
+      /* publish the ack before the new head, and only poke the main
+	 loop if it might have gone to sleep on an empty ring */
+
+      __sync_synchronize ();
+      ring_head = head + 1;
+      __sync_synchronize ();
+      trace_end (tr, TRACE_PARSE, ack->id);
+      if (head == ring_tail)
+	{
+	  char c = 0;
+	  write (wake_pipe[1], &c, 1);
+	}
+    }
+  return NULL;
+}
+
+int measure_start (unsigned int ping_sock, int cpu)
+     /* start the measurement thread
+      * ping_sock: the ICMP socket; the main loop must stop reading it
+      * cpu: the core to pin the thread to, ideally an isolated one
+      * returns: a file descriptor that becomes readable when replies
+      *   are waiting for measure_drain(), or -1 on failure
+      */
+{
+
+  measure_sock = ping_sock;
+  if (pipe (wake_pipe) == -1)
+    {
+      perror ("measurement wakeup pipe");
+      return -1;
+    }
+  fcntl (wake_pipe[0], F_SETFL, fcntl (wake_pipe[0], F_GETFL) | O_NONBLOCK);
+  fcntl (wake_pipe[1], F_SETFL, fcntl (wake_pipe[1], F_GETFL) | O_NONBLOCK);
+
+  /* let the driver poll the device queue for us as well */
+
+#ifdef SO_BUSY_POLL
+  {
+    int busy = MEASURE_BUSY_POLL_USEC;
+
+    if (setsockopt (ping_sock, SOL_SOCKET, SO_BUSY_POLL,
+		    &busy, sizeof busy) == -1)
+      perror ("SO_BUSY_POLL (continuing without it)");
+  }
+#endif
+
+  /* the thread's flight recorder ring is allocated here, so it's
+     locked in with everything else */
+
+  tr = trace_thread ("measure");
+
+  /* no page faults once we're measuring */
+
+  memset (ring, 0, sizeof ring);
+  memset (packet, 0, sizeof packet);
+  if (mlockall (MCL_CURRENT | MCL_FUTURE) == -1)
+    perror ("mlockall (continuing unlocked)");
+
+  if (pthread_create (&thread, NULL, measure_loop, NULL) != 0)
+    {
+      perror ("starting measurement thread");
+      return -1;
+    }
+
+#ifdef __linux__
+  {
+    cpu_set_t cpus;
+
+    CPU_ZERO (&cpus);
+    CPU_SET (cpu, &cpus);
+    if (pthread_setaffinity_np (thread, sizeof cpus, &cpus) != 0)
+      fprintf (stderr, "can't pin measurement thread to cpu %d\n", cpu);
+  }
+#else
+  fprintf (stderr, "cpu pinning isn't supported here; "
+	   "measurement thread is unpinned\n");
+#endif
+
+  return wake_pipe[0];
+}
+
+int measure_drain (struct ping_ack *acks, int max)
+     /* take replies the measurement thread has parsed
+      * returns: the number copied into acks
+      */
+{
+  char junk[64];
+  unsigned long head, tail;
+  int n = 0;
+
+  while (read (wake_pipe[0], junk, sizeof junk) > 0)
+    ;
+
+  /* look at the head again after giving slots back: the thread only
+     wakes us if it saw the ring empty, so anything it added while we
+     were copying is ours to pick up now */
+
+  tail = ring_tail;
+  while (n < max)
+    {
+      head = ring_head;
+      __sync_synchronize ();
+      if (tail == head)
+	break;
+      while (n < max && tail != head)
+	{
+	  acks[n++] = ring[tail & (MEASURE_RING - 1)];
+	  tail++;
+	}
+      __sync_synchronize ();
+      ring_tail = tail;
+      __sync_synchronize ();
+    }
+  return n;
+}
+
+unsigned long measure_dropped (void)
+{
+  return dropped;
+}
+
+void measure_stop (void)
+     /* stop the measurement thread and wait for it.  replies it has
+	already timed stay in the ring for measure_drain(); anything
+	newer stays queued on the ICMP socket */
+{
+  stopping = 1;
+  pthread_join (thread, NULL);
+}
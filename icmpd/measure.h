@@ -0,0 +1,15 @@
+/* measure.h */
+/* low-jitter measurement mode: a dedicated thread, pinned to its own
+   core, busy-polls the ICMP socket and timestamps replies the moment
+   they arrive, so scheduler wakeup latency in the main loop never
+   ends up inside a measured RTT.  the thread does no client I/O; it
+   hands parsed replies to the main loop through a preallocated
+   single-producer, single-consumer ring and a wakeup pipe. */
+
+#define MEASURE_RING 4096 /* must be a power of two */
+#define MEASURE_BUSY_POLL_USEC 50
+
+int measure_start (unsigned int ping_sock, int cpu);
+int measure_drain (struct ping_ack *acks, int max);
+unsigned long measure_dropped (void);
+void measure_stop (void);
@@ -0,0 +1,2003 @@
+/* ping-bench.c */
+/* benchmarks for icmpd.  each one is a subcommand:
+
+     ping-bench pipeline [count]
+       requests/sec through a running daemon, first one request at a
+       time the way ping-client.c does it, then pipelined through
+       libicmpd
+
+     ping-bench jitter [count] [cpu]
+       RTT spread on loopback, first timed from a select loop like
+       the daemon's normal one, then by the busy-polling measurement
+       thread pinned to cpu (default 0).  needs root for the raw
+       socket
+
+     ping-bench targets [count]
+       builds a target registry of count synthetic targets, checks it
+       against TARGET_BYTES_BUDGET, and times the reply-path lookup
+       and update.  with no count, it does that for each of
+       TARGET_BENCH_SIZES, which include counts just past where the
+       registry grows; fails if any of them is over budget
+
+     ping-bench topk [count]
+       feeds replies and timeouts for count synthetic targets
+       (default a million) through the top-K rankings, and times the
+       reply path with and without marking targets dirty, the
+       deferred heap updates, and a TOP_QUERY for each metric
+
+     ping-bench restart [count] [server]
+       sends count pings (default 2000), one a msec, through a
+       running daemon, and halfway through starts server (default
+       ./ping-server) with -r to take over from it.  reports the
+       longest gap between replies; fails if any reply was lost or
+       the connection dropped
+
+     ping-bench pmtu [count]
+       asks for the path MTU to count loopback addresses (default
+       2000) all at once, with a realtime ping every msec alongside,
+       and reports how long discovery took and what it did to the
+       pings' RTTs.  every answer should be PMTU_MAX, since loopback
+       carries more than that
+
+     ping-bench sched [seconds]
+       simulates the scheduler under a bulk flood from every other
+       client slot while one client sends a realtime probe every
+       10 msec, first with every probe in the bulk class and then
+       with the realtime probes in their own class, and reports how
+       long the realtime probes waited to go out.  no network
+       involved; fails if the realtime p99 wait is over
+       SCHED_BENCH_MAX_WAIT
+
+     ping-bench alerts [count]
+       compiles a few alert expressions and times them against count
+       synthetic targets (default 100000): one test on its own, then
+       the reply path with and without checking every alert.  fails
+       if a test costs more than ALERT_BENCH_MAX_NSEC, or if an
+       expression as deep as the compiler allows comes out wrong
+
+     ping-bench adapt [targets] [seconds]
+       simulates targets watches (default 10000), one a second, for
+       seconds (default 600) against a stand-in for the network in
+       which one target in ADAPT_BENCH_ONE_IN has an incident, first
+       at fixed intervals, then adapting within a budget of the same
+       probes a second (see adapt.h) and within a quarter of it, then
+       at the fixed interval that costs as many probes as adapting
+       did.  reports the probes each used and how soon they caught
+       the incidents; fails if adapting goes over either budget in
+       any one second, doesn't save probes, misses an incident fixed
+       intervals catch or catches one later than they do at p50, p90
+       or worst, or catches anything after its incident is over when
+       squeezed
+
+     ping-bench reply [count]
+       pushes count synthetic echo replies (default a million)
+       through the reply path to REPLY_BENCH_CLIENTS clients over
+       socketpairs, half of them taking binary acks: first the way
+       it was, with a formatted record and a send for every reply,
+       then through the reply pool (see reply.h).  the packets are
+       copied in where recvfrom would put them, and the targets
+       aren't credited, so it's only the path that's timed.  reports
+       heap allocations and time per reply, and instructions per
+       reply where the kernel will count them (Linux perf events);
+       fails if the pool allocates anything, or if its records
+       aren't what the old path sent
+
+     ping-bench capture file [targets] [seconds]
+       writes a synthetic pcap capture for ping-replay: CAPTURE_PINGERS
+       pingers taking turns to probe targets hosts (default 10000),
+       each once a second, for seconds (default 60), with made-up
+       RTTs and 1% loss.  the same
+       arguments always give the same file, so timing ping-replay -q
+       on it is a repeatable benchmark of the parse and match path,
+       and the totals it reports can be checked against the ones
+       printed here
+
+     ping-bench replay [threads] [replay]
+       writes a capture as above for REPLAY_BENCH_TARGETS hosts and
+       REPLAY_BENCH_SECONDS seconds, and runs replay (default
+       ./ping-replay) over it with one worker thread and with threads
+       (default 3).  fails unless the two print the same thing, bar
+       the timing
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for syscall, for perf_event_open */
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "ipc-msgs.h"
+#include "ping-code.h"
+#include "measure.h"
+#include "targets.h"
+#include "sched.h"
+#include "topk.h"
+#include "pmtu.h"
+#include "capture.h"
+#include "expr.h"
+#include "alert.h"
+#include "adapt.h"
+#include "reply.h"
+#include "libicmpd.h"
+
+#define BENCH_HOST "127.0.0.1"
+#define JITTER_GAP_USEC 1000
+#define RESTART_MAX_GAP 100      /* msec */
+#define PMTU_BENCH_PINGS 32000
+#define SCHED_BENCH_RTT 20       /* msec */
+#define SCHED_BENCH_GAP 10       /* msec between realtime probes */
+#define SCHED_BENCH_MAX_WAIT 1   /* msec */
+#define ALERT_BENCH_MAX_NSEC 50
+#define ADAPT_BENCH_INTERVAL 1000 /* msec */
+#define ADAPT_BENCH_BATCH 256
+#define ADAPT_BENCH_WARMUP 60000  /* msec before any incident */
+#define ADAPT_BENCH_INCIDENT 60000 /* msec */
+#define ADAPT_BENCH_GRACE 10000  /* msec after it, still its change */
+#define ADAPT_BENCH_ONE_IN 10
+#define ADAPT_BENCH_FLAPPY 10
+#define ADAPT_BENCH_JITTER 0.02f
+#define ADAPT_BENCH_FLAPPY_JITTER 0.3f
+#define ADAPT_BENCH_LOSS 2       /* per thousand */
+#define ADAPT_BENCH_SQUEEZE 4    /* the tight budget is a quarter */
+#define REPLY_BENCH_CLIENTS 4
+#define REPLY_BENCH_PAYLOAD 56
+#define REPLY_BENCH_PACKET (20 + 8 + REPLY_BENCH_PAYLOAD)
+#define TARGET_BENCH_SIZES { 10000, 100000, 131073, 200000, 524289, 1000000 }
+#define CAPTURE_PINGER 0x0a000001 /* 10.0.0.1, and the next few */
+#define CAPTURE_PINGERS 3
+#define REPLAY_BENCH_TARGETS 5000
+#define REPLAY_BENCH_SECONDS 30
+#define CAPTURE_PAYLOAD 56
+#define CAPTURE_FRAME (14 + 20 + 8 + CAPTURE_PAYLOAD)
+
+static double elapsed (struct timeval *start)
+{
+  struct timeval now;
+
+  gettimeofday (&now, NULL);
+  return (now.tv_sec - start->tv_sec)
+    + (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+static int bench_connect (void)
+     /* returns: a registered connection to the daemon, or -1 */
+{
+  struct sockaddr_un comm_remote;
+  char buf[MAX_MSGLEN];
+  int sock, len;
+
+  sock = socket (AF_UNIX, SOCK_STREAM, 0);
+  comm_remote.sun_family = AF_UNIX;
+  strlcpy (comm_remote.sun_path, SOCKET_FILE, 104);
+  len = strlen (comm_remote.sun_path) + sizeof(comm_remote.sun_family) + 1;
+  if (connect (sock, (struct sockaddr *) &comm_remote, len) == -1)
+    {
+      perror ("connecting to icmpd");
+      close (sock);
+      return -1;
+    }
+
+  memset (buf, 0, MAX_MSGLEN);
+  make_msg (buf, CLIENT_REGISTER, "Client registering");
+  send (sock, buf, MAX_MSGLEN, 0);
+  recv (sock, buf, MAX_MSGLEN, MSG_WAITALL);
+  return sock;
+}
+
+static int bench_serial (int count)
+     /* one request, one PING_SENT, then the next request */
+{
+  struct timeval start;
+  struct ping_req req;
+  char buf[MAX_MSGLEN];
+  char info[MAX_MSGLEN];
+  int sock, msg, i;
+
+  sock = bench_connect ();
+  if (sock == -1)
+    return 1;
+
+  gettimeofday (&start, NULL);
+  for (i = 0; i < count; i++)
+    {
+      strlcpy (req.host, BENCH_HOST, MAX_HOST);
+      req.id = 0;
+      req.seq_no = i;
+      req.size = 56;
+      req.priority = PRIORITY_INTERACTIVE;
+      make_ping_req (info, &req);
+      make_msg (buf, SEND_PING, info);
+      send (sock, buf, MAX_MSGLEN, 0);
+
+      do
+	{
+	  if (recv (sock, buf, MAX_MSGLEN, MSG_WAITALL) <= 0)
+	    {
+	      perror ("reading from icmpd");
+	      return 1;
+	    }
+	  parse_msg (buf, &msg, info);
+	}
+      while (msg != PING_SENT);
+    }
+  printf ("serial:    %d requests, %.0f requests/sec\n",
+	  count, count / elapsed (&start));
+
+  make_msg (buf, CLIENT_SIGNOFF, "");
+  send (sock, buf, MAX_MSGLEN, 0);
+  close (sock);
+  return 0;
+}
+
+static void count_ack (struct icmpd_conn *conn, struct ping_ack *ack,
+		       void *arg)
+{
+  (*(int *) arg)++;
+}
+
+static int bench_pipeline (int count)
+     /* every request queued up front, driven from a poll loop */
+{
+  struct icmpd_conn *conn;
+  struct timeval start;
+  int acks = 0;
+  int i;
+
+  conn = icmpd_open (SOCKET_FILE, count_ack, &acks);
+  if (conn == NULL || icmpd_fd (conn) == -1)
+    {
+      fprintf (stderr, "can't connect to icmpd\n");
+      return 1;
+    }
+
+  gettimeofday (&start, NULL);
+  for (i = 0; i < count; i++)
+    icmpd_ping (conn, BENCH_HOST, i, 56, PRIORITY_INTERACTIVE);
+
+  while (icmpd_unsent (conn) > 0)
+    {
+      struct pollfd pfd;
+
+      pfd.fd = icmpd_fd (conn);
+      pfd.events = POLLIN | (icmpd_want_write (conn) ? POLLOUT : 0);
+      poll (&pfd, pfd.fd == -1 ? 0 : 1, icmpd_timeout (conn));
+      if (icmpd_process (conn) < 0)
+	{
+	  fprintf (stderr, "lost icmpd\n");
+	  return 1;
+	}
+    }
+  printf ("pipelined: %d requests, %.0f requests/sec (%d replies so far)\n",
+	  count, count / elapsed (&start), acks);
+
+  icmpd_close (conn);
+  return 0;
+}
+
+struct restart_state
+{
+  int acks;
+  struct timeval last;
+  double max_gap;
+};
+
+static void restart_ack (struct icmpd_conn *conn, struct ping_ack *ack,
+			 void *arg)
+{
+  struct restart_state *st = arg;
+  double gap;
+
+  if (st->acks++ > 0)
+    {
+      gap = elapsed (&st->last) * 1e3;
+      if (gap > st->max_gap)
+	st->max_gap = gap;
+    }
+  gettimeofday (&st->last, NULL);
+}
+
+static int bench_restart (int count, char *server)
+{
+  struct icmpd_conn *conn;
+  struct restart_state st;
+  struct timeval start;
+  int reconnects = 0;
+  int sent = 0;
+  pid_t pid = -1;
+
+  memset (&st, 0, sizeof st);
+  conn = icmpd_open (SOCKET_FILE, restart_ack, &st);
+  if (conn == NULL || icmpd_fd (conn) == -1)
+    {
+      fprintf (stderr, "can't connect to icmpd\n");
+      return 1;
+    }
+
+  /* a msec apart, and then up to a second for the stragglers */
+
+  gettimeofday (&start, NULL);
+  while (st.acks < count && elapsed (&start) * 1e3 < count + 1000)
+    {
+      struct pollfd pfd;
+      int r;
+
+      while (sent < count && elapsed (&start) * 1e3 >= sent)
+	icmpd_ping (conn, BENCH_HOST, sent++, 56, PRIORITY_REALTIME);
+
+      if (sent == count / 2 && pid == -1)
+	{
+	  pid = fork ();
+	  if (pid == 0)
+	    {
+	      int null = open ("/dev/null", O_WRONLY);
+
+	      dup2 (null, 1);
+	      execl (server, server, "-r", (char *) NULL);
+	      perror (server);
+	      _exit (127);
+	    }
+	}
+
+      pfd.fd = icmpd_fd (conn);
+      pfd.events = POLLIN | (icmpd_want_write (conn) ? POLLOUT : 0);
+      poll (&pfd, pfd.fd == -1 ? 0 : 1, 1);
+      r = icmpd_process (conn);
+      if (r == ICMPD_FD_CHANGED)
+	reconnects++;
+      else if (r < 0)
+	{
+	  fprintf (stderr, "lost icmpd\n");
+	  return 1;
+	}
+    }
+
+  printf ("restart: %d pings, %d replies, %d reconnects, "
+	  "longest gap between replies %.1f msec\n",
+	  count, st.acks, reconnects, st.max_gap);
+  icmpd_close (conn);
+  return st.acks < count || reconnects > 0 || st.max_gap > RESTART_MAX_GAP;
+}
+
+static int compare_doubles (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void report_rtts (char *label, double *rtt, int n)
+     /* print the spread of a set of RTTs, in microseconds */
+{
+  double sum = 0, sumsq = 0, mean;
+  int i;
+
+  if (n == 0)
+    {
+      printf ("%s: no replies\n", label);
+      return;
+    }
+  for (i = 0; i < n; i++)
+    {
+      sum += rtt[i];
+      sumsq += rtt[i] * rtt[i];
+    }
+  mean = sum / n;
+  qsort (rtt, n, sizeof *rtt, compare_doubles);
+  printf ("%s: %d replies, mean %.1f usec, stddev %.1f, "
+	  "p50 %.1f, p99 %.1f, max %.1f\n", label, n, mean,
+	  sqrt (sumsq / n - mean * mean), rtt[n / 2],
+	  rtt[(int) (n * 0.99)], rtt[n - 1]);
+}
+
+static double ack_usec (struct ping_ack *ack)
+{
+  /* d_usec goes negative (and wraps) when the second rolls over */
+
+  return ack->d_sec * 1e6 + (int) ack->d_usec;
+}
+
+static int pmtu_run (int sock, int queries, int msec, double *rtt,
+		     int *n_rtt, int *wrong)
+     /* send queries PMTU queries as fast as the daemon takes them,
+	and a realtime ping every msec, until every query is answered
+	and at least msec have gone by
+      * rtt: filled in with the pings' RTTs, in usec
+      * wrong: set to the number of answers that weren't PMTU_MAX
+      * returns: the number of answers
+      */
+{
+  struct timeval start;
+  char buf[MAX_MSGLEN];
+  char info[MAX_MSGLEN];
+  int asked = 0, answered = 0, pings = 0;
+
+  *n_rtt = 0;
+  *wrong = 0;
+  gettimeofday (&start, NULL);
+  while (answered < queries || elapsed (&start) * 1e3 < msec)
+    {
+      struct pollfd pfd;
+      int msg;
+
+      if (elapsed (&start) * 1e3 > msec + 30000)
+	break;
+
+      if (elapsed (&start) * 1e3 >= pings)
+	{
+	  struct ping_req req;
+
+	  strlcpy (req.host, BENCH_HOST, MAX_HOST);
+	  req.id = 0;
+	  req.seq_no = pings++;
+	  req.size = 56;
+	  req.priority = PRIORITY_REALTIME;
+	  make_ping_req (info, &req);
+	  make_msg (buf, SEND_PING, info);
+	  send (sock, buf, MAX_MSGLEN, 0);
+	}
+
+      pfd.fd = sock;
+      pfd.events = POLLIN | (asked < queries ? POLLOUT : 0);
+      poll (&pfd, 1, 1);
+
+      if ((pfd.revents & POLLOUT) && asked < queries)
+	{
+	  struct pmtu_msg pm;
+
+	  snprintf (pm.host, MAX_HOST, "127.1.%d.%d",
+		    asked / 250, asked % 250 + 1);
+	  pm.mtu = 0;
+	  make_pmtu_msg (info, &pm);
+	  make_msg (buf, PMTU_QUERY, info);
+	  send (sock, buf, MAX_MSGLEN, 0);
+	  asked++;
+	}
+
+      if (!(pfd.revents & POLLIN))
+	continue;
+      if (recv (sock, buf, MAX_MSGLEN, MSG_WAITALL) <= 0)
+	break;
+      parse_msg (buf, &msg, info);
+      if (msg == PMTU_RESULT)
+	{
+	  struct pmtu_msg pm;
+
+	  parse_pmtu_msg (info, &pm);
+	  answered++;
+	  if (pm.mtu != PMTU_MAX)
+	    (*wrong)++;
+	}
+      else if (msg == PING_RECD && *n_rtt < PMTU_BENCH_PINGS)
+	{
+	  struct ping_ack ack;
+
+	  parse_ping_ack (info, &ack);
+	  rtt[(*n_rtt)++] = ack_usec (&ack);
+	}
+    }
+  return answered;
+}
+
+static int bench_pmtu (int count)
+{
+  struct timeval start;
+  double *rtt;
+  double secs;
+  int sock, n_rtt, wrong, answered;
+
+  sock = bench_connect ();
+  rtt = malloc (PMTU_BENCH_PINGS * sizeof *rtt);
+  if (sock == -1 || rtt == NULL)
+    return 1;
+
+  pmtu_run (sock, 0, 1000, rtt, &n_rtt, &wrong);
+  report_rtts ("pings alone", rtt, n_rtt);
+
+  gettimeofday (&start, NULL);
+  answered = pmtu_run (sock, count, 0, rtt, &n_rtt, &wrong);
+  secs = elapsed (&start);
+  report_rtts ("pings during discovery", rtt, n_rtt);
+  printf ("pmtu: %d of %d targets in %.0f msec, %d not %d\n",
+	  answered, count, secs * 1e3, wrong, PMTU_MAX);
+
+  close (sock);
+  free (rtt);
+  return answered < count || wrong > 0;
+}
+
+static int bench_jitter (int count, int cpu)
+{
+  unsigned int sock;
+  double *rtt;
+  int id = getpid () & 0xffff;
+  int i, n, fd;
+
+  rtt = malloc (count * sizeof *rtt);
+
+  /* measured from a select loop, the way the daemon does by default */
+
+  sock = init_ping ();
+  for (i = n = 0; i < count; i++)
+    {
+      struct ping_ack ack;
+      struct sockaddr_in from;
+      unsigned int fromlen;
+      char packet[MAX_PACKET];
+      fd_set fds;
+      struct timeval timeout;
+      int cc;
+
+      usleep (JITTER_GAP_USEC);
+      send_ping (sock, BENCH_HOST, id, i, 56);
+      for (;;)
+	{
+	  FD_ZERO (&fds);
+	  FD_SET (sock, &fds);
+	  timeout.tv_sec = 1;
+	  timeout.tv_usec = 0;
+	  if (select (sock + 1, &fds, NULL, NULL, &timeout) <= 0)
+	    break;
+	  fromlen = sizeof from;
+	  cc = recvfrom (sock, packet, MAX_PACKET, 0,
+			 (struct sockaddr *)&from, &fromlen);
+	  if (cc > 0 && parse_ping (&from, packet, cc, &ack)
+	      && ack.id == id && ack.seq_no == (i & 0xffff))
+	    {
+	      rtt[n++] = ack_usec (&ack);
+	      break;
+	    }
+	}
+    }
+  close (sock);
+  report_rtts ("select loop  ", rtt, n);
+
+  /* measured by the pinned, busy-polling thread */
+
+  sock = init_ping ();
+  fd = measure_start (sock, cpu);
+  if (fd == -1)
+    return 1;
+  for (i = n = 0; i < count; i++)
+    {
+      struct ping_ack acks[16];
+      fd_set fds;
+      struct timeval timeout;
+      int got = 0, k, m;
+
+      usleep (JITTER_GAP_USEC);
+      send_ping (sock, BENCH_HOST, id, i, 56);
+      while (!got)
+	{
+	  FD_ZERO (&fds);
+	  FD_SET (fd, &fds);
+	  timeout.tv_sec = 1;
+	  timeout.tv_usec = 0;
+	  if (select (fd + 1, &fds, NULL, NULL, &timeout) <= 0)
+	    break;
+	  while ((m = measure_drain (acks, 16)) > 0)
+	    for (k = 0; k < m; k++)
+	      if (acks[k].id == id && acks[k].seq_no == (i & 0xffff))
+		{
+		  rtt[n++] = ack_usec (&acks[k]);
+		  got = 1;
+		}
+	}
+    }
+  report_rtts ("busy polling ", rtt, n);
+
+  free (rtt);
+  return 0;
+}
+
+static unsigned int *make_targets (struct target_table *t,
+				   unsigned int count)
+     /* register count synthetic targets
+      * returns: their addresses, or NULL if we're out of memory
+      */
+{
+  struct timeval start;
+  unsigned int *addrs;
+  unsigned int i;
+  double secs;
+  char name[MAX_HOST];
+
+  addrs = malloc (count * sizeof *addrs);
+  if (addrs == NULL || !targets_init (t, 0))
+    return NULL;
+
+  /* 10.0.0.0/8 in a scattered order, so the indexes can't lean on
+     sequential addresses */
+
+  gettimeofday (&start, NULL);
+  for (i = 0; i < count; i++)
+    {
+      unsigned int a = 0x0a000000 | ((i * 2654435761u) & 0xffffff);
+
+      snprintf (name, MAX_HOST, "%u.%u.%u.%u", a >> 24, (a >> 16) & 0xff,
+		(a >> 8) & 0xff, a & 0xff);
+      addrs[i] = htonl (a);
+      if (target_by_name (t, name) == TARGET_NONE
+	  && target_add (t, name, addrs[i]) == TARGET_NONE)
+	{
+	  fprintf (stderr, "out of memory at %u targets\n", i);
+	  free (addrs);
+	  return NULL;
+	}
+    }
+  secs = elapsed (&start);
+  printf ("registered %u targets in %.2f sec (%.0f ns each)\n",
+	  t->count, secs, secs * 1e9 / count);
+  return addrs;
+}
+
+static int check_budget (struct target_table *t)
+     /* returns: 0 if the registry is within TARGET_BYTES_BUDGET */
+{
+  unsigned long bytes = targets_bytes (t);
+
+  printf ("memory: %lu bytes, %.1f bytes/target (budget %d): %s\n",
+	  bytes, (double) bytes / t->count, TARGET_BYTES_BUDGET,
+	  bytes <= (unsigned long) TARGET_BYTES_BUDGET * t->count
+	  ? "ok" : "OVER BUDGET");
+  return bytes > (unsigned long) TARGET_BYTES_BUDGET * t->count;
+}
+
+static int targets_run (unsigned int count)
+     /* returns: 0 if every lookup found its target and the registry
+      *   was within budget */
+{
+  struct target_table t;
+  struct timeval start;
+  unsigned int *addrs;
+  unsigned int i, found = 0;
+  double secs;
+  int over;
+
+  addrs = make_targets (&t, count);
+  if (addrs == NULL)
+    return 1;
+
+  /* what the reply path does: address to id, then fold in the RTT */
+
+  gettimeofday (&start, NULL);
+  for (i = 0; i < count; i++)
+    {
+      unsigned int id = target_by_addr (&t, addrs[(i * 7919) % count]);
+
+      if (id != TARGET_NONE)
+	{
+	  target_reply (&t, id, 100 + (i & 63));
+	  found++;
+	}
+    }
+  secs = elapsed (&start);
+  printf ("reply path: %u lookups, %.1f ns each\n",
+	  found, secs * 1e9 / count);
+
+  over = check_budget (&t);
+  targets_free (&t);
+  free (addrs);
+  return found != count || over;
+}
+
+static int bench_targets (unsigned int count)
+     /* count: how many targets, or 0 for each of TARGET_BENCH_SIZES */
+{
+  static const unsigned int sizes[] = TARGET_BENCH_SIZES;
+  unsigned int i;
+  int failed = 0;
+
+  if (count)
+    return targets_run (count);
+  for (i = 0; i < sizeof sizes / sizeof *sizes; i++)
+    {
+      printf ("%s%u targets:\n", i ? "\n" : "", sizes[i]);
+      failed |= targets_run (sizes[i]);
+    }
+  return failed;
+}
+
+static float bench_rtt (unsigned int i)
+     /* a made-up RTT in usec: mostly 100-1100, with a tail */
+{
+  unsigned int h = i * 2654435761u;
+
+  return 100 + (h >> 8) % 1000 + ((h & 0xff) == 0 ? (h >> 12) % 50000 : 0);
+}
+
+static int bench_topk (unsigned int count)
+{
+  struct target_table t;
+  struct topk *k;
+  struct top_query query;
+  struct top_entry entries[TOP_MAX];
+  struct timeval start;
+  unsigned int *addrs;
+  unsigned int i, j, rounds = 4;
+  double plain = 0, touched = 0, flushed = 0;
+  int over, m;
+
+  addrs = make_targets (&t, count);
+  k = malloc (sizeof *k);
+  if (addrs == NULL || k == NULL)
+    return 1;
+  topk_init (k);
+
+  /* the reply path as it was: lookup and update.  once to warm up,
+     then timed */
+
+  for (i = 0; i < count; i++)
+    target_reply (&t, target_by_addr (&t, addrs[(i * 7919) % count]),
+		  bench_rtt (i));
+  gettimeofday (&start, NULL);
+  for (i = 0; i < count; i++)
+    target_reply (&t, target_by_addr (&t, addrs[(i * 7919) % count]),
+		  bench_rtt (i));
+  plain = elapsed (&start);
+
+  /* the reply path now, which also marks the target dirty, and the
+     flush the main loop does after each batch.  every 50th probe
+     times out instead */
+
+  for (j = 0; j < rounds; j++)
+    for (i = 0; i < count; i += TOPK_DIRTY_MAX)
+      {
+	unsigned int b, end = i + TOPK_DIRTY_MAX < count
+	  ? i + TOPK_DIRTY_MAX : count;
+
+	gettimeofday (&start, NULL);
+	for (b = i; b < end; b++)
+	  {
+	    unsigned int id = target_by_addr (&t, addrs[(b * 7919) % count]);
+
+	    if ((b + j) % 50 == 0)
+	      target_lost (&t, id);
+	    else
+	      target_reply (&t, id, bench_rtt (b + j * count));
+	    topk_touch (k, &t, id);
+	  }
+	touched += elapsed (&start);
+
+	gettimeofday (&start, NULL);
+	topk_flush (k, &t);
+	flushed += elapsed (&start);
+      }
+
+  printf ("reply path: %.1f ns without rankings, %.1f ns marking dirty\n",
+	  plain * 1e9 / count, touched * 1e9 / (rounds * count));
+  printf ("deferred update: %.1f ns per target, all %d rankings\n",
+	  flushed * 1e9 / (rounds * count), TOP_METRICS);
+
+  for (m = 0; m < TOP_METRICS; m++)
+    {
+      int n;
+
+      query.metric = m;
+      query.count = 50;
+      gettimeofday (&start, NULL);
+      n = topk_query (k, &t, &query, entries);
+      printf ("top %d by %s in %.1f usec: worst %s at %u\n", n,
+	      m == TOP_RTT ? "rtt" : m == TOP_P99 ? "p99" : "loss",
+	      elapsed (&start) * 1e6, n > 0 ? entries[0].host : "-",
+	      n > 0 ? entries[0].value : 0);
+    }
+
+  over = check_budget (&t);
+  targets_free (&t);
+  free (addrs);
+  free (k);
+  return over;
+}
+
+static int sched_run (int ticks, int rt_class, double *wait, int *n_wait)
+     /* one simulated run: client 0 sends realtime probes in rt_class,
+	the other clients keep their bulk queues full, and every probe
+	comes back SCHED_BENCH_RTT msec after it goes out
+      * wait: filled in with each realtime probe's wait, in msec
+      * returns: the number of probes sent
+      */
+{
+  struct scheduler *s;
+  struct probe out[64];
+  struct probe *flight;
+  unsigned int seq[MAX_CLIENTS];
+  unsigned int f_head = 0, f_count = 0;
+  struct timeval start;
+  int sent = 0;
+  long t;
+  int c, k, n;
+
+  s = malloc (sizeof *s);
+  flight = malloc (SCHED_INFLIGHT * sizeof *flight);
+  if (s == NULL || flight == NULL)
+    {
+      fprintf (stderr, "out of memory\n");
+      exit (1);
+    }
+  sched_init (s);
+  memset (seq, 0, sizeof seq);
+  *n_wait = 0;
+
+  gettimeofday (&start, NULL);
+  for (t = 1; t <= ticks; t++)
+    {
+      struct probe p;
+
+      /* replies; every probe takes the same time, so they come back
+	 in the order they went out */
+
+      while (f_count > 0
+	     && flight[f_head].queued + SCHED_BENCH_RTT <= t)
+	{
+	  sched_reply (s, flight[f_head].client, flight[f_head].seq,
+		       flight[f_head].target, &p);
+	  f_head = (f_head + 1) % SCHED_INFLIGHT;
+	  f_count--;
+	}
+
+      memset (&p, 0, sizeof p);
+      p.size = 56;
+      p.queued = t;
+      for (c = 1; c < MAX_CLIENTS; c++)
+	{
+	  p.client = c;
+	  p.class = SCHED_BULK;
+	  do
+	    p.seq = seq[c]++;
+	  while (sched_enqueue (s, &p));
+	  seq[c]--;
+	}
+      if (t % SCHED_BENCH_GAP == 0)
+	{
+	  p.client = 0;
+	  p.class = rt_class;
+	  p.seq = seq[0]++;
+	  sched_enqueue (s, &p);
+	}
+
+      sched_expire (s, t, out, 64);
+      do
+	{
+	  n = sched_dispatch (s, t, out, 64);
+	  for (k = 0; k < n; k++)
+	    {
+	      if (out[k].client == 0)
+		wait[(*n_wait)++] = t - out[k].queued;
+	      out[k].queued = t;
+	      flight[(f_head + f_count) % SCHED_INFLIGHT] = out[k];
+	      f_count++;
+	    }
+	  sent += n;
+	}
+      while (n == 64);
+    }
+
+  printf ("  %d probes in %.1f simulated sec, %.0f ns of scheduling "
+	  "each\n", sent, ticks / 1000.0,
+	  elapsed (&start) * 1e9 / (sent ? sent : 1));
+  free (flight);
+  free (s);
+  return sent;
+}
+
+static double sched_report (char *label, double *wait, int n)
+     /* returns: the p99 wait */
+{
+  double p99;
+
+  if (n == 0)
+    {
+      printf ("%s: no realtime probes went out\n", label);
+      return 1e9;
+    }
+  qsort (wait, n, sizeof *wait, compare_doubles);
+  p99 = wait[(int) (n * 0.99)];
+  printf ("%s: %d realtime probes, wait p50 %.0f msec, p99 %.0f, "
+	  "max %.0f\n", label, n, wait[n / 2], p99, wait[n - 1]);
+  return p99;
+}
+
+static int bench_sched (int seconds)
+{
+  int ticks = seconds * 1000;
+  double *wait;
+  double p99;
+  int n;
+
+  wait = malloc ((ticks / SCHED_BENCH_GAP + 1) * sizeof *wait);
+  if (wait == NULL)
+    return 1;
+
+  printf ("one class for everything:\n");
+  sched_run (ticks, SCHED_BULK, wait, &n);
+  sched_report ("  bulk", wait, n);
+
+  printf ("realtime class:\n");
+  sched_run (ticks, SCHED_REALTIME, wait, &n);
+  p99 = sched_report ("  realtime", wait, n);
+
+  free (wait);
+  return p99 > SCHED_BENCH_MAX_WAIT;
+}
+
+static char *bench_alerts[] =
+{
+  "loss * 100 + p99 / 2 > 50",
+  "max(rtt, \"last rtt\") > 2 * 0.25 + 0.5",
+  "received / sent < 0.99",
+  "int(last rtt / 10) >= 1",
+  NULL
+};
+
+/* as deep as an expression can go: EXPR_STACK values at once */
+
+#define DEEPEST_ALERT "max(rtt, rtt, rtt, rtt, rtt, rtt, rtt, rtt, rtt, " \
+  "rtt, rtt, rtt, rtt, rtt, rtt, sent) > 0"
+
+static int bench_alert (unsigned int count)
+{
+  struct target_table t;
+  struct alerts *al;
+  struct alert_crossing crossed[ALERT_MAX];
+  struct timeval start;
+  unsigned int *addrs;
+  unsigned int i, id, rounds = 10, raised = 0, cleared = 0;
+  double vars[ALERT_VARS], value, plain, checked, single;
+  char *error;
+  int at, n, k, holds = 0, n_alerts, deep;
+
+  al = malloc (sizeof *al);
+  addrs = make_targets (&t, count);
+  if (al == NULL || addrs == NULL)
+    return 1;
+  alerts_init (al);
+
+  gettimeofday (&start, NULL);
+  for (n_alerts = 0; bench_alerts[n_alerts]; n_alerts++)
+    if (alert_add (al, 0, bench_alerts[n_alerts], &error, &at) < 0)
+      {
+	fprintf (stderr, "%s: %s at %d\n", bench_alerts[n_alerts], error,
+		 at);
+	return 1;
+      }
+  printf ("compiled %d alerts in %.1f usec\n", n_alerts,
+	  elapsed (&start) * 1e6);
+
+  /* the deepest the compiler allows has to run within the machine's
+     stack */
+
+  deep = alert_add (al, 0, DEEPEST_ALERT, &error, &at);
+  if (deep < 0)
+    {
+      fprintf (stderr, "%s: %s at %d\n", DEEPEST_ALERT, error, at);
+      return 1;
+    }
+  memset (vars, 0, sizeof vars);
+  vars[ALERT_RTT] = 5;
+  vars[ALERT_SENT] = 1000;
+  if (!expr_test (&al->a[deep].expr, vars, &value) || value != 1000)
+    {
+      fprintf (stderr, "%s came to %g, not 1000\n", DEEPEST_ALERT, value);
+      return 1;
+    }
+  alert_remove (al, 0, deep);
+
+  /* one test on its own, with the variables already gathered */
+
+  memset (vars, 0, sizeof vars);
+  gettimeofday (&start, NULL);
+  for (i = 0; i < rounds * count; i++)
+    {
+      vars[ALERT_LOSS] = (i & 1023) / 1024.0;
+      vars[ALERT_P99] = i & 127;
+      holds += expr_test (&al->a[0].expr, vars, &value);
+    }
+  single = elapsed (&start) * 1e9 / (rounds * count);
+  printf ("one test: %.1f ns (held %d times)\n", single, holds);
+
+  /* the reply path, first as it was, then checking every alert */
+
+  gettimeofday (&start, NULL);
+  for (i = 0; i < rounds * count; i++)
+    {
+      id = target_by_addr (&t, addrs[(i * 7919) % count]);
+      target_reply (&t, id, bench_rtt (i));
+    }
+  plain = elapsed (&start);
+
+  gettimeofday (&start, NULL);
+  for (i = 0; i < rounds * count; i++)
+    {
+      id = target_by_addr (&t, addrs[(i * 7919) % count]);
+      target_reply (&t, id, bench_rtt (i));
+      n = alerts_check (al, &t, id, bench_rtt (i), crossed);
+      for (k = 0; k < n; k++)
+	if (crossed[k].raised)
+	  raised++;
+	else
+	  cleared++;
+    }
+  checked = elapsed (&start);
+
+  printf ("reply path: %.1f ns, %.1f ns checking %d alerts "
+	  "(%.1f ns each)\n", plain * 1e9 / (rounds * count),
+	  checked * 1e9 / (rounds * count), n_alerts,
+	  (checked - plain) * 1e9 / (rounds * count) / n_alerts);
+  printf ("crossings: %u raised, %u cleared, over %u replies\n",
+	  raised, cleared, rounds * count);
+
+  targets_free (&t);
+  free (addrs);
+  free (al->raised);
+  free (al);
+  return single > ALERT_BENCH_MAX_NSEC;
+}
+
+struct capture_event
+{
+  long usec;
+  unsigned int target;
+  unsigned short seq;
+  unsigned char pinger;
+  unsigned char reply;
+};
+
+/* the responder stand-in for ping-bench adapt.  every target answers
+   with an RTT of its own, 1-100 msec, give or take ADAPT_BENCH_JITTER
+   of it; one in ADAPT_BENCH_FLAPPY is far jumpier than that.  one in
+   ADAPT_BENCH_ONE_IN has an incident at some point, lasting
+   ADAPT_BENCH_INCIDENT msec: its RTT goes up by half and 5 msec more,
+   or it stops answering.  what a probe gets back depends only on the
+   target and when it was sent, so every run sees the same network */
+
+static unsigned int bench_hash (unsigned int a, unsigned int b)
+{
+  unsigned int h = a * 2654435761u ^ (b + 0x9e3779b9u + (a << 6)
+				      + (a >> 2));
+
+  h ^= h >> 16;
+  h *= 0x45d9f3b;
+  h ^= h >> 16;
+  return h;
+}
+
+static long incident_onset (unsigned int id, int seconds)
+     /* returns: when the target's incident starts, msec, or 0 if it
+	doesn't have one */
+{
+  unsigned int h = bench_hash (id, 0);
+  long room = seconds * 1000L - ADAPT_BENCH_INCIDENT
+    - ADAPT_BENCH_WARMUP;
+
+  if (h % ADAPT_BENCH_ONE_IN != 0 || room <= 0)
+    return 0;
+  return ADAPT_BENCH_WARMUP + (long) (bench_hash (id, 1) % room);
+}
+
+static int respond (unsigned int id, long sent, int seconds, float *rtt)
+     /* returns: 1 and the RTT in usec if the probe is answered */
+{
+  unsigned int h = bench_hash (id, 2);
+  float base = 1000 + h % 99000;
+  float jitter = base * (h % ADAPT_BENCH_FLAPPY ? ADAPT_BENCH_JITTER
+			 : ADAPT_BENCH_FLAPPY_JITTER);
+  long onset = incident_onset (id, seconds);
+  unsigned int n = bench_hash (id, sent);
+  float noise;
+
+  if (n % 1000 < ADAPT_BENCH_LOSS)
+    return 0;
+  if (onset && sent >= onset && sent < onset + ADAPT_BENCH_INCIDENT)
+    {
+      if (h & 0x100)
+	return 0;
+      base = base * 1.5f + 5000;
+    }
+
+  /* the sum of three uniforms is near enough normal */
+
+  noise = (n >> 10 & 0x3ff) + (n >> 20 & 0x3ff)
+    + (bench_hash (n, id) & 0x3ff);
+  *rtt = base + jitter * (noise / 1536 - 1) * 1.7f;
+  if (*rtt < 100)
+    *rtt = 100;
+  return 1;
+}
+
+struct bench_reply
+{
+  long when;                 /* msec */
+  unsigned int id;
+  float rtt;                 /* usec, or -1 for a timeout */
+};
+
+struct adapt_run
+{
+  unsigned long probes;
+  unsigned long busiest;     /* the most probes in any one second */
+  unsigned int incidents, caught, false_alarms;
+  double *latency;           /* msec, for each incident caught */
+  double p50, p90, worst;    /* of latency, msec; from adapt_report */
+};
+
+static void reply_push (struct bench_reply **heap, unsigned long *n,
+			unsigned long *cap, struct bench_reply *r)
+     /* a min-heap of replies on their way back, by when they arrive */
+{
+  unsigned long i, parent;
+
+  if (*n == *cap)
+    {
+      *cap = *cap ? *cap * 2 : 4096;
+      *heap = realloc (*heap, *cap * sizeof **heap);
+      if (*heap == NULL)
+	{
+	  fprintf (stderr, "out of memory\n");
+	  exit (1);
+	}
+    }
+  for (i = (*n)++; i > 0; i = parent)
+    {
+      parent = (i - 1) / 2;
+      if ((*heap)[parent].when <= r->when)
+	break;
+      (*heap)[i] = (*heap)[parent];
+    }
+  (*heap)[i] = *r;
+}
+
+static void reply_pop (struct bench_reply *heap, unsigned long *n)
+{
+  struct bench_reply last = heap[--*n];
+  unsigned long i = 0, child;
+
+  while ((child = 2 * i + 1) < *n)
+    {
+      if (child + 1 < *n && heap[child + 1].when < heap[child].when)
+	child++;
+      if (heap[child].when >= last.when)
+	break;
+      heap[i] = heap[child];
+      i = child;
+    }
+  heap[i] = last;
+}
+
+static int adapt_run (unsigned int count, int seconds,
+		      unsigned int interval, double budget,
+		      struct adapt_run *run)
+     /* one simulated run: count targets watched every interval msec,
+	adapting within budget probes a second if that's not 0, with
+	the daemon's loop coming round every WHEEL_TICK_MSEC
+      * returns: 1 on success, 0 if we're out of memory
+      */
+{
+  struct target_table t;
+  struct adapt a;
+  struct bench_reply *heap = NULL;
+  unsigned long n_heap = 0, cap_heap = 0, this_second = 0;
+  unsigned long this_tick[1000 / WHEEL_TICK_MSEC];
+  unsigned int ids[ADAPT_BENCH_BATCH];
+  unsigned char *caught;
+  unsigned int *addrs;
+  unsigned int id, n, k, wait;
+  long now, end = seconds * 1000L, onset;
+  int what;
+
+  addrs = make_targets (&t, count);
+  caught = calloc (count, 1);
+  run->latency = malloc (count * sizeof *run->latency);
+  if (addrs == NULL || caught == NULL || run->latency == NULL)
+    return 0;
+  adapt_init (&a, budget, SCHED_TIMEOUT_MSEC);
+  run->probes = run->busiest = 0;
+  run->incidents = run->caught = run->false_alarms = 0;
+  memset (this_tick, 0, sizeof this_tick);
+
+  for (id = 0; id < t.count; id++)
+    {
+      if (!adapt_watch (&a, &t, id, interval))
+	return 0;
+      t.info[id].interval = interval;
+      if (incident_onset (id, seconds))
+	run->incidents++;
+    }
+
+  /* the watches start spread over an interval, as they would when
+     they'd been running a while */
+
+  for (id = 0; id < t.count; id++)
+    target_schedule (&t, id, WHEEL_TICK_MSEC + id
+		     * adapt_interval (&a, &t, id) / t.count);
+
+  for (now = WHEEL_TICK_MSEC; now <= end; now += WHEEL_TICK_MSEC)
+    {
+      unsigned long *tick = &this_tick[now / WHEEL_TICK_MSEC
+				       % (1000 / WHEEL_TICK_MSEC)];
+
+      /* the second so far is the last one less the tick that's
+	 just dropped out of it */
+
+      this_second -= *tick;
+      *tick = 0;
+
+      /* replies and timeouts due by now, the way deliver_ack and
+	 run_scheduler see them */
+
+      while (n_heap > 0 && heap[0].when <= now)
+	{
+	  struct bench_reply r = heap[0];
+
+	  reply_pop (heap, &n_heap);
+	  if (r.rtt < 0)
+	    {
+	      target_lost (&t, r.id);
+	      what = adapt_lost (&a, &t, r.id);
+	    }
+	  else
+	    {
+	      target_reply (&t, r.id, r.rtt);
+	      what = adapt_reply (&a, &t, r.id, r.rtt);
+	    }
+	  if (budget > 0 && what & ADAPT_FASTER)
+	    target_hurry (&t, r.id, now);
+
+	  /* a change counts for an incident from its start until a
+	     little after it's over, when the target changes back */
+
+	  if (what & ADAPT_CHANGED)
+	    {
+	      onset = incident_onset (r.id, seconds);
+	      if (onset && now >= onset
+		  && now < onset + ADAPT_BENCH_INCIDENT
+			   + ADAPT_BENCH_GRACE)
+		{
+		  if (!caught[r.id])
+		    {
+		      caught[r.id] = 1;
+		      run->latency[run->caught++] = now - onset;
+		    }
+		}
+	      else
+		run->false_alarms++;
+	    }
+	}
+
+      /* probes due by now, the way send_due does them */
+
+      do
+	{
+	  n = targets_due (&t, now, ids, ADAPT_BENCH_BATCH);
+	  for (k = 0; k < n; k++)
+	    {
+	      struct bench_reply r;
+
+	      id = ids[k];
+	      if (!adapt_admit (&a, now))
+		{
+		  target_schedule (&t, id, now + WHEEL_TICK_MSEC);
+		  continue;
+		}
+	      /* a reply later than the probe's timeout finds it given
+		 up on, the way sched_expire would have */
+
+	      r.id = id;
+	      wait = adapt_timeout (&a, id);
+	      if (respond (id, now, seconds, &r.rtt)
+		  && (long) (r.rtt / 1000) + 1 < (long) wait)
+		r.when = now + (long) (r.rtt / 1000) + 1;
+	      else
+		{
+		  r.rtt = -1;
+		  r.when = now + wait;
+		}
+	      reply_push (&heap, &n_heap, &cap_heap, &r);
+	      target_sent (&t, id);
+	      target_schedule (&t, id, now + adapt_interval (&a, &t, id));
+	      run->probes++;
+	      this_second++;
+	      (*tick)++;
+	    }
+	}
+      while (n == ADAPT_BENCH_BATCH);
+
+      if (this_second > run->busiest)
+	run->busiest = this_second;
+    }
+
+  free (heap);
+  free (caught);
+  free (addrs);
+  adapt_free (&a);
+  targets_free (&t);
+  return 1;
+}
+
+static void adapt_report (char *label, struct adapt_run *run,
+			  int seconds)
+     /* print a run's figures, and fill in how soon it caught
+	incidents */
+{
+  run->p50 = run->p90 = run->worst = 0;
+  printf ("%s: %lu probes, %.0f a second on average, %lu at most\n",
+	  label, run->probes, run->probes / (double) seconds,
+	  run->busiest);
+  if (run->caught > 0)
+    {
+      qsort (run->latency, run->caught, sizeof (double), compare_doubles);
+      run->p50 = run->latency[run->caught / 2];
+      run->p90 = run->latency[run->caught * 9 / 10];
+      run->worst = run->latency[run->caught - 1];
+      printf ("  caught %u of %u incidents, after p50 %.0f msec, "
+	      "p90 %.0f, max %.0f; %u false alarms\n",
+	      run->caught, run->incidents, run->p50, run->p90, run->worst,
+	      run->false_alarms);
+    }
+  else
+    printf ("  caught none of %u incidents; %u false alarms\n",
+	    run->incidents, run->false_alarms);
+  free (run->latency);
+}
+
+static int bench_adapt (unsigned int count, int seconds)
+{
+  struct adapt_run fixed, adaptive, squeezed, same;
+  double budget = count * 1000.0 / ADAPT_BENCH_INTERVAL;
+  unsigned int same_interval;
+  int fail;
+
+  if (seconds * 1000L < 2 * (ADAPT_BENCH_INCIDENT + ADAPT_BENCH_WARMUP))
+    {
+      fprintf (stderr, "ping-bench adapt needs at least %d seconds\n",
+	       2 * (ADAPT_BENCH_INCIDENT + ADAPT_BENCH_WARMUP) / 1000);
+      return 2;
+    }
+
+  printf ("%u targets watched every %d msec for %d simulated seconds\n\n",
+	  count, ADAPT_BENCH_INTERVAL, seconds);
+  if (!adapt_run (count, seconds, ADAPT_BENCH_INTERVAL, 0, &fixed))
+    return 1;
+  adapt_report ("fixed intervals", &fixed, seconds);
+
+  if (!adapt_run (count, seconds, ADAPT_BENCH_INTERVAL, budget, &adaptive))
+    return 1;
+  printf ("\n");
+  adapt_report ("adaptive, within the same budget", &adaptive, seconds);
+
+  /* with less than the watches ask for even at their own
+     intervals, the budget has to hold all the same */
+
+  if (!adapt_run (count, seconds, ADAPT_BENCH_INTERVAL,
+		  budget / ADAPT_BENCH_SQUEEZE, &squeezed))
+    return 1;
+  printf ("\n");
+  adapt_report ("adaptive, within a quarter of the budget", &squeezed,
+		seconds);
+
+  /* and what the adaptive run's probes buy at fixed intervals */
+
+  same_interval = (double) ADAPT_BENCH_INTERVAL * fixed.probes
+    / (adaptive.probes ? adaptive.probes : 1) + 0.5;
+  if (!adapt_run (count, seconds, same_interval, 0, &same))
+    return 1;
+  printf ("\n");
+  printf ("fixed intervals of %u msec, for as many probes:\n",
+	  same_interval);
+  adapt_report ("  fixed", &same, seconds);
+
+  printf ("\nadaptive: %.1fx fewer probes, incidents caught %.2fx as "
+	  "fast as fixed intervals\n",
+	  (double) fixed.probes / (adaptive.probes ? adaptive.probes : 1),
+	  adaptive.p50 > 0 ? fixed.p50 / adaptive.p50 : 0);
+
+  /* adapting has to keep every second within the budget, and with
+     fewer probes catch everything probing every watch at its own
+     interval does, as soon or sooner: typically, at p90 and at
+     worst.  squeezed, it has to catch what it catches while the
+     incident is still going on */
+
+  fail = adaptive.busiest > budget
+    || squeezed.busiest > budget / ADAPT_BENCH_SQUEEZE
+    || adaptive.probes >= fixed.probes
+    || adaptive.caught < fixed.caught
+    || adaptive.p50 > fixed.p50 || adaptive.p90 > fixed.p90
+    || adaptive.worst > fixed.worst
+    || squeezed.worst >= ADAPT_BENCH_INCIDENT;
+  if (fail)
+    printf ("FAILED\n");
+  return fail;
+}
+
+static int compare_events (const void *a, const void *b)
+{
+  const struct capture_event *x = a, *y = b;
+
+  if (x->usec != y->usec)
+    return x->usec < y->usec ? -1 : 1;
+  return x->reply - y->reply;
+}
+
+static void write_event (FILE *out, struct capture_event *e)
+     /* one echo request or reply, over ethernet, as a pcap record */
+{
+  unsigned char frame[CAPTURE_FRAME];
+  unsigned int rec[4];
+  unsigned int target = htonl (0x0a010000 + e->target);
+  unsigned int pinger = htonl (CAPTURE_PINGER + e->pinger);
+  unsigned char *ip = frame + 14;
+  unsigned char *icmp = ip + 20;
+
+  memset (frame, 0, sizeof frame);
+  frame[12] = 0x08;             /* ethertype IPv4 */
+  ip[0] = 0x45;
+  ip[2] = (CAPTURE_FRAME - 14) >> 8;
+  ip[3] = (CAPTURE_FRAME - 14) & 0xff;
+  ip[8] = 64;
+  ip[9] = IPPROTO_ICMP;
+  memcpy (ip + 12, e->reply ? &target : &pinger, 4);
+  memcpy (ip + 16, e->reply ? &pinger : &target, 4);
+  icmp[0] = e->reply ? 0 : 8;   /* ICMP_ECHOREPLY, ICMP_ECHO */
+  icmp[4] = 0x12;               /* id */
+  icmp[5] = 0x34;
+  icmp[6] = e->seq >> 8;
+  icmp[7] = e->seq & 0xff;
+
+  rec[0] = e->usec / 1000000;
+  rec[1] = e->usec % 1000000;
+  rec[2] = rec[3] = CAPTURE_FRAME;
+  fwrite (rec, sizeof rec, 1, out);
+  fwrite (frame, sizeof frame, 1, out);
+}
+
+static int bench_capture (char *file, unsigned int targets, int seconds)
+{
+  struct capture_event *events;
+  unsigned int header[6];
+  unsigned int n = 0, i, k, state = 1;
+  unsigned long requests = 0, replies = 0;
+  long base = 1700000000L * 1000000, now;
+  FILE *out;
+  int s;
+
+  /* a second's requests and replies, plus replies carried over from
+     the second before */
+
+  events = malloc (3 * targets * sizeof *events);
+  out = fopen (file, "wb");
+  if (events == NULL || out == NULL)
+    {
+      perror (file);
+      return 1;
+    }
+
+  /* in this machine's byte order, which readers sort out */
+
+  header[0] = PCAP_MAGIC;
+  header[1] = 2 | 4 << 16;      /* version 2.4 */
+  header[2] = header[3] = 0;
+  header[4] = 65535;            /* snap length */
+  header[5] = LINKTYPE_ETHERNET;
+  fwrite (header, sizeof header, 1, out);
+
+  for (s = 0; s < seconds; s++)
+    {
+      for (i = 0; i < targets; i++)
+	{
+	  struct capture_event *e = &events[n++];
+
+	  state = state * 1103515245 + 12345;
+	  e->usec = base + s * 1000000L + (long) i * 1000000 / targets;
+	  e->target = i;
+	  e->seq = s;
+	  e->pinger = (i + s) % CAPTURE_PINGERS;
+	  e->reply = 0;
+	  requests++;
+	  if ((state >> 16) % 100 == 0)
+	    continue;
+
+	  events[n] = *e;
+	  events[n].usec += (long) bench_rtt (state);
+	  events[n].reply = 1;
+	  n++;
+	  replies++;
+	}
+
+      /* write out everything before the next second's requests, and
+	 keep the rest */
+
+      qsort (events, n, sizeof *events, compare_events);
+      now = base + (s + 1) * 1000000L;
+      for (i = 0; i < n && (events[i].usec < now || s == seconds - 1); i++)
+	write_event (out, &events[i]);
+      for (k = 0; i < n; i++, k++)
+	events[k] = events[i];
+      n = k;
+    }
+
+  free (events);
+  if (fclose (out) != 0)
+    {
+      perror (file);
+      return 1;
+    }
+  printf ("wrote %lu echo requests and %lu replies to %s: "
+	  "%lu should come out lost\n", requests, replies, file,
+	  requests - replies);
+  return 0;
+}
+
+static char *replay_output (char *replay, int threads, char *file)
+     /* run replay over file with threads workers
+      * returns: what it printed, its table and then its totals, but
+      *   not its timing line, in a buffer to free; NULL if it failed
+      */
+{
+  char command[1024];
+  char line[256];
+  char *out = NULL, *bigger;
+  unsigned long len = 0, cap = 0, n;
+  FILE *p;
+
+  snprintf (command, sizeof command, "%s -t %d %s 2>&1", replay, threads,
+	    file);
+  p = popen (command, "r");
+  if (p == NULL)
+    {
+      perror (replay);
+      return NULL;
+    }
+  while (fgets (line, sizeof line, p) != NULL)
+    {
+      if (strstr (line, " sec with ") != NULL)
+	continue;
+      n = strlen (line);
+      if (len + n + 1 > cap)
+	{
+	  cap = cap ? cap * 2 : 65536;
+	  bigger = realloc (out, cap);
+	  if (bigger == NULL)
+	    break;
+	  out = bigger;
+	}
+      memcpy (out + len, line, n + 1);
+      len += n;
+    }
+  if (pclose (p) != 0 || out == NULL)
+    {
+      fprintf (stderr, "%s -t %d failed\n", replay, threads);
+      free (out);
+      return NULL;
+    }
+  return out;
+}
+
+static int bench_replay (int threads, char *replay)
+{
+  char file[64];
+  char *one, *many, *a, *b;
+  unsigned int line = 1;
+  int fail;
+
+  snprintf (file, sizeof file, "/tmp/ping-bench.%d.pcap", (int) getpid ());
+  if (bench_capture (file, REPLAY_BENCH_TARGETS, REPLAY_BENCH_SECONDS))
+    return 1;
+  one = replay_output (replay, 1, file);
+  many = replay_output (replay, threads, file);
+  unlink (file);
+  if (one == NULL || many == NULL)
+    return 1;
+
+  /* find the first line where they part, if they do */
+
+  for (a = one, b = many; *a && *a == *b; a++, b++)
+    if (*a == '\n')
+      line++;
+  fail = *a != *b;
+  while (a > one && a[-1] != '\n')
+    a--, b--;
+
+  if (fail)
+    printf ("-t 1 and -t %d differ at line %u:\n  %.*s\n  %.*s\nFAILED\n",
+	    threads, line, (int) strcspn (a, "\n"), a,
+	    (int) strcspn (b, "\n"), b);
+  else
+    printf ("-t 1 and -t %d agree on all %u lines\n", threads, line - 1);
+  free (one);
+  free (many);
+  return fail;
+}
+
+/* heap allocations, counted by standing in for the C library's
+   malloc family.  glibc lets a program do that and still get at its
+   own; elsewhere they go uncounted, and ping-bench reply says so */
+
+static unsigned long allocations;
+
+#ifdef __GLIBC__
+#define COUNTS_ALLOCATIONS 1
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n, size_t size);
+extern void *__libc_realloc (void *p, size_t size);
+
+void *malloc (size_t size)
+{
+  allocations++;
+  return __libc_malloc (size);
+}
+
+void *calloc (size_t n, size_t size)
+{
+  allocations++;
+  return __libc_calloc (n, size);
+}
+
+void *realloc (void *p, size_t size)
+{
+  allocations++;
+  return __libc_realloc (p, size);
+}
+#endif
+
+static int open_counter (void)
+     /* returns: a counter of the instructions this thread runs in
+      *   user space, stopped, or -1 if the kernel won't give us one
+      */
+{
+#ifdef __linux__
+  struct perf_event_attr pe;
+
+  memset (&pe, 0, sizeof pe);
+  pe.type = PERF_TYPE_HARDWARE;
+  pe.size = sizeof pe;
+  pe.config = PERF_COUNT_HW_INSTRUCTIONS;
+  pe.disabled = 1;
+  pe.exclude_kernel = 1;
+  pe.exclude_hv = 1;
+  return syscall (__NR_perf_event_open, &pe, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+static void run_counter (int fd, int on)
+{
+#ifdef __linux__
+  if (fd != -1)
+    ioctl (fd, on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+#endif
+}
+
+static double read_counter (int fd)
+     /* returns: what the counter has counted, and starts it again
+      *   from 0
+      */
+{
+#ifdef __linux__
+  __u64 count;
+
+  if (fd == -1 || read (fd, &count, sizeof count) != sizeof count)
+    return 0;
+  ioctl (fd, PERF_EVENT_IOC_RESET, 0);
+  return count;
+#else
+  return 0;
+#endif
+}
+
+/* what ping-bench reply feeds the path: a batch's worth of echo
+   replies, as the raw socket hands them over, from different
+   targets, for the clients in turn */
+
+static char reply_packets[REPLY_BATCH][REPLY_BENCH_PACKET];
+static struct sockaddr_in reply_from[REPLY_BATCH];
+static struct reply_pool reply_pool;
+
+struct reply_run
+{
+  double usec;               /* in the path, all told */
+  double instructions;       /* the same, or 0 if they weren't counted */
+  unsigned long allocations;
+  unsigned long bytes;       /* what the clients got */
+};
+
+static void make_replies (void)
+{
+  struct timeval sent;
+  unsigned int k, src;
+  unsigned char *ip, *icmp;
+  unsigned short id, seq;
+
+  gettimeofday (&sent, NULL);
+  memset (reply_packets, 0, sizeof reply_packets);
+  for (k = 0; k < REPLY_BATCH; k++)
+    {
+      ip = (unsigned char *) reply_packets[k];
+      icmp = ip + 20;
+      src = htonl (0x0a010000 + k * 257);
+      ip[0] = 0x45;
+      ip[2] = REPLY_BENCH_PACKET >> 8;
+      ip[3] = REPLY_BENCH_PACKET & 0xff;
+      ip[8] = 64;
+      ip[9] = IPPROTO_ICMP;
+      memcpy (ip + 12, &src, 4);
+      icmp[0] = 0;              /* ICMP_ECHOREPLY */
+
+      /* id and sequence number as the daemon sends them, unswapped */
+
+      id = k % REPLY_BENCH_CLIENTS;
+      seq = k * 1000;
+      memcpy (icmp + 4, &id, 2);
+      memcpy (icmp + 6, &seq, 2);
+      memcpy (icmp + 8, &sent, sizeof sent);
+
+      memset (&reply_from[k], 0, sizeof reply_from[k]);
+      reply_from[k].sin_family = AF_INET;
+      reply_from[k].sin_addr.s_addr = src;
+    }
+}
+
+static void old_batch (int *socks)
+     /* a batch through the reply path as it was */
+{
+  char packet[MAX_PACKET];
+  char info[MAX_MSGLEN];
+  char buf[MAX_MSGLEN];
+  struct ping_ack ack;
+  int k;
+
+  for (k = 0; k < REPLY_BATCH; k++)
+    {
+      memcpy (packet, reply_packets[k], REPLY_BENCH_PACKET);
+      if (!parse_ping (&reply_from[k], packet, REPLY_BENCH_PACKET, &ack))
+	continue;
+      strlcpy (ack.host, inet_ntoa (reply_from[k].sin_addr), MAX_HOST);
+      make_ping_ack (info, &ack);
+      make_msg (buf, PING_RECD, info);
+      send (socks[ack.id], buf, MAX_MSGLEN, 0);
+    }
+}
+
+static void new_batch (int *socks)
+     /* a batch through the reply pool, the way the daemon does it */
+{
+  struct reply_pool *p = &reply_pool;
+  int k, n = 0;
+
+  for (k = 0; k < REPLY_BATCH; k++)
+    {
+      memcpy (p->packet, reply_packets[k], REPLY_BENCH_PACKET);
+      if (parse_ping (&reply_from[k], p->packet, REPLY_BENCH_PACKET,
+		      &p->acks[n]))
+	n++;
+    }
+  for (k = 0; k < n; k++)
+    if (reply_queue (p, &p->acks[k]))
+      {
+	reply_format (p, p->acks[k].id);
+	reply_send (p, p->acks[k].id, socks[p->acks[k].id]);
+      }
+  for (k = 0; k < REPLY_BENCH_CLIENTS; k++)
+    if (p->slot[k].n > 0)
+      {
+	reply_format (p, k);
+	reply_send (p, k, socks[k]);
+      }
+}
+
+static unsigned long drain_clients (int *socks, char *check)
+     /* read what the clients have been sent, and if check isn't NULL,
+	compare each client's first record with the text and binary
+	records there, a client's worth each
+      * returns: the bytes read
+      */
+{
+  char buf[REPLY_BATCH * MAX_MSGLEN];
+  unsigned long bytes = 0;
+  int c, cc, first;
+
+  for (c = 0; c < REPLY_BENCH_CLIENTS; c++)
+    for (first = 1;
+	 (cc = recv (socks[c], buf, sizeof buf, MSG_DONTWAIT)) > 0;
+	 first = 0)
+      {
+	if (check && first && cc >= MAX_MSGLEN
+	    && memcmp (buf, check + c * MAX_MSGLEN,
+		       c & 1 ? sizeof (struct ack_record)
+		       : strlen (buf) + 1) != 0)
+	  {
+	    fprintf (stderr, "client %d got %.20s\n", c, buf);
+	    return 0;
+	  }
+	bytes += cc;
+      }
+  return bytes;
+}
+
+static void reply_run (void (*batch) (int *), unsigned int count,
+		       int *ours, int *theirs, int counter,
+		       struct reply_run *run)
+{
+  struct timeval start;
+  unsigned long before;
+  unsigned int done;
+
+  memset (run, 0, sizeof *run);
+  for (done = 0; done < count; done += REPLY_BATCH)
+    {
+      before = allocations;
+      gettimeofday (&start, NULL);
+      run_counter (counter, 1);
+      batch (ours);
+      run_counter (counter, 0);
+      run->usec += elapsed (&start) * 1e6;
+      run->allocations += allocations - before;
+      run->bytes += drain_clients (theirs, NULL);
+    }
+  run->instructions = read_counter (counter);
+}
+
+static void reply_report (char *label, struct reply_run *run,
+			  unsigned int count)
+{
+  printf ("%s: %.0f ns a reply", label, run->usec * 1e3 / count);
+  if (run->instructions > 0)
+    printf (", %.0f instructions", run->instructions / count);
+  printf (", %lu heap allocations, %lu records sent\n",
+	  run->allocations, run->bytes / MAX_MSGLEN);
+}
+
+static int bench_reply (unsigned int count)
+{
+  int ours[REPLY_BENCH_CLIENTS], theirs[REPLY_BENCH_CLIENTS];
+  char expect[REPLY_BENCH_CLIENTS * MAX_MSGLEN];
+  char info[MAX_MSGLEN];
+  struct reply_run old, pool;
+  struct ping_ack ack;
+  int counter, c, pair[2];
+
+  count = (count + REPLY_BATCH - 1) / REPLY_BATCH * REPLY_BATCH;
+  make_replies ();
+  reply_init (&reply_pool);
+  for (c = 0; c < REPLY_BENCH_CLIENTS; c++)
+    {
+      if (socketpair (AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+	{
+	  perror ("socketpair");
+	  return 1;
+	}
+      ours[c] = pair[0];
+      theirs[c] = pair[1];
+      reply_binary (&reply_pool, c, c & 1);
+    }
+
+  /* what each client should have got first, from the first acks
+     of a batch: the odd ones binary, the even ones the same text as
+     ever */
+
+  new_batch (ours);
+  for (c = 0; c < REPLY_BENCH_CLIENTS; c++)
+    {
+      ack = reply_pool.acks[c];
+      if (c & 1)
+	make_ack_record (expect + c * MAX_MSGLEN, &ack);
+      else
+	{
+	  strlcpy (ack.host, inet_ntoa (reply_from[c].sin_addr), MAX_HOST);
+	  make_ping_ack (info, &ack);
+	  make_msg (expect + c * MAX_MSGLEN, PING_RECD, info);
+	}
+    }
+  if (drain_clients (theirs, expect) != REPLY_BATCH * MAX_MSGLEN)
+    {
+      printf ("FAILED: the pool's records aren't the old path's\n");
+      return 1;
+    }
+
+  counter = open_counter ();
+  printf ("%u replies in batches of %d, to %d clients, %d of them "
+	  "binary\n", count, REPLY_BATCH, REPLY_BENCH_CLIENTS,
+	  REPLY_BENCH_CLIENTS / 2);
+  if (counter == -1)
+    printf ("(instructions not counted: no perf events here)\n");
+#ifndef COUNTS_ALLOCATIONS
+  printf ("(heap allocations not counted on this platform)\n");
+#endif
+
+  reply_run (old_batch, count, ours, theirs, counter, &old);
+  reply_report ("record and send a reply", &old, count);
+  reply_run (new_batch, count, ours, theirs, counter, &pool);
+  reply_report ("reply pool             ", &pool, count);
+  if (old.instructions > 0 && pool.instructions > 0)
+    printf ("%.1fx fewer instructions a reply\n",
+	    old.instructions / pool.instructions);
+
+  for (c = 0; c < REPLY_BENCH_CLIENTS; c++)
+    {
+      close (ours[c]);
+      close (theirs[c]);
+    }
+  if (counter != -1)
+    close (counter);
+
+  if (pool.allocations > 0 || pool.bytes != old.bytes)
+    {
+      printf ("FAILED\n");
+      return 1;
+    }
+  return 0;
+}
+
+int main (int argc, char *argv[])
+{
+  int count;
+
+  if (argc < 2)
+    {
+      fprintf (stderr, "usage: ping-bench pipeline [count]\n"
+	       "       ping-bench jitter [count] [cpu]\n"
+	       "       ping-bench targets [count]\n"
+	       "       ping-bench topk [count]\n"
+	       "       ping-bench restart [count] [server]\n"
+	       "       ping-bench pmtu [count]\n"
+	       "       ping-bench sched [seconds]\n"
+	       "       ping-bench alerts [count]\n"
+	       "       ping-bench adapt [targets] [seconds]\n"
+	       "       ping-bench reply [count]\n"
+	       "       ping-bench capture file [targets] [seconds]\n"
+	       "       ping-bench replay [threads] [replay]\n");
+      return 2;
+    }
+  count = argc > 2 ? atoi (argv[2]) : 10000;
+
+  if (strcmp (argv[1], "pipeline") == 0)
+    return bench_serial (count) || bench_pipeline (count);
+  if (strcmp (argv[1], "jitter") == 0)
+    return bench_jitter (count, argc > 3 ? atoi (argv[3]) : 0);
+  if (strcmp (argv[1], "targets") == 0)
+    return bench_targets (argc > 2 ? count : 0);
+  if (strcmp (argv[1], "topk") == 0)
+    return bench_topk (argc > 2 ? count : 1000000);
+  if (strcmp (argv[1], "restart") == 0)
+    return bench_restart (argc > 2 ? count : 2000,
+			  argc > 3 ? argv[3] : "./ping-server");
+  if (strcmp (argv[1], "pmtu") == 0)
+    return bench_pmtu (argc > 2 ? count : 2000);
+  if (strcmp (argv[1], "sched") == 0)
+    return bench_sched (argc > 2 ? count : 10);
+  if (strcmp (argv[1], "alerts") == 0)
+    return bench_alert (argc > 2 ? count : 100000);
+  if (strcmp (argv[1], "adapt") == 0)
+    return bench_adapt (argc > 2 ? count : 10000,
+			argc > 3 ? atoi (argv[3]) : 600);
+  if (strcmp (argv[1], "reply") == 0)
+    return bench_reply (argc > 2 ? count : 1000000);
+  if (strcmp (argv[1], "replay") == 0)
+    return bench_replay (argc > 2 ? count : 3,
+			 argc > 3 ? argv[3] : "./ping-replay");
+  if (strcmp (argv[1], "capture") == 0 && argc > 2)
+    return bench_capture (argv[2], argc > 3 ? atoi (argv[3]) : 10000,
+			  argc > 4 ? atoi (argv[4]) : 60);
+
+  fprintf (stderr, "ping-bench: unknown benchmark %s\n", argv[1]);
+  return 2;
+}
@@ -1,5 +1,6 @@
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/types.h>
@@ -11,6 +12,10 @@
 
 unsigned int init_client (char *sockfile);
 int register_client(unsigned int sock);
+int show_top (unsigned int sock, char *metric, int count);
+int show_pmtu (unsigned int sock, char *host, int upper);
+int show_alerts (unsigned int sock, char *text);
+int dump_trace (unsigned int sock);
 
 int main (int argc, char *argv[])
 {
@@ -21,6 +26,59 @@ int main (int argc, char *argv[])
   /* establish the communications with the master */
 
   comm_server = init_client (SOCKET_FILE);
+
+  /* ping-client top rtt|p99|loss [count] lists the worst targets */
+
+  if (argc > 2 && strcmp (argv[1], "top") == 0)
+    {
+      int result = 1;
+
+      if (register_client (comm_server))
+	result = show_top (comm_server, argv[2],
+			   argc > 3 ? atoi (argv[3]) : 50);
+      close (comm_server);
+      return result;
+    }
+
+  /* ping-client pmtu host [max] measures the path MTU to host */
+
+  if (argc > 2 && strcmp (argv[1], "pmtu") == 0)
+    {
+      int result = 1;
+
+      if (register_client (comm_server))
+	result = show_pmtu (comm_server, argv[2],
+			    argc > 3 ? atoi (argv[3]) : 0);
+      close (comm_server);
+      return result;
+    }
+
+  /* ping-client alert 'expression' sets an alert and prints every
+     target it starts or stops holding for */
+
+  if (argc > 2 && strcmp (argv[1], "alert") == 0)
+    {
+      int result = 1;
+
+      if (register_client (comm_server))
+	result = show_alerts (comm_server, argv[2]);
+      close (comm_server);
+      return result;
+    }
+
+  /* ping-client trace has the daemon dump its flight recorder to
+     TRACE_FILE; ping-trace reads the dump */
+
+  if (argc > 1 && strcmp (argv[1], "trace") == 0)
+    {
+      int result = 1;
+
+      if (register_client (comm_server))
+	result = dump_trace (comm_server);
+      close (comm_server);
+      return result;
+    }
+
   if (register_client(comm_server))
     {
       int result;
@@ -203,9 +261,194 @@ int register_client (unsigned int sock)
   return 0; /* we should never reach this */
 }
 
+int show_top (unsigned int sock, char *metric, int count)
+     /* ask the daemon for its worst targets and print them
+      * metric: rtt, p99 or loss
+      * returns: 0 on success, 1 on failure
+      */
+{
+  struct top_query query;
+  struct top_entry entry;
+  char info[MAX_MSGLEN];
+  char buf[MAX_MSGLEN];
+  int msg;
+
+  if (strcmp (metric, "rtt") == 0)
+    query.metric = TOP_RTT;
+  else if (strcmp (metric, "p99") == 0)
+    query.metric = TOP_P99;
+  else if (strcmp (metric, "loss") == 0)
+    query.metric = TOP_LOSS;
+  else
+    {
+      fprintf (stderr, "unknown metric %s; try rtt, p99 or loss\n", metric);
+      return 1;
+    }
+  query.count = count;
 
+  make_top_query (info, &query);
+  make_msg (buf, TOP_QUERY, info);
+  if (send (sock, buf, MAX_MSGLEN, 0) == -1)
+    {
+      perror ("Sending top query");
+      return 1;
+    }
 
+  for (;;)
+    {
+      if (recv (sock, buf, MAX_MSGLEN, MSG_WAITALL) <= 0)
+	{
+	  printf ("The server closed the connection.\n");
+	  return 1;
+	}
+      parse_msg (buf, &msg, info);
+      if (msg == TOP_END)
+	return 0;
+      if (msg != TOP_ENTRY)
+	continue;
+
+      parse_top_entry (info, &entry);
+      if (entry.metric == TOP_LOSS)
+	printf ("%3u  %-40s %7.3f%%\n", entry.rank, entry.host,
+		entry.value / 1e4);
+      else
+	printf ("%3u  %-40s %9u usec\n", entry.rank, entry.host,
+		entry.value);
+    }
+}
 
+int show_pmtu (unsigned int sock, char *host, int upper)
+     /* ask the daemon for the path MTU to a host and print it
+      * upper: the largest MTU to try, or 0 for the daemon's limit
+      * returns: 0 on success, 1 on failure
+      */
+{
+  struct pmtu_msg pm;
+  char info[MAX_MSGLEN];
+  char buf[MAX_MSGLEN];
+  int msg;
 
+  strlcpy (pm.host, host, MAX_HOST);
+  pm.mtu = upper;
+  make_pmtu_msg (info, &pm);
+  make_msg (buf, PMTU_QUERY, info);
+  if (send (sock, buf, MAX_MSGLEN, 0) == -1)
+    {
+      perror ("Sending PMTU query");
+      return 1;
+    }
 
+  do
+    {
+      if (recv (sock, buf, MAX_MSGLEN, MSG_WAITALL) <= 0)
+	{
+	  printf ("The server closed the connection.\n");
+	  return 1;
+	}
+      parse_msg (buf, &msg, info);
+    }
+  while (msg != PMTU_RESULT);
 
+  parse_pmtu_msg (info, &pm);
+  if (pm.mtu == 0)
+    {
+      printf ("%s: path MTU couldn't be measured\n", pm.host);
+      return 1;
+    }
+  printf ("%s: path MTU %u\n", pm.host, pm.mtu);
+  return 0;
+}
+
+int show_alerts (unsigned int sock, char *text)
+     /* set an alert and print its crossings as they come
+      * text: the expression; see alert.h
+      * returns: 1 on failure; otherwise it runs until the daemon
+      *   goes away
+      */
+{
+  struct alert_msg am;
+  char info[MAX_MSGLEN];
+  char buf[MAX_MSGLEN];
+  int msg, at;
+
+  if (strlen (text) > MAX_MSGLEN - 4)
+    {
+      fprintf (stderr, "alert expressions can be at most %d characters\n",
+	       MAX_MSGLEN - 4);
+      return 1;
+    }
+  make_msg (buf, ALERT_SET, text);
+  if (send (sock, buf, MAX_MSGLEN, 0) == -1)
+    {
+      perror ("Sending alert");
+      return 1;
+    }
+
+  for (;;)
+    {
+      if (recv (sock, buf, MAX_MSGLEN, MSG_WAITALL) <= 0)
+	{
+	  printf ("The server closed the connection.\n");
+	  return 1;
+	}
+      parse_msg (buf, &msg, info);
+
+      switch (msg)
+	{
+	case ALERT_OK:
+	  printf ("alert %s set\n", info);
+	  break;
+
+	case ALERT_BAD:
+	  /* the offset, then what's wrong there */
+
+	  at = atoi (info);
+	  fprintf (stderr, "%s\n%*s^ %s\n", text, at, "",
+		   strchr (info, ' ') ? strchr (info, ' ') + 1 : info);
+	  return 1;
+
+	case ALERT_CROSSED:
+	  parse_alert_msg (info, &am);
+	  printf ("%-40s %s (%g)\n", am.host,
+		  am.raised ? "raised" : "cleared", am.value);
+	  fflush (stdout);
+	  break;
+	}
+    }
+}
+
+int dump_trace (unsigned int sock)
+     /* have the daemon write its flight recorder to TRACE_FILE
+      * returns: 0 on success, 1 on failure
+      */
+{
+  char info[MAX_MSGLEN];
+  char buf[MAX_MSGLEN];
+  int msg;
+
+  make_msg (buf, TRACE_DUMP, "");
+  if (send (sock, buf, MAX_MSGLEN, 0) == -1)
+    {
+      perror ("Sending trace request");
+      return 1;
+    }
+
+  do
+    {
+      if (recv (sock, buf, MAX_MSGLEN, MSG_WAITALL) <= 0)
+	{
+	  printf ("The server closed the connection.\n");
+	  return 1;
+	}
+      parse_msg (buf, &msg, info);
+    }
+  while (msg != TRACE_OK && msg != UNSUPPORTED_MESSAGE);
+
+  if (msg != TRACE_OK)
+    {
+      fprintf (stderr, "%s\n", info);
+      return 1;
+    }
+  printf ("%s\n", info);
+  return 0;
+}
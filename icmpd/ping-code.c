@@ -31,15 +31,9 @@ unsigned int init_ping()
   return psock;
 }
 
-int send_ping (unsigned int sock, char *hostname, int id, int seq, int size)
+int resolve_host (char *hostname, struct in_addr *addr)
 {
-  unsigned char packet[MAX_PACKET];
-  struct icmp *icp = (struct icmp *) packet;
-  struct timeval *tp = (struct timeval *) &packet[8];
-  struct timezone tz;
   struct hostent *hostinfo;
-  struct sockaddr_in target;
-  int cc;
 
   hostinfo = gethostbyname (hostname);
   if (!hostinfo)
@@ -47,9 +41,32 @@ int send_ping (unsigned int sock, char *hostname, int id, int seq, int size)
       herror ("Lookup for ping");
       return HOST_LOOKUP_ERROR;
     }
-  
+  *addr = *((struct in_addr *)hostinfo->h_addr);
+  return PING_OK;
+}
+
+int send_ping (unsigned int sock, char *hostname, int id, int seq, int size)
+{
+  struct in_addr addr;
+
+  if (resolve_host (hostname, &addr) != PING_OK)
+    return HOST_LOOKUP_ERROR;
+  return send_ping_to (sock, addr, id, seq, size);
+}
+
+int send_ping_to (unsigned int sock, struct in_addr addr, int id, 
+		  int seq, int size)
+{
+  unsigned char packet[MAX_PACKET];
+  struct icmp *icp = (struct icmp *) packet;
+  struct timeval *tp = (struct timeval *) &packet[8];
+  struct timezone tz;
+  struct sockaddr_in target;
+  int cc;
+
+  memset (&target, 0, sizeof target);
   target.sin_family = AF_INET;
-  target.sin_addr = *((struct in_addr *)hostinfo->h_addr);
+  target.sin_addr = addr;
  
   gettimeofday (tp, &tz);
 
@@ -62,8 +79,9 @@ int send_ping (unsigned int sock, char *hostname, int id, int seq, int size)
   cc = size + 8;
   icp->icmp_cksum = in_cksum((unsigned short *)icp, cc);
 
-  sendto (sock, packet, cc, 0, (struct sockaddr *) &target, 
-	  sizeof (struct sockaddr_in));
+  if (sendto (sock, packet, cc, 0, (struct sockaddr *) &target, 
+	      sizeof (struct sockaddr_in)) < 0)
+    return SEND_ERROR;
 
   return PING_OK;
 }
@@ -111,51 +129,87 @@ unsigned short in_cksum (unsigned short *addr, int len)
   return answer;
 }
 
-void parse_ping (struct sockaddr_in *from, char *buf, 
-		 int size, struct ping_ack *ack)
+int parse_echo (char *buf, int size, struct echo *e)
+     /* pick apart an ICMP echo or echo reply, header first.  this is
+	the part of reading a reply that doesn't depend on where the
+	packet came from, so ping-replay can use it on captures too
+	buf: the IP datagram, aligned for struct ip
+	size: how much of it there is
+	e: filled in on success
+	returns: 1 for an echo or echo reply, 0 for anything else
+     */
 {
   struct ip *ip;
   struct icmp *icp;
-  struct timeval ping_recd;
-  struct timeval *ping_sent;
-  struct timezone tz;
   int hlen;
 
-  /* work out the time ASAP */
-
-  gettimeofday (&ping_recd, &tz);
-
-  /* figure out what's header and what's not */
+  /* figure out what's header and what's not.  a capture is anyone's
+     bytes, so the header has to be all there and no shorter than an
+     IP header can be before any of it is believed */
 
   ip = (struct ip *) buf;
   
+  if (size < (int) sizeof (struct ip) || ip->ip_hl < 5)
+    return 0;
   hlen = ip->ip_hl << 2;
   if (size < hlen + ICMP_MINLEN)
-    {
-      /* packet too short -- should we handle this ? */
-    }
+    return 0;
   icp = (struct icmp *)(buf + hlen);
 
-  /* ID and sequence number and size, oh my */
+  /* the raw socket only hands us whole ICMP datagrams, but a capture
+     has everything, fragments included */
 
-  ack->id = icp->icmp_id;
-  ack->seq_no = icp->icmp_seq;
-  ack->size = size;
+  if (ip->ip_v != 4 || ip->ip_p != IPPROTO_ICMP
+      || (ntohs (ip->ip_off) & IP_OFFMASK) != 0)
+    return 0;
 
-  /* time, time, time, to see what's become of me */
+  /* the raw socket sees every ICMP packet for the host, including
+     our own echo requests on the loopback interface */
 
-  ping_sent = (struct timeval *) &icp->icmp_data[0];
-  ack->d_sec = ping_recd.tv_sec - ping_sent->tv_sec;
-  ack->d_usec = ping_recd.tv_usec - ping_sent->tv_usec;
-  
-  /* host info */
-  
-  strlcpy (ack->host, inet_ntoa(from->sin_addr), MAX_HOST);
+  if (icp->icmp_type != ICMP_ECHOREPLY && icp->icmp_type != ICMP_ECHO)
+    return 0;
+
+  /* ID and sequence number and size, oh my */
+
+  e->type = icp->icmp_type;
+  e->id = icp->icmp_id;
+  e->seq = icp->icmp_seq;
+  e->src = ip->ip_src.s_addr;
+  e->dst = ip->ip_dst.s_addr;
+  e->data = (char *) &icp->icmp_data[0];
+  e->len = size - hlen - ICMP_MINLEN;
+  return 1;
 }
 
+int parse_ping (struct sockaddr_in *from, char *buf, 
+		int size, struct ping_ack *ack)
+{
+  struct echo e;
+  struct timeval ping_recd;
+  struct timeval *ping_sent;
+  struct timezone tz;
 
+  /* work out the time ASAP */
 
+  gettimeofday (&ping_recd, &tz);
 
+  if (!parse_echo (buf, size, &e) || e.type != ICMP_ECHOREPLY)
+    return 0;
 
+  ack->id = e.id;
+  ack->seq_no = e.seq;
+  ack->size = size;
 
+  /* time, time, time, to see what's become of me */
 
+  ping_sent = (struct timeval *) e.data;
+  ack->d_sec = ping_recd.tv_sec - ping_sent->tv_sec;
+  ack->d_usec = ping_recd.tv_usec - ping_sent->tv_usec;
+  
+  /* host info, kept binary; it's only made into text for a client
+     that wants text, and then by make_ping_recd */
+  
+  ack->addr = from->sin_addr.s_addr;
+  ack->host[0] = '\0';
+  return 1;
+}
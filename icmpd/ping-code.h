@@ -4,13 +4,27 @@
 
 #define PING_OK 1
 #define HOST_LOOKUP_ERROR 2
+#define SEND_ERROR 3 /* errno says why */
 
 #define MAX_PACKET (65536 - 60 - 8) /* max packet size */
 
+struct echo
+{
+  int type;                 /* ICMP_ECHO or ICMP_ECHOREPLY */
+  unsigned short id, seq;   /* as they are on the wire */
+  unsigned int src, dst;    /* network byte order */
+  char *data;               /* what follows the ICMP header */
+  int len;                  /* and how much of it there is */
+};
+
 unsigned int init_ping();
+int resolve_host (char *hostname, struct in_addr *addr);
 int send_ping (unsigned int sock, char *hostname, int id, 
 	       int seq, int size);
-void parse_ping (struct sockaddr_in *from, char *buf, 
-		 int size, struct ping_ack *ack);
+int send_ping_to (unsigned int sock, struct in_addr addr, int id, 
+		  int seq, int size);
+int parse_echo (char *buf, int size, struct echo *e);
+int parse_ping (struct sockaddr_in *from, char *buf, 
+		int size, struct ping_ack *ack);
 
 
@@ -0,0 +1,616 @@
+/* ping-replay.c */
+/* offline analysis: read packet captures and work out the per-target
+   RTT and loss figures the daemon would have, for looking into
+   incidents after the fact.
+
+     ping-replay [-t threads] [-w msec] [-q] capture...
+
+   echo requests are matched with their replies by pinger, target, ICMP
+   id and sequence number, using parse_echo, the same code that reads
+   replies off the daemon's raw socket.  an RTT is the time between the
+   two in the capture; a request with no reply within -w msec (default
+   SCHED_TIMEOUT_MSEC, as in the daemon) counts as lost.  the figures
+   are kept by the same registry code the daemon uses, so smoothed RTT,
+   p99 and loss mean the same thing.  several captures are read as one
+   stream, in the order given.
+
+   the main thread walks the captures and deals frames out in batches
+   to -t worker threads (default one per cpu), by a hash of the target's
+   address - where a request goes, where a reply comes from - so
+   everything about a target, whoever pinged it, lands on the same
+   worker in capture order, and each target is in one worker's table.
+   a worker expires requests by the time of the frames it sees, so at
+   the end each one expires its requests against the capture's last
+   frame, the way a single worker would have.  the results don't
+   depend on the number of threads.  the workers share nothing but
+   their queues; their tables are put together at the end.
+
+   with -q only the summary is printed, which makes a fixed capture a
+   repeatable benchmark of the parse and match path; ping-bench capture
+   writes one. */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in_systm.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <arpa/inet.h>
+
+#include "ipc-msgs.h"
+#include "ping-code.h"
+#include "targets.h"
+#include "sched.h"
+#include "capture.h"
+
+#define MAX_WORKERS 64
+#define BATCH 1024          /* frames handed over at a time */
+#define QUEUE 8             /* batches per worker; a power of two */
+#define HEADERS_MAX 128     /* enough for IP with options, and ICMP */
+#define MIN_PENDING 1024    /* must be a power of two */
+
+struct batch
+{
+  unsigned int n;
+  struct frame f[BATCH];
+};
+
+/* an echo request waiting for its reply.  they're kept in a ring in
+   the order they were seen, so expiring them is a matter of looking
+   at the oldest, and found through an open-addressed index */
+
+struct request
+{
+  unsigned int pinger, addr; /* network byte order */
+  unsigned short id, seq;
+  unsigned int target;
+  int live;                  /* not yet answered, forfeited or lost */
+  long sent;                 /* usec */
+};
+
+struct worker
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  /* batches [head, tail) are full and waiting for the worker; the
+     reader fills batch tail.  done means there won't be any more */
+
+  struct batch queue[QUEUE];
+  unsigned int head, tail;
+  int done;
+
+  struct target_table targets;
+  unsigned int *lost;        /* by target id */
+  unsigned int lost_cap;
+
+  struct request *ring;
+  unsigned long ring_head, ring_tail;
+  unsigned int ring_mask;
+  unsigned int *index;       /* ring position + 1; 0 is empty */
+  unsigned int index_mask;
+
+  unsigned long requests, replies, unmatched, duplicates;
+  int failed;                /* out of memory */
+};
+
+struct result
+{
+  unsigned int addr;
+  char *name;
+  unsigned int sent, recd, lost;
+  float srtt, p99, loss;
+};
+
+static long timeout_usec = SCHED_TIMEOUT_MSEC * 1000L;
+
+static unsigned int hash_request (unsigned int pinger, unsigned int addr,
+				  unsigned int id, unsigned int seq)
+{
+  unsigned int h = pinger * 2654435761u ^ addr;
+
+  h = (h ^ (id << 16 | seq)) * 0x45d9f3b;
+  return h ^ h >> 16;
+}
+
+static struct request *request_find (struct worker *w, struct echo *e,
+				     unsigned int *slot)
+     /* look up the request a reply answers, or an outstanding request
+	that has the same key as a new one
+      * slot: set to its index slot
+      * returns: the request, or NULL
+      */
+{
+  unsigned int pinger, addr, i;
+  struct request *r;
+
+  /* a reply goes the other way */
+
+  pinger = e->type == ICMP_ECHO ? e->src : e->dst;
+  addr = e->type == ICMP_ECHO ? e->dst : e->src;
+
+  for (i = hash_request (pinger, addr, e->id, e->seq) & w->index_mask;
+       w->index[i]; i = (i + 1) & w->index_mask)
+    {
+      r = &w->ring[w->index[i] - 1];
+      if (r->addr == addr && r->pinger == pinger
+	  && r->id == e->id && r->seq == e->seq)
+	{
+	  *slot = i;
+	  return r;
+	}
+    }
+  return NULL;
+}
+
+static void index_remove (struct worker *w, unsigned int i)
+     /* empty index slot i, shifting later entries of the same chain
+	back so that lookups never stop short */
+{
+  unsigned int j = i, k;
+  struct request *r;
+
+  for (;;)
+    {
+      j = (j + 1) & w->index_mask;
+      if (!w->index[j])
+	break;
+      r = &w->ring[w->index[j] - 1];
+      k = hash_request (r->pinger, r->addr, r->id, r->seq) & w->index_mask;
+      if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+	continue;
+      w->index[i] = w->index[j];
+      i = j;
+    }
+  w->index[i] = 0;
+}
+
+static void index_insert (struct worker *w, unsigned int pos)
+{
+  struct request *r = &w->ring[pos];
+  unsigned int i;
+
+  for (i = hash_request (r->pinger, r->addr, r->id, r->seq) & w->index_mask;
+       w->index[i]; i = (i + 1) & w->index_mask)
+    ;
+  w->index[i] = pos + 1;
+}
+
+static int pending_grow (struct worker *w)
+     /* double the ring, moving what's in it to the front, and rebuild
+	the index to match
+      * returns: 1 on success, 0 if we're out of memory
+      */
+{
+  unsigned int cap = w->ring ? 2 * (w->ring_mask + 1) : MIN_PENDING;
+  struct request *ring = malloc (cap * sizeof *ring);
+  unsigned int *index = calloc (2 * cap, sizeof *index);
+  unsigned long n;
+
+  if (ring == NULL || index == NULL)
+    {
+      free (ring);
+      free (index);
+      return 0;
+    }
+  for (n = 0; w->ring_head + n < w->ring_tail; n++)
+    ring[n] = w->ring[(w->ring_head + n) & w->ring_mask];
+
+  free (w->ring);
+  free (w->index);
+  w->ring = ring;
+  w->ring_mask = cap - 1;
+  w->ring_head = 0;
+  w->ring_tail = n;
+  w->index = index;
+  w->index_mask = 2 * cap - 1;
+
+  for (n = 0; n < w->ring_tail; n++)
+    if (ring[n].live)
+      index_insert (w, n);
+  return 1;
+}
+
+static void expire (struct worker *w, long now)
+     /* count requests that have waited too long as lost, and drop
+	ones that have been dealt with from the front of the ring */
+{
+  struct request *r;
+  struct echo e;
+  unsigned int slot;
+
+  while (w->ring_head < w->ring_tail)
+    {
+      r = &w->ring[w->ring_head & w->ring_mask];
+      if (r->live)
+	{
+	  if (r->sent + timeout_usec > now)
+	    break;
+	  e.type = ICMP_ECHO;
+	  e.src = r->pinger;
+	  e.dst = r->addr;
+	  e.id = r->id;
+	  e.seq = r->seq;
+	  request_find (w, &e, &slot);
+	  index_remove (w, slot);
+	  target_lost (&w->targets, r->target);
+	  w->lost[r->target]++;
+	}
+      w->ring_head++;
+    }
+}
+
+static unsigned int find_target (struct worker *w, unsigned int addr)
+     /* returns: the id of the target at addr, added if it's new, or
+      *   TARGET_NONE if we're out of memory
+      */
+{
+  unsigned int id = target_by_addr (&w->targets, addr);
+  struct in_addr in;
+
+  if (id != TARGET_NONE)
+    return id;
+
+  in.s_addr = addr;
+  id = target_add (&w->targets, inet_ntoa (in), addr);
+  if (id != TARGET_NONE && id >= w->lost_cap)
+    {
+      unsigned int cap = w->targets.cap;
+      unsigned int *lost = realloc (w->lost, cap * sizeof *lost);
+
+      if (lost == NULL)
+	return TARGET_NONE;
+      memset (lost + w->lost_cap, 0, (cap - w->lost_cap) * sizeof *lost);
+      w->lost = lost;
+      w->lost_cap = cap;
+    }
+  return id;
+}
+
+static int handle (struct worker *w, struct frame *f)
+     /* match one frame
+      * returns: 1 on success, 0 if we're out of memory
+      */
+{
+  long headers[HEADERS_MAX / sizeof (long)]; /* aligned for struct ip */
+  unsigned int len = f->len < HEADERS_MAX ? f->len : HEADERS_MAX;
+  struct request *r;
+  struct echo e;
+  unsigned int slot, target;
+
+  memcpy (headers, f->ip, len);
+  if (!parse_echo ((char *) headers, len, &e))
+    return 1;
+
+  expire (w, f->usec);
+  r = request_find (w, &e, &slot);
+
+  if (e.type == ICMP_ECHOREPLY)
+    {
+      w->replies++;
+      if (r == NULL)
+	{
+	  w->unmatched++;
+	  return 1;
+	}
+      target_reply (&w->targets, r->target, f->usec - r->sent);
+      r->live = 0;
+      index_remove (w, slot);
+      return 1;
+    }
+
+  /* the daemon never reuses a sequence number for a target while
+     the last probe with it is still out, so a request with the key
+     of one that's still waiting is the same packet captured twice,
+     as happens on bridges and with tcpdump -i any */
+
+  if (r != NULL)
+    {
+      w->duplicates++;
+      return 1;
+    }
+  w->requests++;
+
+  target = find_target (w, e.dst);
+  if (target == TARGET_NONE)
+    return 0;
+  target_sent (&w->targets, target);
+
+  if (w->ring_tail - w->ring_head > w->ring_mask && !pending_grow (w))
+    return 0;
+  slot = w->ring_tail++ & w->ring_mask;
+  r = &w->ring[slot];
+  r->pinger = e.src;
+  r->addr = e.dst;
+  r->id = e.id;
+  r->seq = e.seq;
+  r->target = target;
+  r->live = 1;
+  r->sent = f->usec;
+  index_insert (w, slot);
+  return 1;
+}
+
+static void *work (void *arg)
+{
+  struct worker *w = arg;
+  struct batch *b;
+  unsigned int i;
+
+  for (;;)
+    {
+      pthread_mutex_lock (&w->lock);
+      while (w->head == w->tail && !w->done)
+	pthread_cond_wait (&w->cond, &w->lock);
+      if (w->head == w->tail)
+	{
+	  pthread_mutex_unlock (&w->lock);
+	  return NULL;
+	}
+      pthread_mutex_unlock (&w->lock);
+
+      b = &w->queue[w->head & (QUEUE - 1)];
+      for (i = 0; i < b->n && !w->failed; i++)
+	if (!handle (w, &b->f[i]))
+	  w->failed = 1;
+
+      pthread_mutex_lock (&w->lock);
+      w->head++;
+      pthread_cond_signal (&w->cond);
+      pthread_mutex_unlock (&w->lock);
+    }
+}
+
+static void hand_over (struct worker *w)
+     /* pass the batch being filled to the worker, and wait for room
+	to fill the next one */
+{
+  pthread_mutex_lock (&w->lock);
+  w->tail++;
+  pthread_cond_signal (&w->cond);
+  while (w->tail - w->head == QUEUE)
+    pthread_cond_wait (&w->cond, &w->lock);
+  pthread_mutex_unlock (&w->lock);
+  w->queue[w->tail & (QUEUE - 1)].n = 0;
+}
+
+static unsigned long read_captures (char *files[], int n_files,
+				    struct worker *workers, int n_workers,
+				    struct capture *captures,
+				    unsigned long *bytes, long *last)
+     /* deal every ICMP frame in the captures out to the workers
+      * last: set to the time of the latest frame, in usec
+      * returns: the number of records read
+      */
+{
+  unsigned long records = 0;
+  struct frame f;
+  struct batch *b;
+  unsigned int target, h, hl;
+  int i;
+
+  for (i = 0; i < n_files; i++)
+    {
+      struct capture *c = &captures[i];
+
+      if (!capture_open (c, files[i]))
+	continue;
+      while (capture_next (c, &f))
+	{
+	  if (f.ip[9] != IPPROTO_ICMP)
+	    continue;
+	  if (f.usec > *last)
+	    *last = f.usec;
+
+	  /* the target is the far end: a reply's source, anything
+	     else's destination.  parse_echo throws out what isn't
+	     an echo, so a frame too short to say goes anywhere */
+
+	  hl = (f.ip[0] & 0x0f) * 4;
+	  memcpy (&target, f.ip + (hl < f.len && f.ip[hl] == ICMP_ECHOREPLY
+				   ? 12 : 16), sizeof target);
+	  h = target * 0x45d9f3b;
+	  h ^= h >> 16;
+
+	  b = &workers[h % n_workers].queue[workers[h % n_workers].tail
+					    & (QUEUE - 1)];
+	  b->f[b->n++] = f;
+	  if (b->n == BATCH)
+	    hand_over (&workers[h % n_workers]);
+	}
+      if (c->truncated)
+	fprintf (stderr, "%s: stops partway through a record\n", files[i]);
+      records += c->records;
+      *bytes += c->size;
+    }
+  return records;
+}
+
+static int compare_results (const void *a, const void *b)
+{
+  unsigned int x = ntohl (((const struct result *) a)->addr);
+  unsigned int y = ntohl (((const struct result *) b)->addr);
+
+  return x < y ? -1 : x > y;
+}
+
+static int report (struct worker *workers, int n_workers)
+     /* print every target's figures, in address order
+      * returns: 0 on success, 1 if we're out of memory
+      */
+{
+  struct result *results;
+  unsigned int n = 0, id, k;
+  int i;
+
+  for (i = 0; i < n_workers; i++)
+    n += workers[i].targets.count;
+  results = malloc ((n ? n : 1) * sizeof *results);
+  if (results == NULL)
+    return 1;
+
+  for (i = 0, k = 0; i < n_workers; i++)
+    {
+      struct target_table *t = &workers[i].targets;
+
+      for (id = 0; id < t->count; id++, k++)
+	{
+	  results[k].addr = t->addr[id];
+	  results[k].name = target_name (t, id);
+	  results[k].sent = t->sent[id];
+	  results[k].recd = t->recd[id];
+	  results[k].lost = workers[i].lost[id];
+	  results[k].srtt = t->srtt[id];
+	  results[k].p99 = t->p99[id];
+	  results[k].loss = t->loss[id];
+	}
+    }
+  qsort (results, n, sizeof *results, compare_results);
+
+  printf ("%-15s %9s %9s %9s %8s %11s %11s\n", "target", "sent", "recd",
+	  "lost", "loss", "srtt usec", "p99 usec");
+  for (k = 0; k < n; k++)
+    printf ("%-15s %9u %9u %9u %7.3f%% %11.0f %11.0f\n", results[k].name,
+	    results[k].sent, results[k].recd, results[k].lost,
+	    results[k].loss * 100, results[k].srtt, results[k].p99);
+  free (results);
+  return 0;
+}
+
+int main (int argc, char *argv[])
+{
+  struct worker *workers;
+  struct capture *captures;
+  struct timeval start, end;
+  unsigned long records, bytes = 0;
+  unsigned long requests = 0, replies = 0, unmatched = 0, waiting = 0;
+  unsigned long duplicates = 0;
+  long last = 0;
+  double secs;
+  int n_workers, quiet = 0, failed = 0;
+  int ch, i;
+
+  n_workers = sysconf (_SC_NPROCESSORS_ONLN);
+  while ((ch = getopt (argc, argv, "t:w:q")) != -1)
+    switch (ch)
+      {
+      case 't':
+	n_workers = atoi (optarg);
+	break;
+      case 'w':
+	timeout_usec = atol (optarg) * 1000;
+	break;
+      case 'q':
+	quiet = 1;
+	break;
+      default:
+	optind = argc + 1;
+	break;
+      }
+  if (optind >= argc)
+    {
+      fprintf (stderr,
+	       "usage: ping-replay [-t threads] [-w msec] [-q] capture...\n");
+      return 2;
+    }
+  if (n_workers < 1)
+    n_workers = 1;
+  if (n_workers > MAX_WORKERS)
+    n_workers = MAX_WORKERS;
+
+  workers = calloc (n_workers, sizeof *workers);
+  captures = calloc (argc - optind, sizeof *captures);
+  if (workers == NULL || captures == NULL)
+    {
+      fprintf (stderr, "out of memory\n");
+      return 1;
+    }
+
+  gettimeofday (&start, NULL);
+  for (i = 0; i < n_workers; i++)
+    {
+      struct worker *w = &workers[i];
+
+      if (!targets_init (&w->targets, 0) || !pending_grow (w))
+	{
+	  fprintf (stderr, "out of memory\n");
+	  return 1;
+	}
+      pthread_mutex_init (&w->lock, NULL);
+      pthread_cond_init (&w->cond, NULL);
+      if (pthread_create (&w->thread, NULL, work, w) != 0)
+	{
+	  perror ("starting a worker");
+	  return 1;
+	}
+    }
+
+  records = read_captures (argv + optind, argc - optind,
+			   workers, n_workers, captures, &bytes, &last);
+
+  /* hand over what's left, and wait for the workers to finish */
+
+  for (i = 0; i < n_workers; i++)
+    {
+      struct worker *w = &workers[i];
+
+      pthread_mutex_lock (&w->lock);
+      if (w->queue[w->tail & (QUEUE - 1)].n > 0)
+	w->tail++;
+      w->done = 1;
+      pthread_cond_signal (&w->cond);
+      pthread_mutex_unlock (&w->lock);
+    }
+  for (i = 0; i < n_workers; i++)
+    {
+      struct worker *w = &workers[i];
+      unsigned long k;
+
+      pthread_join (w->thread, NULL);
+      expire (w, last);
+      failed |= w->failed;
+      requests += w->requests;
+      replies += w->replies;
+      unmatched += w->unmatched;
+      duplicates += w->duplicates;
+      for (k = w->ring_head; k < w->ring_tail; k++)
+	waiting += w->ring[k & w->ring_mask].live;
+    }
+  gettimeofday (&end, NULL);
+
+  if (failed)
+    {
+      fprintf (stderr, "out of memory\n");
+      return 1;
+    }
+  if (!quiet && report (workers, n_workers))
+    {
+      fprintf (stderr, "out of memory\n");
+      return 1;
+    }
+
+  /* requests still waiting when the capture ends aren't counted as
+     lost: the daemon wouldn't have given up on them yet either */
+
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+  fprintf (stderr, "%lu records, %lu echo requests (and %lu duplicates), "
+	   "%lu replies (%lu unmatched), %lu still waiting at the end\n",
+	   records, requests, duplicates, replies, unmatched, waiting);
+  fprintf (stderr, "%.1f MB in %.3f sec with %d threads: %.0f MB/sec, "
+	   "%.2f M records/sec\n", bytes / 1e6, secs, n_workers,
+	   bytes / 1e6 / secs, records / 1e6 / secs);
+
+  for (i = 0; i < argc - optind; i++)
+    {
+      failed |= captures[i].map == NULL;
+      capture_close (&captures[i]);
+    }
+  return failed;
+}
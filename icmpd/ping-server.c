@@ -1,38 +1,185 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* for struct ucred */
+#endif
+
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #include "ipc-msgs.h"
 #include "ping-code.h"
+#include "measure.h"
+#include "targets.h"
+#include "sched.h"
+#include "topk.h"
+#include "expr.h"
+#include "alert.h"
+#include "snapshot.h"
+#include "pmtu.h"
+#include "adapt.h"
+#include "reply.h"
+#include "trace.h"
 
 #define MAX_QUEUED 5
-#define MAX_CLIENTS 16
 #define SELECT_TIMEOUT 5
+#define DUE_BATCH 256
+#define DISPATCH_BATCH 64
 
 void add_to_fdset (fd_set *fds, long fd, unsigned int *max);
 unsigned int init_server (char *sockfile, int clients);
+int connect_running (char *sockfile);
+int peer_is_us (int sock);
+void take_over (int sock, unsigned int *comm_sock, unsigned int *ping_sock,
+		long client_sock[]);
+void hand_over (long client_sock[], int to, unsigned int comm_sock,
+		unsigned int ping_sock, int measure_fd);
 unsigned int set_from_array (fd_set *fds, long array[]);
+void deliver_ack (long client_sock[], struct ping_ack *ack);
+void flush_client (long client_sock[], int client);
+void flush_replies (long client_sock[]);
+long now_msec (void);
+unsigned int find_target (char *host);
+void send_due (unsigned int ping_sock, long now);
+void drop_client (long client_sock[], int client);
+void reply_client (long client_sock[], int client, int msg, char *text);
+void run_scheduler (long client_sock[], unsigned int ping_sock, long now);
+void run_pmtu (long client_sock[], long now);
+void check_alerts (long client_sock[], unsigned int target, float last);
+
+/* every host we've pinged, and the watch schedule */
+
+static struct target_table targets;
+static unsigned int watching;
+
+/* how often watched targets are really probed, with -a */
+
+static struct adapt adapt;
+
+/* what's waiting to go out, and what's out */
+
+static struct scheduler sched;
+
+/* the worst targets, for TOP_QUERY */
+
+static struct topk topk;
+
+/* path MTU discovery sessions and results */
+
+static struct pmtu pmtu;
+
+/* clients' alert expressions, and which targets they hold for */
+
+static struct alerts alerts;
+
+/* each client's request, as far as it's come in */
+
+static struct client_in client_in[MAX_CLIENTS];
+
+/* replies on their way to clients, a batch at a time */
+
+static struct reply_pool replies;
+
+/* the flight recorder's ring for this thread */
+
+static struct trace_ring *tr;
 
 int main (int argc, char *argv[])
 {
   unsigned int comm_sock, ping_sock;
   long client_sock[MAX_CLIENTS];
   int done = 0;
-  int i;
+  double budget = 0;
+  int measure_cpu = -1;
+  int measure_fd = -1;
+  int pmtu_fd;
+  int replace = 0;
+  int running;
+  int ready;
+  int i, ch;
 
   for (i = 0; i < MAX_CLIENTS; i++)
     client_sock[i] = -1;
 
-  /* WRITEME: check arguments */
-  /* WRITEME: see if one of us is running already */
+  /* a client that goes away while we're writing to it shouldn't
+     take the daemon with it */
+
+  signal (SIGPIPE, SIG_IGN);
+
+  while ((ch = getopt (argc, argv, "a:j:r")) != -1)
+    switch (ch)
+      {
+      case 'a':
+	/* adaptive watches: probe stable targets less and unstable
+	   ones more, within this many probes a second in all */
+	budget = atof (optarg);
+	break;
+      case 'j':
+	/* low-jitter mode: measure on a busy-polling thread pinned
+	   to this cpu */
+	measure_cpu = atoi (optarg);
+	break;
+      case 'r':
+	/* replace a running daemon without dropping its clients */
+	replace = 1;
+	break;
+      default:
+	fprintf (stderr, "usage: ping-server [-a pps] [-j cpu] [-r]\n");
+	exit (1);
+      }
+
+  if (!targets_init (&targets, 0))
+    {
+      fprintf (stderr, "no memory for the target table\n");
+      exit (1);
+    }
+  adapt_init (&adapt, budget, SCHED_TIMEOUT_MSEC);
+  sched_init (&sched);
+  topk_init (&topk);
+  alerts_init (&alerts);
+  reply_init (&replies);
+
+  /* the flight recorder is always on; SIGUSR2 dumps it */
+
+  if (trace_init ())
+    tr = trace_thread ("main");
+  if (tr == NULL || !trace_catch (SIGUSR2))
+    fprintf (stderr, "can't start the flight recorder; "
+	     "going on without it\n");
+
+  /* see if one of us is running already.  if so, we either take
+     over from it or leave it alone */
+
+  running = connect_running (SOCKET_FILE);
+  if (running != -1 && !replace)
+    {
+      fprintf (stderr, "ping-server: already running on %s; "
+	       "use -r to replace it\n", SOCKET_FILE);
+      exit (1);
+    }
+  if (running != -1)
+    take_over (running, &comm_sock, &ping_sock, client_sock);
+  else
+    {
+      comm_sock = init_server (SOCKET_FILE, MAX_QUEUED);
+      ping_sock = init_ping ();
+    }
+
+  pmtu_fd = pmtu_init (&pmtu);
 
-  comm_sock = init_server (SOCKET_FILE, MAX_QUEUED);
-  ping_sock = init_ping ();
+  if (measure_cpu >= 0)
+    {
+      measure_fd = measure_start (ping_sock, measure_cpu);
+      if (measure_fd == -1)
+	exit (1);
+    }
   
   while (!done)
     {
@@ -44,15 +191,47 @@ int main (int argc, char *argv[])
 
       maxfd = set_from_array (&read_fds, client_sock);
       add_to_fdset (&read_fds, comm_sock, &maxfd);
-      add_to_fdset (&read_fds, ping_sock, &maxfd);
+      if (measure_fd == -1)
+	add_to_fdset (&read_fds, ping_sock, &maxfd);
+      else
+	add_to_fdset (&read_fds, measure_fd, &maxfd);
+      if (pmtu_fd != -1)
+	add_to_fdset (&read_fds, pmtu_fd, &maxfd);
       maxfd += 1; 
 
-      /* prepare timeout for select */
+      /* prepare timeout for select; watched targets, probes waiting
+	 on the scheduler and PMTU rounds need us to come round every
+	 tick */
 
-      timeout.tv_sec = SELECT_TIMEOUT;
-      timeout.tv_usec = 0;
+      if (watching > 0 || sched_busy (&sched) || pmtu_busy (&pmtu))
+	{
+	  timeout.tv_sec = 0;
+	  timeout.tv_usec = WHEEL_TICK_MSEC * 1000;
+	}
+      else
+	{
+	  timeout.tv_sec = SELECT_TIMEOUT;
+	  timeout.tv_usec = 0;
+	}
       
-      select (maxfd, &read_fds, NULL, NULL, &timeout);
+      trace_begin (tr, TRACE_SLEEP, 0);
+      ready = select (maxfd, &read_fds, NULL, NULL, &timeout);
+      trace_end (tr, TRACE_SLEEP, ready > 0 ? ready : 0);
+
+      /* a signal, like the flight recorder's, leaves the sets
+	 undefined */
+
+      if (ready < 0)
+	FD_ZERO (&read_fds);
+
+      if (watching > 0)
+	send_due (ping_sock, now_msec ());
+
+      /* PMTU probe replies have a socket of their own, so they're
+	 read whatever else is going on */
+
+      if (pmtu_fd != -1 && FD_ISSET(pmtu_fd, &read_fds))
+	pmtu_receive (&pmtu, now_msec ());
 
       if (FD_ISSET(comm_sock, &read_fds))
 	{
@@ -66,10 +245,11 @@ int main (int argc, char *argv[])
 	  client = accept (comm_sock, (struct sockaddr *)&comm_remote,
 			   &size);
 	  
-	  while ((client_sock[i] > 0)
-		 && (i < MAX_CLIENTS))
+	  while ((i < MAX_CLIENTS)
+		 && (client_sock[i] > 0))
 	    i++;
 	  
+	  trace (tr, TRACE_ACCEPT, i);
 	  if (i < MAX_CLIENTS)
 	    {
 	      /* we have space for a new client */
@@ -88,46 +268,59 @@ int main (int argc, char *argv[])
 	  
 	}
       
-      else if (FD_ISSET(ping_sock, &read_fds))
+      else if (measure_fd != -1 && FD_ISSET(measure_fd, &read_fds))
+	{
+	  /* replies the measurement thread has already timed */
+	  int n;
+
+	  do
+	    {
+	      trace_begin (tr, TRACE_DRAIN, 0);
+	      n = measure_drain (replies.acks, REPLY_BATCH);
+	      trace_end (tr, TRACE_DRAIN, n);
+	      for (i = 0; i < n; i++)
+		deliver_ack (client_sock, &replies.acks[i]);
+	      flush_replies (client_sock);
+	    }
+	  while (n == REPLY_BATCH);
+	}
+
+      else if (measure_fd == -1 && FD_ISSET(ping_sock, &read_fds))
 	 {
-	   /* this is where the ping reply handling code goes */
-	   char packet[MAX_PACKET];
+	   /* this is where the ping reply handling code goes.  the
+	      socket is readable, so the first recvfrom won't block;
+	      after that we take whatever else has come in, up to a
+	      batch, and send each client its share in one go */
 
 	   struct sockaddr_in from;
 	   unsigned int fromlen;
-	   struct ping_ack ack;
+	   struct ping_ack *ack;
+	   int cc, parsed, got = 0, n = 0;
 
-	   int cc = recvfrom (ping_sock, packet, MAX_PACKET, 0,
-			      (struct sockaddr *)&from, &fromlen);
-	   parse_ping (&from, packet, cc, &ack);
-	   
-	   /* now we figure out who this ping belongs to, and route it
-	      that way - first, if it's not one we care about, then we
-	      simply forget about it */
-	   
-	   if (ack.id < MAX_CLIENTS && client_sock[ack.id] != -1)
+	   do
 	     {
-	       char info[MAX_MSGLEN];
-	       char buf[MAX_MSGLEN];
-	       int result;
-
-	       make_ping_ack (info, &ack);
-	       make_msg (buf, PING_RECD, info);
-
-	       result = send (client_sock[ack.id], buf, MAX_MSGLEN, 0);
-	       if (result < 0)
-		 {
-		   perror ("Sending to client");
-		   close(client_sock[i]);
-		   client_sock[i] = -1;
-		 }
-	       else if (result == 0)
-		 {
-		   printf ("Client closed socket.\n");
-		   close(client_sock[i]);
-		   client_sock[i] = -1;
-		 }
+	       fromlen = sizeof from;
+	       trace_begin (tr, TRACE_RECVFROM, 0);
+	       cc = recvfrom (ping_sock, replies.packet, MAX_PACKET,
+			      got > 0 ? MSG_DONTWAIT : 0,
+			      (struct sockaddr *)&from, &fromlen);
+	       trace_end (tr, TRACE_RECVFROM, cc > 0 ? cc : 0);
+	       if (cc <= 0)
+		 break;
+	       got++;
+
+	       ack = &replies.acks[n];
+	       trace_begin (tr, TRACE_PARSE, 0);
+	       parsed = parse_ping (&from, replies.packet, cc, ack);
+	       trace_end (tr, TRACE_PARSE, parsed ? ack->id : MAX_CLIENTS);
+	       if (parsed)
+		 n++;
 	     }
+	   while (got < REPLY_BATCH);
+
+	   for (i = 0; i < n; i++)
+	     deliver_ack (client_sock, &replies.acks[i]);
+	   flush_replies (client_sock);
 	 }
       else
 	{
@@ -138,27 +331,59 @@ int main (int argc, char *argv[])
 	    if ((client_sock[i] >= 0) 
 		&& (FD_ISSET (client_sock[i], &read_fds)))
 	      {
+		struct client_in *in = &client_in[i];
 		char buf[MAX_MSGLEN];
 		int result;
 		
-		result = recv(client_sock[i], buf, MAX_MSGLEN, 0);
+		/* messages are fixed-size records, and a client that
+		   pipelines requests may have sent only part of one.
+		   we take what's there without waiting for the rest,
+		   which would hold up everyone else, and act on the
+		   record once it's whole */
+
+		result = recv (client_sock[i], in->buf + in->len,
+			       MAX_MSGLEN - in->len, MSG_DONTWAIT);
+		if (result < 0 && (errno == EAGAIN || errno == EINTR))
+		  continue;
+		if (result > 0)
+		  {
+		    in->len += result;
+		    if (in->len < MAX_MSGLEN)
+		      continue;
+		    memcpy (buf, in->buf, MAX_MSGLEN);
+		    in->len = 0;
+		    result = MAX_MSGLEN;
+		  }
+
 		if (result < 0)
-		  perror ("server comm read");
+		  {
+		    perror ("server comm read");
+		    drop_client (client_sock, i);
+		  }
 		else if (result == 0)
 		  {
 		    printf ("Client %d closed socket\n", i);
-		    client_sock[i] = -1;
+		    drop_client (client_sock, i);
 		  }
 		else
 		  {
 		    char info[MAX_MSGLEN];
 		    char reply[MAX_MSGLEN];
 		    struct ping_req req;
-		    int msg;
+		    struct watch_req watch;
+		    struct top_query query;
+		    struct top_entry entries[TOP_MAX];
+		    struct pmtu_msg pm;
+		    struct probe probe;
+		    char *error;
+		    unsigned int target;
+		    int queued = 0;
+		    int msg, n, k;
 
 		    printf ("Received from client %d, fd %ld, length %d: %s\n",
 			    i, client_sock[i], result, buf);
 
+		    trace_begin (tr, TRACE_REQUEST, i);
 		    parse_msg (buf, &msg, info);
 		    switch (msg)
 		      {
@@ -169,12 +394,177 @@ int main (int argc, char *argv[])
 			break;
 
 		      case SEND_PING:
+			/* the scheduler sends PING_SENT when the probe
+			   actually goes out */
+
 			parse_ping_req (info, &req);
-			send_ping (ping_sock, req.host, i, 
-				   req.seq_no, req.size);
-			make_ping_req (info, &req);
-			make_msg (buf, PING_SENT, info);
+			target = find_target (req.host);
+			if (target != TARGET_NONE)
+			  {
+			    probe.target = target;
+			    probe.seq = req.seq_no;
+			    probe.size = req.size;
+			    probe.client = i;
+			    probe.class = sched_class (req.priority);
+			    probe.flags = 0;
+			    probe.timeout = 0;
+			    probe.queued = now_msec ();
+			    queued = sched_enqueue (&sched, &probe);
+			  }
+			if (!queued)
+			  {
+			    make_ping_req (info, &req);
+			    make_msg (buf, PING_REJECTED, info);
+			  }
+			break;
+
+		      case WATCH_TARGET:
+			parse_watch_req (info, &watch);
+			target = find_target (watch.host);
+			if (target == TARGET_NONE)
+			  {
+			    make_msg (buf, UNSUPPORTED_MESSAGE, 
+				      "Unknown host");
+			    break;
+			  }
+			if (watch.interval > 0 
+			    && watch.interval < WHEEL_TICK_MSEC)
+			  watch.interval = WHEEL_TICK_MSEC;
+
+			if (!adapt_watch (&adapt, &targets, target,
+					  watch.interval))
+			  {
+			    make_msg (buf, UNSUPPORTED_MESSAGE,
+				      "Out of memory");
+			    break;
+			  }
+
+			if (watch.interval > 0 
+			    && targets.info[target].interval == 0)
+			  watching++;
+			else if (watch.interval == 0 
+				 && targets.info[target].interval > 0)
+			  watching--;
+			targets.info[target].interval = watch.interval;
+			targets.info[target].size = watch.size;
+			targets.info[target].owner = i;
+			target_schedule (&targets, target, 
+					 watch.interval ? now_msec () : 0);
+
+			make_watch_req (info, &watch);
+			make_msg (buf, WATCH_OK, info);
+			break;
 
+		      case TOP_QUERY:
+			/* the entries, worst first, then TOP_END */
+
+			parse_top_query (info, &query);
+			if (query.count > TOP_MAX)
+			  query.count = TOP_MAX;
+			n = topk_query (&topk, &targets, &query, entries);
+			for (k = 0; k < n && client_sock[i] != -1; k++)
+			  {
+			    make_top_entry (info, &entries[k]);
+			    reply_client (client_sock, i, TOP_ENTRY, info);
+			  }
+			query.count = n > 0 ? n : 0;
+			make_top_query (info, &query);
+			make_msg (buf, TOP_END, info);
+			break;
+
+		      case PMTU_QUERY:
+			/* answered now if it's cached, otherwise when
+			   the measurement finishes */
+
+			parse_pmtu_msg (info, &pm);
+			target = find_target (pm.host);
+			if (target != TARGET_NONE && pmtu_fd != -1)
+			  {
+			    unsigned int mtu;
+
+			    mtu = pmtu_lookup (&pmtu, target, now_msec ());
+			    if (mtu > 0 && (pm.mtu == 0 || mtu <= pm.mtu))
+			      {
+				pm.mtu = mtu;
+				make_pmtu_msg (info, &pm);
+				make_msg (buf, PMTU_RESULT, info);
+				break;
+			      }
+			    queued = pmtu_start (&pmtu, target, i, pm.mtu);
+			  }
+			if (!queued)
+			  {
+			    pm.mtu = 0;
+			    make_pmtu_msg (info, &pm);
+			    make_msg (buf, PMTU_RESULT, info);
+			  }
+			break;
+
+		      case ALERT_SET:
+			/* compiled once here; tested on every reply */
+
+			n = alert_add (&alerts, i, info, &error, &k);
+			if (n >= 0)
+			  {
+			    snprintf (reply, MAX_MSGLEN, "%d", n);
+			    make_msg (buf, ALERT_OK, reply);
+			  }
+			else
+			  {
+			    snprintf (reply, MAX_MSGLEN, "%d %s", k, error);
+			    make_msg (buf, ALERT_BAD, reply);
+			  }
+			break;
+
+		      case ALERT_DELETE:
+			if (alert_remove (&alerts, i, atoi (info)))
+			  make_msg (buf, ALERT_OK, info);
+			else
+			  make_msg (buf, UNSUPPORTED_MESSAGE, "No such alert");
+			break;
+
+		      case HANDOVER:
+			/* a new daemon wants to take over.  if this
+			   works we exit and it carries on where we
+			   stopped.  it gets every socket we have, so
+			   it had better be us */
+
+			if (!peer_is_us (client_sock[i]))
+			  {
+			    make_msg (buf, UNSUPPORTED_MESSAGE,
+				      "Handover refused");
+			    break;
+			  }
+			hand_over (client_sock, i, comm_sock, ping_sock,
+				   measure_fd);
+			make_msg (buf, UNSUPPORTED_MESSAGE, 
+				  "Handover failed");
+			break;
+
+		      case TRACE_DUMP:
+			/* always to TRACE_FILE: we run as root, so a
+			   file named by a client could be anything */
+
+			n = trace_dump_file (TRACE_FILE);
+			trace (tr, TRACE_DUMPED, n > 0 ? n : 0);
+			if (n >= 0)
+			  {
+			    snprintf (reply, MAX_MSGLEN, "%d %s", n,
+				      TRACE_FILE);
+			    make_msg (buf, TRACE_OK, reply);
+			  }
+			else
+			  make_msg (buf, UNSUPPORTED_MESSAGE, 
+				    "Can't write the trace");
+			break;
+
+		      case BINARY_ACKS:
+			/* this client's replies skip the text from now
+			   on; none are waiting, since every batch is
+			   sent before we read requests */
+
+			reply_binary (&replies, i, 1);
+			make_msg (buf, BINARY_OK, "Binary acks it is");
 			break;
 
 		      case CLIENT_SIGNOFF:
@@ -187,29 +577,384 @@ int main (int argc, char *argv[])
 			break;
 		      }
 		    
+		    trace_end (tr, TRACE_REQUEST, msg);
+		    if (queued || client_sock[i] == -1)
+		      continue;
+
+		    trace_begin (tr, TRACE_CLIENT_SEND, i);
 		    result = send (client_sock[i], buf, MAX_MSGLEN, 0);
+		    trace_end (tr, TRACE_CLIENT_SEND, i);
 		    if (result < 0)
 		      {
 			perror ("Sending to client");
-			close(client_sock[i]);
-			client_sock[i] = -1;
+			drop_client (client_sock, i);
 		      }
 		    else if (result == 0)
 		      {
 			printf ("Client closed socket.\n");
-			close(client_sock[i]);
-			client_sock[i] = -1;
+			drop_client (client_sock, i);
 		      }
 		    
 		  }
 	      }
 	}
-      
+
+      run_scheduler (client_sock, ping_sock, now_msec ());
+      if (pmtu_fd != -1)
+	run_pmtu (client_sock, now_msec ());
+
+      /* the rankings catch up once the I/O is done */
+
+      topk_flush (&topk, &targets);
     }
   
   return 0;
 }
 
+long now_msec (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec * 1000L + tv.tv_usec / 1000;
+}
+
+unsigned int find_target (char *host)
+     /* look a host up in the target table, resolving and adding it
+	the first time we see it; the table doubles as our resolver
+	cache
+	host: hostname or dotted quad
+	returns: the target id, or TARGET_NONE if it doesn't resolve
+     */
+{
+  unsigned int id;
+  struct in_addr addr;
+
+  id = target_by_name (&targets, host);
+  if (id != TARGET_NONE)
+    return id;
+
+  /* a lookup can stall the whole loop, so it's worth seeing */
+
+  trace_begin (tr, TRACE_RESOLVE, 0);
+  if (resolve_host (host, &addr) != PING_OK)
+    id = TARGET_NONE;
+  else
+    id = target_add (&targets, host, addr.s_addr);
+  trace_end (tr, TRACE_RESOLVE, id);
+  return id;
+}
+
+void send_due (unsigned int ping_sock, long now)
+     /* probe every watched target whose time has come, and put it
+	back on the schedule
+	ping_sock: the ICMP socket
+	now: the current time in msec
+	returns: nothing
+     */
+{
+  unsigned int ids[DUE_BATCH];
+  unsigned int n, k;
+
+  do
+    {
+      n = targets_due (&targets, now, ids, DUE_BATCH);
+      for (k = 0; k < n; k++)
+	{
+	  unsigned int id = ids[k];
+	  struct target_info *info = &targets.info[id];
+	  struct probe probe;
+
+	  if (info->interval == 0)
+	    continue;
+
+	  /* over the budget, the probe waits a tick */
+
+	  if (!adapt_admit (&adapt, now))
+	    {
+	      target_schedule (&targets, id, now + WHEEL_TICK_MSEC);
+	      continue;
+	    }
+
+	  /* watches are bulk work; if the owner's queue is full this
+	     round is skipped */
+
+	  probe.target = id;
+	  probe.seq = targets.sent[id] & 0xffff;
+	  probe.size = info->size;
+	  probe.client = info->owner;
+	  probe.class = SCHED_BULK;
+	  probe.flags = PROBE_WATCH;
+	  probe.timeout = adapt_timeout (&adapt, id);
+	  probe.queued = now;
+	  sched_enqueue (&sched, &probe);
+	  target_schedule (&targets, id,
+			   now + adapt_interval (&adapt, &targets, id));
+	}
+    }
+  while (n == DUE_BATCH);
+}
+
+void run_scheduler (long client_sock[], unsigned int ping_sock, long now)
+     /* retire probes that have timed out, then send whatever the
+	scheduler picks
+	client_sock: the client socket array
+	ping_sock: the ICMP socket
+	now: the current time in msec
+	returns: nothing
+     */
+{
+  struct probe probes[DISPATCH_BATCH];
+  int n, k;
+
+  do
+    {
+      n = sched_expire (&sched, now, probes, DISPATCH_BATCH);
+      for (k = 0; k < n; k++)
+	{
+	  target_lost (&targets, probes[k].target);
+	  if (adapt.budget > 0 && targets.info[probes[k].target].interval
+	      && adapt_lost (&adapt, &targets, probes[k].target)
+		 & ADAPT_FASTER)
+	    target_hurry (&targets, probes[k].target, now);
+	  topk_touch (&topk, &targets, probes[k].target);
+	  check_alerts (client_sock, probes[k].target,
+			SCHED_TIMEOUT_MSEC * 1000.0f);
+	}
+    }
+  while (n == DISPATCH_BATCH);
+
+  do
+    {
+      n = sched_dispatch (&sched, now, probes, DISPATCH_BATCH);
+      for (k = 0; k < n; k++)
+	{
+	  struct probe *p = &probes[k];
+	  struct in_addr addr;
+
+	  addr.s_addr = targets.addr[p->target];
+	  trace_begin (tr, TRACE_SENDTO, p->target);
+	  send_ping_to (ping_sock, addr, p->client, p->seq, p->size);
+	  trace_end (tr, TRACE_SENDTO, p->target);
+	  target_sent (&targets, p->target);
+
+	  if (!(p->flags & PROBE_WATCH) && client_sock[p->client] != -1)
+	    {
+	      struct ping_req req;
+	      char info[MAX_MSGLEN];
+
+	      strlcpy (req.host, target_name (&targets, p->target), MAX_HOST);
+	      req.id = p->client;
+	      req.seq_no = p->seq;
+	      req.size = p->size;
+	      req.priority = sched_priority (p->class);
+	      make_ping_req (info, &req);
+	      reply_client (client_sock, p->client, PING_SENT, info);
+	    }
+	}
+    }
+  while (n == DISPATCH_BATCH);
+}
+
+void check_alerts (long client_sock[], unsigned int target, float last)
+     /* test the alerts against a target whose statistics just changed,
+	and tell the owners of any whose answer changed
+	client_sock: the client socket array
+	target: the target's id
+	last: the RTT that changed them, usec
+	returns: nothing
+     */
+{
+  struct alert_crossing crossed[ALERT_MAX];
+  struct alert_msg am;
+  char info[MAX_MSGLEN];
+  int n, k, owner;
+
+  n = alerts_check (&alerts, &targets, target, last, crossed);
+  for (k = 0; k < n; k++)
+    {
+      owner = alerts.a[crossed[k].alert].owner;
+      if (owner < 0 || client_sock[owner] == -1)
+	continue;
+      am.id = crossed[k].alert;
+      am.raised = crossed[k].raised;
+      am.value = crossed[k].value;
+      strlcpy (am.host, target_name (&targets, target), MAX_HOST);
+      make_alert_msg (info, &am);
+      reply_client (client_sock, owner, ALERT_CROSSED, info);
+    }
+}
+
+void run_pmtu (long client_sock[], long now)
+     /* move PMTU discovery along, and tell clients what it found
+	client_sock: the client socket array
+	now: the current time in msec
+	returns: nothing
+     */
+{
+  struct pmtu_done done[DISPATCH_BATCH];
+  int n, k, c;
+
+  pmtu_send (&pmtu, &targets, now);
+  do
+    {
+      n = pmtu_poll (&pmtu, now, done, DISPATCH_BATCH);
+      for (k = 0; k < n; k++)
+	{
+	  struct pmtu_msg pm;
+	  char info[MAX_MSGLEN];
+
+	  strlcpy (pm.host, target_name (&targets, done[k].target), MAX_HOST);
+	  pm.mtu = done[k].mtu;
+	  make_pmtu_msg (info, &pm);
+	  for (c = 0; c < MAX_CLIENTS; c++)
+	    if ((done[k].waiting & (1 << c)) && client_sock[c] != -1)
+	      reply_client (client_sock, c, PMTU_RESULT, info);
+	}
+    }
+  while (n == DISPATCH_BATCH);
+}
+
+void reply_client (long client_sock[], int client, int msg, char *text)
+     /* send a message to a client, dropping it if that fails
+	client_sock: the client socket array
+	client: the client's slot
+	msg, text: the message
+	returns: nothing
+     */
+{
+  char buf[MAX_MSGLEN];
+  int result;
+
+  trace_begin (tr, TRACE_FORMAT, client);
+  make_msg (buf, msg, text);
+  trace_end (tr, TRACE_FORMAT, client);
+  trace_begin (tr, TRACE_CLIENT_SEND, client);
+  result = send (client_sock[client], buf, MAX_MSGLEN, 0);
+  trace_end (tr, TRACE_CLIENT_SEND, client);
+  if (result < 0)
+    {
+      perror ("Sending to client");
+      drop_client (client_sock, client);
+    }
+  else if (result == 0)
+    {
+      printf ("Client closed socket.\n");
+      drop_client (client_sock, client);
+    }
+}
+
+void drop_client (long client_sock[], int client)
+     /* close a client's connection and stop probing on its behalf
+	client_sock: the client socket array
+	client: the client's slot
+	returns: nothing
+     */
+{
+  unsigned int id;
+
+  trace (tr, TRACE_DROP, client);
+  close (client_sock[client]);
+  client_sock[client] = -1;
+  client_in[client].len = 0;
+  reply_forget (&replies, client);
+  sched_forget (&sched, client);
+  pmtu_forget (&pmtu, client);
+  alerts_forget (&alerts, client);
+
+  for (id = 0; id < targets.count && watching > 0; id++)
+    if (targets.info[id].owner == client && targets.info[id].interval)
+      {
+	adapt_watch (&adapt, &targets, id, 0);
+	targets.info[id].interval = 0;
+	target_schedule (&targets, id, 0);
+	watching--;
+      }
+}
+
+void deliver_ack (long client_sock[], struct ping_ack *ack)
+     /* credit a ping reply to its target and route it to the client
+	that asked for it
+	client_sock: the client socket array
+	ack: the parsed reply; its id is the client's slot
+	returns: nothing
+     */
+{
+  unsigned int target;
+  struct probe probe;
+  int in_flight;
+
+  /* the raw socket sees every echo reply for the host, including
+     ones to PMTU probes and other programs' pings */
+
+  if (ack->id >= MAX_CLIENTS)
+    return;
+
+  target = target_by_addr (&targets, ack->addr);
+  if (target != TARGET_NONE)
+    {
+      float rtt = ack->d_sec * 1e6 + (int) ack->d_usec;
+
+      in_flight = sched_reply (&sched, ack->id, ack->seq_no, target,
+			       &probe);
+      target_reply (&targets, target, rtt);
+
+      /* a watch whose target has started misbehaving is probed again
+	 straight away, not after the long interval it had while it
+	 was quiet.  a reply to a probe already given up on has been
+	 counted as a loss */
+
+      if (adapt.budget > 0 && targets.info[target].interval && in_flight
+	  && adapt_reply (&adapt, &targets, target, rtt) & ADAPT_FASTER)
+	target_hurry (&targets, target, now_msec ());
+      topk_touch (&topk, &targets, target);
+      check_alerts (client_sock, target, rtt);
+    }
+
+  /* now we figure out who this ping belongs to, and route it that
+     way - first, if it's not one we care about, then we simply
+     forget about it.  it goes out with the rest of the batch, from
+     flush_replies, unless its client's slot is full now */
+
+  if (ack->id < MAX_CLIENTS && client_sock[ack->id] != -1
+      && reply_queue (&replies, ack))
+    flush_client (client_sock, ack->id);
+}
+
+void flush_client (long client_sock[], int client)
+     /* send a client the replies queued for it, formatting them
+	first if it takes text, and drop it if that fails
+	client_sock: the client socket array
+	client: the client's slot
+	returns: nothing
+     */
+{
+  trace_begin (tr, TRACE_FORMAT, client);
+  reply_format (&replies, client);
+  trace_end (tr, TRACE_FORMAT, client);
+
+  trace_begin (tr, TRACE_CLIENT_SEND, client);
+  if (!reply_send (&replies, client, client_sock[client]))
+    {
+      perror ("Sending to client");
+      drop_client (client_sock, client);
+    }
+  trace_end (tr, TRACE_CLIENT_SEND, client);
+}
+
+void flush_replies (long client_sock[])
+     /* send every client with replies waiting its share of the batch
+	client_sock: the client socket array
+	returns: nothing
+     */
+{
+  int c;
+
+  for (c = 0; c < MAX_CLIENTS; c++)
+    if (replies.slot[c].n > 0 && client_sock[c] != -1)
+      flush_client (client_sock, c);
+}
+
 void add_to_fdset (fd_set *fds, long fd, unsigned int *max)
      /* add an element to the fd_set
 	fds: the fd_set
@@ -244,6 +989,276 @@ unsigned int set_from_array (fd_set *fds, long array[])
   return maxfs;
 }
 
+int connect_running (char *sockfile)
+     /* see if a daemon is already listening on sockfile, and clear
+	the socket file away if it's left over from one that died
+	sockfile: path to the unix domain socket file
+	returns: a connection to the running daemon, or -1 if there
+	  isn't one
+     */
+{
+  struct sockaddr_un remote;
+  int sock, len;
+
+  sock = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (sock == -1)
+    {
+      perror ("server comm socket");
+      exit (1);
+    }
+
+  remote.sun_family = AF_UNIX;
+  strlcpy (remote.sun_path, sockfile, 104);
+  len = strlen (remote.sun_path) + sizeof(remote.sun_family) + 1;
+  if (connect (sock, (struct sockaddr *) &remote, len) == 0)
+    return sock;
+
+  if (errno == ECONNREFUSED)
+    unlink (sockfile);
+  close (sock);
+  return -1;
+}
+
+int peer_is_us (int sock)
+     /* is the process at the other end of a client socket running as
+	the same user we are?
+	sock: the client's socket
+	returns: 1 if so, 0 if not or if we can't tell
+     */
+{
+#ifdef __linux__
+  struct ucred cred;
+  socklen_t len = sizeof cred;
+
+  if (getsockopt (sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+    {
+      perror ("Checking a client's credentials");
+      return 0;
+    }
+  return cred.uid == geteuid ();
+#else
+  uid_t uid;
+  gid_t gid;
+
+  if (getpeereid (sock, &uid, &gid) == -1)
+    {
+      perror ("Checking a client's credentials");
+      return 0;
+    }
+  return uid == geteuid ();
+#endif
+}
+
+void hand_over (long client_sock[], int to, unsigned int comm_sock,
+		unsigned int ping_sock, int measure_fd)
+     /* give our sockets and state to a replacement daemon, and exit.
+	the listening socket, the ICMP socket and every client go
+	across with SCM_RIGHTS, so connections stay up, and replies
+	to probes in flight wait on the ICMP socket for the new
+	process.  requests a client has sent that we haven't read
+	wait on its socket the same way, and the part of one we have
+	read goes across in the snapshot.
+	client_sock: the client socket array
+	to: the slot the replacement connected on
+	comm_sock, ping_sock: the listening and ICMP sockets
+	measure_fd: the measurement thread's wakeup fd, or -1
+	returns: only if the handover failed
+     */
+{
+  int fds[2 + MAX_CLIENTS];
+  char cbuf[CMSG_SPACE (sizeof fds)];
+  char buf[MAX_MSGLEN];
+  char text[MAX_MSGLEN];
+  struct msghdr mh;
+  struct iovec iov;
+  struct cmsghdr *cm;
+  int nfds = 0;
+  int len = 0;
+  int c;
+
+  /* the slots, then which of them take binary acks; a daemon that
+     doesn't know about those reads the slots and stops */
+
+  fds[nfds++] = comm_sock;
+  fds[nfds++] = ping_sock;
+  text[0] = '\0';
+  for (c = 0; c < MAX_CLIENTS; c++)
+    if (client_sock[c] != -1 && c != to)
+      {
+	fds[nfds++] = client_sock[c];
+	len += snprintf (text + len, MAX_MSGLEN - len, " %d", c);
+      }
+  snprintf (text + len, MAX_MSGLEN - len, " b %u", replies.binary);
+  make_msg (buf, HANDOVER_STATE, text);
+
+  memset (&mh, 0, sizeof mh);
+  iov.iov_base = buf;
+  iov.iov_len = MAX_MSGLEN;
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = cbuf;
+  mh.msg_controllen = CMSG_SPACE (nfds * sizeof (int));
+  cm = CMSG_FIRSTHDR (&mh);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN (nfds * sizeof (int));
+  memcpy (CMSG_DATA (cm), fds, nfds * sizeof (int));
+
+  if (sendmsg (client_sock[to], &mh, 0) != MAX_MSGLEN)
+    {
+      perror ("Handing over sockets");
+      return;
+    }
+
+  /* once the sockets are across there's no going back: the new
+     daemon is serving our clients whether or not it gets the rest.
+     it doesn't touch them until it has the snapshot, though, so
+     until then they're still ours.
+
+     the measurement thread only stops now, so that a handover that
+     fails above leaves it running.  replies it has already timed
+     are ours to deliver; newer ones stay on the socket */
+
+  if (measure_fd != -1)
+    {
+      int n, k;
+
+      measure_stop ();
+      do
+	{
+	  n = measure_drain (replies.acks, REPLY_BATCH);
+	  for (k = 0; k < n; k++)
+	    deliver_ack (client_sock, &replies.acks[k]);
+	  flush_replies (client_sock);
+	}
+      while (n == REPLY_BATCH);
+    }
+
+  /* PMTU sessions don't go across; whoever is waiting on one hears
+     now, rather than never */
+
+  pmtu_abandon (&pmtu);
+  run_pmtu (client_sock, now_msec ());
+
+  if (!snapshot_write (client_sock[to], &targets, &sched, &alerts,
+		       client_in))
+    perror ("Handing over state");
+  printf ("Handed over %d clients and %u targets; exiting\n",
+	  nfds - 2, targets.count);
+  exit (0);
+}
+
+void take_over (int sock, unsigned int *comm_sock, unsigned int *ping_sock,
+		long client_sock[])
+     /* ask the running daemon for its sockets and state, and carry
+	on where it leaves off
+	sock: our connection to the running daemon
+	comm_sock, ping_sock: set to the listening and ICMP sockets
+	client_sock: filled in with the clients, in their old slots
+	returns: nothing; exits if the handover fails
+     */
+{
+  int fds[2 + MAX_CLIENTS];
+  char cbuf[CMSG_SPACE (sizeof fds)];
+  char buf[MAX_MSGLEN];
+  char info[MAX_MSGLEN];
+  struct timeval start, end;
+  struct msghdr mh;
+  struct iovec iov;
+  struct cmsghdr *cm;
+  unsigned int id, binary;
+  char *p;
+  long slot;
+  int nfds, msg, k;
+
+  gettimeofday (&start, NULL);
+  make_msg (buf, HANDOVER, "Your turn is over");
+  if (send (sock, buf, MAX_MSGLEN, 0) != MAX_MSGLEN)
+    {
+      perror ("Asking for handover");
+      exit (1);
+    }
+
+  memset (&mh, 0, sizeof mh);
+  iov.iov_base = buf;
+  iov.iov_len = MAX_MSGLEN;
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = cbuf;
+  mh.msg_controllen = sizeof cbuf;
+  if (recvmsg (sock, &mh, MSG_WAITALL) != MAX_MSGLEN)
+    {
+      perror ("Waiting for handover");
+      exit (1);
+    }
+  parse_msg (buf, &msg, info);
+  cm = CMSG_FIRSTHDR (&mh);
+  if (msg != HANDOVER_STATE || cm == NULL
+      || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+    {
+      fprintf (stderr, "ping-server: the running daemon refused to "
+	       "hand over (%s)\n", info);
+      exit (1);
+    }
+  nfds = (cm->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+  memcpy (fds, CMSG_DATA (cm), nfds * sizeof (int));
+
+  *comm_sock = fds[0];
+  *ping_sock = fds[1];
+  for (p = info, k = 2; k < nfds; k++)
+    {
+      slot = strtol (p, &p, 10);
+      if (slot >= 0 && slot < MAX_CLIENTS)
+	client_sock[slot] = fds[k];
+      else
+	close (fds[k]);
+    }
+  while (*p == ' ')
+    p++;
+  if (*p == 'b')
+    {
+      binary = strtoul (p + 1, NULL, 10);
+      for (slot = 0; slot < MAX_CLIENTS; slot++)
+	if (binary & 1 << slot && client_sock[slot] != -1)
+	  reply_binary (&replies, slot, 1);
+    }
+
+  if (!snapshot_read (sock, &targets, &sched, &alerts, client_in))
+    {
+      fprintf (stderr, "ping-server: bad state snapshot from the "
+	       "running daemon\n");
+      exit (1);
+    }
+  close (sock);
+
+  /* the rankings aren't in the snapshot; rebuild them */
+
+  for (id = 0; id < targets.count; id++)
+    {
+      if (targets.info[id].interval)
+	{
+	  /* adapt_watch wants to see the watch as new */
+
+	  unsigned int interval = targets.info[id].interval;
+
+	  targets.info[id].interval = 0;
+	  adapt_watch (&adapt, &targets, id, interval);
+	  targets.info[id].interval = interval;
+	  watching++;
+	}
+      if (targets.recd[id] || targets.loss[id] > 0)
+	topk_touch (&topk, &targets, id);
+    }
+  topk_flush (&topk, &targets);
+
+  gettimeofday (&end, NULL);
+  printf ("Took over in %.1f msec: %d clients, %u targets, "
+	  "%u probes in flight\n",
+	  (end.tv_sec - start.tv_sec) * 1e3
+	  + (end.tv_usec - start.tv_usec) / 1e3,
+	  nfds - 2, targets.count, sched.in_total);
+}
+
 unsigned int init_server (char *sockfile, int clients)
      /* initialize the client-server communications 
       * sockfile: path to the unix domain socket file
@@ -269,9 +1284,12 @@ unsigned int init_server (char *sockfile, int clients)
   /* NB: the OpenBSD sockaddr_un struct has 104 characters of room for
      the path.  This may be different on other platforms. */
 
+  /* anything already at sockfile is either a live daemon, which
+     connect_running has dealt with, or one that was cleared away
+     as stale; if another daemon got there in between, bind fails */
+
   comm_local.sun_family = AF_UNIX;
   strlcpy (comm_local.sun_path, sockfile, 104);
-  result = unlink (sockfile);
   len = strlen (comm_local.sun_path) + sizeof(comm_local.sun_family) + 1;
   result = bind (comm_sock, (struct sockaddr *)&comm_local, len);
 
@@ -0,0 +1,377 @@
+/* ping-trace.c */
+/* reads a flight recorder dump (see trace.h) and says where the
+   daemon's time went.
+
+     ping-trace [-j] [-n slowest] [dump]
+
+   the dump is TRACE_FILE unless another is named; the daemon writes it
+   on SIGUSR2, or on TRACE_DUMP (ping-client trace).
+
+   by default it prints, for each thread, every kind of span -- time in
+   select, recvfrom, parsing, formatting, sends to clients, sendto,
+   name lookups, client requests -- with how many there were, the
+   total, and the mean, median, 99th percentile and longest.  then, for
+   the main thread, how the time it was awake divides up, and the
+   -n (default 5) longest stretches between wakeups with what they
+   were spent on: a reply that came late waited through one of those.
+
+   with -j it writes the events as Chrome trace JSON instead, for
+   chrome://tracing or Perfetto. */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ipc-msgs.h"
+#include "trace.h"
+
+struct thread
+{
+  char name[TRACE_NAME + 1];
+  struct trace_event *e;
+  unsigned long n;
+};
+
+static const char *kind_names[TRACE_KINDS] =
+  {
+    "?", "sleep", "accept", "recvfrom", "parse", "format", "client send",
+    "sendto", "resolve", "request", "drain", "drop", "dump"
+  };
+
+static double usec_per_tick;
+static unsigned long origin;
+
+static double usec (unsigned long when)
+{
+  return (when - origin) * usec_per_tick;
+}
+
+static const char *kind_name (int kind)
+{
+  kind &= ~TRACE_BEGIN;
+  return kind > 0 && kind < TRACE_KINDS ? kind_names[kind] : "?";
+}
+
+static int read_dump (FILE *in, struct thread **threads, int *count)
+     /* returns: 1, or 0 if the dump is bad; the events it keeps are
+	the ones the rings can't have overwritten during the dump */
+{
+  struct trace_header h;
+  struct trace_part part;
+  struct thread *t;
+  unsigned long head, skip;
+  int k;
+
+  if (fread (&h, sizeof h, 1, in) != 1 || h.magic != TRACE_MAGIC
+      || h.version != TRACE_VERSION || h.ticks_per_msec == 0
+      || h.rings > TRACE_THREADS)
+    return 0;
+  usec_per_tick = 1000.0 / h.ticks_per_msec;
+
+  *threads = calloc (h.rings + 1, sizeof (struct thread));
+  if (*threads == NULL)
+    return 0;
+  for (k = 0; k < (int) h.rings; k++)
+    {
+      t = &(*threads)[k];
+      if (fread (&part, sizeof part, 1, in) != 1 || part.count > TRACE_RING)
+	return 0;
+      memcpy (t->name, part.name, TRACE_NAME);
+      t->e = malloc ((part.count + 1) * sizeof (struct trace_event));
+      if (t->e == NULL
+	  || fread (t->e, sizeof (struct trace_event), part.count, in)
+	     != part.count
+	  || fread (&head, sizeof head, 1, in) != 1)
+	return 0;
+
+      skip = 0;
+      if (head >= TRACE_RING && head - TRACE_RING + 1 > part.first)
+	skip = head - TRACE_RING + 1 - part.first;
+      if (skip > part.count)
+	skip = part.count;
+      t->n = part.count - skip;
+      memmove (t->e, t->e + skip, t->n * sizeof (struct trace_event));
+    }
+  *count = h.rings;
+  return 1;
+}
+
+static int compare_doubles (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void write_json (struct thread *threads, int count)
+{
+  unsigned long open[TRACE_KINDS];
+  struct trace_event *e;
+  int k, kind, first = 1;
+  unsigned long i;
+
+  printf ("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  for (k = 0; k < count; k++)
+    {
+      printf ("%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+	      "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+	      first ? "" : ",\n", k + 1, threads[k].name);
+      first = 0;
+
+      /* an END whose BEGIN went round the ring before the dump is
+	 left out, so every span that's drawn is whole */
+
+      memset (open, 0, sizeof open);
+      for (i = 0; i < threads[k].n; i++)
+	{
+	  e = &threads[k].e[i];
+	  kind = e->kind & ~TRACE_BEGIN;
+	  if (kind <= 0 || kind >= TRACE_KINDS)
+	    continue;
+	  if (e->kind & TRACE_BEGIN)
+	    open[kind]++;
+	  else if (kind != TRACE_DROP && kind != TRACE_DUMPED
+		   && kind != TRACE_ACCEPT)
+	    {
+	      if (open[kind] == 0)
+		continue;
+	      open[kind]--;
+	    }
+	  printf (",\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,"
+		  "\"tid\":%d,%s\"args\":{\"arg\":%u}}",
+		  kind_name (kind),
+		  e->kind & TRACE_BEGIN ? "B"
+		  : (kind == TRACE_DROP || kind == TRACE_DUMPED
+		     || kind == TRACE_ACCEPT) ? "i" : "E",
+		  usec (e->when), k + 1,
+		  (kind == TRACE_DROP || kind == TRACE_DUMPED
+		   || kind == TRACE_ACCEPT) ? "\"s\":\"t\"," : "",
+		  e->arg);
+	}
+    }
+  printf ("\n]}\n");
+}
+
+struct stretch
+{
+  double start, length;
+  double in[TRACE_KINDS];    /* usec in each kind of span */
+};
+
+static void print_stretch (struct stretch *s)
+{
+  int kind, worst = 0;
+
+  for (kind = 1; kind < TRACE_KINDS; kind++)
+    if (s->in[kind] > s->in[worst])
+      worst = kind;
+  printf ("  at %12.3f msec: %10.1f usec awake", s->start / 1e3,
+	  s->length);
+  if (worst > 0)
+    printf (", %.1f of it in %s", s->in[worst], kind_names[worst]);
+  printf ("\n");
+}
+
+static int compare_stretches (const void *a, const void *b)
+{
+  double x = ((const struct stretch *) a)->length;
+  double y = ((const struct stretch *) b)->length;
+
+  return x > y ? -1 : x < y;
+}
+
+static int breakdown (struct thread *threads, int count, int slowest)
+{
+  double *spans[TRACE_KINDS];
+  unsigned long nspans[TRACE_KINDS];
+  double begun[TRACE_KINDS];
+  double total[TRACE_KINDS];
+  struct stretch *stretches = NULL;
+  unsigned long nstretches = 0;
+  struct stretch now;
+  double awake = 0, asleep = 0, t;
+  struct trace_event *e;
+  unsigned long i, n;
+  int k, kind, main_thread, in_stretch;
+
+  for (k = 0; k < count; k++)
+    {
+      struct thread *th = &threads[k];
+
+      main_thread = strcmp (th->name, "main") == 0;
+      if (th->n == 0)
+	continue;
+      printf ("%s: %lu events over %.3f msec\n", th->name, th->n,
+	      (usec (th->e[th->n - 1].when) - usec (th->e[0].when)) / 1e3);
+      printf ("  %-12s %8s %10s %9s %9s %9s %9s\n", "", "count",
+	      "total ms", "mean us", "p50 us", "p99 us", "max us");
+
+      for (kind = 0; kind < TRACE_KINDS; kind++)
+	{
+	  spans[kind] = malloc ((th->n / 2 + 1) * sizeof (double));
+	  if (spans[kind] == NULL)
+	    return 1;
+	  nspans[kind] = 0;
+	  begun[kind] = -1;
+	  total[kind] = 0;
+	}
+      if (main_thread)
+	{
+	  stretches = malloc ((th->n / 2 + 1) * sizeof (struct stretch));
+	  if (stretches == NULL)
+	    return 1;
+	  nstretches = 0;
+	}
+      in_stretch = 0;
+
+      for (i = 0; i < th->n; i++)
+	{
+	  e = &th->e[i];
+	  kind = e->kind & ~TRACE_BEGIN;
+	  t = usec (e->when);
+	  if (kind <= 0 || kind >= TRACE_KINDS)
+	    continue;
+
+	  /* the main thread's time between waking and going back to
+	     sleep is a stretch; replies and requests that came in
+	     meanwhile waited for it to end */
+
+	  if (main_thread && kind == TRACE_SLEEP)
+	    {
+	      if (e->kind & TRACE_BEGIN && in_stretch)
+		{
+		  now.length = t - now.start;
+		  awake += now.length;
+		  stretches[nstretches++] = now;
+		  in_stretch = 0;
+		}
+	      else if (!(e->kind & TRACE_BEGIN))
+		{
+		  memset (&now, 0, sizeof now);
+		  now.start = t;
+		  in_stretch = 1;
+		}
+	    }
+
+	  if (e->kind & TRACE_BEGIN)
+	    begun[kind] = t;
+	  else if (begun[kind] >= 0)
+	    {
+	      spans[kind][nspans[kind]++] = t - begun[kind];
+	      total[kind] += t - begun[kind];
+	      if (kind == TRACE_SLEEP)
+		asleep += t - begun[kind];
+	      else if (in_stretch)
+		now.in[kind] += t - begun[kind];
+	      begun[kind] = -1;
+	    }
+	  else if (kind == TRACE_ACCEPT || kind == TRACE_DROP
+		   || kind == TRACE_DUMPED)
+	    nspans[kind]++;
+	}
+
+      for (kind = 1; kind < TRACE_KINDS; kind++)
+	{
+	  n = nspans[kind];
+	  if (n == 0)
+	    continue;
+	  if (kind == TRACE_ACCEPT || kind == TRACE_DROP
+	      || kind == TRACE_DUMPED)
+	    {
+	      printf ("  %-12s %8lu\n", kind_names[kind], n);
+	      continue;
+	    }
+	  qsort (spans[kind], n, sizeof (double), compare_doubles);
+	  printf ("  %-12s %8lu %10.3f %9.1f %9.1f %9.1f %9.1f\n",
+		  kind_names[kind], n, total[kind] / 1e3, total[kind] / n,
+		  spans[kind][n / 2], spans[kind][(n - 1) * 99 / 100],
+		  spans[kind][n - 1]);
+	}
+
+      if (main_thread && nstretches > 0)
+	{
+	  printf ("\n  awake %.3f msec, asleep %.3f msec, over %lu "
+		  "wakeups; awake time went on:\n",
+		  awake / 1e3, asleep / 1e3, nstretches);
+	  for (kind = 1; kind < TRACE_KINDS; kind++)
+	    {
+	      double in = 0;
+
+	      for (i = 0; i < nstretches; i++)
+		in += stretches[i].in[kind];
+	      if (in > 0 && kind != TRACE_REQUEST)
+		printf ("    %-12s %5.1f%%\n", kind_names[kind],
+			awake > 0 ? 100 * in / awake : 0);
+	    }
+	  printf ("    (client requests, which include some of the "
+		  "above, %.1f%%)\n",
+		  awake > 0 ? 100 * total[TRACE_REQUEST] / awake : 0);
+
+	  qsort (stretches, nstretches, sizeof *stretches, compare_stretches);
+	  printf ("\n  the %d longest stretches awake:\n",
+		  slowest < (int) nstretches ? slowest : (int) nstretches);
+	  for (i = 0; i < nstretches && (int) i < slowest; i++)
+	    print_stretch (&stretches[i]);
+	}
+      printf ("\n");
+
+      for (kind = 0; kind < TRACE_KINDS; kind++)
+	free (spans[kind]);
+      if (main_thread)
+	free (stretches);
+    }
+  return 0;
+}
+
+int main (int argc, char *argv[])
+{
+  struct thread *threads;
+  char *file = TRACE_FILE;
+  int count, json = 0, slowest = 5;
+  int k, ch;
+  FILE *in;
+
+  while ((ch = getopt (argc, argv, "jn:")) != -1)
+    switch (ch)
+      {
+      case 'j':
+	json = 1;
+	break;
+      case 'n':
+	slowest = atoi (optarg);
+	break;
+      default:
+	fprintf (stderr, "usage: ping-trace [-j] [-n slowest] [dump]\n");
+	return 2;
+      }
+  if (optind < argc)
+    file = argv[optind];
+
+  in = fopen (file, "rb");
+  if (in == NULL)
+    {
+      perror (file);
+      return 1;
+    }
+  if (!read_dump (in, &threads, &count))
+    {
+      fprintf (stderr, "%s: not a flight recorder dump from this "
+	       "machine\n", file);
+      return 1;
+    }
+  fclose (in);
+
+  /* times are from the earliest event in any thread */
+
+  origin = 0;
+  for (k = 0; k < count; k++)
+    if (threads[k].n > 0 && (origin == 0 || threads[k].e[0].when < origin))
+      origin = threads[k].e[0].when;
+
+  if (json)
+    write_json (threads, count);
+  else
+    return breakdown (threads, count, slowest);
+  return 0;
+}
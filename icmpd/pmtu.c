@@ -0,0 +1,494 @@
+/* pmtu.c */
+/* concurrent path MTU discovery */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include <netinet/in_systm.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+
+#include "ipc-msgs.h"
+#include "ping-code.h"
+#include "targets.h"
+#include "pmtu.h"
+
+#define MIN_CACHE 1024
+#define RECEIVE_BATCH 64
+
+#define FINISHED 1
+#define FAILED 2
+
+static int set_df (int sock)
+     /* returns: 1 if outgoing packets on sock will carry DF */
+{
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+  /* set DF, and don't let the kernel's own idea of the path MTU
+     stop a probe bigger than that from going out */
+  int val = IP_PMTUDISC_PROBE;
+
+  return setsockopt (sock, IPPROTO_IP, IP_MTU_DISCOVER,
+		     &val, sizeof val) == 0;
+#elif defined(IP_DONTFRAG)
+  int on = 1;
+
+  return setsockopt (sock, IPPROTO_IP, IP_DONTFRAG, &on, sizeof on) == 0;
+#else
+  return 0;
+#endif
+}
+
+int pmtu_init (struct pmtu *p)
+     /* set up for discovery
+      * returns: the probe socket, which the main loop should watch,
+      *   or -1 if PMTU discovery isn't available
+      */
+{
+  int rcvbuf = PMTU_RCVBUF;
+  unsigned int i;
+
+  memset (p, 0, sizeof *p);
+  for (i = 0; i < PMTU_SESSIONS; i++)
+    {
+      p->sessions[i].target = TARGET_NONE;
+      p->free[i] = PMTU_SESSIONS - 1 - i;
+    }
+  p->n_free = PMTU_SESSIONS;
+
+  p->sock = socket (AF_INET, SOCK_RAW, IPPROTO_ICMP);
+  if (p->sock < 0)
+    {
+      perror ("Getting PMTU socket");
+      return -1;
+    }
+  if (!set_df (p->sock))
+    {
+      fprintf (stderr, "can't set DF on probes; "
+	       "PMTU discovery is off\n");
+      close (p->sock);
+      p->sock = -1;
+      return -1;
+    }
+
+  /* rounds of big replies arrive together */
+
+  setsockopt (p->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+  fcntl (p->sock, F_SETFL, fcntl (p->sock, F_GETFL) | O_NONBLOCK);
+  return p->sock;
+}
+
+static struct pmtu_cached *cache_slot (struct pmtu *p, unsigned int target)
+     /* returns: the cache slot for target, which may be empty */
+{
+  unsigned int h = target * 2654435761u;
+
+  while (p->cache[h & p->cache_mask].key
+	 && p->cache[h & p->cache_mask].key != target + 1)
+    h++;
+  return &p->cache[h & p->cache_mask];
+}
+
+static void cache_store (struct pmtu *p, unsigned int target,
+			 unsigned int mtu, long now)
+{
+  struct pmtu_cached *c;
+
+  /* keep the cache at no more than half load; expired entries are
+     only ever overwritten, so dropping them all when we grow is as
+     good a time as any */
+
+  if ((p->cache_used + 1) * 2 > p->cache_mask + 1 || p->cache == NULL)
+    {
+      struct pmtu_cached *old = p->cache;
+      unsigned int old_slots = p->cache ? p->cache_mask + 1 : 0;
+      unsigned int slots = old_slots ? old_slots * 2 : MIN_CACHE;
+      unsigned int i;
+
+      p->cache = calloc (slots, sizeof *p->cache);
+      if (p->cache == NULL)
+	{
+	  p->cache = old;
+	  return;
+	}
+      p->cache_mask = slots - 1;
+      p->cache_used = 0;
+      for (i = 0; i < old_slots; i++)
+	if (old[i].key && old[i].expires > now)
+	  {
+	    *cache_slot (p, old[i].key - 1) = old[i];
+	    p->cache_used++;
+	  }
+      free (old);
+    }
+
+  c = cache_slot (p, target);
+  if (!c->key)
+    p->cache_used++;
+  c->key = target + 1;
+  c->mtu = mtu;
+  c->expires = now + PMTU_CACHE_MSEC;
+}
+
+unsigned int pmtu_lookup (struct pmtu *p, unsigned int target, long now)
+     /* returns: the cached path MTU to target, or 0 if there's none
+      *   or it has expired
+      */
+{
+  struct pmtu_cached *c;
+
+  if (p->cache == NULL)
+    return 0;
+  c = cache_slot (p, target);
+  if (!c->key || c->expires <= now)
+    return 0;
+  return c->mtu;
+}
+
+static void new_round (struct pmtu_session *s)
+     /* spread this round's probes across what's left of the range,
+	or finish if nothing is left */
+{
+  unsigned int gap = s->hi - s->lo;
+  unsigned int n, k;
+
+  if (gap <= 1)
+    {
+      s->finished = FINISHED;
+      return;
+    }
+
+  n = gap - 1 < PMTU_FANOUT ? gap - 1 : PMTU_FANOUT;
+  for (k = 0; k < n; k++)
+    s->size[k] = s->lo + gap * (k + 1) / (n + 1);
+
+  /* a router told us its MTU; if that's still in range it's very
+     likely the answer, so try it exactly */
+
+  if (s->hint > s->lo && s->hint < s->hi)
+    s->size[0] = s->hint;
+  s->hint = 0;
+
+  s->probes = n;
+  s->unsent = (1 << n) - 1;
+  s->answered = 0;
+  s->tries = 0;
+  s->round++;
+  s->round_end = 0;
+}
+
+static void check_round (struct pmtu_session *s)
+     /* the round's done when every probe still worth having is in */
+{
+  int k;
+
+  for (k = 0; k < s->probes; k++)
+    if (!(s->answered & (1 << k)) && s->size[k] > s->lo
+	&& s->size[k] < s->hi)
+      return;
+  new_round (s);
+}
+
+int pmtu_start (struct pmtu *p, unsigned int target, unsigned int client,
+		unsigned int upper)
+     /* start measuring the path MTU to a target, or join the
+	measurement already under way
+	client: the client slot to answer
+	upper: the largest MTU worth trying, 0 for PMTU_MAX
+	returns: 1 if the client will get an answer, 0 if there are
+	  no sessions free
+     */
+{
+  struct pmtu_session *s;
+  unsigned int i, id;
+
+  for (i = 0; i < p->n_active; i++)
+    if (p->sessions[p->active[i]].target == target)
+      {
+	p->sessions[p->active[i]].waiting |= 1 << client;
+	return 1;
+      }
+  if (p->n_free == 0)
+    return 0;
+
+  if (upper == 0 || upper > PMTU_MAX)
+    upper = PMTU_MAX;
+  if (upper < PMTU_MIN)
+    upper = PMTU_MIN;
+
+  id = p->free[--p->n_free];
+  p->active[p->n_active++] = id;
+  s = &p->sessions[id];
+  memset (s, 0, sizeof *s);
+  s->target = target;
+  s->waiting = 1 << client;
+  s->lo = PMTU_MIN;
+  s->hi = upper + 1;
+  s->rtt = -1;
+  new_round (s);
+  return 1;
+}
+
+void pmtu_forget (struct pmtu *p, unsigned int client)
+     /* a client has gone; measurements go on and are cached */
+{
+  unsigned int i;
+
+  for (i = 0; i < p->n_active; i++)
+    p->sessions[p->active[i]].waiting &= ~(1 << client);
+}
+
+static long round_msec (struct pmtu_session *s, struct target_table *t)
+     /* how long to wait for a round: the session's own RTT if it has
+	one, else the target's smoothed RTT, else PMTU_ROUND_MSEC */
+{
+  float srtt = t->srtt[s->target];
+
+  if (s->rtt >= 0)
+    return s->rtt * 4 + PMTU_SLACK_MSEC;
+  if (srtt == 0)
+    return PMTU_ROUND_MSEC;
+  return srtt * 4 / 1000 + PMTU_SLACK_MSEC;
+}
+
+void pmtu_send (struct pmtu *p, struct target_table *t, long now)
+     /* send up to PMTU_BURST probes, taking sessions in turn */
+{
+  unsigned int budget = PMTU_BURST;
+  unsigned int visited;
+
+  for (visited = 0; visited < p->n_active && budget > 0; visited++)
+    {
+      unsigned int id;
+      struct pmtu_session *s;
+      struct in_addr addr;
+      int k;
+
+      p->cursor = (p->cursor + 1) % p->n_active;
+      id = p->active[p->cursor];
+      s = &p->sessions[id];
+      if (s->finished || !s->unsent)
+	continue;
+
+      addr.s_addr = t->addr[s->target];
+      for (k = 0; k < s->probes && budget > 0; k++)
+	if (s->unsent & (1 << k))
+	  {
+	    unsigned int seq = (s->round & 1) << 15 | id << 3 | k;
+
+	    s->unsent &= ~(1 << k);
+	    budget--;
+	    if (send_ping_to (p->sock, addr, PMTU_ID, seq,
+			      s->size[k] - IP_ICMP_HEADERS) == SEND_ERROR
+		&& errno == EMSGSIZE)
+	      {
+		/* too big for our own interface: that's an answer.  any
+		   other failure counts as a lost probe */
+
+		if (s->size[k] < s->hi)
+		  s->hi = s->size[k];
+		s->answered |= 1 << k;
+	      }
+	  }
+      if (!s->unsent)
+	{
+	  s->sent = now;
+	  s->round_end = now + round_msec (s, t);
+	  check_round (s);
+	}
+    }
+}
+
+static void answer (struct pmtu *p, unsigned int seq, unsigned int size,
+		    unsigned int next_mtu, int too_big, long now)
+     /* fold a reply or a fragmentation-needed error into its session */
+{
+  long rtt;
+
+  unsigned int id = (seq >> 3) & (PMTU_SESSIONS - 1);
+  unsigned int k = seq & 7;
+  struct pmtu_session *s = &p->sessions[id];
+
+  /* stale, or for a session that's since been reused */
+
+  if (s->target == TARGET_NONE || s->finished
+      || (seq >> 15) != (s->round & 1u)
+      || k >= s->probes || s->size[k] != size
+      || (s->answered & (1 << k)))
+    return;
+
+  s->answered |= 1 << k;
+  s->heard = 1;
+
+  /* the first answers tell us how long to wait for the rest */
+
+  rtt = now - s->sent;
+  if (s->round_end && rtt > s->rtt)
+    s->rtt = rtt;
+  if (s->round_end && s->round_end > s->sent + s->rtt * 4 + PMTU_SLACK_MSEC)
+    s->round_end = s->sent + s->rtt * 4 + PMTU_SLACK_MSEC;
+
+  if (!too_big)
+    {
+      if (size > s->lo)
+	s->lo = size;
+    }
+  else
+    {
+      if (size < s->hi)
+	s->hi = size;
+      if (next_mtu > s->lo && next_mtu < s->hi)
+	{
+	  s->hint = next_mtu;
+	  s->hi = next_mtu + 1;
+	}
+    }
+  check_round (s);
+}
+
+void pmtu_receive (struct pmtu *p, long now)
+     /* read what's waiting on the probe socket.  it sees every ICMP
+	packet for the host; we only want echo replies to our probes
+	and fragmentation-needed errors quoting them */
+{
+  char packet[MAX_PACKET];
+  int n;
+
+  for (n = 0; n < RECEIVE_BATCH; n++)
+    {
+      struct sockaddr_in from;
+      socklen_t fromlen = sizeof from;
+      struct ip *ip, *inner;
+      struct icmp *icp, *inner_icp;
+      int cc, hlen, inner_hlen;
+
+      cc = recvfrom (p->sock, packet, MAX_PACKET, 0,
+		     (struct sockaddr *) &from, &fromlen);
+      if (cc <= 0)
+	return;
+
+      ip = (struct ip *) packet;
+      hlen = ip->ip_hl << 2;
+      if (cc < hlen + ICMP_MINLEN)
+	continue;
+      icp = (struct icmp *) (packet + hlen);
+
+      if (icp->icmp_type == ICMP_ECHOREPLY && icp->icmp_id == PMTU_ID)
+	{
+	  /* the reply is the size of the probe */
+
+	  answer (p, icp->icmp_seq, cc, 0, 0, now);
+	  continue;
+	}
+
+      if (icp->icmp_type != ICMP_UNREACH
+	  || icp->icmp_code != ICMP_UNREACH_NEEDFRAG)
+	continue;
+
+      /* the error quotes our probe's IP header and the first 8 bytes
+	 of its ICMP header */
+
+      inner = &icp->icmp_ip;
+      inner_hlen = inner->ip_hl << 2;
+      if (cc < hlen + 8 + inner_hlen + 8 || inner->ip_p != IPPROTO_ICMP)
+	continue;
+      inner_icp = (struct icmp *) ((char *) inner + inner_hlen);
+      if (inner_icp->icmp_type != ICMP_ECHO || inner_icp->icmp_id != PMTU_ID)
+	continue;
+      answer (p, inner_icp->icmp_seq, ntohs (inner->ip_len),
+	      ntohs (icp->icmp_nextmtu), 1, now);
+    }
+}
+
+int pmtu_poll (struct pmtu *p, long now, struct pmtu_done *out, int max)
+     /* close rounds that have timed out, and collect finished
+	sessions
+	out: where to put the results, for the clients in waiting
+	max: how many fit
+	returns: the number of results
+     */
+{
+  unsigned int i = 0;
+  int n = 0;
+
+  while (i < p->n_active && n < max)
+    {
+      unsigned int id = p->active[i];
+      struct pmtu_session *s = &p->sessions[id];
+      int k;
+
+      if (!s->finished && s->round_end && s->round_end <= now)
+	{
+	  unsigned char lost = 0;
+	  unsigned int smallest = s->hi;
+
+	  for (k = 0; k < s->probes; k++)
+	    if (!(s->answered & (1 << k)) && s->size[k] > s->lo
+		&& s->size[k] < s->hi)
+	      {
+		lost |= 1 << k;
+		if (s->size[k] < smallest)
+		  smallest = s->size[k];
+	      }
+
+	  if (lost && ++s->tries < PMTU_TRIES)
+	    {
+	      /* give the missing probes another chance */
+
+	      s->unsent = lost;
+	      s->round_end = 0;
+	    }
+	  else if (lost && !s->heard)
+	    s->finished = FAILED;
+	  else
+	    {
+	      /* lost every time: too big, with nobody saying so */
+
+	      s->hi = smallest;
+	      new_round (s);
+	    }
+	}
+
+      if (!s->finished)
+	{
+	  i++;
+	  continue;
+	}
+
+      out[n].target = s->target;
+      out[n].mtu = s->finished == FINISHED ? s->lo : 0;
+      out[n].waiting = s->waiting;
+      n++;
+      if (s->finished == FINISHED)
+	cache_store (p, s->target, s->lo, now);
+
+      s->target = TARGET_NONE;
+      p->free[p->n_free++] = id;
+      p->active[i] = p->active[--p->n_active];
+    }
+  return n;
+}
+
+int pmtu_busy (struct pmtu *p)
+{
+  return p->n_active > 0;
+}
+
+void pmtu_abandon (struct pmtu *p)
+     /* give up on every session in progress; the next pmtu_poll
+	hands them back as failed, with an mtu of 0 */
+{
+  unsigned int i;
+
+  for (i = 0; i < p->n_active; i++)
+    if (!p->sessions[p->active[i]].finished)
+      p->sessions[p->active[i]].finished = FAILED;
+}
@@ -0,0 +1,97 @@
+/* pmtu.h */
+/* path MTU discovery.  each target being measured gets a session
+   that keeps the range the path MTU must lie in: lo, a size known to
+   get through, and hi, a size known not to.  every round sends up to
+   PMTU_FANOUT echo probes with the DF bit set, spread across that
+   range, all at once.  replies raise lo; fragmentation-needed errors
+   lower hi, and the next-hop MTU they carry becomes one of the next
+   round's sizes.  a probe nobody answers is sent again, and only
+   counts against its size if it's lost PMTU_TRIES times, since a
+   lost probe and a black-holed one look the same.  a round shrinks
+   the range about ninefold, so from 68 to 9000 takes four or five
+   round trips, and a router that reports its MTU ends it in two.
+
+   probes go out on a raw socket of their own, with DF set on it, so
+   ordinary probes are unaffected, and they are paced at PMTU_BURST
+   per pass of the main loop so that thousands of sessions can't
+   crowd out other traffic.  their ICMP id is PMTU_ID, which no
+   client slot has, and the sequence number says which session and
+   which probe.  results are cached per target for PMTU_CACHE_MSEC.
+
+   sessions and the cache aren't part of a handover.  the old daemon
+   gives up on queries still in progress with pmtu_abandon and
+   answers them with an mtu of 0, so their clients know to ask the
+   new one again.
+
+   pmtu.h needs ipc-msgs.h and targets.h. */
+
+#define PMTU_ID MAX_CLIENTS
+#define PMTU_MIN 68           /* every IPv4 path carries this */
+#define PMTU_MAX 9000
+#define PMTU_FANOUT 8         /* probes per round; at most 8 */
+#define PMTU_TRIES 2
+#define PMTU_ROUND_MSEC 1000  /* round timeout until we know the RTT */
+#define PMTU_SLACK_MSEC 20    /* added to four RTTs for a round timeout */
+#define PMTU_SESSIONS 4096    /* must be a power of two, at most 4096 */
+#define PMTU_BURST 64         /* probes per pass */
+#define PMTU_CACHE_MSEC (10 * 60 * 1000)
+#define PMTU_RCVBUF (1024 * 1024)
+#define IP_ICMP_HEADERS 28
+
+struct pmtu_session
+{
+  unsigned int target;     /* TARGET_NONE if the session is free */
+  unsigned short lo, hi;
+  unsigned short hint;     /* next-hop MTU from a router, or 0 */
+  unsigned short size[PMTU_FANOUT]; /* IP packet sizes this round */
+  unsigned short waiting;  /* bit per client slot to answer */
+  unsigned char probes;    /* how many this round */
+  unsigned char unsent;    /* bit per probe */
+  unsigned char answered;  /* bit per probe */
+  unsigned char tries;
+  unsigned char round;
+  unsigned char heard;     /* the target has answered at all */
+  unsigned char finished;
+  long sent;               /* msec; when the round was all sent */
+  long round_end;          /* msec; 0 until the round is all sent */
+  long rtt;                /* msec, the worst seen; -1 if none yet */
+};
+
+struct pmtu_cached
+{
+  unsigned int key;        /* target + 1; 0 is empty */
+  unsigned short mtu;
+  long expires;            /* msec */
+};
+
+struct pmtu_done
+{
+  unsigned int target;
+  unsigned int mtu;        /* 0 if it couldn't be measured */
+  unsigned short waiting;
+};
+
+struct pmtu
+{
+  int sock;
+  struct pmtu_session sessions[PMTU_SESSIONS];
+  unsigned int active[PMTU_SESSIONS];
+  unsigned int n_active;
+  unsigned int free[PMTU_SESSIONS];
+  unsigned int n_free;
+  unsigned int cursor;
+
+  struct pmtu_cached *cache;
+  unsigned int cache_mask, cache_used;
+};
+
+int pmtu_init (struct pmtu *p);
+unsigned int pmtu_lookup (struct pmtu *p, unsigned int target, long now);
+int pmtu_start (struct pmtu *p, unsigned int target, unsigned int client,
+		unsigned int upper);
+void pmtu_forget (struct pmtu *p, unsigned int client);
+void pmtu_send (struct pmtu *p, struct target_table *t, long now);
+void pmtu_receive (struct pmtu *p, long now);
+int pmtu_poll (struct pmtu *p, long now, struct pmtu_done *out, int max);
+int pmtu_busy (struct pmtu *p);
+void pmtu_abandon (struct pmtu *p);
@@ -0,0 +1,96 @@
+/* reply.c */
+/* the reply pool: client output slots, filled a batch at a time */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "ipc-msgs.h"
+#include "ping-code.h"
+#include "reply.h"
+
+void reply_init (struct reply_pool *p)
+     /* set up an empty pool.  touching all of it now means the reply
+	path never takes a page fault on it later */
+{
+  memset (p, 0, sizeof *p);
+}
+
+int reply_queue (struct reply_pool *p, struct ping_ack *ack)
+     /* file a reply in its client's slot
+      * ack: the reply; its id is the client's slot
+      * returns: 1 if the slot is now full, and has to be formatted
+      *   and sent before anything more is queued for the client
+      */
+{
+  struct reply_slot *s = &p->slot[ack->id];
+
+  make_ack_record (s->out + s->n * MAX_MSGLEN, ack);
+  return ++s->n == REPLY_BATCH;
+}
+
+void reply_format (struct reply_pool *p, int client)
+     /* turn a text client's waiting records into PING_RECD text, in
+	place; a binary client's are left alone.  call it once, just
+	before reply_send */
+{
+  struct reply_slot *s = &p->slot[client];
+  struct ping_ack ack;
+  unsigned int k;
+  char *raw;
+
+  if (p->binary & 1 << client)
+    return;
+  for (k = 0; k < s->n; k++)
+    {
+      raw = s->out + k * MAX_MSGLEN;
+      parse_ack_record (raw, &ack);
+      make_ping_recd (raw, &ack);
+    }
+}
+
+int reply_send (struct reply_pool *p, int client, int sock)
+     /* send a client everything waiting for it, in one go if the
+	socket will take it, and empty its slot
+      * sock: the client's socket
+      * returns: 1 on success, or if there was nothing to send; 0 if
+      *   the socket failed, with errno saying why
+      */
+{
+  struct reply_slot *s = &p->slot[client];
+  unsigned int off = 0, len = s->n * MAX_MSGLEN;
+  int result;
+
+  /* a signal, like the flight recorder's, can cut a send short;
+     what's left still has to go, or the records come apart */
+
+  s->n = 0;
+  while (off < len)
+    {
+      result = send (sock, s->out + off, len - off, 0);
+      if (result < 0 && errno == EINTR)
+	continue;
+      if (result <= 0)
+	return 0;
+      off += result;
+    }
+  return 1;
+}
+
+void reply_binary (struct reply_pool *p, int client, int on)
+     /* have a client's replies sent as PING_RECD_BINARY, or not */
+{
+  if (on)
+    p->binary |= 1 << client;
+  else
+    p->binary &= ~(1 << client);
+}
+
+void reply_forget (struct reply_pool *p, int client)
+     /* a client has gone; what was waiting for it goes too, and its
+	slot's next client starts out with text */
+{
+  p->slot[client].n = 0;
+  reply_binary (p, client, 0);
+}
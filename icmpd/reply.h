@@ -0,0 +1,50 @@
+/* reply.h */
+/* the steady-state reply path: echo replies in off the ICMP socket,
+   PING_RECD records out to clients, with no heap allocation and as
+   little formatting as it can get away with.
+
+   everything it needs is in a struct reply_pool, preallocated, one
+   for each thread that handles replies: the packet buffer recvfrom
+   fills, REPLY_BATCH ack records for parse_ping or measure_drain to
+   fill, and an output slot for each client holding REPLY_BATCH
+   records.  (the measurement thread's ring in measure.c is that
+   thread's pool.)
+
+   a batch goes like this.  the daemon reads up to REPLY_BATCH
+   replies into the pool's acks and credits them to their targets;
+   the addresses stay binary all the way.  reply_queue files each
+   in its client's slot as an ack_record, which is a copy of a few
+   numbers.  once the batch is in, reply_format turns a text client's
+   records into PING_RECD text, in place, with make_ping_recd, and
+   reply_send hands the client its whole slot in one send.  a client
+   that asked for BINARY_ACKS gets its records as they are.  a slot
+   that fills up mid-batch is formatted and sent there and then.
+
+   the pool doesn't know about sockets failing or clients going away;
+   the daemon drops the client, and reply_forget throws away what
+   was waiting for it.
+
+   reply.h needs ipc-msgs.h and ping-code.h. */
+
+#define REPLY_BATCH 64
+
+struct reply_slot
+{
+  char out[REPLY_BATCH * MAX_MSGLEN];
+  unsigned int n;            /* records waiting */
+};
+
+struct reply_pool
+{
+  char packet[MAX_PACKET];
+  struct ping_ack acks[REPLY_BATCH];
+  struct reply_slot slot[MAX_CLIENTS];
+  unsigned int binary;       /* a bit for each client taking binary acks */
+};
+
+void reply_init (struct reply_pool *p);
+int reply_queue (struct reply_pool *p, struct ping_ack *ack);
+void reply_format (struct reply_pool *p, int client);
+int reply_send (struct reply_pool *p, int client, int sock);
+void reply_binary (struct reply_pool *p, int client, int on);
+void reply_forget (struct reply_pool *p, int client);
@@ -0,0 +1,282 @@
+/* sched.c */
+/* priority classes, deficit round robin, and the in-flight budget */
+
+#include <string.h>
+
+#include "ipc-msgs.h"
+#include "sched.h"
+
+#define INFLIGHT_MASK (2 * SCHED_INFLIGHT - 1)
+#define WIRE_OVERHEAD 28 /* IP and ICMP headers */
+
+/* how much of the in-flight budget each class may use; whatever a
+   class can't touch is headroom kept for the classes above it */
+
+static unsigned int class_limit[SCHED_CLASSES] =
+{
+  SCHED_INFLIGHT,
+  SCHED_INFLIGHT - SCHED_INFLIGHT / 8,
+  SCHED_INFLIGHT / 2
+};
+
+static unsigned int inflight_home (unsigned int key)
+{
+  return (key * 2654435761u) >> 7 & INFLIGHT_MASK;
+}
+
+static int inflight_find (struct scheduler *s, unsigned int key,
+			  unsigned int target)
+     /* watch probes number their sequence per target, so one client
+	can have several probes out with the same sequence number;
+	the target tells them apart */
+{
+  unsigned int i;
+
+  for (i = inflight_home (key); s->inflight[i].key;
+       i = (i + 1) & INFLIGHT_MASK)
+    if (s->inflight[i].key == key && s->inflight[i].target == target)
+      return i;
+  return -1;
+}
+
+static void inflight_remove (struct scheduler *s, unsigned int i)
+     /* empty slot i, shifting later entries of the same probe chain
+	back so that lookups never stop short */
+{
+  unsigned int j = i, k;
+
+  s->in_use[s->inflight[i].class]--;
+  s->in_total--;
+
+  for (;;)
+    {
+      j = (j + 1) & INFLIGHT_MASK;
+      if (!s->inflight[j].key)
+	break;
+      k = inflight_home (s->inflight[j].key);
+      if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+	continue;
+      s->inflight[i] = s->inflight[j];
+      i = j;
+    }
+  s->inflight[i].key = 0;
+}
+
+static void inflight_add (struct scheduler *s, struct probe *p, long now)
+{
+  unsigned int key = (p->client << 16 | p->seq) + 1;
+  int found = inflight_find (s, key, p->target);
+  unsigned int i;
+
+  /* a client reusing a sequence number that's still out forfeits
+     the old probe */
+
+  if (found >= 0)
+    inflight_remove (s, found);
+
+  for (i = inflight_home (key); s->inflight[i].key;
+       i = (i + 1) & INFLIGHT_MASK)
+    ;
+  s->inflight[i].key = key;
+  s->inflight[i].target = p->target;
+  s->inflight[i].class = p->class;
+  s->inflight[i].timeout = p->timeout ? p->timeout : SCHED_TIMEOUT_MSEC;
+  s->inflight[i].sent = now;
+  s->in_use[p->class]++;
+  s->in_total++;
+}
+
+void sched_restore (struct scheduler *s, struct inflight *f)
+     /* put back a probe that was in flight when another daemon
+	handed us its state */
+{
+  struct probe p;
+
+  p.client = (f->key - 1) >> 16;
+  p.seq = (f->key - 1) & 0xffff;
+  p.target = f->target;
+  p.class = f->class;
+  p.timeout = f->timeout;
+  inflight_add (s, &p, f->sent);
+}
+
+void sched_init (struct scheduler *s)
+{
+  memset (s, 0, sizeof *s);
+}
+
+int sched_class (unsigned int priority)
+     /* map a request's priority field onto a scheduling class
+	priority: PRIORITY_INTERACTIVE, PRIORITY_REALTIME or PRIORITY_BULK
+	returns: the class
+     */
+{
+  switch (priority)
+    {
+    case PRIORITY_REALTIME:
+      return SCHED_REALTIME;
+    case PRIORITY_INTERACTIVE:
+      return SCHED_INTERACTIVE;
+    default:
+      return SCHED_BULK;
+    }
+}
+
+unsigned int sched_priority (int class)
+     /* the inverse of sched_class, for answering clients */
+{
+  switch (class)
+    {
+    case SCHED_REALTIME:
+      return PRIORITY_REALTIME;
+    case SCHED_INTERACTIVE:
+      return PRIORITY_INTERACTIVE;
+    default:
+      return PRIORITY_BULK;
+    }
+}
+
+int sched_enqueue (struct scheduler *s, struct probe *p)
+     /* queue a probe behind the others from the same client and class
+	p: the probe; its client, class and queued time must be set
+	returns: 1 if it was queued, 0 if the queue is full
+     */
+{
+  struct sched_queue *q = &s->queues[p->class][p->client];
+
+  if (q->count == SCHED_QUEUE)
+    return 0;
+  q->q[(q->head + q->count) & (SCHED_QUEUE - 1)] = *p;
+  q->count++;
+  s->queued[p->class]++;
+  return 1;
+}
+
+int sched_dispatch (struct scheduler *s, long now,
+		    struct probe *out, int max)
+     /* pick the probes to send now, and count them as in flight
+	now: the current time in msec
+	out: where to put them, in the order they should go
+	max: how many fit
+	returns: the number picked
+     */
+{
+  int n = 0;
+  int c;
+
+  for (c = 0; c < SCHED_CLASSES && n < max; c++)
+    while (s->queued[c] > 0 && n < max && s->in_total < class_limit[c])
+      {
+	struct sched_queue *q = &s->queues[c][s->cursor[c]];
+
+	if (q->count > 0)
+	  {
+	    struct probe *p = &q->q[q->head];
+	    long cost = p->size + WIRE_OVERHEAD;
+
+	    if (!s->granted[c])
+	      {
+		q->deficit += SCHED_QUANTUM;
+		s->granted[c] = 1;
+	      }
+	    if (q->deficit >= cost)
+	      {
+		q->deficit -= cost;
+		out[n] = *p;
+		inflight_add (s, &out[n], now);
+		n++;
+		q->head = (q->head + 1) & (SCHED_QUEUE - 1);
+		q->count--;
+		s->queued[c]--;
+		continue;
+	      }
+	  }
+	else
+	  q->deficit = 0;
+
+	s->cursor[c] = (s->cursor[c] + 1) % MAX_CLIENTS;
+	s->granted[c] = 0;
+      }
+  return n;
+}
+
+int sched_reply (struct scheduler *s, unsigned int client,
+		 unsigned int seq, unsigned int target, struct probe *p)
+     /* a reply came back; release its slot in the budget
+	client, seq: the reply's ICMP id and sequence number
+	target: the target it came from
+	p: filled in with the probe's target, class and send time
+	returns: 1 if it was one of ours and still in flight, else 0
+     */
+{
+  int i = inflight_find (s, (client << 16 | (seq & 0xffff)) + 1, target);
+
+  if (i < 0)
+    return 0;
+  p->target = target;
+  p->class = s->inflight[i].class;
+  p->client = client;
+  p->seq = seq;
+  p->queued = s->inflight[i].sent;
+  inflight_remove (s, i);
+  return 1;
+}
+
+int sched_expire (struct scheduler *s, long now,
+		  struct probe *out, int max)
+     /* give up on probes that have had their timeout to come back
+	out: the probes given up on, for loss accounting
+	max: how many fit
+	returns: the number given up on
+     */
+{
+  unsigned int i = 0;
+  int n = 0;
+
+  while (i <= INFLIGHT_MASK && n < max && s->in_total > 0)
+    {
+      struct inflight *f = &s->inflight[i];
+
+      if (f->key && f->sent + f->timeout <= now)
+	{
+	  out[n].target = f->target;
+	  out[n].class = f->class;
+	  out[n].timeout = f->timeout;
+	  out[n].client = (f->key - 1) >> 16;
+	  out[n].seq = (f->key - 1) & 0xffff;
+	  out[n].queued = f->sent;
+	  n++;
+	  inflight_remove (s, i);
+	  continue; /* something may have shifted into slot i */
+	}
+      i++;
+    }
+  return n;
+}
+
+void sched_forget (struct scheduler *s, unsigned int client)
+     /* drop everything a departed client still had queued; what it
+	has in flight runs out its timeout as usual */
+{
+  int c;
+
+  for (c = 0; c < SCHED_CLASSES; c++)
+    {
+      struct sched_queue *q = &s->queues[c][client];
+
+      s->queued[c] -= q->count;
+      q->head = q->count = 0;
+      q->deficit = 0;
+    }
+}
+
+int sched_busy (struct scheduler *s)
+     /* returns: whether anything is queued or in flight, which means
+      *   the main loop has timeouts to keep track of
+      */
+{
+  return s->in_total > 0
+    || s->queued[SCHED_REALTIME] > 0
+    || s->queued[SCHED_INTERACTIVE] > 0
+    || s->queued[SCHED_BULK] > 0;
+}
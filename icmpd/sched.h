@@ -0,0 +1,92 @@
+/* sched.h */
+/* probe dispatch.  requests don't go out in whatever order select()
+   hands us client fds; they're queued by priority class and client,
+   and sent by a scheduler:
+
+   - classes are served in strict priority order, realtime first,
+     then interactive, then bulk.
+
+   - within a class, clients share by deficit round robin, charged by
+     the bytes each probe puts on the wire, so one client sending big
+     probes or lots of them gets no more than its share.
+
+   - admission control: at most SCHED_INFLIGHT probes may be awaiting
+     a reply or a timeout at once.  the lower classes may only use part
+     of that, so a bulk flood can't take the slots realtime probes
+     need.  work beyond the budget waits in its queue; work beyond a
+     full queue is rejected.
+
+   a probe is given up on SCHED_TIMEOUT_MSEC after it goes out, unless
+   it asks for less; adaptive watch probes do (see adapt.h).
+
+   the scheduler needs ipc-msgs.h for MAX_CLIENTS. */
+
+#define SCHED_REALTIME 0
+#define SCHED_INTERACTIVE 1
+#define SCHED_BULK 2
+#define SCHED_CLASSES 3
+
+#define SCHED_QUEUE 256      /* per client and class; a power of two */
+#define SCHED_INFLIGHT 1024  /* must be a power of two */
+#define SCHED_QUANTUM 1500   /* bytes per client per round */
+#define SCHED_TIMEOUT_MSEC 2000
+
+#define PROBE_WATCH 0x01     /* from the watch schedule, not a request */
+
+struct probe
+{
+  unsigned int target;
+  unsigned short seq;
+  unsigned short size;
+  unsigned char client;
+  unsigned char class;
+  unsigned char flags;
+  unsigned short timeout;    /* msec; 0 for SCHED_TIMEOUT_MSEC */
+  long queued;               /* msec */
+};
+
+struct sched_queue
+{
+  struct probe q[SCHED_QUEUE];
+  unsigned int head, count;
+  long deficit;
+};
+
+struct inflight
+{
+  unsigned int key;          /* client << 16 | seq, plus one; 0 is empty */
+  unsigned int target;
+  unsigned char class;
+  unsigned short timeout;    /* msec */
+  long sent;                 /* msec */
+};
+
+struct scheduler
+{
+  struct sched_queue queues[SCHED_CLASSES][MAX_CLIENTS];
+  unsigned int cursor[SCHED_CLASSES];
+  unsigned int queued[SCHED_CLASSES];
+
+  /* set when the queue under a class's cursor has had its quantum
+     for this visit, in case the budget ran out partway through */
+
+  int granted[SCHED_CLASSES];
+
+  struct inflight inflight[2 * SCHED_INFLIGHT];
+  unsigned int in_use[SCHED_CLASSES];
+  unsigned int in_total;
+};
+
+void sched_init (struct scheduler *s);
+int sched_class (unsigned int priority);
+unsigned int sched_priority (int class);
+int sched_enqueue (struct scheduler *s, struct probe *p);
+int sched_dispatch (struct scheduler *s, long now,
+		    struct probe *out, int max);
+int sched_reply (struct scheduler *s, unsigned int client,
+		 unsigned int seq, unsigned int target, struct probe *p);
+int sched_expire (struct scheduler *s, long now,
+		  struct probe *out, int max);
+void sched_forget (struct scheduler *s, unsigned int client);
+void sched_restore (struct scheduler *s, struct inflight *f);
+int sched_busy (struct scheduler *s);
@@ -0,0 +1,229 @@
+/* snapshot.c */
+/* writing and reading the handover snapshot */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "ipc-msgs.h"
+#include "targets.h"
+#include "sched.h"
+#include "expr.h"
+#include "alert.h"
+#include "snapshot.h"
+
+#define LAYOUT (sizeof (long) << 24 | sizeof (struct target_info) << 16 \
+		| sizeof (struct inflight) << 8 | sizeof (struct probe))
+
+static int write_all (int fd, void *buf, unsigned long len)
+{
+  char *p = buf;
+  int n;
+
+  while (len > 0)
+    {
+      n = write (fd, p, len);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return 0;
+      p += n;
+      len -= n;
+    }
+  return 1;
+}
+
+static int read_all (int fd, void *buf, unsigned long len)
+{
+  char *p = buf;
+  int n;
+
+  while (len > 0)
+    {
+      n = read (fd, p, len);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return 0;
+      p += n;
+      len -= n;
+    }
+  return 1;
+}
+
+int snapshot_write (int fd, struct target_table *t, struct scheduler *s,
+		    struct alerts *al, struct client_in *in)
+     /* write the daemon's state to fd
+      * in: the MAX_CLIENTS clients' part-read requests
+      * returns: 1 on success, 0 if the write failed
+      */
+{
+  struct snapshot_header h;
+  unsigned int i, c, k, n;
+
+  h.magic = SNAPSHOT_MAGIC;
+  h.version = SNAPSHOT_VERSION;
+  h.layout = LAYOUT;
+  h.count = t->count;
+  h.names_len = t->names_len;
+  h.inflight = s->in_total;
+  h.queued = s->queued[SCHED_REALTIME] + s->queued[SCHED_INTERACTIVE]
+    + s->queued[SCHED_BULK];
+  for (h.alerts = 0, i = 0; i < ALERT_MAX; i++)
+    h.alerts += (al->active >> i) & 1;
+
+  n = t->count;
+  if (!write_all (fd, &h, sizeof h)
+      || !write_all (fd, t->names, t->names_len)
+      || !write_all (fd, t->addr, n * sizeof *t->addr)
+      || !write_all (fd, t->next_send, n * sizeof *t->next_send)
+      || !write_all (fd, t->srtt, n * sizeof *t->srtt)
+      || !write_all (fd, t->p99, n * sizeof *t->p99)
+      || !write_all (fd, t->loss, n * sizeof *t->loss)
+      || !write_all (fd, t->sent, n * sizeof *t->sent)
+      || !write_all (fd, t->recd, n * sizeof *t->recd)
+      || !write_all (fd, t->info, n * sizeof *t->info))
+    return 0;
+
+  for (i = 0; i < 2 * SCHED_INFLIGHT; i++)
+    if (s->inflight[i].key
+	&& !write_all (fd, &s->inflight[i], sizeof s->inflight[i]))
+      return 0;
+
+  /* each queue oldest first, so reading them back in order keeps
+     every client's requests in the order it sent them */
+
+  for (c = 0; c < SCHED_CLASSES; c++)
+    for (i = 0; i < MAX_CLIENTS; i++)
+      {
+	struct sched_queue *q = &s->queues[c][i];
+
+	for (k = 0; k < q->count; k++)
+	  if (!write_all (fd, &q->q[(q->head + k) & (SCHED_QUEUE - 1)],
+			  sizeof (struct probe)))
+	    return 0;
+      }
+
+  if (!write_all (fd, in, MAX_CLIENTS * sizeof *in))
+    return 0;
+
+  if (h.alerts == 0)
+    return 1;
+  for (i = 0; i < ALERT_MAX; i++)
+    if (al->active & 1u << i)
+      {
+	struct snapshot_alert sa;
+
+	memset (&sa, 0, sizeof sa);
+	sa.id = i;
+	sa.owner = al->a[i].owner;
+	strlcpy (sa.text, al->a[i].text, MAX_MSGLEN);
+	if (!write_all (fd, &sa, sizeof sa))
+	  return 0;
+      }
+  return alerts_reserve (al, n)
+    && write_all (fd, al->raised, n * sizeof *al->raised);
+}
+
+int snapshot_read (int fd, struct target_table *t, struct scheduler *s,
+		   struct alerts *al, struct client_in *in)
+     /* load a snapshot into an empty registry, scheduler and alerts
+      * in: filled in with the MAX_CLIENTS clients' part-read requests
+      * returns: 1 on success, 0 if it was short, from a different
+      *   build, or we ran out of memory
+      */
+{
+  struct snapshot_header h;
+  struct target_info *info = NULL;
+  unsigned int *addr = NULL;
+  char *names = NULL;
+  unsigned int i, n, off;
+  int ok = 0;
+
+  if (!read_all (fd, &h, sizeof h)
+      || h.magic != SNAPSHOT_MAGIC || h.version != SNAPSHOT_VERSION
+      || h.layout != LAYOUT)
+    return 0;
+
+  n = h.count;
+  names = malloc ((size_t) h.names_len + 1);
+  addr = malloc (((size_t) n + 1) * sizeof *addr);
+  info = malloc (((size_t) n + 1) * sizeof *info);
+  if (names == NULL || addr == NULL || info == NULL
+      || !read_all (fd, names, h.names_len)
+      || !read_all (fd, addr, n * sizeof *addr))
+    goto out;
+  names[h.names_len] = '\0';
+
+  /* names were interned one after another, so adding them back in
+     order gives every target the id it had.  a snapshot that runs
+     out of names before targets is corrupt */
+
+  for (i = 0, off = 0; i < n; i++)
+    {
+      if (off >= h.names_len || target_add (t, names + off, addr[i]) != i)
+	goto out;
+      off += strlen (names + off) + 1;
+    }
+
+  if (!read_all (fd, t->next_send, n * sizeof *t->next_send)
+      || !read_all (fd, t->srtt, n * sizeof *t->srtt)
+      || !read_all (fd, t->p99, n * sizeof *t->p99)
+      || !read_all (fd, t->loss, n * sizeof *t->loss)
+      || !read_all (fd, t->sent, n * sizeof *t->sent)
+      || !read_all (fd, t->recd, n * sizeof *t->recd)
+      || !read_all (fd, info, n * sizeof *info))
+    goto out;
+
+  for (i = 0; i < n; i++)
+    {
+      t->info[i].interval = info[i].interval;
+      t->info[i].size = info[i].size;
+      t->info[i].owner = info[i].owner;
+      if (info[i].interval)
+	target_schedule (t, i, t->next_send[i]);
+    }
+
+  for (i = 0; i < h.inflight; i++)
+    {
+      struct inflight f;
+
+      if (!read_all (fd, &f, sizeof f))
+	goto out;
+      sched_restore (s, &f);
+    }
+  for (i = 0; i < h.queued; i++)
+    {
+      struct probe p;
+
+      if (!read_all (fd, &p, sizeof p))
+	goto out;
+      sched_enqueue (s, &p);
+    }
+
+  if (!read_all (fd, in, MAX_CLIENTS * sizeof *in))
+    goto out;
+  for (i = 0; i < MAX_CLIENTS; i++)
+    if (in[i].len >= MAX_MSGLEN)
+      goto out;
+
+  for (i = 0; i < h.alerts; i++)
+    {
+      struct snapshot_alert sa;
+
+      if (!read_all (fd, &sa, sizeof sa) || sa.id >= ALERT_MAX
+	  || !alert_restore (al, sa.id, sa.owner, sa.text))
+	goto out;
+    }
+  if (h.alerts > 0 && (!alerts_reserve (al, n)
+		       || !read_all (fd, al->raised, n * sizeof *al->raised)))
+    goto out;
+  ok = 1;
+
+ out:
+  free (names);
+  free (addr);
+  free (info);
+  return ok;
+}
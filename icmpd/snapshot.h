@@ -0,0 +1,52 @@
+/* snapshot.h */
+/* the daemon's state in a compact binary form, for handing over to
+   a replacement process: the target registry (which doubles as the
+   resolver cache, names and all), watch schedules and statistics,
+   the scheduler's queued and in-flight probes, whatever part of a
+   request each client has sent that the daemon has read, and
+   clients' alerts, which are recompiled from their text, with the
+   targets each one holds for.  the rankings aren't sent; the replacement rebuilds them
+   from the statistics.
+
+   the format is the in-memory layout, array by array, so it only
+   works between builds that agree on it.  the header says which
+   layout was written and snapshot_read refuses any other.
+
+   snapshot.h needs ipc-msgs.h, targets.h, sched.h, expr.h and
+   alert.h. */
+
+#define SNAPSHOT_MAGIC 0x69636d70 /* "icmp" */
+#define SNAPSHOT_VERSION 4
+
+struct snapshot_header
+{
+  unsigned int magic;
+  unsigned int version;
+  unsigned int layout;    /* record sizes, see snapshot.c */
+  unsigned int count;     /* targets */
+  unsigned int names_len;
+  unsigned int inflight;
+  unsigned int queued;
+  unsigned int alerts;
+};
+
+struct snapshot_alert
+{
+  unsigned int id;
+  int owner;
+  char text[MAX_MSGLEN];
+};
+
+/* a request record as far as the daemon has read it; one for each
+   client slot */
+
+struct client_in
+{
+  unsigned int len;
+  char buf[MAX_MSGLEN];
+};
+
+int snapshot_write (int fd, struct target_table *t, struct scheduler *s,
+		    struct alerts *al, struct client_in *in);
+int snapshot_read (int fd, struct target_table *t, struct scheduler *s,
+		   struct alerts *al, struct client_in *in);
@@ -0,0 +1,376 @@
+/* targets.c */
+/* the structure-of-arrays target registry */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "targets.h"
+
+#define MIN_TARGETS 1024
+#define GROW_BY 8      /* the arrays and the names grow by an eighth */
+#define ON_WHEEL 0x01
+
+static unsigned int hash_addr (unsigned int addr)
+{
+  addr ^= addr >> 16;
+  addr *= 0x45d9f3b;
+  addr ^= addr >> 16;
+  return addr;
+}
+
+static unsigned int hash_name (char *name)
+{
+  unsigned int h = 2166136261u;
+
+  while (*name)
+    h = (h ^ (unsigned char) *name++) * 16777619u;
+  return h;
+}
+
+static void index_insert (unsigned int *index, unsigned int slots,
+			  unsigned int h, unsigned int id)
+{
+  h %= slots;
+  while (index[h])
+    if (++h == slots)
+      h = 0;
+  index[h] = id + 1;
+}
+
+static int build_indexes (struct target_table *t, unsigned int slots)
+     /* (re)build both indexes with the given number of slots
+      * returns: 1 on success, 0 if we're out of memory
+      */
+{
+  unsigned int *by_addr, *by_name;
+  unsigned int id;
+
+  by_addr = calloc (slots, sizeof *by_addr);
+  by_name = calloc (slots, sizeof *by_name);
+  if (by_addr == NULL || by_name == NULL)
+    {
+      free (by_addr);
+      free (by_name);
+      return 0;
+    }
+
+  free (t->by_addr);
+  free (t->by_name);
+  t->by_addr = by_addr;
+  t->by_name = by_name;
+  t->index_slots = slots;
+
+  for (id = 0; id < t->count; id++)
+    {
+      index_insert (t->by_name, slots,
+		    hash_name (t->names + t->info[id].name), id);
+      if (target_by_addr (t, t->addr[id]) == TARGET_NONE)
+	index_insert (t->by_addr, slots, hash_addr (t->addr[id]), id);
+    }
+  return 1;
+}
+
+#define GROW(field, cap)					\
+  do								\
+    {								\
+      void *p = realloc (t->field, (cap) * sizeof *t->field);	\
+      if (p == NULL)						\
+	return 0;						\
+      t->field = p;						\
+    }								\
+  while (0)
+
+static int grow (struct target_table *t, unsigned int cap)
+     /* make room for cap targets
+      * returns: 1 on success, 0 if we're out of memory
+      */
+{
+  GROW (addr, cap);
+  GROW (next_send, cap);
+  GROW (srtt, cap);
+  GROW (p99, cap);
+  GROW (loss, cap);
+  GROW (sent, cap);
+  GROW (recd, cap);
+  GROW (wheel_next, cap);
+  GROW (info, cap);
+  t->cap = cap;
+
+  /* keep the indexes at no more than half load, and no bigger than
+     that needs: they're sized to the arrays rather than to a power
+     of two, which is what keeps a target inside its budget whatever
+     the count */
+
+  return build_indexes (t, cap * 2);
+}
+
+int targets_init (struct target_table *t, unsigned int hint)
+     /* set up an empty registry
+      * hint: roughly how many targets to expect
+      * returns: 1 on success, 0 if we're out of memory
+      */
+{
+  unsigned int cap = MIN_TARGETS;
+
+  memset (t, 0, sizeof *t);
+  if (cap < hint)
+    cap = hint;
+  return grow (t, cap);
+}
+
+void targets_free (struct target_table *t)
+{
+  free (t->addr);
+  free (t->next_send);
+  free (t->srtt);
+  free (t->p99);
+  free (t->loss);
+  free (t->sent);
+  free (t->recd);
+  free (t->wheel_next);
+  free (t->info);
+  free (t->names);
+  free (t->by_addr);
+  free (t->by_name);
+  memset (t, 0, sizeof *t);
+}
+
+unsigned long targets_bytes (struct target_table *t)
+     /* returns: everything the registry has allocated, in bytes */
+{
+  return sizeof *t
+    + (unsigned long) t->cap * (sizeof *t->addr + sizeof *t->next_send
+				+ sizeof *t->srtt + sizeof *t->p99
+				+ sizeof *t->loss + sizeof *t->sent
+				+ sizeof *t->recd + sizeof *t->wheel_next
+				+ sizeof *t->info)
+    + t->names_cap
+    + 2UL * t->index_slots * sizeof *t->by_addr;
+}
+
+unsigned int target_add (struct target_table *t, char *name,
+			 unsigned int addr)
+     /* register a new target; the caller has already checked that
+	the name isn't known.  if another name already resolved to
+	the same address, replies are credited to that target.
+      * returns: the new target's id, or TARGET_NONE if we're out of
+      *   memory
+      */
+{
+  unsigned int id = t->count;
+  unsigned int len = strlen (name) + 1;
+
+  if (id == t->cap && !grow (t, t->cap + t->cap / GROW_BY))
+    return TARGET_NONE;
+
+  if (t->names_len + len > t->names_cap)
+    {
+      unsigned int cap = t->names_cap ? t->names_cap : 16 * t->cap;
+      char *names;
+
+      while (t->names_len + len > cap)
+	cap += cap / GROW_BY;
+      names = realloc (t->names, cap);
+      if (names == NULL)
+	return TARGET_NONE;
+      t->names = names;
+      t->names_cap = cap;
+    }
+  memcpy (t->names + t->names_len, name, len);
+
+  t->addr[id] = addr;
+  t->next_send[id] = 0;
+  t->srtt[id] = 0;
+  t->p99[id] = 0;
+  t->loss[id] = 0;
+  t->sent[id] = 0;
+  t->recd[id] = 0;
+  t->wheel_next[id] = 0;
+  memset (&t->info[id], 0, sizeof t->info[id]);
+  t->info[id].name = t->names_len;
+  t->names_len += len;
+  t->count++;
+
+  index_insert (t->by_name, t->index_slots, hash_name (name), id);
+  if (target_by_addr (t, addr) == TARGET_NONE)
+    index_insert (t->by_addr, t->index_slots, hash_addr (addr), id);
+  return id;
+}
+
+unsigned int target_by_addr (struct target_table *t, unsigned int addr)
+     /* returns: the id of the target at addr, or TARGET_NONE */
+{
+  unsigned int h, slot;
+
+  for (h = hash_addr (addr) % t->index_slots; (slot = t->by_addr[h]); )
+    {
+      if (t->addr[slot - 1] == addr)
+	return slot - 1;
+      if (++h == t->index_slots)
+	h = 0;
+    }
+  return TARGET_NONE;
+}
+
+unsigned int target_by_name (struct target_table *t, char *name)
+     /* returns: the id of the target called name, or TARGET_NONE */
+{
+  unsigned int h, slot;
+
+  for (h = hash_name (name) % t->index_slots; (slot = t->by_name[h]); )
+    {
+      if (strcmp (t->names + t->info[slot - 1].name, name) == 0)
+	return slot - 1;
+      if (++h == t->index_slots)
+	h = 0;
+    }
+  return TARGET_NONE;
+}
+
+char *target_name (struct target_table *t, unsigned int id)
+{
+  return t->names + t->info[id].name;
+}
+
+void target_sent (struct target_table *t, unsigned int id)
+{
+  t->sent[id]++;
+}
+
+void target_reply (struct target_table *t, unsigned int id, float rtt)
+     /* credit a reply, folding its RTT (usec) into the smoothed RTT
+	with the usual 1/8 gain, and into the 99th percentile.
+
+	the percentile is a stochastic approximation: it steps up by
+	99 parts when a sample is above it and down by 1 part when one
+	is below, so it settles where 1% of samples are above it.  the
+	step is scaled by the smoothed RTT so it suits fast and slow
+	targets alike.  loss decays by 1/16 per reply */
+{
+  float step;
+
+  t->recd[id]++;
+  if (t->srtt[id] == 0)
+    {
+      t->srtt[id] = rtt;
+      t->p99[id] = rtt;
+    }
+  else
+    {
+      t->srtt[id] += (rtt - t->srtt[id]) / 8;
+      step = (t->srtt[id] + 1) / 16;
+      if (rtt > t->p99[id])
+	t->p99[id] += step * 0.99f;
+      else if (t->p99[id] > step * 0.01f)
+	t->p99[id] -= step * 0.01f;
+    }
+  t->loss[id] -= t->loss[id] / 16;
+}
+
+void target_lost (struct target_table *t, unsigned int id)
+     /* a probe timed out; loss moves 1/16 of the way towards 1 */
+{
+  t->loss[id] += (1 - t->loss[id]) / 16;
+}
+
+static void wheel_push (struct target_table *t, unsigned int id)
+{
+  unsigned int slot;
+
+  slot = (t->next_send[id] / WHEEL_TICK_MSEC) & (WHEEL_SLOTS - 1);
+
+  t->wheel_next[id] = t->wheel[slot];
+  t->wheel[slot] = id + 1;
+}
+
+void target_schedule (struct target_table *t, unsigned int id, long when)
+     /* set a target's next probe time (msec), or stop probing it if
+	when is 0.  a target already on the wheel stays where it is
+	and is re-filed when its slot comes round, so moving a probe
+	earlier only takes effect from the following one */
+{
+  t->next_send[id] = when;
+  if (when == 0 || (t->info[id].flags & ON_WHEEL))
+    return;
+  t->info[id].flags |= ON_WHEEL;
+  wheel_push (t, id);
+}
+
+void target_hurry (struct target_table *t, unsigned int id, long when)
+     /* bring a watched target's next probe forward to when (msec), if
+	that's sooner.  unlike target_schedule, it takes the target
+	off the wheel and files it again, which means walking its
+	slot's chain; that's meant for the odd target whose rate just
+	went up, not for every probe */
+{
+  unsigned int *link;
+  unsigned int slot;
+
+  if (t->next_send[id] == 0 || when >= t->next_send[id])
+    return;
+  if (t->info[id].flags & ON_WHEEL)
+    {
+      /* it's filed under its next-send time, unless that was moved
+	 by target_schedule since; then it waits for its slot */
+
+      slot = (t->next_send[id] / WHEEL_TICK_MSEC) & (WHEEL_SLOTS - 1);
+      for (link = &t->wheel[slot]; *link && *link != id + 1;
+	   link = &t->wheel_next[*link - 1])
+	;
+      if (*link == 0)
+	{
+	  t->next_send[id] = when;
+	  return;
+	}
+      *link = t->wheel_next[id];
+      t->info[id].flags &= ~ON_WHEEL;
+    }
+  target_schedule (t, id, when);
+}
+
+unsigned int targets_due (struct target_table *t, long now,
+			  unsigned int *ids, unsigned int max)
+     /* collect watched targets whose probes are due, to the tick.
+	they come off the wheel; the caller sends and reschedules them
+      * now: the current time in msec
+      * ids: where to put the ids
+      * max: how many ids fit
+      * returns: the number of ids collected; if that's max, there may
+      *   be more
+      */
+{
+  long tick = now / WHEEL_TICK_MSEC;
+  unsigned int n = 0;
+
+  if (t->wheel_now == 0 || tick - t->wheel_now > WHEEL_SLOTS)
+    t->wheel_now = tick - WHEEL_SLOTS;
+
+  /* only slots whose tick has completely passed */
+
+  while (t->wheel_now + 1 < tick)
+    {
+      unsigned int slot = (t->wheel_now + 1) & (WHEEL_SLOTS - 1);
+      unsigned int next = t->wheel[slot];
+
+      t->wheel[slot] = 0;
+      while (next)
+	{
+	  unsigned int id = next - 1;
+
+	  next = t->wheel_next[id];
+	  if (t->next_send[id] == 0)
+	    t->info[id].flags &= ~ON_WHEEL;
+	  else if (t->next_send[id] <= now && n < max)
+	    {
+	      t->info[id].flags &= ~ON_WHEEL;
+	      ids[n++] = id;
+	    }
+	  else
+	    wheel_push (t, id);
+	}
+      if (n == max)
+	return n;
+      t->wheel_now++;
+    }
+  return n;
+}
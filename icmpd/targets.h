@@ -0,0 +1,93 @@
+/* targets.h */
+/* the target registry.  every host the daemon pings gets an integer
+   id, and its per-target state is kept in parallel arrays indexed by
+   that id, so the reply path touches a handful of dense arrays
+   rather than a struct per target with a name buried in it.
+
+   hot fields, touched on every send or reply, each get an array of
+   their own.  cold metadata - the interned name, probe size, who's
+   watching and how often - lives in one array of small structs.
+   names are interned into a single arena, and two open-addressed
+   indexes map addresses and names back to ids in O(1).
+
+   watched targets are probed on a schedule.  their next-send times
+   are kept on a hashed timer wheel, so finding what's due only
+   visits targets that are (nearly) due.
+
+   memory budget: 36 bytes of hot arrays, 16 of cold metadata, the
+   name (13 bytes for a typical dotted quad plus its NUL), and two
+   slots in each index for half load, 16 bytes: about 82 bytes a
+   target when the arrays are full.  they grow by an eighth at a
+   time, and the indexes are sized to match rather than to a power
+   of two, so even just after growing it's no more than about 92, at
+   any count from ten thousand up.  TARGET_BYTES_BUDGET is the
+   ceiling ping-bench holds us to. */
+
+#define TARGET_NONE ((unsigned int) -1)
+#define TARGET_BYTES_BUDGET 96
+
+#define WHEEL_SLOTS 4096 /* must be a power of two */
+#define WHEEL_TICK_MSEC 10
+
+#define TARGET_RANKINGS 3 /* top-K lists a target can be in; see topk.h */
+
+struct target_info
+{
+  unsigned int name;     /* offset into the name arena */
+  unsigned int interval; /* msec between probes, 0 if not watched */
+  unsigned short size;   /* probe payload size */
+  unsigned char owner;   /* client slot that gets the replies */
+  unsigned char flags;
+  unsigned char top[TARGET_RANKINGS]; /* heap slot + 1, or 0 */
+};
+
+struct target_table
+{
+  unsigned int count, cap;
+
+  /* hot */
+
+  unsigned int *addr;       /* network byte order */
+  long *next_send;          /* msec; 0 if not watched */
+  float *srtt;              /* smoothed RTT, usec */
+  float *p99;               /* running 99th percentile RTT, usec */
+  float *loss;              /* recent loss ratio */
+  unsigned int *sent;
+  unsigned int *recd;
+  unsigned int *wheel_next; /* timer wheel chain */
+
+  /* cold */
+
+  struct target_info *info;
+
+  char *names;
+  unsigned int names_len, names_cap;
+
+  /* indexes hold id + 1, so that 0 is an empty slot */
+
+  unsigned int *by_addr;
+  unsigned int *by_name;
+  unsigned int index_slots;  /* twice cap, in each index */
+
+  unsigned int wheel[WHEEL_SLOTS];
+  long wheel_now;           /* the last tick we swept */
+};
+
+int targets_init (struct target_table *t, unsigned int hint);
+void targets_free (struct target_table *t);
+unsigned long targets_bytes (struct target_table *t);
+
+unsigned int target_add (struct target_table *t, char *name,
+			 unsigned int addr);
+unsigned int target_by_name (struct target_table *t, char *name);
+unsigned int target_by_addr (struct target_table *t, unsigned int addr);
+char *target_name (struct target_table *t, unsigned int id);
+
+void target_sent (struct target_table *t, unsigned int id);
+void target_reply (struct target_table *t, unsigned int id, float rtt);
+void target_lost (struct target_table *t, unsigned int id);
+
+void target_schedule (struct target_table *t, unsigned int id, long when);
+void target_hurry (struct target_table *t, unsigned int id, long when);
+unsigned int targets_due (struct target_table *t, long now,
+			  unsigned int *ids, unsigned int max);
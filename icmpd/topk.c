@@ -0,0 +1,183 @@
+/* topk.c */
+/* incrementally maintained rankings of the worst targets */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ipc-msgs.h"
+#include "targets.h"
+#include "topk.h"
+
+static float metric_value (struct target_table *t, int metric,
+			   unsigned int id)
+{
+  switch (metric)
+    {
+    case TOP_RTT:
+      return t->srtt[id];
+    case TOP_P99:
+      return t->p99[id];
+    default:
+      return t->loss[id];
+    }
+}
+
+static void heap_set (struct topk_heap *h, struct target_table *t,
+		      int metric, unsigned int slot, unsigned int id,
+		      float key)
+{
+  h->id[slot] = id;
+  h->key[slot] = key;
+  t->info[id].top[metric] = slot + 1;
+}
+
+static void sift_up (struct topk_heap *h, struct target_table *t,
+		     int metric, unsigned int slot)
+{
+  unsigned int id = h->id[slot];
+  float key = h->key[slot];
+
+  while (slot > 0 && h->key[(slot - 1) / 2] > key)
+    {
+      unsigned int parent = (slot - 1) / 2;
+
+      heap_set (h, t, metric, slot, h->id[parent], h->key[parent]);
+      slot = parent;
+    }
+  heap_set (h, t, metric, slot, id, key);
+}
+
+static void sift_down (struct topk_heap *h, struct target_table *t,
+		       int metric, unsigned int slot)
+{
+  unsigned int id = h->id[slot];
+  float key = h->key[slot];
+
+  for (;;)
+    {
+      unsigned int child = 2 * slot + 1;
+
+      if (child >= h->count)
+	break;
+      if (child + 1 < h->count && h->key[child + 1] < h->key[child])
+	child++;
+      if (h->key[child] >= key)
+	break;
+      heap_set (h, t, metric, slot, h->id[child], h->key[child]);
+      slot = child;
+    }
+  heap_set (h, t, metric, slot, id, key);
+}
+
+static void heap_update (struct topk_heap *h, struct target_table *t,
+			 int metric, unsigned int id)
+     /* fold one target's current value into one ranking */
+{
+  float key = metric_value (t, metric, id);
+  unsigned int slot = t->info[id].top[metric];
+
+  if (slot)
+    {
+      /* already ranked; move it to where it now belongs */
+
+      slot--;
+      h->key[slot] = key;
+      sift_up (h, t, metric, slot);
+      sift_down (h, t, metric, t->info[id].top[metric] - 1);
+    }
+  else if (key <= 0)
+    return;
+  else if (h->count < TOP_MAX)
+    {
+      h->id[h->count] = id;
+      h->key[h->count] = key;
+      sift_up (h, t, metric, h->count++);
+    }
+  else if (key > h->key[0])
+    {
+      /* displace the least bad */
+
+      t->info[h->id[0]].top[metric] = 0;
+      h->id[0] = id;
+      h->key[0] = key;
+      sift_down (h, t, metric, 0);
+    }
+}
+
+void topk_init (struct topk *k)
+{
+  memset (k, 0, sizeof *k);
+}
+
+void topk_touch (struct topk *k, struct target_table *t, unsigned int id)
+     /* note that a target's numbers have changed; this is all the
+	reply path pays.  a target touched twice before a flush is
+	listed twice, which costs the flush a redundant update but
+	keeps the reply path off the target's cold metadata */
+{
+  if (k->n_dirty == TOPK_DIRTY_MAX)
+    topk_flush (k, t);
+  k->dirty[k->n_dirty++] = id;
+}
+
+void topk_flush (struct topk *k, struct target_table *t)
+     /* bring the rankings up to date with every target touched since
+	the last flush */
+{
+  unsigned int i;
+  int m;
+
+  for (i = 0; i < k->n_dirty; i++)
+    {
+      unsigned int id = k->dirty[i];
+
+      for (m = 0; m < TOP_METRICS; m++)
+	heap_update (&k->heaps[m], t, m, id);
+    }
+  k->n_dirty = 0;
+}
+
+static struct topk_heap *sort_heap;
+
+static int compare_slots (const void *a, const void *b)
+{
+  float x = sort_heap->key[*(const unsigned char *) a];
+  float y = sort_heap->key[*(const unsigned char *) b];
+
+  return x > y ? -1 : x < y;
+}
+
+int topk_query (struct topk *k, struct target_table *t,
+		struct top_query *query, struct top_entry *out)
+     /* answer a TOP_QUERY from the rankings as they stand
+      * out: room for TOP_MAX entries, filled in worst first
+      * returns: the number of entries, or -1 for an unknown metric
+      */
+{
+  struct topk_heap *h;
+  unsigned char slots[TOP_MAX];
+  unsigned int i, n;
+
+  if (query->metric >= TOP_METRICS)
+    return -1;
+  topk_flush (k, t);
+
+  h = &k->heaps[query->metric];
+  for (i = 0; i < h->count; i++)
+    slots[i] = i;
+  sort_heap = h;
+  qsort (slots, h->count, 1, compare_slots);
+
+  n = query->count < h->count ? query->count : h->count;
+  for (i = 0; i < n; i++)
+    {
+      float key = h->key[slots[i]];
+
+      out[i].metric = query->metric;
+      out[i].rank = i + 1;
+      out[i].value = query->metric == TOP_LOSS
+	? (unsigned int) (key * 1e6) : (unsigned int) key;
+      strlcpy (out[i].host, target_name (t, h->id[slots[i]]), MAX_HOST);
+    }
+  return n;
+}
@@ -0,0 +1,41 @@
+/* topk.h */
+/* the worst targets right now, by smoothed RTT, 99th percentile RTT
+   and loss.  each ranking is a min-heap of the TOP_MAX worst targets,
+   so the least bad of them is at the root and is the bar a target
+   has to clear to get in.  every target records its slot in each
+   heap, so a target already ranked is re-sifted in place.  all of
+   that is O(log TOP_MAX) per update.
+
+   updates don't happen on the reply path.  a reply or timeout only
+   appends its target to a dirty list; the main loop calls
+   topk_flush() when it's done with I/O, and that folds every dirty
+   target into the heaps.
+
+   a ranked target that gets better stays ranked until something
+   worse displaces it, so a target that got worse without reporting
+   since may be missing for a while.  watched targets report every
+   interval, which bounds how long.
+
+   topk.h needs ipc-msgs.h for TOP_MAX and targets.h. */
+
+#define TOPK_DIRTY_MAX 4096 /* flushed early if this many pile up */
+
+struct topk_heap
+{
+  unsigned int id[TOP_MAX];
+  float key[TOP_MAX];
+  unsigned int count;
+};
+
+struct topk
+{
+  struct topk_heap heaps[TOP_METRICS];
+  unsigned int dirty[TOPK_DIRTY_MAX];
+  unsigned int n_dirty;
+};
+
+void topk_init (struct topk *k);
+void topk_touch (struct topk *k, struct target_table *t, unsigned int id);
+void topk_flush (struct topk *k, struct target_table *t);
+int topk_query (struct topk *k, struct target_table *t,
+		struct top_query *query, struct top_entry *out);
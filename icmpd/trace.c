@@ -0,0 +1,252 @@
+/* trace.c */
+/* the flight recorder's rings, and dumping them */
+
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600 /* for clock_gettime and SA_RESTART */
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+
+#include "trace.h"
+
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+
+/* the rings are allocated as threads ask for them, so only the
+   threads there are take up memory; the measurement thread's mlockall
+   locks its ring down with everything else */
+
+static struct trace_ring *rings[TRACE_THREADS];
+static int ring_count;
+static unsigned long ticks_per_msec;
+
+#ifndef TRACE_CYCLES
+unsigned long trace_clock (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+#endif
+
+int trace_init (void)
+     /* work out what the clock counts in; call it once, before any
+	thread traces anything
+      * returns: 1, or 0 if the clock can't be read
+      */
+{
+#ifdef TRACE_CYCLES
+  struct timespec start, end, pause;
+  unsigned long t0, t1;
+  double nsec;
+
+  /* 20 msec against the monotonic clock is good to a part in ten
+     thousand or so, which is plenty for telling where time went */
+
+  pause.tv_sec = 0;
+  pause.tv_nsec = 20000000;
+  if (clock_gettime (CLOCK_MONOTONIC, &start) == -1)
+    return 0;
+  t0 = trace_clock ();
+  nanosleep (&pause, NULL);
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  t1 = trace_clock ();
+  nsec = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+  if (nsec <= 0 || t1 <= t0)
+    return 0;
+  ticks_per_msec = (t1 - t0) / nsec * 1e6 + 0.5;
+#else
+  ticks_per_msec = 1000000;
+#endif
+  return ticks_per_msec > 0;
+}
+
+struct trace_ring *trace_thread (char *name)
+     /* give the calling thread a ring of its own
+      * name: what to call the thread in dumps
+      * returns: the ring, to pass to trace(), or NULL if there's no
+      *   room or no memory; trace() does nothing with NULL
+      */
+{
+  struct trace_ring *r;
+  int slot;
+
+  slot = __sync_fetch_and_add (&ring_count, 1);
+  if (slot >= TRACE_THREADS)
+    return NULL;
+
+  /* touched now, so writing events never faults a page in */
+
+  r = malloc (sizeof *r);
+  if (r == NULL)
+    return NULL;
+  memset (r, 0, sizeof *r);
+  strncpy (r->name, name, TRACE_NAME - 1);
+  __sync_synchronize ();
+  rings[slot] = r;
+  return r;
+}
+
+static int write_all (int fd, void *buf, unsigned long len)
+{
+  char *p = buf;
+  long n;
+
+  while (len > 0)
+    {
+      n = write (fd, p, len);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return 0;
+      p += n;
+      len -= n;
+    }
+  return 1;
+}
+
+int trace_dump (int fd)
+     /* write every ring to fd.  it only calls write(), so it's safe in
+	a signal handler; the rings keep being written while it runs
+      * returns: the number of events written, or -1 on error
+      */
+{
+  struct trace_header h;
+  struct trace_part part;
+  struct trace_ring *r;
+  unsigned long head, first, at, n;
+  long total = 0;
+  int k, slots;
+
+  slots = ring_count < TRACE_THREADS ? ring_count : TRACE_THREADS;
+  h.magic = TRACE_MAGIC;
+  h.version = TRACE_VERSION;
+  h.ticks_per_msec = ticks_per_msec;
+  h.rings = 0;
+  for (k = 0; k < slots; k++)
+    if (rings[k] != NULL)
+      h.rings++;
+  if (!write_all (fd, &h, sizeof h))
+    return -1;
+
+  for (k = 0; k < slots; k++)
+    {
+      r = rings[k];
+      if (r == NULL)
+	continue;
+
+      head = r->head;
+      first = head > TRACE_RING ? head - TRACE_RING : 0;
+      memcpy (part.name, r->name, TRACE_NAME);
+      part.first = first;
+      part.count = head - first;
+      if (!write_all (fd, &part, sizeof part))
+	return -1;
+
+      /* the oldest events are at the head's position in the ring, so
+	 it goes out in at most two pieces */
+
+      for (at = first; at < head; at += n)
+	{
+	  unsigned long i = at & (TRACE_RING - 1);
+
+	  n = TRACE_RING - i < head - at ? TRACE_RING - i : head - at;
+	  if (!write_all (fd, &r->e[i], n * sizeof (struct trace_event)))
+	    return -1;
+	}
+      total += head - first;
+
+      head = r->head;
+      if (!write_all (fd, &head, sizeof head))
+	return -1;
+    }
+  return total;
+}
+
+static int temp_name (char *tmp, char *path)
+     /* path with our pid on the end, without snprintf, which isn't
+	safe in a signal handler
+      * tmp: TRACE_PATH bytes
+      * returns: 1, or 0 if it doesn't fit
+      */
+{
+  char digits[24];
+  unsigned long pid = getpid ();
+  unsigned int len = strlen (path), n = 0;
+
+  do
+    digits[n++] = '0' + pid % 10;
+  while ((pid /= 10) > 0);
+  if (len + 1 + n + 1 > TRACE_PATH)
+    return 0;
+  memcpy (tmp, path, len);
+  tmp[len++] = '.';
+  while (n > 0)
+    tmp[len++] = digits[--n];
+  tmp[len] = '\0';
+  return 1;
+}
+
+int trace_dump_file (char *path)
+     /* dump the rings to a file, replacing it.  the dump is written to
+	a file of its own next to it, made afresh, and renamed over it,
+	so whatever was at path -- a link to somewhere else, say -- is
+	replaced rather than written through
+      * returns: the number of events written, or -1 on error
+      */
+{
+  char tmp[TRACE_PATH];
+  int fd;
+  int n;
+
+  if (!temp_name (tmp, path))
+    return -1;
+
+  /* one left over from a dump that died goes; if another turns up
+     before we make ours, we give up */
+
+  unlink (tmp);
+  fd = open (tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+  if (fd == -1)
+    return -1;
+  n = trace_dump (fd);
+  if (close (fd) == -1)
+    n = -1;
+  if (n >= 0 && rename (tmp, path) == -1)
+    n = -1;
+  if (n < 0)
+    unlink (tmp);
+  return n;
+}
+
+static void dump_on_signal (int sig)
+{
+  int saved = errno;
+
+  trace_dump_file (TRACE_FILE);
+  errno = saved;
+}
+
+int trace_catch (int sig)
+     /* dump to TRACE_FILE whenever sig arrives, whatever the loop is
+	doing at the time -- even stuck in a DNS lookup
+      * returns: 1, or 0 if the handler couldn't be set
+      */
+{
+  struct sigaction sa;
+
+  memset (&sa, 0, sizeof sa);
+  sa.sa_handler = dump_on_signal;
+  sigemptyset (&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  return sigaction (sig, &sa, NULL) == 0;
+}
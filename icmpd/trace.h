@@ -0,0 +1,136 @@
+/* trace.h */
+/* the flight recorder.  every thread that does I/O for the daemon
+   writes small binary events into a ring of its own: when the loop
+   wakes, accepts, reads and writes sockets, parses and formats, and
+   resolves names.  the rings are always on and fixed in size, so the
+   last TRACE_RING events of each thread are there to look at when a
+   client says a reply came late, or never came.
+
+   writing an event is a timestamp and three stores, with no locks and
+   no system calls: the timestamp is the cpu's cycle counter where
+   there's one we can read from user space, and the monotonic clock
+   where there isn't.  each ring has one writer, its own thread; a dump
+   reads it from outside and works out afterwards which events may have
+   been overwritten while it was reading.
+
+   trace_dump writes every ring to a file, and is safe to call from a
+   signal handler: the daemon dumps to TRACE_FILE on SIGUSR2 and on
+   TRACE_DUMP.  it's never anywhere a client chooses, since the
+   daemon runs as root.  ping-trace turns a dump into a latency
+   breakdown or a Chrome trace. */
+
+#define TRACE_RING 65536     /* events per thread; a power of two */
+#define TRACE_THREADS 8
+#define TRACE_NAME 16
+#define TRACE_FILE "/tmp/icmpd-trace"
+#define TRACE_PATH 256       /* longest dump file name, and its NUL */
+#define TRACE_MAGIC 0x69637472UL /* "ictr" */
+#define TRACE_VERSION 1
+
+/* what happened.  spans come as a BEGIN and an END event with the same
+   kind; the rest are instants */
+
+#define TRACE_BEGIN 0x80     /* or'ed into a span kind */
+
+#define TRACE_SLEEP 1        /* in select(); the END is the wakeup */
+#define TRACE_ACCEPT 2       /* arg: the client slot, or MAX_CLIENTS */
+#define TRACE_RECVFROM 3     /* arg: bytes */
+#define TRACE_PARSE 4        /* arg: the client slot the reply is for */
+#define TRACE_FORMAT 5       /* arg: the client slot */
+#define TRACE_CLIENT_SEND 6  /* arg: the client slot */
+#define TRACE_SENDTO 7       /* arg: the target */
+#define TRACE_RESOLVE 8      /* a DNS lookup; arg: the target, at the end */
+#define TRACE_REQUEST 9      /* a client request; arg: the message */
+#define TRACE_DRAIN 10       /* replies from the measurement thread */
+#define TRACE_DROP 11        /* instant: a client dropped; arg: the slot */
+#define TRACE_DUMPED 12      /* instant: a dump; arg: events written */
+#define TRACE_KINDS 13
+
+struct trace_event
+{
+  unsigned long when;        /* cycles or nsec; see the dump header */
+  unsigned int arg;
+  unsigned char kind;
+  unsigned char pad[3];
+};
+
+struct trace_ring
+{
+  struct trace_event e[TRACE_RING];
+  volatile unsigned long head; /* events ever written */
+  char name[TRACE_NAME];
+};
+
+/* a dump is a struct trace_header, then for each ring a struct
+   trace_part, its events, oldest first, and the ring's head after
+   they were written out.  a reader should skip any event whose index
+   isn't past that head less TRACE_RING: the thread may have written
+   over it, or been in the middle of writing it, while the dump was
+   going on.  everything is in the byte order and sizes of the machine
+   that wrote it */
+
+struct trace_header
+{
+  unsigned long magic;
+  unsigned long version;
+  unsigned long ticks_per_msec; /* what trace_event.when counts in */
+  unsigned long rings;
+};
+
+struct trace_part
+{
+  char name[TRACE_NAME];
+  unsigned long first;       /* the index of the first event */
+  unsigned long count;
+};
+
+#if defined (__GNUC__) && defined (__x86_64__)
+#define TRACE_CYCLES 1
+static __inline__ unsigned long trace_clock (void)
+{
+  unsigned int lo, hi;
+
+  __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+  return (unsigned long) hi << 32 | lo;
+}
+/* x86 doesn't reorder stores, so the compiler is all that needs
+   telling */
+#define TRACE_PUBLISH() __asm__ __volatile__ ("" ::: "memory")
+#elif defined (__GNUC__) && defined (__aarch64__)
+#define TRACE_CYCLES 1
+static __inline__ unsigned long trace_clock (void)
+{
+  unsigned long t;
+
+  __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (t));
+  return t;
+}
+#define TRACE_PUBLISH() __asm__ __volatile__ ("dmb ishst" ::: "memory")
+#else
+unsigned long trace_clock (void);
+#define TRACE_PUBLISH() __sync_synchronize ()
+#endif
+
+static __inline__ void trace (struct trace_ring *r, int kind,
+			      unsigned int arg)
+{
+  struct trace_event *e;
+
+  if (r == NULL)
+    return;
+  e = &r->e[r->head & (TRACE_RING - 1)];
+  e->when = trace_clock ();
+  e->arg = arg;
+  e->kind = kind;
+  TRACE_PUBLISH ();
+  r->head++;
+}
+
+#define trace_begin(r, kind, arg) trace (r, (kind) | TRACE_BEGIN, arg)
+#define trace_end(r, kind, arg) trace (r, kind, arg)
+
+int trace_init (void);
+struct trace_ring *trace_thread (char *name);
+int trace_dump (int fd);
+int trace_dump_file (char *path);
+int trace_catch (int sig);